@@ -0,0 +1,348 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <endian.h>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#include "liblogcabin/Core/CRC32C.h"
+
+namespace LibLogCabin {
+namespace Core {
+namespace CRC32C {
+
+namespace {
+
+/**
+ * The CRC-32C polynomial in reversed bit order.
+ */
+const uint32_t POLY = 0x82f63b78;
+
+/**
+ * Lookup tables for extendPortable(), which processes 8 bytes at a time
+ * ("slicing-by-8").
+ */
+struct Tables {
+    Tables()
+        : t()
+    {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (uint32_t j = 0; j < 8; ++j)
+                c = (c >> 1) ^ (POLY & (0U - (c & 1)));
+            t[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (uint32_t k = 1; k < 8; ++k)
+                t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+        }
+    }
+    uint32_t t[8][256];
+};
+
+const Tables&
+getTables()
+{
+    static Tables tables;
+    return tables;
+}
+
+#if defined(__x86_64__)
+
+/**
+ * extendPCLMUL() splits the data into three streams of this many bytes at a
+ * time while it can, then of #SHORT_BLOCK bytes.
+ */
+const uint64_t LONG_BLOCK = 8192;
+
+/**
+ * See #LONG_BLOCK.
+ */
+const uint64_t SHORT_BLOCK = 256;
+
+/**
+ * Return x^n modulo the CRC-32C polynomial, in reversed bit order.
+ */
+uint32_t
+xPowMod(uint64_t n)
+{
+    uint32_t v = 1U << 31; // x^0
+    for (uint64_t i = 0; i < n; ++i)
+        v = (v >> 1) ^ (POLY & (0U - (v & 1)));
+    return v;
+}
+
+/**
+ * Multipliers used by shift() to advance a CRC past a block of zeros.
+ */
+struct Constants {
+    Constants()
+        // shift() multiplies by x^33 on its own.
+        : longShift(xPowMod(LONG_BLOCK * 8 - 33))
+        , shortShift(xPowMod(SHORT_BLOCK * 8 - 33))
+    {
+    }
+    const uint32_t longShift;
+    const uint32_t shortShift;
+};
+
+const Constants&
+getConstants()
+{
+    static Constants constants;
+    return constants;
+}
+
+/**
+ * Run the crc32 instruction over the data, without the pre- and
+ * post-conditioning that extend() applies.
+ */
+__attribute__((target("sse4.2")))
+uint32_t
+updateSSE42(uint32_t state, const uint8_t* p, uint64_t length)
+{
+    while (length > 0 && (uintptr_t(p) & 7) != 0) {
+        state = _mm_crc32_u8(state, *p);
+        ++p;
+        --length;
+    }
+    uint64_t state64 = state;
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        state64 = _mm_crc32_u64(state64, word);
+        p += 8;
+        length -= 8;
+    }
+    state = uint32_t(state64);
+    while (length > 0) {
+        state = _mm_crc32_u8(state, *p);
+        ++p;
+        --length;
+    }
+    return state;
+}
+
+/**
+ * Return the CRC state 'state' advanced past a block of zeros, where
+ * 'multiplier' is x^(8 * blockBytes - 33) from Constants.
+ *
+ * The carry-less product of two reflected 32-bit values is their polynomial
+ * product times x when read as a reflected 64-bit value, and crc32 of that
+ * value multiplies it by another x^32 before reducing it.
+ */
+__attribute__((target("sse4.2,pclmul")))
+uint32_t
+shift(uint32_t state, uint32_t multiplier)
+{
+    __m128i product = _mm_clmulepi64_si128(
+        _mm_cvtsi32_si128(int(state)),
+        _mm_cvtsi32_si128(int(multiplier)),
+        0x00);
+    return uint32_t(_mm_crc32_u64(0, uint64_t(_mm_cvtsi128_si64(product))));
+}
+
+/**
+ * Consume groups of three 'blockBytes'-sized blocks from the data, running
+ * the crc32 instruction over all three at once. The crc32 instruction has a
+ * latency of several cycles but can start every cycle, so three independent
+ * streams keep it busy.
+ */
+__attribute__((target("sse4.2,pclmul")))
+uint32_t
+updateThreeWay(uint32_t state, const uint8_t*& p, uint64_t& length,
+               uint64_t blockBytes, uint32_t multiplier)
+{
+    while (length >= 3 * blockBytes) {
+        uint64_t crc0 = state;
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+        const uint8_t* end = p + blockBytes;
+        while (p < end) {
+            uint64_t word0;
+            uint64_t word1;
+            uint64_t word2;
+            memcpy(&word0, p, sizeof(word0));
+            memcpy(&word1, p + blockBytes, sizeof(word1));
+            memcpy(&word2, p + 2 * blockBytes, sizeof(word2));
+            crc0 = _mm_crc32_u64(crc0, word0);
+            crc1 = _mm_crc32_u64(crc1, word1);
+            crc2 = _mm_crc32_u64(crc2, word2);
+            p += 8;
+        }
+        state = shift(uint32_t(crc0), multiplier) ^ uint32_t(crc1);
+        state = shift(state, multiplier) ^ uint32_t(crc2);
+        p += 2 * blockBytes;
+        length -= 3 * blockBytes;
+    }
+    return state;
+}
+
+#endif /* __x86_64__ */
+
+/**
+ * The type of extend() and its implementations.
+ */
+typedef uint32_t (*ExtendFn)(uint32_t crc, const void* data, uint64_t length);
+
+/**
+ * Return the fastest implementation of extend() that the CPU supports.
+ */
+ExtendFn
+chooseImplementation()
+{
+    if (Internal::hasPCLMUL())
+        return Internal::extendPCLMUL;
+    if (Internal::hasSSE42())
+        return Internal::extendSSE42;
+    return Internal::extendPortable;
+}
+
+} // namespace LibLogCabin::Core::CRC32C::<anonymous>
+
+uint32_t
+extend(uint32_t crc, const void* data, uint64_t length)
+{
+    static const ExtendFn implementation = chooseImplementation();
+    return implementation(crc, data, length);
+}
+
+uint32_t
+value(const void* data, uint64_t length)
+{
+    return extend(0, data, length);
+}
+
+bool
+isHardwareAccelerated()
+{
+    return Internal::hasSSE42();
+}
+
+namespace Internal {
+
+uint32_t
+extendPortable(uint32_t crc, const void* data, uint64_t length)
+{
+    const Tables& tables = getTables();
+    const uint32_t (&t)[8][256] = tables.t;
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    uint32_t state = ~crc;
+    while (length >= 8) {
+        uint32_t lo;
+        uint32_t hi;
+        memcpy(&lo, p, sizeof(lo));
+        memcpy(&hi, p + 4, sizeof(hi));
+        lo = le32toh(lo) ^ state;
+        hi = le32toh(hi);
+        state = (t[7][lo & 0xff] ^
+                 t[6][(lo >> 8) & 0xff] ^
+                 t[5][(lo >> 16) & 0xff] ^
+                 t[4][lo >> 24] ^
+                 t[3][hi & 0xff] ^
+                 t[2][(hi >> 8) & 0xff] ^
+                 t[1][(hi >> 16) & 0xff] ^
+                 t[0][hi >> 24]);
+        p += 8;
+        length -= 8;
+    }
+    while (length > 0) {
+        state = t[0][(state ^ *p) & 0xff] ^ (state >> 8);
+        ++p;
+        --length;
+    }
+    return ~state;
+}
+
+#if defined(__x86_64__)
+
+bool
+hasSSE42()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+
+uint32_t
+extendSSE42(uint32_t crc, const void* data, uint64_t length)
+{
+    return ~updateSSE42(~crc, static_cast<const uint8_t*>(data), length);
+}
+
+bool
+hasPCLMUL()
+{
+    __builtin_cpu_init();
+    return (__builtin_cpu_supports("sse4.2") &&
+            __builtin_cpu_supports("pclmul"));
+}
+
+uint32_t
+extendPCLMUL(uint32_t crc, const void* data, uint64_t length)
+{
+    const Constants& constants = getConstants();
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    uint32_t state = ~crc;
+    if (length >= 3 * SHORT_BLOCK) {
+        // Align the streams' loads.
+        uint64_t misaligned = (8 - (uintptr_t(p) & 7)) & 7;
+        state = updateSSE42(state, p, misaligned);
+        p += misaligned;
+        length -= misaligned;
+        state = updateThreeWay(state, p, length,
+                               LONG_BLOCK, constants.longShift);
+        state = updateThreeWay(state, p, length,
+                               SHORT_BLOCK, constants.shortShift);
+    }
+    return ~updateSSE42(state, p, length);
+}
+
+#else /* __x86_64__ */
+
+bool
+hasSSE42()
+{
+    return false;
+}
+
+uint32_t
+extendSSE42(uint32_t crc, const void* data, uint64_t length)
+{
+    return extendPortable(crc, data, length);
+}
+
+bool
+hasPCLMUL()
+{
+    return false;
+}
+
+uint32_t
+extendPCLMUL(uint32_t crc, const void* data, uint64_t length)
+{
+    return extendPortable(crc, data, length);
+}
+
+#endif /* __x86_64__ */
+
+} // namespace LibLogCabin::Core::CRC32C::Internal
+
+} // namespace LibLogCabin::Core::CRC32C
+} // namespace LibLogCabin::Core
+} // namespace LibLogCabin
@@ -0,0 +1,99 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * \file
+ * Computes CRC-32C (Castagnoli) checksums, using the SSE4.2 crc32 instruction
+ * when the CPU has it.
+ */
+
+#include <cinttypes>
+
+#ifndef LIBLOGCABIN_CORE_CRC32C_H
+#define LIBLOGCABIN_CORE_CRC32C_H
+
+namespace LibLogCabin {
+namespace Core {
+namespace CRC32C {
+
+/**
+ * Return the CRC-32C of the concatenation of the data that produced 'crc'
+ * and the given data. The fastest implementation the CPU supports is chosen
+ * the first time this is called.
+ * \param crc
+ *      The CRC-32C of the preceding data, or 0 to start a new checksum.
+ * \param data
+ *      The first byte of the data.
+ * \param length
+ *      The number of bytes in the data.
+ */
+uint32_t extend(uint32_t crc, const void* data, uint64_t length);
+
+/**
+ * Return the CRC-32C of a chunk of data.
+ * \param data
+ *      The first byte of the data.
+ * \param length
+ *      The number of bytes in the data.
+ */
+uint32_t value(const void* data, uint64_t length);
+
+/**
+ * Return true if extend() uses hardware CRC instructions rather than the
+ * portable table-driven implementation.
+ */
+bool isHardwareAccelerated();
+
+namespace Internal {
+
+/**
+ * Table-driven implementation of extend() that works on any CPU.
+ */
+uint32_t extendPortable(uint32_t crc, const void* data, uint64_t length);
+
+/**
+ * Return true if the CPU supports extendSSE42().
+ */
+bool hasSSE42();
+
+/**
+ * Implementation of extend() using the SSE4.2 crc32 instruction.
+ * \pre
+ *      hasSSE42() is true.
+ */
+uint32_t extendSSE42(uint32_t crc, const void* data, uint64_t length);
+
+/**
+ * Return true if the CPU supports extendPCLMUL().
+ */
+bool hasPCLMUL();
+
+/**
+ * Implementation of extend() for large buffers. This splits the data into
+ * three streams that are run through the crc32 instruction in parallel, then
+ * folds them together with carry-less multiplication (PCLMULQDQ). Short
+ * buffers and remainders are handed to extendSSE42().
+ * \pre
+ *      hasPCLMUL() is true.
+ */
+uint32_t extendPCLMUL(uint32_t crc, const void* data, uint64_t length);
+
+} // namespace LibLogCabin::Core::CRC32C::Internal
+
+} // namespace LibLogCabin::Core::CRC32C
+} // namespace LibLogCabin::Core
+} // namespace LibLogCabin
+
+#endif /* LIBLOGCABIN_CORE_CRC32C_H */
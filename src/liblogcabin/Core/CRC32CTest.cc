@@ -0,0 +1,104 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+#include <vector>
+
+#include "liblogcabin/Core/CRC32C.h"
+
+namespace LibLogCabin {
+namespace Core {
+namespace CRC32C {
+namespace {
+
+typedef uint32_t (*ExtendFn)(uint32_t crc, const void* data, uint64_t length);
+
+/**
+ * Return every implementation that this CPU can run.
+ */
+std::vector<ExtendFn>
+getImplementations()
+{
+    std::vector<ExtendFn> fns;
+    fns.push_back(Internal::extendPortable);
+    if (Internal::hasSSE42())
+        fns.push_back(Internal::extendSSE42);
+    if (Internal::hasPCLMUL())
+        fns.push_back(Internal::extendPCLMUL);
+    return fns;
+}
+
+// Test vectors from RFC 3720, section B.4.
+TEST(CoreCRC32CTest, knownValues) {
+    std::vector<uint8_t> zeros(32, 0);
+    std::vector<uint8_t> ones(32, 0xff);
+    std::vector<uint8_t> ascending;
+    for (uint8_t i = 0; i < 32; ++i)
+        ascending.push_back(i);
+    for (ExtendFn fn : getImplementations()) {
+        EXPECT_EQ(0x8a9136aaU, fn(0, zeros.data(), zeros.size()));
+        EXPECT_EQ(0x62a8ab43U, fn(0, ones.data(), ones.size()));
+        EXPECT_EQ(0x46dd794eU, fn(0, ascending.data(), ascending.size()));
+        EXPECT_EQ(0xe3069283U, fn(0, "123456789", 9));
+        EXPECT_EQ(0U, fn(0, "", 0));
+    }
+    EXPECT_EQ(0xe3069283U, value("123456789", 9));
+}
+
+TEST(CoreCRC32CTest, extend) {
+    EXPECT_EQ(value("123456789", 9),
+              extend(extend(0, "1234", 4), "56789", 5));
+}
+
+// The accelerated implementations take different paths depending on the
+// length and alignment of the data, so compare them against the portable one
+// across a range of both.
+TEST(CoreCRC32CTest, implementationsAgree) {
+    std::vector<uint8_t> data(100000);
+    uint32_t x = 1;
+    for (auto it = data.begin(); it != data.end(); ++it) {
+        x = x * 1103515245 + 12345;
+        *it = uint8_t(x >> 16);
+    }
+    std::vector<uint64_t> lengths = {
+        0, 1, 7, 8, 9, 63, 767, 768, 769, 1000,
+        3 * 8192 - 1, 3 * 8192, 3 * 8192 + 8 * 3 * 256 + 5, 99990,
+    };
+    std::vector<ExtendFn> fns = getImplementations();
+    for (uint64_t offset = 0; offset < 9; ++offset) {
+        for (uint64_t length : lengths) {
+            if (offset + length > data.size())
+                continue;
+            uint32_t expected = Internal::extendPortable(
+                0x12345678, data.data() + offset, length);
+            for (ExtendFn fn : fns) {
+                EXPECT_EQ(expected,
+                          fn(0x12345678, data.data() + offset, length))
+                    << "offset " << offset << ", length " << length;
+            }
+            EXPECT_EQ(expected,
+                      extend(0x12345678, data.data() + offset, length));
+        }
+    }
+}
+
+TEST(CoreCRC32CTest, isHardwareAccelerated) {
+    EXPECT_EQ(Internal::hasSSE42(), isHardwareAccelerated());
+}
+
+} // namespace LibLogCabin::Core::CRC32C::<anonymous>
+} // namespace LibLogCabin::Core::CRC32C
+} // namespace LibLogCabin::Core
+} // namespace LibLogCabin
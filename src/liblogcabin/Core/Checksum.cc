@@ -31,9 +31,11 @@
 
 #include "liblogcabin/Core/Debug.h"
 #include "liblogcabin/Core/Checksum.h"
+#include "liblogcabin/Core/CRC32C.h"
 #include "liblogcabin/Core/STLUtil.h"
 #include "liblogcabin/Core/StringUtil.h"
 #include "liblogcabin/Core/Util.h"
+#include "liblogcabin/Core/XXHash.h"
 
 namespace LibLogCabin {
 namespace Core {
@@ -45,32 +47,24 @@ using Core::StringUtil::format;
 namespace {
 
 /**
- * Helper for writeChecksum template, to keep code bloat to a minimum.
+ * Format a binary digest as name:hexdigest.
+ * \return
+ *      The number of valid characters in 'result', including the null
+ *      terminator.
  */
 uint32_t
-writeChecksumHelper(
-        CryptoPP::HashTransformation& hashFn,
-        const char* name,
-        std::initializer_list<std::pair<const void*, uint64_t>> data,
-        char result[MAX_LENGTH])
+formatChecksum(const char* name,
+               const uint8_t* binary,
+               uint32_t digestSize,
+               char result[MAX_LENGTH])
 {
     // Length of name in bytes, not including null character.
     const uint32_t nameLength = downCast<uint32_t>(strlen(name));
-    // Size in bytes of binary hash function output.
-    const uint32_t digestSize = hashFn.DigestSize();
     // Size in bytes of name:hexdigest string, including null character.
     const uint32_t outputSize = (nameLength + 1 +
                                  digestSize * 2 + 1);
     assert(outputSize <= MAX_LENGTH);
 
-    // calculate binary digest
-    uint8_t binary[digestSize];
-    for (auto it = data.begin(); it != data.end(); ++it) {
-        hashFn.Update(static_cast<const uint8_t*>(it->first),
-                      it->second);
-    }
-    hashFn.Final(binary);
-
     // copy name and : to result
     memcpy(result, name, nameLength);
     result += nameLength;
@@ -91,6 +85,29 @@ writeChecksumHelper(
     return outputSize;
 }
 
+/**
+ * Helper for writeChecksum template, to keep code bloat to a minimum.
+ */
+uint32_t
+writeChecksumHelper(
+        CryptoPP::HashTransformation& hashFn,
+        const char* name,
+        std::initializer_list<std::pair<const void*, uint64_t>> data,
+        char result[MAX_LENGTH])
+{
+    // Size in bytes of binary hash function output.
+    const uint32_t digestSize = hashFn.DigestSize();
+
+    // calculate binary digest
+    uint8_t binary[digestSize];
+    for (auto it = data.begin(); it != data.end(); ++it) {
+        hashFn.Update(static_cast<const uint8_t*>(it->first),
+                      it->second);
+    }
+    hashFn.Final(binary);
+    return formatChecksum(name, binary, digestSize, result);
+}
+
 /**
  * Template to produce functions of type Algorithm when instantiated with a
  * CryptoPP::HashTransformation.
@@ -107,6 +124,79 @@ writeChecksum(std::initializer_list<std::pair<const void*, uint64_t>> data,
                                result);
 }
 
+/**
+ * An Algorithm for CRC-32C, which isn't available in all versions of
+ * crypto++ and is much faster with Core::CRC32C on CPUs that have SSE4.2.
+ * Like crypto++'s CRC32, the digest is written in little-endian byte order.
+ */
+uint32_t
+writeCRC32C(std::initializer_list<std::pair<const void*, uint64_t>> data,
+            char result[MAX_LENGTH])
+{
+    uint32_t crc = 0;
+    for (auto it = data.begin(); it != data.end(); ++it)
+        crc = CRC32C::extend(crc, it->first, it->second);
+    uint8_t binary[4] = {
+        uint8_t(crc),
+        uint8_t(crc >> 8),
+        uint8_t(crc >> 16),
+        uint8_t(crc >> 24),
+    };
+    return formatChecksum("CRC32C", binary, sizeof(binary), result);
+}
+
+/**
+ * Write 'value' into 'binary' in big-endian byte order.
+ */
+void
+putBigEndian(uint64_t value, uint8_t binary[8])
+{
+    for (uint32_t i = 0; i < 8; ++i)
+        binary[i] = uint8_t(value >> (56 - 8 * i));
+}
+
+/**
+ * An Algorithm for XXH64, a fast non-cryptographic hash. The digest is
+ * written in big-endian byte order, matching the reference implementation's
+ * canonical form (as printed by xxhsum).
+ */
+uint32_t
+writeXXH64(std::initializer_list<std::pair<const void*, uint64_t>> data,
+           char result[MAX_LENGTH])
+{
+    uint8_t binary[8];
+    putBigEndian(XXHash::xxh64(data), binary);
+    return formatChecksum("XXH64", binary, sizeof(binary), result);
+}
+
+/**
+ * An Algorithm for the 64-bit XXH3, the fastest of the xxHash family. The
+ * digest is written in xxhsum's big-endian form, like XXH64.
+ */
+uint32_t
+writeXXH3(std::initializer_list<std::pair<const void*, uint64_t>> data,
+          char result[MAX_LENGTH])
+{
+    uint8_t binary[8];
+    putBigEndian(XXHash::xxh3(data), binary);
+    return formatChecksum("XXH3-64", binary, sizeof(binary), result);
+}
+
+/**
+ * An Algorithm for XXH128, the 128-bit XXH3. The digest is written in
+ * xxhsum's big-endian form: the high 64 bits, then the low 64 bits.
+ */
+uint32_t
+writeXXH128(std::initializer_list<std::pair<const void*, uint64_t>> data,
+            char result[MAX_LENGTH])
+{
+    std::pair<uint64_t, uint64_t> hash = XXHash::xxh128(data);
+    uint8_t binary[16];
+    putBigEndian(hash.first, binary);
+    putBigEndian(hash.second, binary + 8);
+    return formatChecksum("XXH128", binary, sizeof(binary), result);
+}
+
 /**
  * Type for function that calculate the checksum for some data.
  * \param data
@@ -157,6 +247,14 @@ class Algorithms {
         registerAlgorithm<CryptoPP::RIPEMD320>();
         registerAlgorithm<CryptoPP::RIPEMD128>();
         registerAlgorithm<CryptoPP::RIPEMD256>();
+        byName.insert(std::pair<std::string, Algorithm>(
+                "CRC32C", Algorithm(writeCRC32C)));
+        byName.insert(std::pair<std::string, Algorithm>(
+                "XXH64", Algorithm(writeXXH64)));
+        byName.insert(std::pair<std::string, Algorithm>(
+                "XXH3-64", Algorithm(writeXXH3)));
+        byName.insert(std::pair<std::string, Algorithm>(
+                "XXH128", Algorithm(writeXXH128)));
     }
 
     /**
@@ -16,6 +16,9 @@
 #include <gtest/gtest.h>
 
 #include "liblogcabin/Core/Checksum.h"
+#include "liblogcabin/Core/Debug.h"
+#include "liblogcabin/Core/StringUtil.h"
+#include "liblogcabin/Core/Time.h"
 
 namespace LibLogCabin {
 namespace Core {
@@ -35,6 +38,7 @@ TEST_F(CoreChecksumTest, listAlgorithms) {
     EXPECT_EQ((std::vector<std::string> {
                    "Adler32",
                    "CRC32",
+                   "CRC32C",
                    "MD5",
                    "RIPEMD-128",
                    "RIPEMD-160",
@@ -47,6 +51,9 @@ TEST_F(CoreChecksumTest, listAlgorithms) {
                    "SHA-512",
                    "Tiger",
                    "Whirlpool",
+                   "XXH128",
+                   "XXH3-64",
+                   "XXH64",
               }),
               listAlgorithms());
 }
@@ -72,6 +79,94 @@ TEST_F(CoreChecksumTest, calculate) {
                  "not available");
 }
 
+TEST_F(CoreChecksumTest, calculate_crc32c) {
+    char output[MAX_LENGTH];
+    EXPECT_EQ(16U, calculate("CRC32C", "123456789", 9, output));
+    EXPECT_STREQ("CRC32C:839206e3", output);
+    EXPECT_EQ(16U, calculate("CRC32C",
+                             {{"1234", 4},
+                              {"", 0},
+                              {"56789", 5}}, output));
+    EXPECT_STREQ("CRC32C:839206e3", output);
+    EXPECT_EQ("", verify("CRC32C:839206e3", "123456789", 9));
+}
+
+TEST_F(CoreChecksumTest, calculate_xxh64) {
+    char output[MAX_LENGTH];
+    EXPECT_EQ(23U, calculate("XXH64", "abc", 3, output));
+    EXPECT_STREQ("XXH64:44bc2cf5ad770999", output);
+    EXPECT_EQ(23U, calculate("XXH64",
+                             {{"a", 1},
+                              {"", 0},
+                              {"bc", 2}}, output));
+    EXPECT_STREQ("XXH64:44bc2cf5ad770999", output);
+    EXPECT_EQ("", verify("XXH64:44bc2cf5ad770999", "abc", 3));
+}
+
+TEST_F(CoreChecksumTest, calculate_xxh3) {
+    char output[MAX_LENGTH];
+    EXPECT_EQ(25U, calculate("XXH3-64", "abc", 3, output));
+    EXPECT_STREQ("XXH3-64:78af5f94892f3950", output);
+    EXPECT_EQ(25U, calculate("XXH3-64",
+                             {{"a", 1},
+                              {"", 0},
+                              {"bc", 2}}, output));
+    EXPECT_STREQ("XXH3-64:78af5f94892f3950", output);
+    EXPECT_EQ("", verify("XXH3-64:78af5f94892f3950", "abc", 3));
+}
+
+TEST_F(CoreChecksumTest, calculate_xxh128) {
+    char output[MAX_LENGTH];
+    EXPECT_EQ(40U, calculate("XXH128", "abc", 3, output));
+    EXPECT_STREQ("XXH128:06b05ab6733a618578af5f94892f3950", output);
+    EXPECT_EQ(40U, calculate("XXH128",
+                             {{"a", 1},
+                              {"", 0},
+                              {"bc", 2}}, output));
+    EXPECT_STREQ("XXH128:06b05ab6733a618578af5f94892f3950", output);
+    EXPECT_EQ("", verify("XXH128:06b05ab6733a618578af5f94892f3950",
+                         "abc", 3));
+}
+
+// Compares the throughput of every registered algorithm across a range of
+// entry sizes and logs the results as NOTICE messages. This takes a while, so
+// it's disabled by default; run it with
+// --gtest_also_run_disabled_tests --gtest_filter=*DISABLED_benchmark.
+TEST_F(CoreChecksumTest, DISABLED_benchmark) {
+    Core::Debug::setLogPolicy({
+        {"Core/ChecksumTest.cc", "NOTICE"}
+    });
+    const uint64_t totalBytes = 64 * 1024 * 1024;
+    const std::vector<uint64_t> sizes = {
+        64, 256, 1024, 4 * 1024, 64 * 1024, 1024 * 1024,
+    };
+    std::vector<char> data(sizes.back());
+    for (uint64_t i = 0; i < data.size(); ++i)
+        data.at(i) = char(i * 31);
+
+    std::string header = StringUtil::format("%-12s", "algorithm");
+    for (auto size = sizes.begin(); size != sizes.end(); ++size)
+        header += StringUtil::format(" %9luB", *size);
+    NOTICE("%s  (MB/s)", header.c_str());
+    std::vector<std::string> algorithms = listAlgorithms();
+    for (auto algo = algorithms.begin(); algo != algorithms.end(); ++algo) {
+        std::string row = StringUtil::format("%-12s", algo->c_str());
+        for (auto size = sizes.begin(); size != sizes.end(); ++size) {
+            char output[MAX_LENGTH];
+            uint64_t iterations = totalBytes / *size;
+            Time::SteadyClock::time_point start = Time::SteadyClock::now();
+            for (uint64_t i = 0; i < iterations; ++i)
+                calculate(algo->c_str(), data.data(), *size, output);
+            std::chrono::duration<double> elapsed =
+                Time::SteadyClock::now() - start;
+            row += StringUtil::format(" %10.0f",
+                                      double(totalBytes) / 1e6 /
+                                      elapsed.count());
+        }
+        NOTICE("%s", row.c_str());
+    }
+}
+
 TEST_F(CoreChecksumTest, lengthReasonable) {
     strcpy(buf, "mock:1234"); // NOLINT
     EXPECT_EQ(10U, length(buf, sizeof(buf)));
@@ -0,0 +1,76 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+
+#include "liblogcabin/Core/TokenBucket.h"
+
+namespace LibLogCabin {
+namespace Core {
+
+TokenBucket::TokenBucket(uint64_t rate, uint64_t burst)
+    : rate(rate)
+    , burst(burst)
+    , tokens(double(burst))
+    , lastRefill(Clock::now())
+{
+}
+
+TokenBucket::~TokenBucket()
+{
+}
+
+void
+TokenBucket::consume(uint64_t tokens, TimePoint now)
+{
+    if (isUnlimited())
+        return;
+    refill(now);
+    this->tokens -= double(tokens);
+}
+
+TokenBucket::TimePoint
+TokenBucket::getReadyTime(TimePoint now)
+{
+    if (isUnlimited())
+        return now;
+    refill(now);
+    if (tokens >= 0)
+        return now;
+    double seconds = -tokens / double(rate);
+    return now + std::chrono::duration_cast<Clock::duration>(
+                        std::chrono::duration<double>(seconds)) +
+                 // round up so that the bucket is really ready then
+                 Clock::duration(1);
+}
+
+bool
+TokenBucket::isUnlimited() const
+{
+    return rate == 0;
+}
+
+void
+TokenBucket::refill(TimePoint now)
+{
+    if (now <= lastRefill)
+        return;
+    double elapsed = std::chrono::duration<double>(now - lastRefill).count();
+    tokens = std::min(double(burst), tokens + elapsed * double(rate));
+    lastRefill = now;
+}
+
+} // namespace LibLogCabin::Core
+} // namespace LibLogCabin
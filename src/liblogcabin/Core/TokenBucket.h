@@ -0,0 +1,118 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cinttypes>
+
+#include "liblogcabin/Core/Time.h"
+
+#ifndef LIBLOGCABIN_CORE_TOKENBUCKET_H
+#define LIBLOGCABIN_CORE_TOKENBUCKET_H
+
+namespace LibLogCabin {
+namespace Core {
+
+/**
+ * A simple token bucket rate limiter, used to cap the throughput of some
+ * background activity (measured in bytes, usually).
+ *
+ * Tokens accumulate at a fixed rate up to a maximum burst size. Callers check
+ * #getReadyTime() before doing some work, then report how much work they did
+ * with #consume(). Since callers often don't know in advance how much work
+ * they'll do, #consume() may drive the bucket into debt; the next caller will
+ * then have to wait until the debt has been repaid.
+ *
+ * This class has no internal locking.
+ */
+class TokenBucket {
+  public:
+    /**
+     * Clock used for refilling the bucket.
+     */
+    typedef Core::Time::SteadyClock Clock;
+    /**
+     * Time point for Clock.
+     */
+    typedef Clock::time_point TimePoint;
+
+    /**
+     * Constructor.
+     * \param rate
+     *      The number of tokens added to the bucket per second. If this is 0,
+     *      the bucket is unlimited: #getReadyTime() always returns 'now'.
+     * \param burst
+     *      The maximum number of tokens the bucket holds. The bucket starts
+     *      out full.
+     */
+    TokenBucket(uint64_t rate, uint64_t burst);
+
+    /**
+     * Destructor.
+     */
+    ~TokenBucket();
+
+    /**
+     * Remove tokens from the bucket. This may put the bucket into debt.
+     * \param tokens
+     *      The amount of work that was just done.
+     * \param now
+     *      The current time.
+     */
+    void consume(uint64_t tokens, TimePoint now);
+
+    /**
+     * Return the earliest time at which the bucket will have a non-negative
+     * number of tokens. This will be 'now' if the caller may proceed
+     * immediately.
+     * \param now
+     *      The current time.
+     */
+    TimePoint getReadyTime(TimePoint now);
+
+    /**
+     * Return true if the bucket has no rate limit.
+     */
+    bool isUnlimited() const;
+
+  private:
+    /**
+     * Add tokens for the time that has passed since #lastRefill.
+     */
+    void refill(TimePoint now);
+
+    /**
+     * See constructor.
+     */
+    uint64_t rate;
+
+    /**
+     * See constructor.
+     */
+    uint64_t burst;
+
+    /**
+     * The number of tokens currently available. Negative if in debt.
+     */
+    double tokens;
+
+    /**
+     * The time at which #tokens was last brought up to date.
+     */
+    TimePoint lastRefill;
+};
+
+} // namespace LibLogCabin::Core
+} // namespace LibLogCabin
+
+#endif /* LIBLOGCABIN_CORE_TOKENBUCKET_H */
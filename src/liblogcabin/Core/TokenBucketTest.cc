@@ -0,0 +1,66 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include "liblogcabin/Core/TokenBucket.h"
+
+namespace LibLogCabin {
+namespace {
+
+typedef Core::TokenBucket::TimePoint TimePoint;
+using std::chrono::milliseconds;
+
+TEST(CoreTokenBucketTest, unlimited) {
+    Core::TokenBucket bucket(0, 0);
+    EXPECT_TRUE(bucket.isUnlimited());
+    TimePoint now = bucket.lastRefill;
+    bucket.consume(1000000, now);
+    EXPECT_EQ(now, bucket.getReadyTime(now));
+}
+
+TEST(CoreTokenBucketTest, consumeIntoDebt) {
+    Core::TokenBucket bucket(1000, 500);
+    EXPECT_FALSE(bucket.isUnlimited());
+    TimePoint now = bucket.lastRefill;
+    EXPECT_EQ(now, bucket.getReadyTime(now));
+    bucket.consume(400, now);
+    EXPECT_EQ(now, bucket.getReadyTime(now));
+    bucket.consume(600, now);
+    // 500 tokens in debt at 1000 tokens/s
+    TimePoint ready = bucket.getReadyTime(now);
+    EXPECT_LT(now + milliseconds(499), ready);
+    EXPECT_GT(now + milliseconds(501), ready);
+    EXPECT_LT(now + milliseconds(250),
+              bucket.getReadyTime(now + milliseconds(250)));
+    EXPECT_EQ(ready, bucket.getReadyTime(ready));
+}
+
+TEST(CoreTokenBucketTest, refillCappedAtBurst) {
+    Core::TokenBucket bucket(1000, 500);
+    TimePoint now = bucket.lastRefill;
+    bucket.consume(500, now);
+    EXPECT_EQ(0, bucket.tokens);
+    now += std::chrono::seconds(10);
+    bucket.getReadyTime(now);
+    EXPECT_EQ(500, bucket.tokens);
+    // time going backwards is ignored
+    bucket.consume(100, now - milliseconds(1));
+    EXPECT_EQ(400, bucket.tokens);
+    EXPECT_EQ(now, bucket.lastRefill);
+}
+
+} // namespace LibLogCabin::<anonymous>
+} // namespace LibLogCabin
@@ -0,0 +1,79 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// xxhash.h is third-party C code that doesn't build cleanly with the
+// project's -Weffc++ and -Wconversion flags. XXH_INLINE_ALL makes all of its
+// symbols static, so they can't collide with another copy of xxHash linked
+// into the same program.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wconversion"
+#pragma GCC diagnostic ignored "-Wcast-align"
+#pragma GCC diagnostic ignored "-Wcast-qual"
+#pragma GCC diagnostic ignored "-Weffc++"
+#define XXH_INLINE_ALL
+#include "xxhash/xxhash.h"
+#pragma GCC diagnostic pop
+
+#include "liblogcabin/Core/XXHash.h"
+
+namespace LibLogCabin {
+namespace Core {
+namespace XXHash {
+
+uint64_t
+xxh64(Data data, uint64_t seed)
+{
+    XXH64_state_t state;
+    XXH64_reset(&state, seed);
+    for (auto it = data.begin(); it != data.end(); ++it)
+        XXH64_update(&state, it->first, it->second);
+    return XXH64_digest(&state);
+}
+
+uint64_t
+xxh3(Data data)
+{
+    // A single buffer (the common case for log entries) can use the one-shot
+    // function, which avoids setting up the 576-byte streaming state.
+    if (data.size() == 1)
+        return XXH3_64bits(data.begin()->first, data.begin()->second);
+    XXH3_state_t state;
+    XXH3_INITSTATE(&state);
+    XXH3_64bits_reset(&state);
+    for (auto it = data.begin(); it != data.end(); ++it)
+        XXH3_64bits_update(&state, it->first, it->second);
+    return XXH3_64bits_digest(&state);
+}
+
+std::pair<uint64_t, uint64_t>
+xxh128(Data data)
+{
+    XXH128_hash_t hash;
+    if (data.size() == 1) {
+        hash = XXH128(data.begin()->first, data.begin()->second, 0);
+    } else {
+        XXH3_state_t state;
+        XXH3_INITSTATE(&state);
+        XXH3_128bits_reset(&state);
+        for (auto it = data.begin(); it != data.end(); ++it)
+            XXH3_128bits_update(&state, it->first, it->second);
+        hash = XXH3_128bits_digest(&state);
+    }
+    return {hash.high64, hash.low64};
+}
+
+} // namespace LibLogCabin::Core::XXHash
+} // namespace LibLogCabin::Core
+} // namespace LibLogCabin
@@ -0,0 +1,73 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cinttypes>
+#include <initializer_list>
+#include <utility>
+
+#ifndef LIBLOGCABIN_CORE_XXHASH_H
+#define LIBLOGCABIN_CORE_XXHASH_H
+
+namespace LibLogCabin {
+namespace Core {
+
+/**
+ * Fast non-cryptographic hashes from the xxHash family. These detect
+ * corruption about as well as hashes of their width can while running at
+ * close to memory bandwidth. They are thin wrappers around the reference
+ * implementation (xxhash/xxhash.h at the top of the source tree), so their
+ * output matches xxhsum's.
+ *
+ * Each function hashes the concatenation of a list of (pointer, length)
+ * pairs, the same way Core::Checksum::calculate() takes its input.
+ */
+namespace XXHash {
+
+/**
+ * A list of (pointer, length) pairs describing what to hash.
+ */
+typedef std::initializer_list<std::pair<const void*, uint64_t>> Data;
+
+/**
+ * Compute the classic 64-bit xxHash, XXH64.
+ * \param data
+ *      The data to hash.
+ * \param seed
+ *      Starting value for the hash.
+ */
+uint64_t xxh64(Data data, uint64_t seed = 0);
+
+/**
+ * Compute the 64-bit variant of XXH3, which is faster than XXH64 on all
+ * inputs and much faster on small ones.
+ * \param data
+ *      The data to hash.
+ */
+uint64_t xxh3(Data data);
+
+/**
+ * Compute XXH128, the 128-bit variant of XXH3.
+ * \param data
+ *      The data to hash.
+ * \return
+ *      The high and low 64 bits of the hash, in that order.
+ */
+std::pair<uint64_t, uint64_t> xxh128(Data data);
+
+} // namespace LibLogCabin::Core::XXHash
+} // namespace LibLogCabin::Core
+} // namespace LibLogCabin
+
+#endif /* LIBLOGCABIN_CORE_XXHASH_H */
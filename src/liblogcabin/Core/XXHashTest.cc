@@ -0,0 +1,82 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <string>
+
+#include "liblogcabin/Core/XXHash.h"
+
+namespace LibLogCabin {
+namespace Core {
+namespace XXHash {
+namespace {
+
+// Expected values were produced by the reference implementation (xxhsum).
+
+TEST(CoreXXHashTest, xxh64) {
+    EXPECT_EQ(0xef46db3751d8e999UL, xxh64({{"", 0}}));
+    EXPECT_EQ(0xef46db3751d8e999UL, xxh64({}));
+    EXPECT_EQ(0x44bc2cf5ad770999UL, xxh64({{"abc", 3}}));
+    EXPECT_EQ(0xfbcea83c8a378bf1UL,
+              xxh64({{"Nobody inspects the spammish repetition", 39}}));
+    EXPECT_NE(xxh64({{"abc", 3}}, 1), xxh64({{"abc", 3}}, 2));
+}
+
+TEST(CoreXXHashTest, xxh3) {
+    EXPECT_EQ(0x2d06800538d394c2UL, xxh3({{"", 0}}));
+    EXPECT_EQ(0x2d06800538d394c2UL, xxh3({}));
+    EXPECT_EQ(0x78af5f94892f3950UL, xxh3({{"abc", 3}}));
+    EXPECT_EQ(0x6cb00603b5cc47e9UL,
+              xxh3({{"Nobody inspects the spammish repetition", 39}}));
+}
+
+TEST(CoreXXHashTest, xxh128) {
+    typedef std::pair<uint64_t, uint64_t> P;
+    EXPECT_EQ(P(0x99aa06d3014798d8UL, 0x6001c324468d497fUL),
+              xxh128({{"", 0}}));
+    EXPECT_EQ(P(0x99aa06d3014798d8UL, 0x6001c324468d497fUL), xxh128({}));
+    EXPECT_EQ(P(0x06b05ab6733a6185UL, 0x78af5f94892f3950UL),
+              xxh128({{"abc", 3}}));
+    EXPECT_EQ(P(0xa32c6f55b80b5f44UL, 0x9f1a957522431b91UL),
+              xxh128({{"Nobody inspects the spammish repetition", 39}}));
+}
+
+TEST(CoreXXHashTest, pieces) {
+    std::string data;
+    for (uint32_t i = 0; i < 1000; ++i)
+        data.push_back(char(i * 7));
+    const char* p = data.data();
+    EXPECT_EQ(0x25275608a9cfc168UL, xxh64({{p, 1000}}));
+    EXPECT_EQ(0x10ad30264426c830UL, xxh3({{p, 1000}}));
+    EXPECT_EQ(std::make_pair(0xabee229cdadad76dUL, 0x10ad30264426c830UL),
+              xxh128({{p, 1000}}));
+    for (uint64_t split = 0; split <= 1000; split += 37) {
+        EXPECT_EQ(0x25275608a9cfc168UL,
+                  xxh64({{p, split}, {p + split, 1000 - split}}))
+            << split;
+        EXPECT_EQ(0x10ad30264426c830UL,
+                  xxh3({{p, split}, {p + split, 1000 - split}}))
+            << split;
+        EXPECT_EQ(std::make_pair(0xabee229cdadad76dUL, 0x10ad30264426c830UL),
+                  xxh128({{p, split}, {p + split, 1000 - split}}))
+            << split;
+    }
+}
+
+} // namespace LibLogCabin::Core::XXHash::<anonymous>
+} // namespace LibLogCabin::Core::XXHash
+} // namespace LibLogCabin::Core
+} // namespace LibLogCabin
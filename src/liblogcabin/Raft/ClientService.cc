@@ -119,6 +119,10 @@ ClientService::getConfiguration(RPC::ServerRPC rpc)
         LibLogCabin::Protocol::Client::Server* server = response.add_servers();
         server->set_server_id(it->server_id());
         server->set_addresses(it->addresses());
+        if (it->has_priority())
+            server->set_priority(it->priority());
+        if (it->has_witness())
+            server->set_witness(it->witness());
     }
     rpc.reply(response);
 }
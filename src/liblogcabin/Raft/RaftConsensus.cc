@@ -27,6 +27,7 @@
 #include "liblogcabin/Protocol/Raft.pb.h"
 
 #include "liblogcabin/Core/Buffer.h"
+#include "liblogcabin/Core/Checksum.h"
 #include "liblogcabin/Core/Debug.h"
 #include "liblogcabin/Core/ProtoBuf.h"
 #include "liblogcabin/Core/Random.h"
@@ -50,6 +51,25 @@ typedef Storage::Log Log;
 static const int DEFAULT_PORT = 5254;
 static const int MAX_MESSAGE_LENGTH = 1024 + 1024 * 1024;
 
+/**
+ * The number of recent round-trip times kept for each follower to derive its
+ * adaptive election timeout.
+ */
+static const size_t RTT_WINDOW = 100;
+
+/**
+ * The minimum number of round-trip times that must be measured to a follower
+ * before its election timeout is adapted.
+ */
+static const size_t RTT_MIN_SAMPLES = 10;
+
+/**
+ * The checksum algorithm used to protect each InstallSnapshot chunk in
+ * transit. XXH3 runs at close to memory bandwidth, so it adds little to the
+ * cost of sending a megabyte-sized chunk.
+ */
+static const char SNAPSHOT_CHUNK_CHECKSUM[] = "XXH3-64";
+
 class RaftService : public RPC::Service {
   public:
     /// Constructor.
@@ -67,6 +87,7 @@ class RaftService : public RPC::Service {
     void requestVote(RPC::ServerRPC rpc);
     void appendEntries(RPC::ServerRPC rpc);
     void installSnapshot(RPC::ServerRPC rpc);
+    void timeoutNow(RPC::ServerRPC rpc);
 
     RaftConsensus& raft;
   public:
@@ -92,6 +113,9 @@ RaftService::handleRPC(RPC::ServerRPC rpc)
         case OpCode::REQUEST_VOTE:
             requestVote(std::move(rpc));
             break;
+        case OpCode::TIMEOUT_NOW:
+            timeoutNow(std::move(rpc));
+            break;
         default:
             WARNING("Client sent request with bad op code (%u) to RaftService",
                     rpc.getOpCode());
@@ -142,6 +166,14 @@ RaftService::requestVote(RPC::ServerRPC rpc)
     rpc.reply(response);
 }
 
+void
+RaftService::timeoutNow(RPC::ServerRPC rpc)
+{
+    PRELUDE(TimeoutNow);
+    raft.handleTimeoutNow(request, response);
+    rpc.reply(response);
+}
+
 namespace RaftConsensusInternal {
 
 bool startThreads = true;
@@ -151,6 +183,8 @@ bool startThreads = true;
 Server::Server(uint64_t serverId)
     : serverId(serverId)
     , addresses()
+    , priority(1)
+    , witness(false)
     , haveStateMachineSupportedVersions(false)
     , minStateMachineVersion(std::numeric_limits<uint16_t>::max())
     , maxStateMachineVersion(0)
@@ -278,9 +312,15 @@ Peer::Peer(uint64_t serverId, RaftConsensus& consensus)
     , thisCatchUpIterationStart(Clock::now())
     , thisCatchUpIterationGoalId(~0UL)
     , isCaughtUp_(false)
+    , catchUpBucket(consensus.CATCH_UP_BYTES_PER_SECOND_PER_PEER,
+                    consensus.CATCH_UP_BURST_BYTES)
+    , recentRTTs()
+    , rttStat()
+    , electionTimeout(consensus.ELECTION_TIMEOUT)
     , snapshotFile()
     , snapshotFileOffset(0)
     , lastSnapshotIndex(0)
+    , lastSnapshotHeaderIndex(0)
     , session()
     , rpc()
 {
@@ -306,6 +346,8 @@ Peer::beginLeadership()
     snapshotFile.reset();
     snapshotFileOffset = 0;
     lastSnapshotIndex = 0;
+    lastSnapshotHeaderIndex = 0;
+    restartCatchUp();
 }
 
 void
@@ -406,15 +448,46 @@ Peer::callRPC(Raft::Protocol::OpCode opCode,
 }
 
 void
-Peer::startThread(std::shared_ptr<Peer> self)
+Peer::restartCatchUp()
 {
+    isCaughtUp_ = false;
+    lastCatchUpIterationMs = ~0UL;
     thisCatchUpIterationStart = Clock::now();
     thisCatchUpIterationGoalId = consensus.log->getLastLogIndex();
+}
+
+void
+Peer::startThread(std::shared_ptr<Peer> self)
+{
+    restartCatchUp();
     ++consensus.numPeerThreads;
     NOTICE("Starting peer thread for server %lu", serverId);
     std::thread(&RaftConsensus::peerThreadMain, &consensus, self).detach();
 }
 
+void
+Peer::recordRTT(std::chrono::nanoseconds rtt)
+{
+    uint64_t nanos = uint64_t(rtt.count());
+    rttStat.push(nanos);
+    recentRTTs.push_back(nanos);
+    if (recentRTTs.size() > RTT_WINDOW)
+        recentRTTs.pop_front();
+    if (!consensus.ADAPTIVE_ELECTION_TIMEOUT ||
+        recentRTTs.size() < RTT_MIN_SAMPLES) {
+        return;
+    }
+    // Use the 99th percentile so that an occasional slow RPC doesn't cause a
+    // needless election, but a consistently slow link does raise the
+    // timeout.
+    std::vector<uint64_t> sorted(recentRTTs.begin(), recentRTTs.end());
+    auto p99 = sorted.begin() + (sorted.size() - 1) * 99 / 100;
+    std::nth_element(sorted.begin(), p99, sorted.end());
+    electionTimeout = consensus.clampElectionTimeout(
+        std::chrono::nanoseconds(*p99) *
+        consensus.ELECTION_TIMEOUT_RTT_MULTIPLE);
+}
+
 std::shared_ptr<RPC::ClientSession>
 Peer::getSession(std::unique_lock<Mutex>& lockGuard)
 {
@@ -482,6 +555,10 @@ Peer::updatePeerStats(LibLogCabin::Protocol::ServerStats_Raft_Peer& peerStats,
             peerStats.set_last_agree_index(matchIndex);
             peerStats.set_is_caught_up(isCaughtUp_);
             peerStats.set_next_heartbeat_at(time.unixNanos(nextHeartbeatTime));
+            if (rttStat.getCount() > 0)
+                rttStat.updateProtoBuf(*peerStats.mutable_rtt_nanos());
+            peerStats.set_election_timeout_nanos(
+                uint64_t(electionTimeout.count()));
             break;
     }
 
@@ -501,6 +578,7 @@ Peer::updatePeerStats(LibLogCabin::Protocol::ServerStats_Raft_Peer& peerStats,
 
 Configuration::SimpleConfiguration::SimpleConfiguration()
     : servers()
+    , commitQuorumSize(0)
 {
 }
 
@@ -556,7 +634,7 @@ Configuration::SimpleConfiguration::quorumAll(const Predicate& predicate) const
     for (auto it = servers.begin(); it != servers.end(); ++it)
         if (predicate(**it))
             ++count;
-    return (count >= servers.size() / 2 + 1);
+    return (count >= electionQuorum());
 }
 
 uint64_t
@@ -568,7 +646,23 @@ Configuration::SimpleConfiguration::quorumMin(const GetValue& getValue) const
     for (auto it = servers.begin(); it != servers.end(); ++it)
         values.push_back(getValue(**it));
     std::sort(values.begin(), values.end());
-    return values.at((values.size() - 1)/ 2);
+    return values.at(values.size() - commitQuorum());
+}
+
+uint64_t
+Configuration::SimpleConfiguration::commitQuorum() const
+{
+    if (!isValidCommitQuorumSize(commitQuorumSize, servers.size()))
+        return servers.size() / 2 + 1;
+    return commitQuorumSize;
+}
+
+uint64_t
+Configuration::SimpleConfiguration::electionQuorum() const
+{
+    if (!isValidCommitQuorumSize(commitQuorumSize, servers.size()))
+        return servers.size() / 2 + 1;
+    return servers.size() - commitQuorumSize + 1;
 }
 
 ////////// Configuration //////////
@@ -609,6 +703,15 @@ Configuration::hasVote(std::shared_ptr<Server> server) const
     }
 }
 
+bool
+Configuration::isValidCommitQuorumSize(uint64_t commitQuorumSize,
+                                       uint64_t numServers)
+{
+    return (commitQuorumSize >= 1 &&
+            commitQuorumSize <= numServers &&
+            2 * (numServers - commitQuorumSize + 1) > numServers);
+}
+
 std::string
 Configuration::lookupAddress(uint64_t serverId) const
 {
@@ -618,6 +721,17 @@ Configuration::lookupAddress(uint64_t serverId) const
     return "";
 }
 
+uint64_t
+Configuration::maxPriority() const
+{
+    uint64_t largest = 0;
+    for (auto it = knownServers.begin(); it != knownServers.end(); ++it) {
+        if (hasVote(it->second))
+            largest = std::max(largest, it->second->priority);
+    }
+    return largest;
+}
+
 bool
 Configuration::quorumAll(const Predicate& predicate) const
 {
@@ -665,7 +779,9 @@ Configuration::reset()
     id = 0;
     description = {};
     oldServers.servers.clear();
+    oldServers.commitQuorumSize = 0;
     newServers.servers.clear();
+    newServers.commitQuorumSize = 0;
     for (auto it = knownServers.begin(); it != knownServers.end(); ++it)
         it->second->exit();
     knownServers.clear();
@@ -687,7 +803,11 @@ Configuration::setConfiguration(
     id = newId;
     description = newDescription;
     oldServers.servers.clear();
+    oldServers.commitQuorumSize =
+        description.prev_configuration().commit_quorum_size();
     newServers.servers.clear();
+    newServers.commitQuorumSize =
+        description.next_configuration().commit_quorum_size();
 
     // Build up the list of old servers
     for (auto confIt = description.prev_configuration().servers().begin();
@@ -695,6 +815,8 @@ Configuration::setConfiguration(
          ++confIt) {
         std::shared_ptr<Server> server = getServer(confIt->server_id());
         server->addresses = confIt->addresses();
+        server->priority = confIt->priority();
+        server->witness = confIt->witness();
         oldServers.servers.push_back(server);
     }
 
@@ -704,9 +826,24 @@ Configuration::setConfiguration(
          ++confIt) {
         std::shared_ptr<Server> server = getServer(confIt->server_id());
         server->addresses = confIt->addresses();
+        server->priority = confIt->priority();
+        server->witness = confIt->witness();
         newServers.servers.push_back(server);
     }
 
+    // commit_quorum_size is an absolute count, so it may not suit a list of
+    // servers it wasn't chosen for. Quorums fall back to simple majorities.
+    for (const SimpleConfiguration* servers : {&oldServers, &newServers}) {
+        if (servers->commitQuorumSize != 0 &&
+            !isValidCommitQuorumSize(servers->commitQuorumSize,
+                                     servers->servers.size())) {
+            WARNING("Ignoring commit quorum size of %lu, which is not safe "
+                    "with %lu servers; using simple majorities instead",
+                    servers->commitQuorumSize,
+                    servers->servers.size());
+        }
+    }
+
     // Servers not in the current configuration need to be told to exit
     setGCFlag(*localServer);
     oldServers.forEach(setGCFlag);
@@ -730,11 +867,14 @@ Configuration::setStagingServers(
 {
     assert(state == State::STABLE);
     state = State::STAGING;
+    newServers.commitQuorumSize = stagingServers.commit_quorum_size();
     for (auto it = stagingServers.servers().begin();
          it != stagingServers.servers().end();
          ++it) {
         std::shared_ptr<Server> server = getServer(it->server_id());
         server->addresses = it->addresses();
+        server->priority = it->priority();
+        server->witness = it->witness();
         newServers.servers.push_back(server);
     }
 }
@@ -774,6 +914,8 @@ Configuration::updateServerStats(LibLogCabin::Protocol::ServerStats& serverStats
                                  newServers.contains(peer));
         peerStats.set_staging_member(state == State::STAGING &&
                                      newServers.contains(peer));
+        peerStats.set_priority(peer->priority);
+        peerStats.set_witness(peer->witness);
         peer->updatePeerStats(peerStats, time);
     }
 }
@@ -1042,6 +1184,21 @@ RaftConsensus::RaftConsensus(
                     config.read<uint64_t>(
                         "heartbeatPeriodMilliseconds")))
             : ELECTION_TIMEOUT / 2)
+    , ADAPTIVE_ELECTION_TIMEOUT(
+        config.read<bool>(
+            "adaptiveElectionTimeout",
+            false))
+    , MIN_ELECTION_TIMEOUT(
+        config.keyExists("minElectionTimeoutMilliseconds")
+            ? std::chrono::nanoseconds(
+                std::chrono::milliseconds(
+                    config.read<uint64_t>(
+                        "minElectionTimeoutMilliseconds")))
+            : ELECTION_TIMEOUT / 10)
+    , ELECTION_TIMEOUT_RTT_MULTIPLE(
+        config.read<uint64_t>(
+            "electionTimeoutRTTMultiple",
+            10))
     , MAX_LOG_ENTRIES_PER_REQUEST(
         config.read<uint64_t>(
             "maxLogEntriesPerRequest",
@@ -1059,6 +1216,18 @@ RaftConsensus::RaftConsensus(
                 "stateMachineUpdaterBackoffMilliseconds",
                 10000)))
     , SOFT_RPC_SIZE_LIMIT(MAX_MESSAGE_LENGTH - 1024)
+    , CATCH_UP_BYTES_PER_SECOND_PER_PEER(
+        config.read<uint64_t>(
+            "catchUpBytesPerSecondPerPeer",
+            0))
+    , CATCH_UP_BYTES_PER_SECOND(
+        config.read<uint64_t>(
+            "catchUpBytesPerSecond",
+            0))
+    , CATCH_UP_BURST_BYTES(
+        config.read<uint64_t>(
+            "catchUpBurstBytes",
+            SOFT_RPC_SIZE_LIMIT))
     , serverId(serverId)
     , serverAddresses()
     , eventLoop()
@@ -1094,8 +1263,12 @@ RaftConsensus::RaftConsensus(
     , currentEpoch(0)
     , clusterClock()
     , startElectionAt(TimePoint::max())
+    , electionTimeout(ELECTION_TIMEOUT)
     , withholdVotesUntil(TimePoint::min())
+    , leadershipTransferTerm(0)
+    , leadershipTransferBackoffUntil(TimePoint::min())
     , numEntriesTruncated(0)
+    , catchUpBucket(CATCH_UP_BYTES_PER_SECOND, CATCH_UP_BURST_BYTES)
     , leaderDiskThread()
     , timerThread()
     , stateMachineUpdaterThread()
@@ -1103,6 +1276,14 @@ RaftConsensus::RaftConsensus(
     , eventLoopThread()
     , invariants(*this)
 {
+    if (MIN_ELECTION_TIMEOUT > ELECTION_TIMEOUT) {
+        PANIC("minElectionTimeoutMilliseconds (%lu) must not exceed "
+              "electionTimeoutMilliseconds (%lu)",
+              std::chrono::duration_cast<std::chrono::milliseconds>(
+                  MIN_ELECTION_TIMEOUT).count(),
+              std::chrono::duration_cast<std::chrono::milliseconds>(
+                  ELECTION_TIMEOUT).count());
+    }
 }
 
 RaftConsensus::~RaftConsensus()
@@ -1305,6 +1486,16 @@ RaftConsensus::bootstrapConfiguration()
         *configuration.mutable_prev_configuration()->add_servers();
     server.set_server_id(serverId);
     server.set_addresses(serverAddresses);
+    if (config.keyExists("electionPriority"))
+        server.set_priority(config.read<uint64_t>("electionPriority"));
+    if (config.keyExists("witness"))
+        server.set_witness(config.read<bool>("witness"));
+    if (server.witness()) {
+        // A witness alone could never serve clients or add the full servers
+        // that would let it hand off leadership.
+        PANIC("Refusing to bootstrap with a witness as the only server; "
+              "bootstrap a full server and add witnesses later");
+    }
     append({&entry});
 }
 
@@ -1354,7 +1545,13 @@ RaftConsensus::getNextEntry(uint64_t lastIndex) const
             RaftConsensus::Entry entry;
             // Make the state machine load a snapshot if we don't have the next
             // entry it needs in the log.
-            if (log->getLogStartIndex() > nextIndex) {
+            if (log->getLogStartIndex() > nextIndex &&
+                configuration->localServer->witness) {
+                // Witnesses only store snapshot headers.
+                entry.type = Entry::SKIP;
+                entry.index = lastSnapshotIndex;
+                entry.clusterTime = lastSnapshotClusterTime;
+            } else if (log->getLogStartIndex() > nextIndex) {
                 entry.type = Entry::SNAPSHOT;
                 // For well-behaved state machines, we expect 'snapshotReader'
                 // to contain a SnapshotFile::Reader that we can return
@@ -1378,7 +1575,8 @@ RaftConsensus::getNextEntry(uint64_t lastIndex) const
                 // not a snapshot
                 const Log::Entry& logEntry = log->getEntry(nextIndex);
                 entry.index = nextIndex;
-                if (logEntry.type() == Raft::Protocol::EntryType::DATA) {
+                if (logEntry.type() == Raft::Protocol::EntryType::DATA &&
+                    !configuration->localServer->witness) {
                     entry.type = Entry::DATA;
                     const std::string& s = logEntry.data();
                     entry.command = Core::Buffer(
@@ -1413,7 +1611,7 @@ RaftConsensus::getSnapshotStats() const
 
 void
 RaftConsensus::handleAppendEntries(
-                    const Raft::Protocol::AppendEntries::Request& request,
+                    Raft::Protocol::AppendEntries::Request& request,
                     Raft::Protocol::AppendEntries::Response& response)
 {
     std::lock_guard<Mutex> lockGuard(mutex);
@@ -1456,8 +1654,14 @@ RaftConsensus::handleAppendEntries(
     // election timer. set it here in case request we exit the
     // function early, we will set it again after the disk write.
     stepDown(request.term());
+    if (ADAPTIVE_ELECTION_TIMEOUT && request.has_election_timeout_nanos()) {
+        electionTimeout = clampElectionTimeout(
+            std::chrono::nanoseconds(request.election_timeout_nanos()));
+    } else {
+        electionTimeout = ELECTION_TIMEOUT;
+    }
     setElectionTimer();
-    withholdVotesUntil = Clock::now() + ELECTION_TIMEOUT;
+    withholdVotesUntil = Clock::now() + electionTimeout;
 
     // Record the leader ID as a hint for clients.
     if (leaderId == 0) {
@@ -1480,7 +1684,7 @@ RaftConsensus::handleAppendEntries(
     // We could truncate the log here, but there's no real advantage to doing
     // that.
     if (request.prev_log_index() >= log->getLogStartIndex() &&
-        log->getEntry(request.prev_log_index()).term() !=
+        log->getTerm(request.prev_log_index()) !=
             request.prev_log_term()) {
         VERBOSE("Rejecting AppendEntries RPC: terms don't agree");
         return; // response was set to a rejection above
@@ -1506,8 +1710,8 @@ RaftConsensus::handleAppendEntries(
     // on the follower's disk between the truncate and append operations (which
     // are not done atomically) when the follower processes the later request.
     uint64_t index = request.prev_log_index();
-    for (auto it = request.entries().begin();
-         it != request.entries().end();
+    for (auto it = request.mutable_entries()->begin();
+         it != request.mutable_entries()->end();
          ++it) {
         ++index;
         const Raft::Protocol::Entry& entry = *it;
@@ -1522,7 +1726,7 @@ RaftConsensus::handleAppendEntries(
             continue;
         }
         if (log->getLastLogIndex() >= index) {
-            if (log->getEntry(index).term() == entry.term())
+            if (log->getTerm(index) == entry.term())
                 continue;
             // should never truncate committed entries:
             assert(commitIndex < index);
@@ -1536,11 +1740,11 @@ RaftConsensus::handleAppendEntries(
             configurationManager->truncateSuffix(lastIndexKept);
         }
 
-        // Append this and all following entries.
+        // Append this and all following entries. They're moved out of the
+        // request rather than copied, unless the callbacks need them.
         std::vector<Raft::Protocol::Entry*> entries;
-        std::vector<const Raft::Protocol::Entry*> entries_;
         do {
-            const Raft::Protocol::Entry& entry = *it;
+            Raft::Protocol::Entry& entry = *it;
             if (entry.type() == Raft::Protocol::EntryType::UNKNOWN) {
                 PANIC("Leader %lu is trying to send us an unknown log entry "
                       "type for index %lu (term %lu). It shouldn't do that, "
@@ -1551,16 +1755,24 @@ RaftConsensus::handleAppendEntries(
                       entry.term(),
                       leaderId);
             }
-            entries.push_back(const_cast<Raft::Protocol::Entry*>(&entry));
-            entries_.push_back(&entry);
+            entries.push_back(&entry);
             ++it;
             ++index;
-        } while (it != request.entries().end());
-        append(entries_);
+        } while (it != request.mutable_entries()->end());
+        uint64_t clusterTime = entries.back()->cluster_time();
+        std::vector<Log::Entry> newEntries;
+        newEntries.reserve(entries.size());
+        for (auto it2 = entries.begin(); it2 != entries.end(); ++it2) {
+            if (committedEntriesCallbacks.empty())
+                newEntries.push_back(std::move(**it2));
+            else
+                newEntries.push_back(**it2);
+        }
+        appendMoved(std::move(newEntries));
         for (auto callback : committedEntriesCallbacks) {
           callback(entries);
         }
-        clusterClock.newEpoch(entries.back()->cluster_time());
+        clusterClock.newEpoch(clusterTime);
         break;
     }
     response.set_last_log_index(log->getLastLogIndex());
@@ -1580,7 +1792,7 @@ RaftConsensus::handleAppendEntries(
     // reset election timer to avoid punishing the leader for our own
     // long disk writes
     setElectionTimer();
-    withholdVotesUntil = Clock::now() + ELECTION_TIMEOUT;
+    withholdVotesUntil = Clock::now() + electionTimeout;
 }
 
 void
@@ -1611,7 +1823,7 @@ RaftConsensus::handleInstallSnapshot(
     // and convert to follower if necessary; reset the election timer.
     stepDown(request.term());
     setElectionTimer();
-    withholdVotesUntil = Clock::now() + ELECTION_TIMEOUT;
+    withholdVotesUntil = Clock::now() + electionTimeout;
 
     // Record the leader ID as a hint for clients.
     if (leaderId == 0) {
@@ -1622,6 +1834,11 @@ RaftConsensus::handleInstallSnapshot(
         assert(leaderId == request.server_id());
     }
 
+    if (request.has_last_snapshot_term()) {
+        installSnapshotHeader(request);
+        return;
+    }
+
     if (!snapshotWriter) {
       snapshotWriter.reset(snapshotFileFactory->makeWriter(storageLayout));
     }
@@ -1655,6 +1872,19 @@ RaftConsensus::handleInstallSnapshot(
         }
         return;
     }
+    if (request.has_data_checksum()) {
+        std::string error = Core::Checksum::verify(
+            request.data_checksum().c_str(),
+            request.data().data(),
+            request.data().length());
+        if (!error.empty()) {
+            WARNING("Discarding snapshot chunk at byte offset %lu that failed "
+                    "its checksum (%s). The leader will resend it.",
+                    request.byte_offset(),
+                    error.c_str());
+            return;
+        }
+    }
     snapshotWriter->writeRaw(request.data().data(), request.data().length());
     response.set_bytes_stored(snapshotWriter->getBytesWritten());
 
@@ -1678,6 +1908,44 @@ RaftConsensus::handleInstallSnapshot(
     }
 }
 
+void
+RaftConsensus::installSnapshotHeader(
+        const Raft::Protocol::InstallSnapshot::Request& request)
+{
+    if (request.last_snapshot_index() <= lastSnapshotIndex) {
+        VERBOSE("Ignoring snapshot header through %lu since we already have "
+                "a snapshot through %lu",
+                request.last_snapshot_index(), lastSnapshotIndex);
+        return;
+    }
+    if (snapshotWriter) {
+        snapshotWriter->discard();
+        snapshotWriter.reset();
+    }
+
+    // Witnesses keep no state machine data, so the snapshot is just a
+    // header, written in this server's own snapshot format.
+    std::unique_ptr<Storage::Snapshot::Writer> writer(
+        snapshotFileFactory->makeWriter(storageLayout));
+    uint8_t version = 1;
+    writer->writeRaw(&version, sizeof(version));
+    Storage::SnapshotMetadata::Header header;
+    header.set_last_included_index(request.last_snapshot_index());
+    header.set_last_included_term(request.last_snapshot_term());
+    header.set_last_cluster_time(request.last_snapshot_cluster_time());
+    if (request.has_configuration()) {
+        header.set_configuration_index(request.configuration_index());
+        *header.mutable_configuration() = request.configuration();
+    }
+    writer->writeMessage(header);
+
+    NOTICE("Loading in new snapshot header through index %lu from leader",
+           request.last_snapshot_index());
+    writer->save();
+    readSnapshot();
+    stateChanged.notify_all();
+}
+
 void
 RaftConsensus::handleRequestVote(
                     const Raft::Protocol::RequestVote::Request& request,
@@ -1693,7 +1961,7 @@ RaftConsensus::handleRequestVote(
                     (request.last_log_term() == lastLogTerm &&
                      request.last_log_index() >= lastLogIndex));
 
-    if (withholdVotesUntil > Clock::now()) {
+    if (withholdVotesUntil > Clock::now() && !request.leadership_transfer()) {
         NOTICE("Rejecting RequestVote for term %lu from server %lu, since "
                "this server (which is in term %lu) recently heard from a "
                "leader (%lu). Should server %lu be shut down?",
@@ -1737,6 +2005,28 @@ RaftConsensus::handleRequestVote(
     response.set_log_ok(logIsOk);
 }
 
+void
+RaftConsensus::handleTimeoutNow(
+                    const Raft::Protocol::TimeoutNow::Request& request,
+                    Raft::Protocol::TimeoutNow::Response& response)
+{
+    std::lock_guard<Mutex> lockGuard(mutex);
+    assert(!exiting);
+
+    // Only the leader of the current term may hand off leadership, and only
+    // to a follower.
+    if (request.term() == currentTerm &&
+        request.server_id() == leaderId &&
+        state == State::FOLLOWER) {
+        NOTICE("Leader %lu is handing off leadership for term %lu to this "
+               "server",
+               request.server_id(), currentTerm);
+        startNewElection();
+        leadershipTransferTerm = currentTerm;
+    }
+    response.set_term(currentTerm);
+}
+
 std::pair<RaftConsensus::ClientResult, uint64_t>
 RaftConsensus::replicate(const Core::Buffer& operation)
 {
@@ -1754,7 +2044,8 @@ RaftConsensus::setConfiguration(
 {
     std::unique_lock<Mutex> lockGuard(mutex);
 
-    if (exiting || state != State::LEADER) {
+    if (exiting || state != State::LEADER ||
+        configuration->localServer->witness) {
         // caller fills out response
         return ClientResult::NOT_LEADER;
     }
@@ -1791,6 +2082,28 @@ RaftConsensus::setConfiguration(
         Raft::Protocol::Server* s = nextConfiguration.add_servers();
         s->set_server_id(it->server_id());
         s->set_addresses(it->addresses());
+        if (it->has_priority())
+            s->set_priority(it->priority());
+        if (it->has_witness())
+            s->set_witness(it->witness());
+    }
+    if (request.commit_quorum_size() > 0) {
+        if (!Configuration::isValidCommitQuorumSize(
+                request.commit_quorum_size(),
+                uint64_t(request.new_servers().size()))) {
+            response.mutable_configuration_changed()->set_error(
+                Core::StringUtil::format(
+                    "Commit quorums of %lu servers are not safe with %d "
+                    "servers: they must be at least 1 and at most %d",
+                    request.commit_quorum_size(),
+                    request.new_servers().size(),
+                    (request.new_servers().size() + 1) / 2));
+            return ClientResult::FAIL;
+        }
+        NOTICE("Using commit quorums of %lu servers",
+               request.commit_quorum_size());
+        nextConfiguration.set_commit_quorum_size(
+            request.commit_quorum_size());
     }
     configuration->setStagingServers(nextConfiguration);
     stateChanged.notify_all();
@@ -2043,6 +2356,7 @@ RaftConsensus::updateServerStats(LibLogCabin::Protocol::ServerStats& serverStats
     raftStats.set_voted_for(votedFor);
     raftStats.set_start_election_at(time.unixNanos(startElectionAt));
     raftStats.set_withhold_votes_until(time.unixNanos(withholdVotesUntil));
+    raftStats.set_election_timeout_nanos(uint64_t(electionTimeout.count()));
     raftStats.set_cluster_time_epoch(clusterClock.clusterTimeAtEpoch);
     raftStats.set_cluster_time(clusterClock.interpolate());
 
@@ -2254,11 +2568,22 @@ RaftConsensus::peerThreadMain(std::shared_ptr<Peer> peer)
 
                 // Leaders replicate entries and periodically send heartbeats.
                 case State::LEADER:
-                    if (peer->getMatchIndex() < log->getLastLogIndex() ||
-                        peer->nextHeartbeatTime < now) {
+                    if (shouldTransferLeadership(peer)) {
+                        timeoutNow(lockGuard, *peer);
+                    } else if (peer->nextHeartbeatTime < now) {
                         // appendEntries delegates to installSnapshot if we
                         // need to send a snapshot instead
                         appendEntries(lockGuard, *peer);
+                    } else if (peer->getMatchIndex() <
+                               log->getLastLogIndex()) {
+                        // Catch-up traffic may need to wait for its rate
+                        // limit, but not past the next heartbeat.
+                        TimePoint readyTime = getCatchUpReadyTime(*peer, now);
+                        if (readyTime <= now)
+                            appendEntries(lockGuard, *peer);
+                        else
+                            waitUntil = std::min(readyTime,
+                                                 peer->nextHeartbeatTime);
                     } else {
                         waitUntil = peer->nextHeartbeatTime;
                     }
@@ -2353,7 +2678,7 @@ RaftConsensus::advanceCommitIndex()
     assert(newCommitIndex >= log->getLogStartIndex());
     // At least one of these entries must also be from the current term to
     // guarantee that no server without them can be elected.
-    if (log->getEntry(newCommitIndex).term() != currentTerm)
+    if (log->getTerm(newCommitIndex) != currentTerm)
         return;
     commitIndex = newCommitIndex;
     VERBOSE("New commitIndex: %lu", commitIndex);
@@ -2388,9 +2713,26 @@ RaftConsensus::advanceCommitIndex()
 void
 RaftConsensus::append(const std::vector<const Log::Entry*>& entries)
 {
+    std::vector<Log::Entry> copies;
+    copies.reserve(entries.size());
     for (auto it = entries.begin(); it != entries.end(); ++it)
-        assert((*it)->term() != 0);
-    std::pair<uint64_t, uint64_t> range = log->append(entries);
+        copies.push_back(**it);
+    appendMoved(std::move(copies));
+}
+
+void
+RaftConsensus::appendMoved(std::vector<Log::Entry>&& entries)
+{
+    // The configuration entries are read back out of the log below, since
+    // 'entries' won't have them anymore.
+    std::vector<uint64_t> configurationOffsets;
+    for (uint64_t i = 0; i < entries.size(); ++i) {
+        const Log::Entry& entry = entries.at(i);
+        assert(entry.term() != 0);
+        if (entry.type() == Raft::Protocol::EntryType::CONFIGURATION)
+            configurationOffsets.push_back(i);
+    }
+    std::pair<uint64_t, uint64_t> range = log->appendMoved(std::move(entries));
     if (state == State::LEADER) { // defer log sync
         logSyncQueued = true;
     } else { // sync log now
@@ -2398,12 +2740,12 @@ RaftConsensus::append(const std::vector<const Log::Entry*>& entries)
         sync->wait();
         log->syncComplete(std::move(sync));
     }
-    uint64_t index = range.first;
-    for (auto it = entries.begin(); it != entries.end(); ++it) {
-        const Log::Entry& entry = **it;
-        if (entry.type() == Raft::Protocol::EntryType::CONFIGURATION)
-            configurationManager->add(index, entry.configuration());
-        ++index;
+    for (auto it = configurationOffsets.begin();
+         it != configurationOffsets.end();
+         ++it) {
+        uint64_t index = range.first + *it;
+        configurationManager->add(index,
+                                  log->getEntry(index).configuration());
     }
     stateChanged.notify_all();
 }
@@ -2416,39 +2758,78 @@ RaftConsensus::appendEntries(std::unique_lock<Mutex>& lockGuard,
     uint64_t prevLogIndex = peer.nextIndex - 1;
     assert(prevLogIndex <= lastLogIndex);
 
+    // Let a witness discard the entries our latest snapshot covers once it
+    // has them all.
+    if (peer.witness &&
+        lastSnapshotIndex > peer.lastSnapshotHeaderIndex &&
+        peer.matchIndex >= lastSnapshotIndex) {
+        installSnapshotHeader(lockGuard, peer);
+        return;
+    }
+
     // Don't have needed entry: send a snapshot instead.
     if (peer.nextIndex < log->getLogStartIndex()) {
-        installSnapshot(lockGuard, peer);
+        if (peer.witness)
+            installSnapshotHeader(lockGuard, peer);
+        else
+            installSnapshot(lockGuard, peer);
         return;
     }
 
     // Find prevLogTerm or fall back to sending a snapshot.
     uint64_t prevLogTerm;
     if (prevLogIndex >= log->getLogStartIndex()) {
-        prevLogTerm = log->getEntry(prevLogIndex).term();
+        prevLogTerm = log->getTerm(prevLogIndex);
     } else if (prevLogIndex == 0) {
         prevLogTerm = 0;
     } else if (prevLogIndex == lastSnapshotIndex) {
         prevLogTerm = lastSnapshotTerm;
     } else {
         // Don't have needed entry for prevLogTerm: send snapshot instead.
-        installSnapshot(lockGuard, peer);
+        if (peer.witness)
+            installSnapshotHeader(lockGuard, peer);
+        else
+            installSnapshot(lockGuard, peer);
         return;
     }
 
-    // Build up request
-    Raft::Protocol::AppendEntries::Request request;
+    // Build up request. The request and response are allocated from an
+    // arena, since a large request would otherwise take a few heap
+    // allocations for every entry packed into it.
+    Core::ProtoBuf::Arena arena;
+    Raft::Protocol::AppendEntries::Request& request =
+        arena.create<Raft::Protocol::AppendEntries::Request>();
     request.set_server_id(serverId);
     request.set_term(currentTerm);
     request.set_prev_log_term(prevLogTerm);
     request.set_prev_log_index(prevLogIndex);
     uint64_t numEntries = 0;
-    if (!peer.suppressBulkData)
-        numEntries = packEntries(peer.nextIndex, request);
+    if (!peer.suppressBulkData) {
+        TimePoint now = Clock::now();
+        if (getCatchUpReadyTime(peer, now) <= now) {
+            numEntries = packEntries(peer.nextIndex, request);
+            if (numEntries > 0) {
+                consumeCatchUpBytes(peer,
+                                    uint64_t(request.ByteSize()),
+                                    now);
+                // If the peer is behind, it'll need the next batch of
+                // entries after this one. Have the log start reading them
+                // from disk now, while this request is in flight, so that
+                // packing them later doesn't stall on page faults.
+                log->prefetch(peer.nextIndex + numEntries,
+                              SOFT_RPC_SIZE_LIMIT);
+            }
+        }
+    }
     request.set_commit_index(std::min(commitIndex, prevLogIndex + numEntries));
+    if (ADAPTIVE_ELECTION_TIMEOUT) {
+        request.set_election_timeout_nanos(
+            uint64_t(peer.electionTimeout.count()));
+    }
 
     // Execute RPC
-    Raft::Protocol::AppendEntries::Response response;
+    Raft::Protocol::AppendEntries::Response& response =
+        arena.create<Raft::Protocol::AppendEntries::Response>();
     TimePoint start = Clock::now();
     uint64_t epoch = currentEpoch;
     Peer::CallStatus status = peer.callRPC(
@@ -2457,6 +2838,7 @@ RaftConsensus::appendEntries(std::unique_lock<Mutex>& lockGuard,
                 lockGuard);
     switch (status) {
         case Peer::CallStatus::OK:
+            peer.recordRTT(Clock::now() - start);
             break;
         case Peer::CallStatus::FAILED:
             peer.suppressBulkData = true;
@@ -2485,7 +2867,7 @@ RaftConsensus::appendEntries(std::unique_lock<Mutex>& lockGuard,
         assert(response.term() == currentTerm);
         peer.lastAckEpoch = epoch;
         stateChanged.notify_all();
-        peer.nextHeartbeatTime = start + HEARTBEAT_PERIOD;
+        peer.nextHeartbeatTime = start + getHeartbeatPeriod(peer);
         if (response.success()) {
             if (peer.matchIndex > prevLogIndex + numEntries) {
                 // Revisit this warning if we pipeline AppendEntries RPCs for
@@ -2519,6 +2901,10 @@ RaftConsensus::appendEntries(std::unique_lock<Mutex>& lockGuard,
                 }
             }
         } else {
+            // The follower's log diverges from ours, so it's no longer caught
+            // up until it completes another catch-up iteration.
+            if (peer.isCaughtUp_)
+                peer.restartCatchUp();
             if (peer.nextIndex > 1)
                 --peer.nextIndex;
             // A server that hasn't been around for a while might have a much
@@ -2556,7 +2942,20 @@ RaftConsensus::installSnapshot(std::unique_lock<Mutex>& lockGuard,
     request.set_term(currentTerm);
     request.set_version(2);
 
+    if (configuration->localServer->witness) {
+        // Our snapshots are just headers. This follower will have to wait
+        // for a full server to take over.
+        WARNING("Server %lu needs a snapshot, but this server is a witness "
+                "and has no snapshot data to send it",
+                peer.serverId);
+        peer.backoffUntil = Clock::now() + RPC_FAILURE_BACKOFF;
+        return folly::Unit();
+    }
+
     if (!peer.snapshotFile) {
+        // A follower that needs a snapshot has fallen well behind.
+        if (peer.isCaughtUp_)
+            peer.restartCatchUp();
         auto promise = std::make_shared<folly::Promise<folly::Unit>>();
         namespace FS = Storage::FilesystemUtil;
         try {
@@ -2598,18 +2997,26 @@ RaftConsensus::_installSnapshot(std::unique_lock<Mutex>& lockGuard,
     request.set_last_snapshot_index(peer.lastSnapshotIndex);
     request.set_byte_offset(peer.snapshotFileOffset);
     uint64_t numDataBytes = 0;
-    if (!peer.suppressBulkData) {
+    TimePoint now = Clock::now();
+    if (!peer.suppressBulkData && getCatchUpReadyTime(peer, now) <= now) {
         // The amount of data we can send is bounded by the remaining bytes in
         // the file and the maximum length for RPCs.
         numDataBytes = std::min(
             peer.snapshotFile->getFileLength() - peer.snapshotFileOffset,
             SOFT_RPC_SIZE_LIMIT);
+        consumeCatchUpBytes(peer, numDataBytes, now);
     }
     request.set_data(peer.snapshotFile->get<char>(peer.snapshotFileOffset,
                                                   numDataBytes),
                      numDataBytes);
     request.set_done(peer.snapshotFileOffset + numDataBytes ==
                      peer.snapshotFile->getFileLength());
+    char checksum[Core::Checksum::MAX_LENGTH];
+    Core::Checksum::calculate(SNAPSHOT_CHUNK_CHECKSUM,
+                              request.data().data(),
+                              request.data().length(),
+                              checksum);
+    request.set_data_checksum(checksum);
 
     // Execute RPC
     Raft::Protocol::InstallSnapshot::Response response;
@@ -2649,7 +3056,7 @@ RaftConsensus::_installSnapshot(std::unique_lock<Mutex>& lockGuard,
         assert(response.term() == currentTerm);
         peer.lastAckEpoch = epoch;
         stateChanged.notify_all();
-        peer.nextHeartbeatTime = start + HEARTBEAT_PERIOD;
+        peer.nextHeartbeatTime = start + getHeartbeatPeriod(peer);
         peer.suppressBulkData = false;
         if (response.has_bytes_stored()) {
             // Normal path (since InstallSnapshot version 2).
@@ -2677,6 +3084,77 @@ RaftConsensus::_installSnapshot(std::unique_lock<Mutex>& lockGuard,
     }
 }
 
+void
+RaftConsensus::installSnapshotHeader(std::unique_lock<Mutex>& lockGuard,
+                                     Peer& peer)
+{
+    // Build up request
+    Raft::Protocol::InstallSnapshot::Request request;
+    request.set_server_id(serverId);
+    request.set_term(currentTerm);
+    request.set_version(2);
+    request.set_last_snapshot_index(lastSnapshotIndex);
+    request.set_byte_offset(0);
+    request.set_data("");
+    request.set_done(true);
+    request.set_last_snapshot_term(lastSnapshotTerm);
+    request.set_last_snapshot_cluster_time(lastSnapshotClusterTime);
+    std::pair<uint64_t, Raft::Protocol::Configuration> c =
+        configurationManager->getLatestConfigurationAsOf(lastSnapshotIndex);
+    if (c.first != 0) {
+        request.set_configuration_index(c.first);
+        *request.mutable_configuration() = c.second;
+    }
+
+    // Execute RPC
+    Raft::Protocol::InstallSnapshot::Response response;
+    TimePoint start = Clock::now();
+    uint64_t epoch = currentEpoch;
+    Peer::CallStatus status = peer.callRPC(
+                Raft::Protocol::OpCode::INSTALL_SNAPSHOT,
+                request, response,
+                lockGuard);
+    switch (status) {
+        case Peer::CallStatus::OK:
+            break;
+        case Peer::CallStatus::FAILED:
+            peer.backoffUntil = start + RPC_FAILURE_BACKOFF;
+            return;
+        case Peer::CallStatus::INVALID_REQUEST:
+            PANIC("The server's RaftService doesn't support the "
+                  "InstallSnapshot RPC or claims the request is malformed");
+    }
+
+    // Process response
+
+    if (currentTerm != request.term() || peer.exiting) {
+        // we don't care about result of RPC
+        return;
+    }
+    // Since we were leader in this term before, we must still be leader in
+    // this term.
+    assert(state == State::LEADER);
+    if (response.term() > currentTerm) {
+        NOTICE("Received InstallSnapshot response from server %lu in "
+               "term %lu (this server's term was %lu)",
+                peer.serverId, response.term(), currentTerm);
+        stepDown(response.term());
+    } else {
+        assert(response.term() == currentTerm);
+        peer.lastAckEpoch = epoch;
+        stateChanged.notify_all();
+        peer.nextHeartbeatTime = start + getHeartbeatPeriod(peer);
+        peer.lastSnapshotHeaderIndex = request.last_snapshot_index();
+        if (peer.matchIndex < request.last_snapshot_index()) {
+            peer.matchIndex = request.last_snapshot_index();
+            peer.nextIndex = request.last_snapshot_index() + 1;
+            // As in _installSnapshot(), bumping matchIndex should always be
+            // followed by a call to advanceCommitIndex().
+            advanceCommitIndex();
+        }
+    }
+}
+
 void
 RaftConsensus::becomeLeader()
 {
@@ -2715,6 +3193,23 @@ RaftConsensus::becomeLeader()
     interruptAll();
 }
 
+std::chrono::nanoseconds
+RaftConsensus::clampElectionTimeout(std::chrono::nanoseconds timeout) const
+{
+    return std::max(MIN_ELECTION_TIMEOUT,
+                    std::min(ELECTION_TIMEOUT, timeout));
+}
+
+void
+RaftConsensus::consumeCatchUpBytes(Peer& peer, uint64_t bytes, TimePoint now)
+{
+    // Same test as in getCatchUpReadyTime().
+    if (peer.isCaughtUp_ || peer.nextIndex > commitIndex)
+        return;
+    peer.catchUpBucket.consume(bytes, now);
+    catchUpBucket.consume(bytes, now);
+}
+
 void
 RaftConsensus::discardUnneededEntries()
 {
@@ -2734,12 +3229,34 @@ RaftConsensus::discardUnneededEntries()
     }
 }
 
+RaftConsensus::TimePoint
+RaftConsensus::getCatchUpReadyTime(Peer& peer, TimePoint now)
+{
+    // If the follower is caught up, or if the next entry we'd send it isn't
+    // committed yet, the follower might be needed to advance the commitIndex.
+    if (peer.isCaughtUp_ || peer.nextIndex > commitIndex)
+        return now;
+    return std::max(peer.catchUpBucket.getReadyTime(now),
+                    catchUpBucket.getReadyTime(now));
+}
+
+std::chrono::nanoseconds
+RaftConsensus::getHeartbeatPeriod(const Peer& peer) const
+{
+    if (peer.electionTimeout >= ELECTION_TIMEOUT)
+        return HEARTBEAT_PERIOD;
+    return std::chrono::nanoseconds(std::chrono::nanoseconds::rep(
+        double(HEARTBEAT_PERIOD.count()) *
+        double(peer.electionTimeout.count()) /
+        double(ELECTION_TIMEOUT.count())));
+}
+
 uint64_t
 RaftConsensus::getLastLogTerm() const
 {
     uint64_t lastLogIndex = log->getLastLogIndex();
     if (lastLogIndex >= log->getLogStartIndex()) {
-        return log->getEntry(lastLogIndex).term();
+        return log->getTerm(lastLogIndex);
     } else {
         assert(lastLogIndex == lastSnapshotIndex); // potentially 0
         return lastSnapshotTerm;
@@ -2869,7 +3386,7 @@ RaftConsensus::readSnapshot()
         //    lastSnapshotTerm.
         if (log->getLastLogIndex() < lastSnapshotIndex ||
             (log->getLogStartIndex() <= lastSnapshotIndex &&
-             log->getEntry(lastSnapshotIndex).term() != lastSnapshotTerm)) {
+             log->getTerm(lastSnapshotIndex) != lastSnapshotTerm)) {
             // The NOTICE message can be confusing if the log is empty, so
             // don't print it in that case. We still want to shift the log
             // start index, though.
@@ -2924,12 +3441,22 @@ std::pair<RaftConsensus::ClientResult, uint64_t>
 RaftConsensus::replicateEntry(Log::Entry& entry,
                               std::unique_lock<Mutex>& lockGuard)
 {
-    if (state == State::LEADER) {
-        entry.set_term(currentTerm);
+    // Witnesses only lead until a full server can take over, and they can't
+    // serve clients in the meantime.
+    if (state == State::LEADER && !configuration->localServer->witness) {
+        uint64_t term = currentTerm;
+        entry.set_term(term);
         entry.set_cluster_time(clusterClock.leaderStamp());
-        append({&entry});
+        if (committedEntriesCallbacks.empty()) {
+            // Nothing needs the entry after this, so move it into the log.
+            std::vector<Log::Entry> entries;
+            entries.push_back(std::move(entry));
+            appendMoved(std::move(entries));
+        } else {
+            append({&entry});
+        }
         uint64_t index = log->getLastLogIndex();
-        while (!exiting && currentTerm == entry.term()) {
+        while (!exiting && currentTerm == term) {
             if (commitIndex >= index) {
                 VERBOSE("replicate succeeded");
                 for (auto callback : committedEntriesCallbacks) {
@@ -2953,6 +3480,8 @@ RaftConsensus::requestVote(std::unique_lock<Mutex>& lockGuard, Peer& peer)
     request.set_term(currentTerm);
     request.set_last_log_term(getLastLogTerm());
     request.set_last_log_index(log->getLastLogIndex());
+    if (leadershipTransferTerm == currentTerm)
+        request.set_leadership_transfer(true);
 
     Raft::Protocol::RequestVote::Response response;
     VERBOSE("requestVote start");
@@ -3005,13 +3534,91 @@ RaftConsensus::requestVote(std::unique_lock<Mutex>& lockGuard, Peer& peer)
     }
 }
 
+bool
+RaftConsensus::shouldTransferLeadership(
+        const std::shared_ptr<Peer>& peer) const
+{
+    // A witness leader steps aside for any full server, since it can't serve
+    // clients.
+    return (state == State::LEADER &&
+            configuration->state == Configuration::State::STABLE &&
+            (peer->priority > configuration->localServer->priority ||
+             configuration->localServer->witness) &&
+            !peer->witness &&
+            configuration->hasVote(peer) &&
+            peer->matchIndex == log->getLastLogIndex() &&
+            leadershipTransferBackoffUntil <= Clock::now());
+}
+
+void
+RaftConsensus::timeoutNow(std::unique_lock<Mutex>& lockGuard, Peer& peer)
+{
+    NOTICE("Handing off leadership for term %lu to server %lu, which has "
+           "priority %lu (this server has priority %lu)",
+           currentTerm, peer.serverId, peer.priority,
+           configuration->localServer->priority);
+    // If the hand-off doesn't work out, try again later.
+    leadershipTransferBackoffUntil = Clock::now() + ELECTION_TIMEOUT;
+
+    Raft::Protocol::TimeoutNow::Request request;
+    request.set_server_id(serverId);
+    request.set_term(currentTerm);
+
+    Raft::Protocol::TimeoutNow::Response response;
+    TimePoint start = Clock::now();
+    Peer::CallStatus status = peer.callRPC(
+                Raft::Protocol::OpCode::TIMEOUT_NOW,
+                request, response,
+                lockGuard);
+    switch (status) {
+        case Peer::CallStatus::OK:
+            break;
+        case Peer::CallStatus::FAILED:
+            peer.suppressBulkData = true;
+            peer.backoffUntil = start + RPC_FAILURE_BACKOFF;
+            return;
+        case Peer::CallStatus::INVALID_REQUEST:
+            // Older servers don't support TimeoutNow. They'll just have to
+            // win an election on their own.
+            WARNING("Server %lu doesn't support the TimeoutNow RPC",
+                    peer.serverId);
+            return;
+    }
+
+    if (currentTerm != request.term() || peer.exiting) {
+        // we don't care about result of RPC
+        return;
+    }
+    if (response.term() > currentTerm) {
+        NOTICE("Received TimeoutNow response from server %lu in term %lu "
+               "(this server's term was %lu)",
+                peer.serverId, response.term(), currentTerm);
+        stepDown(response.term());
+    }
+}
+
 void
 RaftConsensus::setElectionTimer()
 {
+    uint64_t timeout = uint64_t(electionTimeout.count());
+    uint64_t delay = 0;
+    uint64_t maxDuration = timeout * 2;
+    // A configuration is sometimes missing for unit tests.
+    if (configuration && configuration->localServer->witness) {
+        // Witnesses should only lead when no full server can, so they wait
+        // out the longest timeout of any full server first.
+        delay = timeout;
+        maxDuration = timeout * 3;
+    } else if (configuration) {
+        uint64_t maxPriority = configuration->maxPriority();
+        uint64_t priority = configuration->localServer->priority;
+        if (priority < maxPriority)
+            delay = timeout / maxPriority * (maxPriority - priority);
+    }
     std::chrono::nanoseconds duration(
         Core::Random::randomRange(
-            uint64_t(std::chrono::nanoseconds(ELECTION_TIMEOUT).count()),
-            uint64_t(std::chrono::nanoseconds(ELECTION_TIMEOUT).count()) * 2));
+            timeout + delay,
+            maxDuration));
     VERBOSE("Will become candidate in %s",
             Core::StringUtil::toString(duration).c_str());
     startElectionAt = Clock::now() + duration;
@@ -3150,8 +3757,10 @@ RaftConsensus::upToDateLeader(std::unique_lock<Mutex>& lockGuard) const
     configuration->forEach(&Server::scheduleHeartbeat);
     stateChanged.notify_all();
     while (true) {
-        if (exiting || state != State::LEADER)
+        if (exiting || state != State::LEADER ||
+            configuration->localServer->witness) {
             return false;
+        }
         if (configuration->quorumMin(&Server::getLastAckEpoch) >= epoch) {
             // So we know we're the current leader, but do we have an
             // up-to-date commitIndex yet? What we'd like to check is whether
@@ -3165,7 +3774,7 @@ RaftConsensus::upToDateLeader(std::unique_lock<Mutex>& lockGuard) const
                 assert(commitIndex > lastSnapshotIndex);
                 assert(commitIndex >= log->getLogStartIndex());
                 assert(commitIndex <= log->getLastLogIndex());
-                commitTerm = log->getEntry(commitIndex).term();
+                commitTerm = log->getTerm(commitIndex);
             }
             if (commitTerm == currentTerm)
                 return true;
@@ -34,7 +34,9 @@
 #include "liblogcabin/Core/ConditionVariable.h"
 #include "liblogcabin/Core/Config.h"
 #include "liblogcabin/Core/Mutex.h"
+#include "liblogcabin/Core/RollingStat.h"
 #include "liblogcabin/Core/Time.h"
+#include "liblogcabin/Core/TokenBucket.h"
 #include "liblogcabin/Event/Loop.h"
 #include "liblogcabin/RPC/ClientRPC.h"
 #include "liblogcabin/Storage/Layout.h"
@@ -197,6 +199,18 @@ class Server {
      */
     std::string addresses;
 
+    /**
+     * The election priority of this server, from the configuration. See
+     * Raft::Protocol::Server::priority.
+     */
+    uint64_t priority;
+
+    /**
+     * True if this server is a witness, from the configuration. See
+     * Raft::Protocol::Server::witness.
+     */
+    bool witness;
+
     /**
      * If true, minStateMachineVersion and maxStateMachineVersion are set
      * (although they may be stale).
@@ -324,6 +338,14 @@ class Peer : public Server {
             google::protobuf::Message& response,
             std::unique_lock<Mutex>& lockGuard);
 
+    /**
+     * Forget that this follower was caught up and begin timing a fresh
+     * catch-up iteration towards the end of the leader's log. Called when the
+     * follower has fallen behind again, such as when it rejects an
+     * AppendEntries request or needs a snapshot.
+     */
+    void restartCatchUp();
+
     /**
      * Launch this Peer's thread, which should run
      * RaftConsensus::peerThreadMain.
@@ -332,6 +354,16 @@ class Peer : public Server {
      *      sure this object doesn't go away.
      */
     void startThread(std::shared_ptr<Peer> self);
+
+    /**
+     * Record the round-trip time of an AppendEntries RPC to this follower
+     * and recalculate #electionTimeout.
+     * \param rtt
+     *      The time from when the request was sent until the response was
+     *      received.
+     */
+    void recordRTT(std::chrono::nanoseconds rtt);
+
     std::ostream& dumpToStream(std::ostream& os) const;
     void updatePeerStats(LibLogCabin::Protocol::ServerStats::Raft::Peer& peerStats,
                          Core::Time::SteadyTimeConverter& time) const;
@@ -442,6 +474,34 @@ class Peer : public Server {
      */
     bool isCaughtUp_;
 
+    /**
+     * Limits the rate at which catch-up data is sent to this follower. See
+     * RaftConsensus::getCatchUpReadyTime().
+     */
+    Core::TokenBucket catchUpBucket;
+
+    /**
+     * Round-trip times of the most recent AppendEntries RPCs to this
+     * follower, in nanoseconds, oldest first. See #recordRTT().
+     */
+    std::deque<uint64_t> recentRTTs;
+
+    /**
+     * Round-trip times of all AppendEntries RPCs to this follower, in
+     * nanoseconds. Used for diagnostics only.
+     */
+    Core::RollingStat rttStat;
+
+    /**
+     * The election timeout to suggest to this follower in AppendEntries
+     * requests, derived from a high percentile of #recentRTTs. This is
+     * RaftConsensus::ELECTION_TIMEOUT unless adaptive election timeouts are
+     * enabled and enough round-trip times have been measured. The leader
+     * also scales its heartbeat period for this follower accordingly (see
+     * RaftConsensus::getHeartbeatPeriod()).
+     */
+    std::chrono::nanoseconds electionTimeout;
+
     /**
      * A snapshot file to be sent to the follower, or NULL.
      * TODO(ongaro): It'd be better to destroy this as soon as this server
@@ -459,6 +519,12 @@ class Peer : public Server {
      * the snapshot.
      */
     uint64_t lastSnapshotIndex;
+    /**
+     * For witnesses, the last snapshot index whose header has been
+     * acknowledged by the follower during this term. See
+     * RaftConsensus::installSnapshotHeader().
+     */
+    uint64_t lastSnapshotHeaderIndex;
 
   private:
 
@@ -493,7 +559,13 @@ class Configuration {
 
   private:
     /**
-     * A list of servers in which a simple majority constitutes a quorum.
+     * A list of servers in which a simple majority constitutes a quorum,
+     * unless #commitQuorumSize is set. In that case, a commit quorum is any
+     * #commitQuorumSize servers, and an election quorum is any set of servers
+     * that intersects every commit quorum. Because #commitQuorumSize is an
+     * absolute count, it's checked against the current number of servers
+     * (see #isValidCommitQuorumSize()) each time, and a simple majority is
+     * used for both whenever it isn't valid.
      */
     struct SimpleConfiguration {
         SimpleConfiguration();
@@ -504,7 +576,13 @@ class Configuration {
         uint64_t min(const GetValue& getValue) const;
         bool quorumAll(const Predicate& predicate) const;
         uint64_t quorumMin(const GetValue& getValue) const;
+        uint64_t commitQuorum() const;
+        uint64_t electionQuorum() const;
         std::vector<ServerRef> servers;
+        /**
+         * See Protocol::Raft::SimpleConfiguration::commit_quorum_size.
+         */
+        uint64_t commitQuorumSize;
     };
 
   public:
@@ -558,6 +636,19 @@ class Configuration {
      */
     bool hasVote(ServerRef server) const;
 
+    /**
+     * Return true if commit quorums of the given size are safe to use in a
+     * list of the given number of servers: the size must be between 1 and
+     * the number of servers, and any two of the election quorums it implies
+     * must intersect, so that no two leaders can be elected in one term.
+     * \param commitQuorumSize
+     *      See Protocol::Raft::SimpleConfiguration::commit_quorum_size.
+     * \param numServers
+     *      The number of servers in the list.
+     */
+    static bool isValidCommitQuorumSize(uint64_t commitQuorumSize,
+                                        uint64_t numServers);
+
     /**
      * Lookup the network addresses for a particular server
      * (comma-delimited).
@@ -566,14 +657,20 @@ class Configuration {
     std::string lookupAddress(uint64_t serverId) const;
 
     /**
-     * Return true if there exists a quorum for which every server satisfies
-     * the predicate, false otherwise.
+     * Return the largest election priority of any server that may be part of
+     * a quorum, or 0 if the configuration is BLANK.
+     */
+    uint64_t maxPriority() const;
+
+    /**
+     * Return true if there exists an election quorum for which every server
+     * satisfies the predicate, false otherwise.
      */
     bool quorumAll(const Predicate& predicate) const;
 
     /**
-     * Return the smallest value of any server in the quorum of servers that
-     * have the largest values.
+     * Return the smallest value of any server in the commit quorum of servers
+     * that have the largest values.
      * \return
      *      Largest value for which every server in a quorum has a value
      *      greater than or equal to this one. 0 if the configuration is BLANK.
@@ -1016,8 +1113,10 @@ class RaftConsensus {
     /**
      * Initialize the log with a configuration consisting of just this server.
      * This should be called just once the very first time the very first
-     * server in your cluster is started.
-     * PANICs if any log entries or snapshots already exist.
+     * server in your cluster is started. The server's election priority is
+     * taken from the 'electionPriority' config option, if it's set.
+     * PANICs if any log entries or snapshots already exist, or if the
+     * 'witness' config option marks this server as a witness.
      */
     void bootstrapConfiguration();
 
@@ -1049,7 +1148,8 @@ class RaftConsensus {
      * machine is that the state machine waits to be caught up to the latest
      * committed entry in the replicated log sometimes, but if that entry
      * was for internal use, it would would otherwise never reach the state
-     * machine.
+     * machine. Witnesses don't apply commands or keep snapshot contents, so
+     * on a witness, every entry and snapshot is returned as SKIP.
      * \throw Core::Util::ThreadInterruptedException
      *      Thread should exit.
      */
@@ -1062,13 +1162,14 @@ class RaftConsensus {
 
     /**
      * Process an AppendEntries RPC from another server. Called by RaftService.
-     * \param[in] request
-     *      The request that was received from the other server.
+     * \param[in,out] request
+     *      The request that was received from the other server. The entries
+     *      that get appended to the log may be moved out of it.
      * \param[out] response
      *      Where the reply should be placed.
      */
     void handleAppendEntries(
-                const Raft::Protocol::AppendEntries::Request& request,
+                Raft::Protocol::AppendEntries::Request& request,
                 Raft::Protocol::AppendEntries::Response& response);
 
     /**
@@ -1093,6 +1194,18 @@ class RaftConsensus {
     void handleRequestVote(const Raft::Protocol::RequestVote::Request& request,
                            Raft::Protocol::RequestVote::Response& response);
 
+    /**
+     * Process a TimeoutNow RPC from the leader. Called by RaftService.
+     * Requests from any server other than the known leader of the current
+     * term are ignored.
+     * \param[in] request
+     *      The request that was received from the leader.
+     * \param[out] response
+     *      Where the reply should be placed.
+     */
+    void handleTimeoutNow(const Raft::Protocol::TimeoutNow::Request& request,
+                          Raft::Protocol::TimeoutNow::Response& response);
+
     /**
      * Submit an operation to the replicated log.
      * \param operation
@@ -1274,6 +1387,12 @@ class RaftConsensus {
      */
     void append(const std::vector<const Storage::Log::Entry*>& entries);
 
+    /**
+     * Like append() above, but moves the entries into the log rather than
+     * copying them.
+     */
+    void appendMoved(std::vector<Storage::Log::Entry>&& entries);
+
     /**
      * Send an AppendEntries RPC to the server (either a heartbeat or containing
      * an entry to replicate).
@@ -1298,24 +1417,96 @@ class RaftConsensus {
      */
     folly::Future<folly::Unit> installSnapshot(std::unique_lock<Mutex>& lockGuard, Peer& peer);
 
+    /**
+     * Send a witness the header of this server's latest snapshot, so that it
+     * can discard the log entries the snapshot covers. Witnesses don't keep
+     * snapshot data, so they get this instead of installSnapshot().
+     * \param lockGuard
+     *      Used to temporarily release the lock while invoking the RPC, so as
+     *      to allow for some concurrency.
+     * \param peer
+     *      State used in communicating with the follower, building the RPC
+     *      request, and processing its result.
+     */
+    void installSnapshotHeader(std::unique_lock<Mutex>& lockGuard,
+                               Peer& peer);
+
+    /**
+     * Helper for #handleInstallSnapshot() on witnesses: write a snapshot
+     * consisting of just the header described by the request, in this
+     * server's own snapshot format, and load it.
+     */
+    void installSnapshotHeader(
+                const Raft::Protocol::InstallSnapshot::Request& request);
+
     /**
      * Transition to being a leader. This is called when a candidate has
      * received votes from a quorum.
      */
     void becomeLeader();
 
+    /**
+     * Bound an adaptive election timeout to the configured range.
+     * \param timeout
+     *      The desired election timeout.
+     * \return
+     *      'timeout' limited to [MIN_ELECTION_TIMEOUT, ELECTION_TIMEOUT].
+     */
+    std::chrono::nanoseconds
+    clampElectionTimeout(std::chrono::nanoseconds timeout) const;
+
+    /**
+     * Charge the catch-up rate limits for data that was just packed into a
+     * request for the given follower. This has no effect if the request
+     * isn't catch-up traffic (see #getCatchUpReadyTime()).
+     * \param peer
+     *      The follower that the request is destined for.
+     * \param bytes
+     *      The number of bytes of log entries or snapshot data in the request.
+     * \param now
+     *      The current time.
+     */
+    void consumeCatchUpBytes(Peer& peer, uint64_t bytes, TimePoint now);
+
     /**
      * Remove the prefix of the log that is redundant with this server's
      * snapshot.
      */
     void discardUnneededEntries();
 
+    /**
+     * Return the earliest time at which the leader may send bulk data to the
+     * given follower, according to the catch-up rate limits.
+     *
+     * Only catch-up traffic is limited: this is data sent to a follower that
+     * isn't caught up (see Peer::isCaughtUp()) and that starts at an entry
+     * that is already committed (including snapshot chunks). Sending such
+     * data can't help advance the commitIndex, so it's safe to delay it in
+     * favor of replicating new entries to the other followers. Heartbeats are
+     * never delayed; they are sent without entries while the follower is
+     * being throttled.
+     * \param peer
+     *      The follower to which bulk data would be sent.
+     * \param now
+     *      The current time.
+     * \return
+     *      'now' if the data may be sent immediately.
+     */
+    TimePoint getCatchUpReadyTime(Peer& peer, TimePoint now);
+
     /**
      * Return the term corresponding to log->getLastLogIndex(). This may come
      * from the log, from the snapshot, or it may be 0.
      */
     uint64_t getLastLogTerm() const;
 
+    /**
+     * Return how often the leader should send heartbeats to the given
+     * follower. This is HEARTBEAT_PERIOD, scaled down in proportion to the
+     * follower's adaptive election timeout (see Peer::electionTimeout).
+     */
+    std::chrono::nanoseconds getHeartbeatPeriod(const Peer& peer) const;
+
     /**
      * Notify the #stateChanged condition variable and cancel all current RPCs.
      * This should be called when stepping down, starting a new election,
@@ -1330,6 +1521,8 @@ class RaftConsensus {
      *      First entry to send to the follower.
      * \param request
      *      AppendEntries request ProtoBuf in which to pack the entries.
+     *      If it was created by a Core::ProtoBuf::Arena, the copies of the
+     *      entries are allocated from the same arena.
      * \return
      *      Number of entries in the request.
      */
@@ -1350,6 +1543,9 @@ class RaftConsensus {
 
     /**
      * Append an entry to the log and wait for it to be committed.
+     * \param entry
+     *      The entry to append. This may be moved into the log, leaving it in
+     *      a valid but unspecified state.
      */
     std::pair<ClientResult, uint64_t>
     replicateEntry(Storage::Log::Entry& entry,
@@ -1368,6 +1564,28 @@ class RaftConsensus {
      */
     void requestVote(std::unique_lock<Mutex>& lockGuard, Peer& peer);
 
+    /**
+     * Return true if this leader should hand off leadership to the given
+     * follower now. This is the case when the follower has a higher election
+     * priority than this server (or this server is a witness), has a vote in
+     * a stable configuration, isn't a witness itself, and has every entry in
+     * this leader's log.
+     */
+    bool shouldTransferLeadership(const std::shared_ptr<Peer>& peer) const;
+
+    /**
+     * Send a TimeoutNow RPC to the server, asking it to start a new election
+     * right away. This is used by leaders to hand off leadership to servers
+     * with higher election priorities.
+     * \param lockGuard
+     *      Used to temporarily release the lock while invoking the RPC, so as
+     *      to allow for some concurrency.
+     * \param peer
+     *      State used in communicating with the follower, building the RPC
+     *      request, and processing its result.
+     */
+    void timeoutNow(std::unique_lock<Mutex>& lockGuard, Peer& peer);
+
     /**
      * Dumps serverId, currentTerm, state, leaderId, and votedFor to the debug
      * log. This is intended to be easy to grep and parse.
@@ -1377,7 +1595,11 @@ class RaftConsensus {
     /**
      * Set the timer to start a new election and notify #stateChanged.
      * The timer is set for ELECTION_TIMEOUT plus some random jitter from
-     * now.
+     * now. Servers with lower election priorities than others in the
+     * configuration draw from the later part of that range, so that
+     * higher-priority servers usually start (and win) elections first.
+     * Witnesses wait longer than any full server, since they only lead when
+     * no full server can.
      */
     void setElectionTimer();
 
@@ -1439,6 +1661,31 @@ class RaftConsensus {
      */
     const std::chrono::nanoseconds HEARTBEAT_PERIOD;
 
+    /**
+     * If true, leaders measure the round-trip times of AppendEntries RPCs to
+     * each follower and suggest to each follower an election timeout of
+     * ELECTION_TIMEOUT_RTT_MULTIPLE times a high percentile of those round
+     * trip times, within [MIN_ELECTION_TIMEOUT, ELECTION_TIMEOUT].
+     * Heartbeats are sent more often accordingly. This allows for fast
+     * failover on fast networks without risking false elections on slow
+     * ones. Followers only use a suggested timeout if they have this enabled
+     * too.
+     * Const except for unit tests.
+     */
+    bool ADAPTIVE_ELECTION_TIMEOUT;
+
+    /**
+     * The lower bound for adaptive election timeouts. ELECTION_TIMEOUT is
+     * the upper bound. See #ADAPTIVE_ELECTION_TIMEOUT.
+     */
+    const std::chrono::nanoseconds MIN_ELECTION_TIMEOUT;
+
+    /**
+     * The ratio of an adaptive election timeout to the round-trip time it
+     * is derived from. See #ADAPTIVE_ELECTION_TIMEOUT.
+     */
+    const uint64_t ELECTION_TIMEOUT_RTT_MULTIPLE;
+
     /**
      * A leader will pack at most this many entries into an AppendEntries
      * request message. This helps bound processing time when entries are very
@@ -1469,6 +1716,26 @@ class RaftConsensus {
      */
     uint64_t SOFT_RPC_SIZE_LIMIT;
 
+    /**
+     * The maximum rate, in bytes per second, at which a leader sends
+     * catch-up data to any one follower (see #getCatchUpReadyTime()).
+     * 0 means unlimited.
+     */
+    const uint64_t CATCH_UP_BYTES_PER_SECOND_PER_PEER;
+
+    /**
+     * The maximum rate, in bytes per second, at which a leader sends
+     * catch-up data to all followers combined (see #getCatchUpReadyTime()).
+     * 0 means unlimited.
+     */
+    const uint64_t CATCH_UP_BYTES_PER_SECOND;
+
+    /**
+     * The number of bytes of catch-up data that a leader may send in a
+     * burst after being idle, both per follower and combined.
+     */
+    const uint64_t CATCH_UP_BURST_BYTES;
+
   public:
     /**
      * This server's unique ID. Not available until init() is called.
@@ -1728,6 +1995,13 @@ class RaftConsensus {
      */
     TimePoint startElectionAt;
 
+    /**
+     * The election timeout used by #setElectionTimer() and for withholding
+     * votes. This is ELECTION_TIMEOUT unless the current leader suggested a
+     * shorter one (see #ADAPTIVE_ELECTION_TIMEOUT).
+     */
+    std::chrono::nanoseconds electionTimeout;
+
     /**
      * The earliest time at which RequestVote messages should be processed.
      * Until this time, they are rejected, as processing them risks
@@ -1741,6 +2015,19 @@ class RaftConsensus {
      */
     TimePoint withholdVotesUntil;
 
+    /**
+     * If this server is a candidate because the leader asked it to take over
+     * (see #handleTimeoutNow()), this is the term of that election; otherwise,
+     * it's 0. Used to set RequestVote's leadership_transfer flag.
+     */
+    uint64_t leadershipTransferTerm;
+
+    /**
+     * Leaders don't hand off leadership again until this time, in case an
+     * earlier hand-off failed. See #timeoutNow().
+     */
+    TimePoint leadershipTransferBackoffUntil;
+
     /**
      * The total number of entries ever truncated from the end of the log.
      * This happens only when a new leader tells this server to remove
@@ -1748,6 +2035,12 @@ class RaftConsensus {
      */
     uint64_t numEntriesTruncated;
 
+    /**
+     * Limits the rate at which catch-up data is sent to all followers
+     * combined. See #getCatchUpReadyTime().
+     */
+    Core::TokenBucket catchUpBucket;
+
     /**
      * The thread that executes leaderDiskThreadMain() to flush log entries to
      * stable storage in the background on leaders.
@@ -47,8 +47,8 @@ struct Invariants::ConsensusSnapshot {
     {
         if (consensus.log->getLastLogIndex() >=
             consensus.log->getLogStartIndex()) {
-            lastLogTerm = consensus.log->getEntry(
-                                    consensus.log->getLastLogIndex()).term();
+            lastLogTerm = consensus.log->getTerm(
+                                    consensus.log->getLastLogIndex());
         }
 
     }
@@ -141,6 +141,26 @@ Invariants::checkBasic()
         }
     }
 
+    // Every commit quorum intersects every election quorum, and any two
+    // election quorums intersect, in both the old and new lists of servers.
+    // A configured commit quorum size is only used if it's valid for the
+    // number of servers.
+    const Configuration& configuration = *consensus.configuration;
+    for (const Configuration::SimpleConfiguration* servers :
+             {&configuration.oldServers, &configuration.newServers}) {
+        if (servers->servers.empty())
+            continue;
+        expect(servers->commitQuorum() + servers->electionQuorum() >
+               servers->servers.size());
+        expect(2 * servers->electionQuorum() > servers->servers.size());
+        if (Configuration::isValidCommitQuorumSize(servers->commitQuorumSize,
+                                                   servers->servers.size())) {
+            expect(servers->commitQuorum() == servers->commitQuorumSize);
+        } else {
+            expect(servers->commitQuorum() == servers->servers.size() / 2 + 1);
+        }
+    }
+
     // Every configuration present in the log should also be present in the
     // configurationDescriptions map.
     for (uint64_t index = consensus.log->getLogStartIndex();
@@ -189,7 +209,7 @@ Invariants::checkBasic()
             consensus.configuration->quorumMin(&Server::getMatchIndex);
         expect(consensus.commitIndex >= majorityEntry ||
                majorityEntry < consensus.log->getLogStartIndex() ||
-               consensus.log->getEntry(majorityEntry).term() !=
+               consensus.log->getTerm(majorityEntry) !=
                     consensus.currentTerm);
     }
 
@@ -208,10 +228,17 @@ Invariants::checkBasic()
     if (consensus.state == RaftConsensus::State::LEADER) {
         expect(consensus.startElectionAt == TimePoint::max());
     } else {
+        // Witnesses wait out an extra timeout (see setElectionTimer()).
+        uint64_t maxTimeouts = 2;
+        if (consensus.configuration &&
+            consensus.configuration->localServer->witness) {
+            maxTimeouts = 3;
+        }
         expect(consensus.startElectionAt > TimePoint::min());
         expect(consensus.startElectionAt <=
-               Clock::now() + consensus.ELECTION_TIMEOUT * 2);
+               Clock::now() + consensus.ELECTION_TIMEOUT * maxTimeouts);
     }
+    expect(consensus.electionTimeout <= consensus.ELECTION_TIMEOUT);
 
     // Log metadata is updated when the term or vote changes.
     expect(consensus.log->metadata.current_term() == consensus.currentTerm);
@@ -20,6 +20,7 @@
 
 #include "liblogcabin/Protocol/Client.pb.h"
 #include "liblogcabin/Protocol/Raft.pb.h"
+#include "liblogcabin/Core/Checksum.h"
 #include "liblogcabin/Core/Config.h"
 #include "liblogcabin/Core/Debug.h"
 #include "liblogcabin/Core/ProtoBuf.h"
@@ -192,6 +193,57 @@ TEST_F(ServerRaftConsensusSimpleConfigurationTest, quorumMin) {
     EXPECT_EQ(1U, cfg.quorumMin(getServerId));
 }
 
+TEST_F(ServerRaftConsensusSimpleConfigurationTest, flexibleQuorums) {
+    cfg.servers.push_back(makeServer(4));
+    cfg.servers.push_back(makeServer(5));
+    EXPECT_EQ(3U, cfg.commitQuorum());
+    EXPECT_EQ(3U, cfg.electionQuorum());
+    cfg.commitQuorumSize = 2;
+    EXPECT_EQ(2U, cfg.commitQuorum());
+    EXPECT_EQ(4U, cfg.electionQuorum());
+    // the two largest IDs are 4 and 5
+    EXPECT_EQ(4U, cfg.quorumMin(getServerId));
+    // only servers 1 and 2 have heart
+    EXPECT_FALSE(cfg.quorumAll(idHeart));
+    cfg.commitQuorumSize = 1;
+    EXPECT_EQ(1U, cfg.commitQuorum());
+    EXPECT_EQ(5U, cfg.electionQuorum());
+    EXPECT_EQ(5U, cfg.quorumMin(getServerId));
+    // election quorums of 2 out of 5 could elect two leaders: use majorities
+    cfg.commitQuorumSize = 4;
+    EXPECT_EQ(3U, cfg.commitQuorum());
+    EXPECT_EQ(3U, cfg.electionQuorum());
+    EXPECT_EQ(3U, cfg.quorumMin(getServerId));
+    EXPECT_FALSE(cfg.quorumAll(idHeart));
+    cfg.commitQuorumSize = 7;
+    EXPECT_EQ(3U, cfg.commitQuorum());
+    EXPECT_EQ(3U, cfg.electionQuorum());
+    // a size chosen for 5 servers is re-checked after membership shrinks
+    cfg.commitQuorumSize = 3;
+    EXPECT_EQ(3U, cfg.commitQuorum());
+    cfg.servers.pop_back();
+    EXPECT_EQ(3U, cfg.commitQuorum());
+    EXPECT_EQ(3U, cfg.electionQuorum());
+    cfg.commitQuorumSize = 2;
+    EXPECT_EQ(2U, cfg.commitQuorum());
+    EXPECT_EQ(3U, cfg.electionQuorum());
+    oneCfg.commitQuorumSize = 2;
+    EXPECT_EQ(1U, oneCfg.commitQuorum());
+    EXPECT_EQ(1U, oneCfg.electionQuorum());
+}
+
+TEST_F(ServerRaftConsensusSimpleConfigurationTest, isValidCommitQuorumSize) {
+    EXPECT_FALSE(Configuration::isValidCommitQuorumSize(0, 5));
+    EXPECT_TRUE(Configuration::isValidCommitQuorumSize(1, 5));
+    EXPECT_TRUE(Configuration::isValidCommitQuorumSize(3, 5));
+    EXPECT_FALSE(Configuration::isValidCommitQuorumSize(4, 5));
+    EXPECT_FALSE(Configuration::isValidCommitQuorumSize(6, 5));
+    EXPECT_TRUE(Configuration::isValidCommitQuorumSize(2, 4));
+    EXPECT_FALSE(Configuration::isValidCommitQuorumSize(3, 4));
+    EXPECT_TRUE(Configuration::isValidCommitQuorumSize(1, 1));
+    EXPECT_FALSE(Configuration::isValidCommitQuorumSize(1, 0));
+}
+
 class ServerRaftConsensusConfigurationTest
             : public ServerRaftConsensusSimpleConfigurationTest {
     ServerRaftConsensusConfigurationTest()
@@ -223,6 +275,24 @@ TEST_F(ServerRaftConsensusConfigurationTest, hasVote) {
     EXPECT_FALSE(cfg.hasVote(s2));
 }
 
+TEST_F(ServerRaftConsensusConfigurationTest, maxPriority) {
+    EXPECT_EQ(0U, cfg.maxPriority());
+    cfg.setConfiguration(1, desc(
+        "prev_configuration {"
+        "    servers { server_id: 1, addresses: '127.0.0.1:5254' }"
+        "    servers { server_id: 2, addresses: '127.0.0.1:5255',"
+        "              priority: 3 }"
+        "}"));
+    EXPECT_EQ(1U, cfg.localServer->priority);
+    EXPECT_EQ(3U, cfg.getServer(2)->priority);
+    EXPECT_EQ(3U, cfg.maxPriority());
+    // staging servers don't count
+    cfg.setStagingServers(sdesc(
+        "servers { server_id: 3, addresses: '127.0.0.1:5256',"
+        "          priority: 7 }"));
+    EXPECT_EQ(3U, cfg.maxPriority());
+}
+
 TEST_F(ServerRaftConsensusConfigurationTest, quorumAll) {
     // TODO(ongaro): low-priority test
 }
@@ -292,6 +362,33 @@ TEST_F(ServerRaftConsensusConfigurationTest, setConfiguration) {
     EXPECT_EQ(1U, cfg.knownServers.size());
 }
 
+TEST_F(ServerRaftConsensusConfigurationTest, commitQuorumSize) {
+    cfg.setConfiguration(1, desc(
+        "prev_configuration {"
+        "    servers { server_id: 1, addresses: '127.0.0.1:5254' }"
+        "    servers { server_id: 2, addresses: '127.0.0.1:5255' }"
+        "    servers { server_id: 3, addresses: '127.0.0.1:5256' }"
+        "    commit_quorum_size: 1"
+        "}"));
+    EXPECT_EQ(1U, cfg.oldServers.commitQuorum());
+    EXPECT_EQ(3U, cfg.oldServers.electionQuorum());
+    EXPECT_EQ(0U, cfg.newServers.commitQuorumSize);
+
+    // a size that's no longer safe for the servers falls back to majorities
+    cfg.setConfiguration(2, desc(
+        "prev_configuration {"
+        "    servers { server_id: 1, addresses: '127.0.0.1:5254' }"
+        "    servers { server_id: 2, addresses: '127.0.0.1:5255' }"
+        "    commit_quorum_size: 2"
+        "}"));
+    EXPECT_EQ(2U, cfg.oldServers.commitQuorumSize);
+    EXPECT_EQ(2U, cfg.oldServers.commitQuorum());
+    EXPECT_EQ(2U, cfg.oldServers.electionQuorum());
+
+    cfg.reset();
+    EXPECT_EQ(0U, cfg.oldServers.commitQuorumSize);
+}
+
 TEST_F(ServerRaftConsensusConfigurationTest, setStagingServers) {
     cfg.setConfiguration(1, desc(
         "prev_configuration {"
@@ -700,6 +797,18 @@ TEST_F(ServerRaftConsensusTest, bootstrapConfiguration)
                  "Refusing to bootstrap configuration");
 }
 
+TEST_F(ServerRaftConsensusTest, bootstrapConfiguration_priority)
+{
+    consensus->config.set<uint64_t>("electionPriority", 4);
+    init();
+    consensus->bootstrapConfiguration();
+    EXPECT_EQ("prev_configuration { "
+              "  servers { server_id: 1 addresses: '127.0.0.1:5254' "
+              "            priority: 4 } "
+              "} ",
+              consensus->log->getEntry(1).configuration());
+}
+
 TEST_F(ServerRaftConsensusTest, getConfiguration_notleader)
 {
     init();
@@ -834,6 +943,29 @@ TEST_F(ServerRaftConsensusTest, getNextEntry_snapshot)
     EXPECT_EQ(20U, e2.clusterTime);
 }
 
+TEST_F(ServerRaftConsensusTest, getNextEntry_witness)
+{
+    init();
+    *entry1.mutable_configuration() = desc(
+        "prev_configuration {"
+        "    servers { server_id: 1, addresses: '127.0.0.1:5254',"
+        "              witness: true }"
+        "    servers { server_id: 2, addresses: '127.0.0.1:5255' }"
+        "}");
+    consensus->append({&entry1});
+    consensus->append({&entry2});
+    consensus->stepDown(5);
+    consensus->commitIndex = 2;
+    EXPECT_TRUE(consensus->configuration->localServer->witness);
+    RaftConsensus::Entry e1 = consensus->getNextEntry(0);
+    EXPECT_EQ(1U, e1.index);
+    EXPECT_EQ(RaftConsensus::Entry::SKIP, e1.type);
+    RaftConsensus::Entry e2 = consensus->getNextEntry(e1.index);
+    EXPECT_EQ(2U, e2.index);
+    EXPECT_EQ(RaftConsensus::Entry::SKIP, e2.type);
+    EXPECT_EQ(0U, e2.command.getLength());
+}
+
 TEST_F(ServerRaftConsensusTest, getSnapshotStats)
 {
     init();
@@ -924,6 +1056,52 @@ TEST_F(ServerRaftConsensusTest, handleAppendEntries_newLeaderAndCommitIndex)
               response);
 }
 
+TEST_F(ServerRaftConsensusTest, constructor_minElectionTimeoutTooLarge)
+{
+    init();
+    config.set("minElectionTimeoutMilliseconds", 5001);
+    EXPECT_DEATH(RaftConsensus bad(config),
+                 "must not exceed electionTimeoutMilliseconds");
+}
+
+TEST_F(ServerRaftConsensusTest, handleAppendEntries_adaptiveElectionTimeout)
+{
+    init();
+    Raft::Protocol::AppendEntries::Request request;
+    Raft::Protocol::AppendEntries::Response response;
+    request.set_server_id(3);
+    request.set_term(10);
+    request.set_prev_log_term(0);
+    request.set_prev_log_index(0);
+    request.set_commit_index(0);
+    request.set_election_timeout_nanos(
+        uint64_t(std::chrono::nanoseconds(milliseconds(1)).count()));
+
+    // ignored unless enabled locally
+    consensus->handleAppendEntries(request, response);
+    EXPECT_EQ(consensus->ELECTION_TIMEOUT, consensus->electionTimeout);
+
+    // clamped to MIN_ELECTION_TIMEOUT
+    consensus->ADAPTIVE_ELECTION_TIMEOUT = true;
+    consensus->handleAppendEntries(request, response);
+    EXPECT_EQ(milliseconds(500), consensus->MIN_ELECTION_TIMEOUT);
+    EXPECT_EQ(consensus->MIN_ELECTION_TIMEOUT, consensus->electionTimeout);
+
+    request.set_election_timeout_nanos(
+        uint64_t(std::chrono::nanoseconds(milliseconds(1000)).count()));
+    consensus->handleAppendEntries(request, response);
+    EXPECT_EQ(milliseconds(1000), consensus->electionTimeout);
+    EXPECT_LE(Clock::now() + milliseconds(1000), consensus->startElectionAt);
+    EXPECT_GE(Clock::now() + milliseconds(2000), consensus->startElectionAt);
+    EXPECT_GE(Clock::now() + milliseconds(1000),
+              consensus->withholdVotesUntil);
+
+    // leader didn't suggest a timeout
+    request.clear_election_timeout_nanos();
+    consensus->handleAppendEntries(request, response);
+    EXPECT_EQ(consensus->ELECTION_TIMEOUT, consensus->electionTimeout);
+}
+
 TEST_F(ServerRaftConsensusTest, handleAppendEntries_rejectGap)
 {
     init();
@@ -1006,6 +1184,7 @@ TEST_F(ServerRaftConsensusTest, handleAppendEntries_append)
     EXPECT_EQ(5U, l2.term());
     EXPECT_EQ(Raft::Protocol::EntryType::DATA, l2.type());
     EXPECT_EQ("hello", l2.data());
+    EXPECT_FALSE(request.entries(1).has_data()); // moved into the log
     EXPECT_EQ(30U, consensus->clusterClock.clusterTimeAtEpoch);
     EXPECT_EQ(Clock::mockValue, consensus->clusterClock.localTimeAtEpoch);
 }
@@ -1261,6 +1440,56 @@ TEST_F(ServerRaftConsensusTest, handleInstallSnapshot)
     // TODO(ongaro): Test that the configuration is update accordingly
 }
 
+TEST_F(ServerRaftConsensusTest, handleInstallSnapshot_witness)
+{
+    init();
+    *entry1.mutable_configuration() = desc(
+        "prev_configuration {"
+        "    servers { server_id: 1, addresses: '127.0.0.1:5254',"
+        "              witness: true }"
+        "    servers { server_id: 2, addresses: '127.0.0.1:5255' }"
+        "}");
+    consensus->stepDown(10);
+    consensus->append({&entry1});
+    consensus->append({&entry2});
+
+    Raft::Protocol::InstallSnapshot::Request request;
+    Raft::Protocol::InstallSnapshot::Response response;
+    request.set_server_id(2);
+    request.set_term(10);
+    request.set_last_snapshot_index(3);
+    request.set_byte_offset(0);
+    request.set_data("");
+    request.set_done(true);
+    request.set_version(2);
+    request.set_last_snapshot_term(10);
+    request.set_last_snapshot_cluster_time(30);
+    request.set_configuration_index(1);
+    *request.mutable_configuration() = entry1.configuration();
+    consensus->handleInstallSnapshot(request, response);
+    EXPECT_EQ("term: 10 ", response);
+    EXPECT_FALSE(bool(consensus->snapshotWriter));
+    EXPECT_EQ(3U, consensus->lastSnapshotIndex);
+    EXPECT_EQ(10U, consensus->lastSnapshotTerm);
+    EXPECT_EQ(30U, consensus->lastSnapshotClusterTime);
+    EXPECT_EQ(4U, consensus->log->getLogStartIndex());
+    EXPECT_EQ(3U, consensus->commitIndex);
+    EXPECT_TRUE(consensus->configuration->localServer->witness);
+
+    // The header was written in this server's own format, so it reads back.
+    consensus->lastSnapshotIndex = 0;
+    consensus->readSnapshot();
+    EXPECT_EQ(3U, consensus->lastSnapshotIndex);
+    EXPECT_EQ(10U, consensus->lastSnapshotTerm);
+
+    // Stale headers are ignored.
+    request.set_last_snapshot_index(2);
+    request.set_last_snapshot_term(9);
+    consensus->handleInstallSnapshot(request, response);
+    EXPECT_EQ(3U, consensus->lastSnapshotIndex);
+    EXPECT_EQ(10U, consensus->lastSnapshotTerm);
+}
+
 TEST_F(ServerRaftConsensusTest, handleInstallSnapshot_byteOffsetHigh)
 {
     init();
@@ -1309,6 +1538,41 @@ TEST_F(ServerRaftConsensusTest, handleInstallSnapshot_byteOffsetHigh)
     EXPECT_EQ(11U, consensus->currentTerm);
 }
 
+TEST_F(ServerRaftConsensusTest, handleInstallSnapshot_badChecksum)
+{
+    init();
+    consensus->stepDown(10);
+    Raft::Protocol::InstallSnapshot::Request request;
+    Raft::Protocol::InstallSnapshot::Response response;
+    request.set_server_id(3);
+    request.set_term(10);
+    request.set_last_snapshot_index(1);
+    request.set_byte_offset(0);
+    request.set_data("hello");
+    request.set_done(false);
+    request.set_version(2);
+
+    // corrupt chunk: expect warning
+    request.set_data_checksum("XXH3-64:0000000000000000");
+    LibLogCabin::Core::Debug::setLogPolicy({
+        {"Server/RaftConsensus.cc", "ERROR"}
+    });
+    consensus->handleInstallSnapshot(request, response);
+    LibLogCabin::Core::Debug::setLogPolicy({
+        {"Server/RaftConsensus.cc", "WARNING"}
+    });
+    EXPECT_EQ("term: 10 "
+              "bytes_stored: 0", response);
+
+    // resent intact
+    char checksum[Core::Checksum::MAX_LENGTH];
+    Core::Checksum::calculate("XXH3-64", "hello", 5, checksum);
+    request.set_data_checksum(checksum);
+    consensus->handleInstallSnapshot(request, response);
+    EXPECT_EQ("term: 10 "
+              "bytes_stored: 5", response);
+}
+
 TEST_F(ServerRaftConsensusTest, handleRequestVote)
 {
     init();
@@ -1382,6 +1646,72 @@ TEST_F(ServerRaftConsensusTest, handleRequestVote_termStale)
     EXPECT_GT(Clock::mockValue, consensus->startElectionAt);
 }
 
+TEST_F(ServerRaftConsensusTest, handleRequestVote_leadershipTransfer)
+{
+    init();
+    Raft::Protocol::RequestVote::Request request;
+    Raft::Protocol::RequestVote::Response response;
+    request.set_server_id(3);
+    request.set_term(12);
+    request.set_last_log_term(1);
+    request.set_last_log_index(1);
+    consensus->stepDown(11);
+    consensus->withholdVotesUntil = Clock::now() + milliseconds(100);
+    consensus->handleRequestVote(request, response);
+    EXPECT_EQ("term: 11 "
+              "granted: false "
+              "log_ok: true",
+              response);
+
+    // the leader asked for this election, so it's not disruptive
+    request.set_leadership_transfer(true);
+    consensus->handleRequestVote(request, response);
+    EXPECT_EQ("term: 12 "
+              "granted: true "
+              "log_ok: true",
+              response);
+    EXPECT_EQ(3U, consensus->votedFor);
+}
+
+TEST_F(ServerRaftConsensusTest, handleTimeoutNow)
+{
+    init();
+    consensus->append({&entry5});
+    consensus->stepDown(5);
+    Raft::Protocol::TimeoutNow::Request request;
+    Raft::Protocol::TimeoutNow::Response response;
+    request.set_server_id(2);
+
+    // stale term: ignored
+    request.set_term(4);
+    consensus->handleTimeoutNow(request, response);
+    EXPECT_EQ("term: 5", response);
+    EXPECT_EQ(State::FOLLOWER, consensus->state);
+    EXPECT_EQ(0U, consensus->leadershipTransferTerm);
+
+    // current term but not from the leader: ignored
+    request.set_term(5);
+    request.set_server_id(3);
+    consensus->leaderId = 2;
+    consensus->handleTimeoutNow(request, response);
+    EXPECT_EQ("term: 5", response);
+    EXPECT_EQ(State::FOLLOWER, consensus->state);
+    EXPECT_EQ(0U, consensus->leadershipTransferTerm);
+
+    // current term from the leader: start an election right away
+    request.set_server_id(2);
+    consensus->handleTimeoutNow(request, response);
+    EXPECT_EQ("term: 6", response);
+    EXPECT_EQ(State::CANDIDATE, consensus->state);
+    EXPECT_EQ(6U, consensus->leadershipTransferTerm);
+
+    // not a follower: ignored
+    request.set_term(6);
+    consensus->handleTimeoutNow(request, response);
+    EXPECT_EQ("term: 6", response);
+    EXPECT_EQ(State::CANDIDATE, consensus->state);
+}
+
 // TODO(ongardie): low-priority test: replicate
 
 TEST_F(ServerRaftConsensusTest, setConfiguration_notLeader)
@@ -1418,6 +1748,33 @@ TEST_F(ServerRaftConsensusTest, setConfiguration_changed)
     EXPECT_TRUE(response.has_configuration_changed());
 }
 
+TEST_F(ServerRaftConsensusTest, setConfiguration_invalidCommitQuorumSize)
+{
+    init();
+    consensus->append({&entry1});
+    consensus->startNewElection();
+    drainDiskQueue(*consensus);
+
+    LibLogCabin::Protocol::Client::SetConfiguration::Request request;
+    LibLogCabin::Protocol::Client::SetConfiguration::Response response;
+    request = Core::ProtoBuf::fromString<
+        LibLogCabin::Protocol::Client::SetConfiguration::Request>(
+        "old_id: 1 "
+        "new_servers { server_id: 1, addresses: '127.0.0.1:5254' } "
+        "new_servers { server_id: 2, addresses: '127.0.0.1:5255' } "
+        "new_servers { server_id: 3, addresses: '127.0.0.1:5256' } "
+        "new_servers { server_id: 4, addresses: '127.0.0.1:5257' } "
+        "commit_quorum_size: 3");
+    EXPECT_EQ(ClientResult::FAIL,
+              consensus->setConfiguration(request, response));
+    EXPECT_EQ("configuration_changed { "
+              "  error: 'Commit quorums of 3 servers are not safe with 4 "
+              "servers: they must be at least 1 and at most 2' "
+              "}",
+              response);
+    EXPECT_EQ(Configuration::State::STABLE, consensus->configuration->state);
+}
+
 void
 setConfigurationHelper(RaftConsensus* consensus)
 {
@@ -1581,6 +1938,45 @@ TEST_F(ServerRaftConsensusTest, setConfiguration_replicateOkNontrivial)
     EXPECT_EQ(4U, consensus->log->getLastLogIndex());
 }
 
+TEST_F(ServerRaftConsensusTest, setConfiguration_priority)
+{
+    init();
+    consensus->append({&entry1});
+    consensus->stepDown(1);
+    consensus->startNewElection();
+    drainDiskQueue(*consensus);
+    consensus->stateChanged.callback =
+        SetConfigurationHelper3(consensus.get());
+    LibLogCabin::Protocol::Client::SetConfiguration::Request request;
+    LibLogCabin::Protocol::Client::SetConfiguration::Response response;
+    request = Core::ProtoBuf::fromString<
+        LibLogCabin::Protocol::Client::SetConfiguration::Request>(
+        "old_id: 1 "
+        "new_servers { server_id: 1, addresses: '127.0.0.1:5254' }"
+        "new_servers { server_id: 2, addresses: '127.0.0.1:5255', "
+        "              priority: 3 }");
+    EXPECT_EQ(ClientResult::SUCCESS,
+              consensus->setConfiguration(request, response));
+    EXPECT_EQ(4U, consensus->log->getLastLogIndex());
+    EXPECT_EQ("prev_configuration {"
+              "  servers { server_id: 1, addresses: '127.0.0.1:5254' }"
+              "  servers { server_id: 2, addresses: '127.0.0.1:5255',"
+              "            priority: 3 }"
+              "}",
+              consensus->log->getEntry(4).configuration());
+    EXPECT_EQ(1U, consensus->configuration->localServer->priority);
+    EXPECT_EQ(3U, consensus->configuration->knownServers.at(2)->priority);
+
+    // this server now waits longer before starting elections
+    consensus->stateChanged.callback = std::function<void()>();
+    consensus->stepDown(consensus->currentTerm + 1);
+    for (uint64_t i = 0; i < 100; ++i) {
+        consensus->setElectionTimer();
+        EXPECT_LE(Clock::now() + consensus->ELECTION_TIMEOUT * 5 / 3,
+                  consensus->startElectionAt);
+    }
+}
+
 TEST_F(ServerRaftConsensusTest, setSupportedStateMachineVersions)
 {
     init();
@@ -2160,6 +2556,28 @@ TEST_F(ServerRaftConsensusTest,
     EXPECT_EQ(3U, consensus->commitIndex);
 }
 
+TEST_F(ServerRaftConsensusTest, advanceCommitIndex_witness)
+{
+    init();
+    *entry1.mutable_configuration() = desc(
+        "prev_configuration {"
+        "    servers { server_id: 1, addresses: '127.0.0.1:5254' }"
+        "    servers { server_id: 2, addresses: '127.0.0.1:5255' }"
+        "    servers { server_id: 3, addresses: '127.0.0.1:5256',"
+        "              witness: true }"
+        "}");
+    consensus->append({&entry1});
+    consensus->stepDown(5);
+    consensus->startNewElection();
+    consensus->becomeLeader();
+    drainDiskQueue(*consensus);
+    // Server 2 is down, but the witness stores the entries.
+    getPeer(3)->matchIndex = 2;
+    consensus->advanceCommitIndex();
+    EXPECT_EQ(State::LEADER, consensus->state);
+    EXPECT_EQ(2U, consensus->commitIndex);
+}
+
 TEST_F(ServerRaftConsensusTest, advanceCommitIndex_commitCfgWithoutSelf)
 {
     // Log:
@@ -2321,6 +2739,43 @@ TEST_F(ServerRaftConsensusPATest, appendEntries_rpcFailed)
     EXPECT_EQ(0U, peer->matchIndex);
 }
 
+class PrefetchRecordingLog : public Storage::MemoryLog {
+  public:
+    PrefetchRecordingLog()
+        : MemoryLog()
+        , prefetches()
+    {
+    }
+    void prefetch(uint64_t startIndex, uint64_t bytes) const {
+        prefetches.emplace_back(startIndex, bytes);
+    }
+    mutable std::vector<std::pair<uint64_t, uint64_t>> prefetches;
+};
+
+TEST_F(ServerRaftConsensusPATest, appendEntries_prefetchesNextBatch)
+{
+    PrefetchRecordingLog* log = new PrefetchRecordingLog();
+    for (uint64_t index = 1; index <= 4; ++index) {
+        Log::Entry entry = consensus->log->getEntry(index);
+        log->append({&entry});
+    }
+    log->metadata = consensus->log->metadata;
+    consensus->log.reset(log);
+
+    consensus->SOFT_RPC_SIZE_LIMIT = 1;
+    request.mutable_entries()->RemoveLast();
+    request.mutable_entries()->RemoveLast();
+    request.mutable_entries()->RemoveLast();
+    request.set_commit_index(1);
+    peer->exiting = true;
+    peerService->reply(Raft::Protocol::OpCode::APPEND_ENTRIES,
+                       request, response);
+    std::unique_lock<Mutex> lockGuard(consensus->mutex);
+    consensus->appendEntries(lockGuard, *peer);
+    EXPECT_EQ((std::vector<std::pair<uint64_t, uint64_t>> {{2, 1}}),
+              log->prefetches);
+}
+
 // Mostly a test for packEntries now that that function has been split out of
 // AppendEntries.
 TEST_F(ServerRaftConsensusPATest, appendEntries_limitSizeAndIgnoreResult)
@@ -2394,6 +2849,132 @@ TEST_F(ServerRaftConsensusPATest, appendEntries_suppressBulkData)
     EXPECT_FALSE(peer->suppressBulkData);
 }
 
+TEST_F(ServerRaftConsensusPATest, appendEntries_catchUpThrottled)
+{
+    consensus->catchUpBucket = Core::TokenBucket(1, 1);
+    consensus->catchUpBucket.consume(1000, Clock::now());
+    request.mutable_entries()->Clear();
+    request.set_commit_index(0);
+    peerService->reply(Raft::Protocol::OpCode::APPEND_ENTRIES,
+                       request, response);
+    std::unique_lock<Mutex> lockGuard(consensus->mutex);
+    consensus->appendEntries(lockGuard, *peer);
+    EXPECT_EQ(0U, peer->matchIndex);
+    EXPECT_EQ(1U, peer->nextIndex);
+}
+
+TEST_F(ServerRaftConsensusPATest, getCatchUpReadyTime)
+{
+    TimePoint now = Clock::now();
+    EXPECT_EQ(now, consensus->getCatchUpReadyTime(*peer, now));
+    consensus->consumeCatchUpBytes(*peer, 1000000, now);
+    EXPECT_EQ(now, consensus->getCatchUpReadyTime(*peer, now));
+
+    peer->catchUpBucket = Core::TokenBucket(1000, 1000);
+    consensus->consumeCatchUpBytes(*peer, 2000, now);
+    EXPECT_LT(now + milliseconds(900),
+              consensus->getCatchUpReadyTime(*peer, now));
+
+    // caught-up followers aren't throttled
+    peer->isCaughtUp_ = true;
+    EXPECT_EQ(now, consensus->getCatchUpReadyTime(*peer, now));
+    peer->isCaughtUp_ = false;
+
+    // nor are followers that need uncommitted entries
+    peer->nextIndex = consensus->commitIndex + 1;
+    EXPECT_EQ(now, consensus->getCatchUpReadyTime(*peer, now));
+}
+
+TEST_F(ServerRaftConsensusPATest, appendEntries_adaptiveElectionTimeout)
+{
+    consensus->ADAPTIVE_ELECTION_TIMEOUT = true;
+    peer->electionTimeout = milliseconds(1000);
+    request.set_election_timeout_nanos(
+        uint64_t(std::chrono::nanoseconds(milliseconds(1000)).count()));
+    peerService->reply(Raft::Protocol::OpCode::APPEND_ENTRIES,
+                       request, response);
+    std::unique_lock<Mutex> lockGuard(consensus->mutex);
+    TimePoint start = Clock::now();
+    consensus->appendEntries(lockGuard, *peer);
+    EXPECT_EQ(4U, peer->matchIndex);
+    EXPECT_EQ(1U, peer->rttStat.getCount());
+    EXPECT_EQ(1U, peer->recentRTTs.size());
+    EXPECT_GE(start + milliseconds(500), peer->nextHeartbeatTime);
+}
+
+TEST_F(ServerRaftConsensusPATest, recordRTT)
+{
+    // not enabled: only stats are kept
+    for (uint64_t i = 0; i < 20; ++i)
+        peer->recordRTT(milliseconds(1));
+    EXPECT_EQ(20U, peer->rttStat.getCount());
+    EXPECT_EQ(consensus->ELECTION_TIMEOUT, peer->electionTimeout);
+    EXPECT_EQ(consensus->HEARTBEAT_PERIOD,
+              consensus->getHeartbeatPeriod(*peer));
+
+    // clamped to MIN_ELECTION_TIMEOUT
+    consensus->ADAPTIVE_ELECTION_TIMEOUT = true;
+    peer->recordRTT(milliseconds(1));
+    EXPECT_EQ(consensus->MIN_ELECTION_TIMEOUT, peer->electionTimeout);
+    EXPECT_EQ(milliseconds(250), consensus->getHeartbeatPeriod(*peer));
+
+    // 10 times the RTT, with one outlier ignored
+    for (uint64_t i = 0; i < 99; ++i)
+        peer->recordRTT(milliseconds(100));
+    peer->recordRTT(milliseconds(10000));
+    EXPECT_EQ(100U, peer->recentRTTs.size());
+    EXPECT_EQ(milliseconds(1000), peer->electionTimeout);
+    EXPECT_EQ(milliseconds(500), consensus->getHeartbeatPeriod(*peer));
+
+    // clamped to ELECTION_TIMEOUT
+    for (uint64_t i = 0; i < 100; ++i)
+        peer->recordRTT(milliseconds(10000));
+    EXPECT_EQ(consensus->ELECTION_TIMEOUT, peer->electionTimeout);
+    EXPECT_EQ(consensus->HEARTBEAT_PERIOD,
+              consensus->getHeartbeatPeriod(*peer));
+}
+
+TEST_F(ServerRaftConsensusPATest, shouldTransferLeadership)
+{
+    peer->matchIndex = 4;
+    consensus->commitIndex = 4;
+    EXPECT_FALSE(consensus->shouldTransferLeadership(peer));
+    peer->priority = 2;
+    EXPECT_TRUE(consensus->shouldTransferLeadership(peer));
+    peer->matchIndex = 3;
+    EXPECT_FALSE(consensus->shouldTransferLeadership(peer));
+    peer->matchIndex = 4;
+    consensus->leadershipTransferBackoffUntil =
+        Clock::now() + milliseconds(1);
+    EXPECT_FALSE(consensus->shouldTransferLeadership(peer));
+}
+
+TEST_F(ServerRaftConsensusPATest, shouldTransferLeadership_witness)
+{
+    peer->matchIndex = 4;
+    consensus->commitIndex = 4;
+    consensus->configuration->localServer->witness = true;
+    EXPECT_TRUE(consensus->shouldTransferLeadership(peer));
+    peer->witness = true;
+    EXPECT_FALSE(consensus->shouldTransferLeadership(peer));
+}
+
+TEST_F(ServerRaftConsensusPATest, timeoutNow)
+{
+    Raft::Protocol::TimeoutNow::Request tnRequest;
+    tnRequest.set_server_id(1);
+    tnRequest.set_term(6);
+    Raft::Protocol::TimeoutNow::Response tnResponse;
+    tnResponse.set_term(7);
+    peerService->reply(Raft::Protocol::OpCode::TIMEOUT_NOW,
+                       tnRequest, tnResponse);
+    std::unique_lock<Mutex> lockGuard(consensus->mutex);
+    consensus->timeoutNow(lockGuard, *peer);
+    EXPECT_LT(Clock::now(), consensus->leadershipTransferBackoffUntil);
+    EXPECT_EQ(State::FOLLOWER, consensus->state);
+    EXPECT_EQ(7U, consensus->currentTerm);
+}
+
 TEST_F(ServerRaftConsensusPATest, appendEntries_termChanged)
 {
     peerService->runArbitraryCode(
@@ -2460,6 +3041,40 @@ TEST_F(ServerRaftConsensusPATest, appendEntries_mismatch)
     EXPECT_EQ(1U, peer->nextIndex);
 }
 
+// A follower that was caught up but then falls behind again has to complete
+// another catch-up iteration before it's considered caught up.
+TEST_F(ServerRaftConsensusPATest, appendEntries_lagsAgain)
+{
+    std::unique_lock<Mutex> lockGuard(consensus->mutex);
+    peer->isCaughtUp_ = true;
+    peer->lastCatchUpIterationMs = 5;
+    peer->thisCatchUpIterationGoalId = 1;
+    peer->nextIndex = 5;
+    request.set_prev_log_index(4);
+    request.set_prev_log_term(6);
+    request.clear_entries();
+    response.set_success(false);
+    peerService->reply(Raft::Protocol::OpCode::APPEND_ENTRIES,
+                       request, response);
+    consensus->appendEntries(lockGuard, *peer);
+    EXPECT_FALSE(peer->isCaughtUp());
+    EXPECT_EQ(~0UL, peer->lastCatchUpIterationMs);
+    EXPECT_EQ(consensus->log->getLastLogIndex(),
+              peer->thisCatchUpIterationGoalId);
+
+    // lagging followers are throttled again
+    peer->nextIndex = 1;
+    peer->catchUpBucket = Core::TokenBucket(1000, 1000);
+    TimePoint now = Clock::now();
+    consensus->consumeCatchUpBytes(*peer, 2000, now);
+    EXPECT_LT(now, consensus->getCatchUpReadyTime(*peer, now));
+
+    // a new term's leadership starts over as well
+    peer->isCaughtUp_ = true;
+    peer->beginLeadership();
+    EXPECT_FALSE(peer->isCaughtUp());
+}
+
 TEST_F(ServerRaftConsensusPATest, appendEntries_serverCapabilities)
 {
     auto& cap = *response.mutable_server_capabilities();
@@ -2524,13 +3139,22 @@ class ServerRaftConsensusPSTest : public ServerRaftConsensusPTest {
         request.set_term(5);
         request.set_last_snapshot_index(2);
         request.set_byte_offset(0);
-        request.set_data("hello, world!");
+        setData("hello, world!");
         request.set_done(true);
         request.set_version(2);
 
         response.set_term(5);
     }
 
+    // Sets the request's data and the checksum the leader sends with it.
+    void setData(const std::string& data) {
+        request.set_data(data);
+        char checksum[Core::Checksum::MAX_LENGTH];
+        Core::Checksum::calculate("XXH3-64", data.data(), data.length(),
+                                  checksum);
+        request.set_data_checksum(checksum);
+    }
+
     std::shared_ptr<Peer> peer;
     Raft::Protocol::InstallSnapshot::Request request;
     Raft::Protocol::InstallSnapshot::Response response;
@@ -2582,12 +3206,12 @@ TEST_F(ServerRaftConsensusPSTest, installSnapshot_ok)
 {
     peer->suppressBulkData = false;
     consensus->SOFT_RPC_SIZE_LIMIT = 7;
-    request.set_data("hello, ");
+    setData("hello, ");
     request.set_done(false);
     peerService->reply(Raft::Protocol::OpCode::INSTALL_SNAPSHOT,
                        request, response);
     request.set_byte_offset(7);
-    request.set_data("world!");
+    setData("world!");
     request.set_done(true);
     peerService->reply(Raft::Protocol::OpCode::INSTALL_SNAPSHOT,
                        request, response);
@@ -2606,15 +3230,49 @@ TEST_F(ServerRaftConsensusPSTest, installSnapshot_ok)
               peer->nextHeartbeatTime);
 }
 
+TEST_F(ServerRaftConsensusPSTest, installSnapshot_witnessLeader)
+{
+    consensus->configuration->localServer->witness = true;
+    std::unique_lock<Mutex> lockGuard(consensus->mutex);
+    consensus->installSnapshot(lockGuard, *peer).wait();
+    EXPECT_LT(Clock::now(), peer->backoffUntil);
+    EXPECT_FALSE(peer->snapshotFile);
+    EXPECT_EQ(0U, peer->matchIndex);
+}
+
+TEST_F(ServerRaftConsensusPSTest, installSnapshotHeader)
+{
+    peer->witness = true;
+    consensus->lastSnapshotTerm = 5;
+    consensus->lastSnapshotClusterTime = 20;
+    request.set_data("");
+    request.clear_data_checksum();
+    request.set_last_snapshot_term(5);
+    request.set_last_snapshot_cluster_time(20);
+    request.set_configuration_index(1);
+    *request.mutable_configuration() = entry1.configuration();
+    peerService->reply(Raft::Protocol::OpCode::INSTALL_SNAPSHOT,
+                       request, response);
+    std::unique_lock<Mutex> lockGuard(consensus->mutex);
+    consensus->installSnapshotHeader(lockGuard, *peer);
+    EXPECT_EQ(2U, peer->matchIndex);
+    EXPECT_EQ(3U, peer->nextIndex);
+    EXPECT_EQ(2U, peer->lastSnapshotHeaderIndex);
+    EXPECT_FALSE(peer->snapshotFile);
+    EXPECT_EQ(consensus->currentEpoch, peer->lastAckEpoch);
+    EXPECT_EQ(Clock::mockValue + consensus->HEARTBEAT_PERIOD,
+              peer->nextHeartbeatTime);
+}
+
 TEST_F(ServerRaftConsensusPSTest, installSnapshot_suppressBulkData)
 {
     peer->suppressBulkData = true;
     consensus->SOFT_RPC_SIZE_LIMIT = 7;
-    request.set_data("");
+    setData("");
     request.set_done(false);
     peerService->reply(Raft::Protocol::OpCode::INSTALL_SNAPSHOT,
                        request, response);
-    request.set_data("hello, ");
+    setData("hello, ");
     peerService->reply(Raft::Protocol::OpCode::INSTALL_SNAPSHOT,
                        request, response);
     std::unique_lock<Mutex> lockGuard(consensus->mutex);
@@ -2628,23 +3286,23 @@ TEST_F(ServerRaftConsensusPSTest, installSnapshot_notAllBytesStored)
 {
     peer->suppressBulkData = false;
     consensus->SOFT_RPC_SIZE_LIMIT = 7;
-    request.set_data("hello, ");
+    setData("hello, ");
     request.set_done(false);
     response.set_bytes_stored(4);
     peerService->reply(Raft::Protocol::OpCode::INSTALL_SNAPSHOT,
                        request, response);
     request.set_byte_offset(4);
-    request.set_data("o, worl");
+    setData("o, worl");
     response.set_bytes_stored(0);
     peerService->reply(Raft::Protocol::OpCode::INSTALL_SNAPSHOT,
                        request, response);
     request.set_byte_offset(0);
-    request.set_data("hello, ");
+    setData("hello, ");
     response.set_bytes_stored(7);
     peerService->reply(Raft::Protocol::OpCode::INSTALL_SNAPSHOT,
                        request, response);
     request.set_byte_offset(7);
-    request.set_data("world!");
+    setData("world!");
     request.set_done(true);
     response.set_bytes_stored(13);
     peerService->reply(Raft::Protocol::OpCode::INSTALL_SNAPSHOT,
@@ -2788,6 +3446,28 @@ TEST_F(ServerRaftConsensusTest, packEntries)
     EXPECT_EQ(1U, consensus->packEntries(3U, request));
 }
 
+TEST_F(ServerRaftConsensusTest, packEntries_arena)
+{
+    init();
+    consensus->stepDown(5);
+    consensus->append({&entry1});
+    for (uint64_t i = 0; i < 256; ++i)
+        consensus->append({&entry2});
+    consensus->SOFT_RPC_SIZE_LIMIT = 1024;
+    Core::ProtoBuf::Arena arena;
+    Raft::Protocol::AppendEntries::Request& request =
+        arena.create<Raft::Protocol::AppendEntries::Request>();
+    uint64_t n = consensus->packEntries(1U, request);
+    EXPECT_LT(1U, n);
+    EXPECT_GT(257U, n);
+    ASSERT_EQ(n, uint64_t(request.entries_size()));
+    EXPECT_EQ(entry1.configuration(), request.entries(0).configuration());
+    EXPECT_EQ("hello", request.entries(int(n) - 1).data());
+#if GOOGLE_PROTOBUF_VERSION >= 3000000
+    EXPECT_EQ(&arena.arena, request.entries(int(n) - 1).GetArena());
+#endif
+}
+
 TEST_F(ServerRaftConsensusTest, readSnapshot)
 {
     init();
@@ -2904,6 +3584,25 @@ TEST_F(ServerRaftConsensusTest, replicateEntry_notLeader)
               consensus->replicateEntry(entry2, lockGuard).first);
 }
 
+TEST_F(ServerRaftConsensusTest, replicateEntry_witness)
+{
+    init();
+    consensus->stepDown(5);
+    *entry1.mutable_configuration() = desc(
+        "prev_configuration {"
+        "    servers { server_id: 1, addresses: '127.0.0.1:5254',"
+        "              witness: true }"
+        "}");
+    consensus->append({&entry1});
+    consensus->startNewElection();
+    drainDiskQueue(*consensus);
+    EXPECT_EQ(State::LEADER, consensus->state);
+    std::unique_lock<Mutex> lockGuard(consensus->mutex);
+    EXPECT_EQ(ClientResult::NOT_LEADER,
+              consensus->replicateEntry(entry2, lockGuard).first);
+    EXPECT_FALSE(consensus->upToDateLeader(lockGuard));
+}
+
 TEST_F(ServerRaftConsensusTest, replicateEntry_okJustUs)
 {
     init();
@@ -3130,6 +3829,46 @@ TEST_F(ServerRaftConsensusTest, setElectionTimer)
     }
 }
 
+TEST_F(ServerRaftConsensusTest, setElectionTimer_priority)
+{
+    init();
+    *entry1.mutable_configuration() = desc(
+        "prev_configuration {"
+        "    servers { server_id: 1, addresses: '127.0.0.1:5254' }"
+        "    servers { server_id: 2, addresses: '127.0.0.1:5255',"
+        "              priority: 3 }"
+        "}");
+    consensus->stepDown(1);
+    consensus->append({&entry1});
+    for (uint64_t i = 0; i < 100; ++i) {
+        consensus->setElectionTimer();
+        EXPECT_LE(Clock::now() + consensus->ELECTION_TIMEOUT * 5 / 3,
+                  consensus->startElectionAt);
+        EXPECT_GE(Clock::now() + consensus->ELECTION_TIMEOUT * 2,
+                  consensus->startElectionAt);
+    }
+}
+
+TEST_F(ServerRaftConsensusTest, setElectionTimer_witness)
+{
+    init();
+    *entry1.mutable_configuration() = desc(
+        "prev_configuration {"
+        "    servers { server_id: 1, addresses: '127.0.0.1:5254',"
+        "              witness: true }"
+        "    servers { server_id: 2, addresses: '127.0.0.1:5255' }"
+        "}");
+    consensus->stepDown(1);
+    consensus->append({&entry1});
+    for (uint64_t i = 0; i < 100; ++i) {
+        consensus->setElectionTimer();
+        EXPECT_LE(Clock::now() + consensus->ELECTION_TIMEOUT * 2,
+                  consensus->startElectionAt);
+        EXPECT_GE(Clock::now() + consensus->ELECTION_TIMEOUT * 3,
+                  consensus->startElectionAt);
+    }
+}
+
 TEST_F(ServerRaftConsensusTest, startNewElection)
 {
     init();
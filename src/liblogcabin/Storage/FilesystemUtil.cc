@@ -299,6 +299,19 @@ tryOpenFile(const File& dir, const std::string& child, int flags)
     return File(fd, dir.path + "/" + child);
 }
 
+void
+prefetch(const File& file, uint64_t offset, uint64_t bytes)
+{
+    int errnum = ::posix_fadvise(file.fd,
+                                 Core::Util::downCast<off_t>(offset),
+                                 Core::Util::downCast<off_t>(bytes),
+                                 POSIX_FADV_WILLNEED);
+    if (errnum != 0) {
+        WARNING("Could not posix_fadvise bytes [%lu, %lu) of %s: %s",
+                offset, offset + bytes, file.path.c_str(), strerror(errnum));
+    }
+}
+
 void
 remove(const std::string& path)
 {
@@ -401,6 +414,14 @@ write(int fildes, const void* data, uint64_t dataLen)
 ssize_t
 write(int fildes,
        std::initializer_list<std::pair<const void*, uint64_t>> data)
+{
+    return write(fildes,
+                 std::vector<std::pair<const void*, uint64_t>>(data));
+}
+
+ssize_t
+write(int fildes,
+      const std::vector<std::pair<const void*, uint64_t>>& data)
 {
     using Core::Util::downCast;
     size_t totalBytes = 0;
@@ -440,12 +461,34 @@ write(int fildes,
     }
 }
 
+ssize_t
+pwrite(int fildes, const void* data, uint64_t dataLen, uint64_t offset)
+{
+    using Core::Util::downCast;
+    const char* next = static_cast<const char*>(data);
+    uint64_t bytesRemaining = dataLen;
+    while (bytesRemaining > 0) {
+        ssize_t written = ::pwrite(fildes, next, bytesRemaining,
+                                   downCast<off_t>(offset));
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        next += written;
+        offset += uint64_t(written);
+        bytesRemaining -= uint64_t(written);
+    }
+    return downCast<ssize_t>(dataLen);
+}
+
 // class FileContents
 
 FileContents::FileContents(const File& origFile)
     : file(dup(origFile))
     , fileLen(getSize(file))
     , map(NULL)
+    , mapped(false)
 {
     // len of 0 for empty files results in invalid argument
     if (fileLen > 0) {
@@ -454,12 +497,23 @@ FileContents::FileContents(const File& origFile)
             PANIC("Could not map %s: %s",
                   file.path.c_str(), strerror(errno));
         }
+        mapped = true;
     }
 }
 
+FileContents::FileContents(const void* data,
+                           uint64_t length,
+                           const std::string& path)
+    : file(-1, path)
+    , fileLen(length)
+    , map(data)
+    , mapped(false)
+{
+}
+
 FileContents::~FileContents()
 {
-    if (map == NULL)
+    if (!mapped)
         return;
     if (munmap(const_cast<void*>(map), fileLen) != 0) {
         WARNING("Failed to munmap file %s: %s",
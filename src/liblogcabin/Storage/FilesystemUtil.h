@@ -201,6 +201,14 @@ File openFile(const File& dir, const std::string& child, int flags);
  */
 File tryOpenFile(const File& dir, const std::string& child, int flags);
 
+/**
+ * Advise the kernel that a range of a file will be read soon, so that it can
+ * start reading it into the page cache. See man 2 posix_fadvise
+ * (POSIX_FADV_WILLNEED). This returns without waiting for the reads. Since
+ * this is only a hint, failures are logged as warnings and otherwise ignored.
+ */
+void prefetch(const File& file, uint64_t offset, uint64_t bytes);
+
 /**
  * Remove the file or directory at path.
  * If path is a directory, its contents will also be removed.
@@ -276,6 +284,39 @@ ssize_t
 write(int fildes,
       std::initializer_list<std::pair<const void*, uint64_t>> data);
 
+/**
+ * A wrapper around write that retries interrupted calls.
+ * \param fildes
+ *      The file handle on which to write data.
+ * \param data
+ *      An I/O vector of data to write (pointer, length pairs). This may have
+ *      up to IOV_MAX elements.
+ * \return
+ *      Either -1 with errno set, or the number of bytes requested to write.
+ *      This wrapper will never return -1 with errno set to EINTR.
+ */
+ssize_t
+write(int fildes,
+      const std::vector<std::pair<const void*, uint64_t>>& data);
+
+/**
+ * A wrapper around pwrite that retries interrupted calls and short writes.
+ * Unlike write(), this does not use or change the file position.
+ * \param fildes
+ *      The file handle on which to write data.
+ * \param data
+ *      A pointer to the data to write.
+ * \param dataLen
+ *      The number of bytes of 'data' to write.
+ * \param offset
+ *      The byte offset in the file at which to write 'data'.
+ * \return
+ *      Either -1 with errno set, or the number of bytes requested to write.
+ *      This wrapper will never return -1 with errno set to EINTR.
+ */
+ssize_t
+pwrite(int fildes, const void* data, uint64_t dataLen, uint64_t offset);
+
 /**
  * Provides random access to a file.
  * This implementation currently works by mmaping the file and working from the
@@ -289,6 +330,18 @@ class FileContents {
      *      An open file descriptor for the file to read.
      */
     explicit FileContents(const File& file);
+    /**
+     * Constructor for contents that are already in memory, such as a file
+     * that was decompressed. Nothing is copied, so 'data' must outlive this
+     * object.
+     * \param data
+     *      The contents.
+     * \param length
+     *      The number of bytes in 'data'.
+     * \param path
+     *      Where the contents came from; used for error messages.
+     */
+    FileContents(const void* data, uint64_t length, const std::string& path);
     /// Destructor.
     ~FileContents();
     /**
@@ -355,8 +408,11 @@ class FileContents {
     File file;
     /// The number of bytes in the file.
     uint64_t fileLen;
-    /// The value returned by mmap(), or NULL for empty files.
+    /// The value returned by mmap(), or NULL for empty files. For contents
+    /// that were already in memory, the start of those instead.
     const void* map;
+    /// True if #map was returned by mmap() and must be unmapped.
+    bool mapped;
     FileContents(const FileContents&) = delete;
     FileContents& operator=(const FileContents&) = delete;
 };
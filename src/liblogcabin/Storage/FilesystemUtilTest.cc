@@ -245,6 +245,22 @@ TEST_F(StorageFilesystemUtilTest, tryOpenFile) {
     EXPECT_EQ(-1, f2.fd);
 }
 
+TEST_F(StorageFilesystemUtilTest, prefetch) {
+    FS::File file(FS::openFile(tmpdir, "a", O_RDWR|O_CREAT));
+    FS::write(file.fd, "hello world", 11);
+    FS::prefetch(file, 0, 11);
+    FS::prefetch(file, 6, 100); // past the end is fine
+    char buf[12] = {0};
+    EXPECT_EQ(11, pread(file.fd, buf, 11, 0));
+    EXPECT_STREQ("hello world", buf);
+
+    // bad fd: expect warning, but it's only a hint
+    Core::Debug::setLogPolicy({
+        {"Storage/FilesystemUtil.cc", "ERROR"}
+    });
+    FS::prefetch(File(), 0, 10);
+}
+
 // This test makes sure we call rewinddir after fdopendir. This is needed at
 // least on eglibc v2.13.
 TEST_F(StorageFilesystemUtilTest, ls_rewindDir) {
@@ -358,6 +374,34 @@ TEST_F(StorageFilesystemUtilTest, writeCommon) {
 
 }
 
+TEST_F(StorageFilesystemUtilTest, writeVector) {
+    int fd = open((tmpdir.path + "/a").c_str(), O_RDWR|O_CREAT, 0644);
+    EXPECT_LE(0, fd);
+    std::vector<std::pair<const void*, uint64_t>> data;
+    EXPECT_EQ(0, FilesystemUtil::write(fd, data));
+    data.push_back({"hello ", 6});
+    data.push_back({"world!", 7});
+    EXPECT_EQ(13, FilesystemUtil::write(fd, data));
+    char buf[13];
+    EXPECT_EQ(13, pread(fd, buf, sizeof(buf), 0));
+    EXPECT_STREQ("hello world!", buf);
+    EXPECT_EQ(0, close(fd));
+}
+
+TEST_F(StorageFilesystemUtilTest, pwrite) {
+    int fd = open((tmpdir.path + "/a").c_str(), O_RDWR|O_CREAT, 0644);
+    EXPECT_LE(0, fd);
+    EXPECT_EQ(6, FilesystemUtil::pwrite(fd, "world!", 6, 6));
+    EXPECT_EQ(6, FilesystemUtil::pwrite(fd, "hello ", 6, 0));
+    EXPECT_EQ(0, lseek(fd, 0, SEEK_CUR));
+    char buf[13] = {};
+    EXPECT_EQ(12, pread(fd, buf, sizeof(buf), 0));
+    EXPECT_STREQ("hello world!", buf);
+    EXPECT_EQ(-1, FilesystemUtil::pwrite(-1, "x", 1, 0));
+    EXPECT_EQ(EBADF, errno);
+    EXPECT_EQ(0, close(fd));
+}
+
 TEST_F(StorageFilesystemUtilTest, writeInterruption) {
     MockWritev::state->allowWrites.push(-EINTR);
     MockWritev::state->allowWrites.push(0);
@@ -391,6 +435,18 @@ TEST_F(StorageFileContentsTest, constructor) {
                  "Bad file descriptor");
 }
 
+TEST_F(StorageFileContentsTest, constructor_memory) {
+    std::string data = "hello world!";
+    FilesystemUtil::FileContents file(data.data(), data.length(), "mem");
+    EXPECT_EQ(12U, file.getFileLength());
+    EXPECT_EQ(data.data(), file.get<char>(0, 12));
+    char buf[6] = {};
+    EXPECT_EQ(5U, file.copyPartial(7, buf, 10));
+    EXPECT_STREQ("orld!", buf);
+    EXPECT_DEATH(file.get(1, 12),
+                 "mem too short");
+}
+
 TEST_F(StorageFileContentsTest, getFileLength) {
     FilesystemUtil::FileContents file(rawFile);
     EXPECT_EQ(13U, file.getFileLength());
@@ -0,0 +1,246 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+#include "liblogcabin/Core/Debug.h"
+#include "liblogcabin/Storage/IoUring.h"
+
+namespace LibLogCabin {
+namespace Storage {
+
+namespace {
+
+/**
+ * The operations that SegmentedLog::Sync submits. If the kernel doesn't
+ * support all of these, the ring isn't used.
+ */
+const uint8_t REQUIRED_OPS[] = {
+    IORING_OP_WRITEV,
+    IORING_OP_FSYNC,
+    IORING_OP_CLOSE,
+    IORING_OP_RENAMEAT,
+    IORING_OP_UNLINKAT,
+};
+
+/**
+ * Return true if the kernel behind 'fd' supports every op in REQUIRED_OPS.
+ */
+bool
+probeOps(int fd)
+{
+    const uint32_t numOps = 256;
+    std::vector<char> buf(sizeof(struct io_uring_probe) +
+                          numOps * sizeof(struct io_uring_probe_op));
+    struct io_uring_probe* probe =
+        reinterpret_cast<struct io_uring_probe*>(buf.data());
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+                probe, numOps) < 0) {
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(REQUIRED_OPS); ++i) {
+        uint8_t op = REQUIRED_OPS[i];
+        if (op > probe->last_op ||
+            !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Return a pointer 'offset' bytes into 'base'.
+ */
+unsigned*
+at(void* base, uint32_t offset)
+{
+    return reinterpret_cast<unsigned*>(static_cast<char*>(base) + offset);
+}
+
+} // anonymous namespace
+
+IoUring::IoUring(uint32_t entries)
+    : mutex()
+    , fd(-1)
+    , available(false)
+    , params()
+    , sqRing(MAP_FAILED)
+    , sqRingBytes(0)
+    , cqRing(MAP_FAILED)
+    , cqRingBytes(0)
+    , sqes(NULL)
+    , sqesBytes(0)
+    , sqHead(NULL)
+    , sqTail(NULL)
+    , sqMask(NULL)
+    , sqArray(NULL)
+    , cqHead(NULL)
+    , cqTail(NULL)
+    , cqMask(NULL)
+    , cqes(NULL)
+    , sqeTail(0)
+{
+    memset(&params, 0, sizeof(params));
+    fd = int(syscall(__NR_io_uring_setup, entries, &params));
+    if (fd < 0) {
+        NOTICE("io_uring is not available: %s", strerror(errno));
+        fd = -1;
+        return;
+    }
+
+    sqRingBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingBytes = (params.cq_off.cqes +
+                   params.cq_entries * sizeof(struct io_uring_cqe));
+    bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP);
+    if (singleMmap) {
+        sqRingBytes = std::max(sqRingBytes, cqRingBytes);
+        cqRingBytes = sqRingBytes;
+    }
+    sqRing = mmap(NULL, sqRingBytes, PROT_READ|PROT_WRITE,
+                  MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) {
+        WARNING("Could not map io_uring submission ring: %s",
+                strerror(errno));
+        cleanup();
+        return;
+    }
+    if (singleMmap) {
+        cqRing = sqRing;
+    } else {
+        cqRing = mmap(NULL, cqRingBytes, PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) {
+            WARNING("Could not map io_uring completion ring: %s",
+                    strerror(errno));
+            cleanup();
+            return;
+        }
+    }
+    sqesBytes = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqesMap = mmap(NULL, sqesBytes, PROT_READ|PROT_WRITE,
+                         MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqesMap == MAP_FAILED) {
+        WARNING("Could not map io_uring submission entries: %s",
+                strerror(errno));
+        cleanup();
+        return;
+    }
+    sqes = static_cast<struct io_uring_sqe*>(sqesMap);
+
+    sqHead = at(sqRing, params.sq_off.head);
+    sqTail = at(sqRing, params.sq_off.tail);
+    sqMask = at(sqRing, params.sq_off.ring_mask);
+    sqArray = at(sqRing, params.sq_off.array);
+    cqHead = at(cqRing, params.cq_off.head);
+    cqTail = at(cqRing, params.cq_off.tail);
+    cqMask = at(cqRing, params.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe*>(
+        static_cast<char*>(cqRing) + params.cq_off.cqes);
+    sqeTail = *sqTail;
+
+    // Log writes rely on the kernel tracking the file position.
+    if (!(params.features & IORING_FEAT_RW_CUR_POS) || !probeOps(fd)) {
+        NOTICE("io_uring is missing operations needed for log writes");
+        cleanup();
+        return;
+    }
+    available = true;
+}
+
+IoUring::~IoUring()
+{
+    cleanup();
+}
+
+bool
+IoUring::isAvailable() const
+{
+    return available;
+}
+
+struct io_uring_sqe*
+IoUring::getSqe()
+{
+    assert(available);
+    unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    if (sqeTail - head >= params.sq_entries)
+        return NULL;
+    struct io_uring_sqe* sqe = &sqes[sqeTail & *sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    ++sqeTail;
+    return sqe;
+}
+
+void
+IoUring::submitAndWait(std::vector<Completion>& completions)
+{
+    assert(available);
+    unsigned tail = *sqTail;
+    unsigned toSubmit = sqeTail - tail;
+    for (; tail != sqeTail; ++tail)
+        sqArray[tail & *sqMask] = tail & *sqMask;
+    __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+
+    uint64_t pending = toSubmit;
+    while (pending > 0) {
+        long r = syscall(__NR_io_uring_enter, fd, toSubmit, 1,
+                         IORING_ENTER_GETEVENTS, NULL, 0);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            PANIC("io_uring_enter failed: %s", strerror(errno));
+        }
+        toSubmit -= unsigned(r);
+
+        unsigned head = *cqHead;
+        unsigned cqTailNow = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != cqTailNow; ++head) {
+            const struct io_uring_cqe& cqe = cqes[head & *cqMask];
+            completions.push_back({cqe.user_data, cqe.res});
+            --pending;
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+}
+
+void
+IoUring::cleanup()
+{
+    available = false;
+    if (sqes != NULL) {
+        munmap(sqes, sqesBytes);
+        sqes = NULL;
+    }
+    if (cqRing != MAP_FAILED && cqRing != sqRing)
+        munmap(cqRing, cqRingBytes);
+    cqRing = MAP_FAILED;
+    if (sqRing != MAP_FAILED) {
+        munmap(sqRing, sqRingBytes);
+        sqRing = MAP_FAILED;
+    }
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+} // namespace LibLogCabin::Storage
+} // namespace LibLogCabin
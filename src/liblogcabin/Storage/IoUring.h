@@ -0,0 +1,166 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <linux/io_uring.h>
+#include <cinttypes>
+#include <vector>
+
+#include "liblogcabin/Core/Mutex.h"
+
+#ifndef LIBLOGCABIN_STORAGE_IOURING_H
+#define LIBLOGCABIN_STORAGE_IOURING_H
+
+namespace LibLogCabin {
+namespace Storage {
+
+/**
+ * A minimal wrapper around a Linux io_uring instance, used by SegmentedLog to
+ * submit a batch of filesystem operations with a single system call. This
+ * talks to the kernel directly rather than depending on liburing.
+ *
+ * If the kernel doesn't support io_uring or any of the operations SegmentedLog
+ * needs (for example, because it's too old or io_uring has been disabled),
+ * #isAvailable() returns false and callers should fall back to issuing
+ * blocking system calls.
+ */
+class IoUring {
+  public:
+    /**
+     * The result of a completed submission queue entry.
+     */
+    struct Completion {
+        /// The user_data field from the submission queue entry.
+        uint64_t userData;
+        /// The operation's return value, or a negated errno value.
+        int32_t result;
+    };
+
+    /**
+     * Constructor.
+     * \param entries
+     *      The number of submission queue entries to request from the kernel.
+     *      The kernel may round this up.
+     */
+    explicit IoUring(uint32_t entries);
+
+    /**
+     * Destructor.
+     */
+    ~IoUring();
+
+    /**
+     * Return true if the ring was set up and the kernel supports every
+     * operation used by SegmentedLog.
+     */
+    bool isAvailable() const;
+
+    /**
+     * Return a zeroed submission queue entry for the caller to fill in, or
+     * NULL if the submission queue is full. The entry is not visible to the
+     * kernel until #submitAndWait() is called.
+     * \pre
+     *      #isAvailable() is true and the caller holds #mutex.
+     */
+    struct io_uring_sqe* getSqe();
+
+    /**
+     * Submit every entry returned by #getSqe() since the last call, then
+     * wait for all of them to complete.
+     * \param[out] completions
+     *      One Completion per entry is appended here, in completion order.
+     * \pre
+     *      #isAvailable() is true and the caller holds #mutex.
+     */
+    void submitAndWait(std::vector<Completion>& completions);
+
+    /**
+     * Protects the rings. Callers must hold this from their first #getSqe()
+     * through their last #submitAndWait() for a batch.
+     */
+    Core::Mutex mutex;
+
+  private:
+    /**
+     * Unmap the rings and close #fd.
+     */
+    void cleanup();
+
+    /**
+     * The io_uring file descriptor, or -1 if setup failed.
+     */
+    int fd;
+
+    /**
+     * See #isAvailable().
+     */
+    bool available;
+
+    /**
+     * Parameters filled in by the kernel during setup.
+     */
+    struct io_uring_params params;
+
+    /**
+     * The mapping containing the submission queue ring.
+     */
+    void* sqRing;
+    /**
+     * The size of #sqRing in bytes.
+     */
+    size_t sqRingBytes;
+    /**
+     * The mapping containing the completion queue ring. This may be the
+     * same as #sqRing.
+     */
+    void* cqRing;
+    /**
+     * The size of #cqRing in bytes.
+     */
+    size_t cqRingBytes;
+    /**
+     * The array of submission queue entries.
+     */
+    struct io_uring_sqe* sqes;
+    /**
+     * The size of #sqes in bytes.
+     */
+    size_t sqesBytes;
+
+    /// Pointers into #sqRing.
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    /// Pointers into #cqRing.
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_cqe* cqes;
+
+    /**
+     * The tail of the submission queue including entries handed out by
+     * #getSqe() but not yet submitted.
+     */
+    unsigned sqeTail;
+
+    // IoUring is non-copyable.
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+};
+
+} // namespace LibLogCabin::Storage
+} // namespace LibLogCabin
+
+#endif /* LIBLOGCABIN_STORAGE_IOURING_H */
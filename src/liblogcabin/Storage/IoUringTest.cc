@@ -0,0 +1,78 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <gtest/gtest.h>
+
+#include "liblogcabin/Storage/FilesystemUtil.h"
+#include "liblogcabin/Storage/IoUring.h"
+#include "liblogcabin/Storage/Layout.h"
+
+namespace LibLogCabin {
+namespace Storage {
+namespace {
+
+namespace FS = FilesystemUtil;
+
+// io_uring may be unavailable (old kernel, seccomp, sysctl); these tests only
+// check the ring when it can be set up.
+
+TEST(StorageIoUringTest, writeAndLink) {
+    IoUring ring(4);
+    if (!ring.isAvailable())
+        return;
+    Layout layout;
+    layout.initTemporary();
+    FS::File file = FS::openFile(layout.logDir, "f", O_CREAT|O_WRONLY);
+    std::lock_guard<Core::Mutex> lockGuard(ring.mutex);
+    const char* data[] = {"hello, ", "world!"};
+    for (uint64_t i = 0; i < 2; ++i) {
+        struct io_uring_sqe* sqe = ring.getSqe();
+        ASSERT_TRUE(sqe != NULL);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = file.fd;
+        sqe->addr = uint64_t(data[i]);
+        sqe->len = uint32_t(strlen(data[i]));
+        sqe->off = ~0UL;
+        sqe->flags = (i == 0 ? IOSQE_IO_LINK : 0);
+        sqe->user_data = i;
+    }
+    std::vector<IoUring::Completion> completions;
+    ring.submitAndWait(completions);
+    ASSERT_EQ(2U, completions.size());
+    for (auto it = completions.begin(); it != completions.end(); ++it)
+        EXPECT_EQ(int32_t(strlen(data[it->userData])), it->result);
+    EXPECT_EQ(13U, FS::getSize(file));
+}
+
+TEST(StorageIoUringTest, getSqe_full) {
+    IoUring ring(2);
+    if (!ring.isAvailable())
+        return;
+    std::lock_guard<Core::Mutex> lockGuard(ring.mutex);
+    uint64_t n = 0;
+    while (ring.getSqe() != NULL)
+        ++n; // zeroed entries are IORING_OP_NOP
+    EXPECT_LE(2U, n);
+    std::vector<IoUring::Completion> completions;
+    ring.submitAndWait(completions);
+    EXPECT_EQ(n, completions.size());
+    EXPECT_TRUE(ring.getSqe() != NULL);
+    ring.submitAndWait(completions);
+}
+
+} // namespace LibLogCabin::Storage::<anonymous>
+} // namespace LibLogCabin::Storage
+} // namespace LibLogCabin
@@ -33,6 +33,7 @@ Layout::Layout()
     , lockFile()
     , logDir()
     , snapshotDir()
+    , archiveDir()
     , removeAllFiles(false)
 {
 }
@@ -43,6 +44,7 @@ Layout::Layout(Layout&& other)
     , lockFile(std::move(other.lockFile))
     , logDir(std::move(other.logDir))
     , snapshotDir(std::move(other.snapshotDir))
+    , archiveDir(std::move(other.archiveDir))
     , removeAllFiles(other.removeAllFiles)
 {
     other.removeAllFiles = false;
@@ -66,6 +68,7 @@ Layout::operator=(Layout&& other)
     lockFile = std::move(other.lockFile);
     logDir = std::move(other.logDir);
     snapshotDir = std::move(other.snapshotDir);
+    archiveDir = std::move(other.archiveDir);
     removeAllFiles = other.removeAllFiles;
     other.removeAllFiles = false;
     return *this;
@@ -76,6 +79,15 @@ Layout::init(const Core::Config& config, uint64_t serverId)
 {
     init(config.read<std::string>("storagePath", "storage"),
          serverId);
+    std::string archivePath =
+        config.read<std::string>("storageArchivePath", "");
+    if (!archivePath.empty()) {
+        FS::File archiveTopDir = FS::openDir(archivePath);
+        FS::File archiveServerDir = FS::openDir(
+            archiveTopDir,
+            Core::StringUtil::format("server%lu", serverId));
+        archiveDir = FS::openDir(archiveServerDir, "log");
+    }
 }
 
 void
@@ -104,6 +116,7 @@ Layout::init(const std::string& storagePath, uint64_t serverId)
     }
     logDir = FS::openDir(serverDir, "log");
     snapshotDir = FS::openDir(serverDir, "snapshot");
+    archiveDir.close();
 }
 
 void
@@ -40,6 +40,13 @@ namespace Storage {
  *             snapshot - latest complete snapshot
  *             "partial.%010lu.%06lu" % (seconds, micro) - in progress
  *         lock - lockFile, ensures only 1 process accesses serverDir a time
+ *
+ * If the config option 'storageArchivePath' is set, the log may also move
+ * files it rarely reads to a secondary (usually slower and cheaper) device:
+ *
+ * / - defined by config option 'storageArchivePath'
+ *     "server%lu" % serverId/
+ *         log/ - archiveDir, Storage::Log implementation-defined
  */
 class Layout {
   public:
@@ -59,7 +66,7 @@ class Layout {
     /**
      * Initialize in the normal way for a LibLogCabin Raft service.
      * \param config
-     *      Server settings: used to extract storage path.
+     *      Server settings: used to extract storage path and archive path.
      * \param serverId
      *      Unique ID for this server.
      */
@@ -108,6 +115,13 @@ class Layout {
      * Sits underneath serverDir in a directory called "snapshot".
      */
     FilesystemUtil::File snapshotDir;
+    /**
+     * Contains log files for this particular server that the log has moved
+     * off of the main storage device, or an empty placeholder if config
+     * option 'storageArchivePath' isn't set. Sits underneath that path in
+     * "server%lu/log" % serverId.
+     */
+    FilesystemUtil::File archiveDir;
 
   private:
     /**
@@ -15,6 +15,8 @@
 
 #include <gtest/gtest.h>
 
+#include "liblogcabin/Core/Config.h"
+#include "liblogcabin/Core/StringUtil.h"
 #include "liblogcabin/Storage/Layout.h"
 
 namespace LibLogCabin {
@@ -32,6 +34,29 @@ TEST(StorageLayoutTest, basics)
         "Could not lock storage directory");
 }
 
+TEST(StorageLayoutTest, init_archivePath)
+{
+    namespace FS = FilesystemUtil;
+    std::string storagePath = FS::mkdtemp();
+    std::string archivePath = FS::mkdtemp();
+    {
+        Core::Config config;
+        config.set("storagePath", storagePath);
+        Layout layout;
+        layout.init(config, 3);
+        EXPECT_EQ(-1, layout.archiveDir.fd);
+        config.set("storageArchivePath", archivePath);
+        layout.init(config, 3);
+        EXPECT_LE(0, layout.archiveDir.fd);
+        EXPECT_TRUE(Core::StringUtil::endsWith(layout.archiveDir.path,
+                                               "/server3/log"));
+        Layout layout2(std::move(layout));
+        EXPECT_LE(0, layout2.archiveDir.fd);
+    }
+    FS::remove(storagePath);
+    FS::remove(archivePath);
+}
+
 } // namespace LibLogCabin::Storage::<anonymous>
 } // namespace LibLogCabin::Storage
 } // namespace LibLogCabin
@@ -51,6 +51,16 @@ Log::~Log()
 {
 }
 
+std::pair<uint64_t, uint64_t>
+Log::appendMoved(std::vector<Entry>&& entries)
+{
+    std::vector<const Entry*> pointers;
+    pointers.reserve(entries.size());
+    for (auto it = entries.begin(); it != entries.end(); ++it)
+        pointers.push_back(&*it);
+    return append(pointers);
+}
+
 std::ostream&
 operator<<(std::ostream& os, const Log& log)
 {
@@ -90,6 +90,19 @@ class Log {
     virtual std::pair<uint64_t, uint64_t> append(
                             const std::vector<const Entry*>& entries) = 0;
 
+    /**
+     * Like append() above, but the log may take the entries over rather than
+     * copying them. Implementations that keep entries in memory should
+     * override this; the default just copies them.
+     * \param entries
+     *      Entries to place at the end of the log. These are left in a valid
+     *      but unspecified state.
+     * \return
+     *      Range of indexes of the new entries in the log, inclusive.
+     */
+    virtual std::pair<uint64_t, uint64_t> appendMoved(
+                            std::vector<Entry>&& entries);
+
     /**
      * Look up an entry by its log index.
      * \param index
@@ -97,10 +110,38 @@ class Log {
      *      Otherwise, this will crash the server.
      * \return
      *      The entry corresponding to that index. This reference is only
-     *      guaranteed to be valid until the next time the log is modified.
+     *      guaranteed to be valid until the next time the log is modified or
+     *      the next call to getEntry(), since some implementations keep only
+     *      a bounded cache of entries in memory.
      */
     virtual const Entry& getEntry(uint64_t index) const = 0;
 
+    /**
+     * Look up the term of an entry by its log index. This is cheaper than
+     * getEntry(index).term(): implementations keep the terms of all their
+     * entries in a compact TermIndex, so this never needs to load or parse
+     * the entry.
+     * \param index
+     *      Must be in the range [getLogStartIndex(), getLastLogIndex()].
+     *      Otherwise, this will crash the server.
+     */
+    virtual uint64_t getTerm(uint64_t index) const = 0;
+
+    /**
+     * Hint that the entries starting at the given index will soon be read
+     * with getEntry(), so that implementations that keep entries on disk can
+     * start reading them into memory in the background. This never blocks on
+     * I/O and has no effect on the contents of the log. The default does
+     * nothing.
+     * \param startIndex
+     *      Index of the first entry that will be read. Indexes outside of
+     *      [getLogStartIndex(), getLastLogIndex()] are ignored.
+     * \param bytes
+     *      Roughly how many bytes of entries will be read, starting with
+     *      startIndex.
+     */
+    virtual void prefetch(uint64_t startIndex, uint64_t bytes) const {}
+
     /**
      * Get the index of the first entry in the log (whether or not this
      * entry exists).
@@ -18,6 +18,7 @@
 #include "liblogcabin/Core/Debug.h"
 #include "liblogcabin/Storage/Layout.h"
 #include "liblogcabin/Storage/LogFactory.h"
+#include "liblogcabin/Storage/MMapLog.h"
 #include "liblogcabin/Storage/MemoryLog.h"
 #include "liblogcabin/Storage/SegmentedLog.h"
 #include "liblogcabin/Storage/SimpleFileLog.h"
@@ -42,11 +43,20 @@ makeLog(const Core::Config& config,
                module == "Segmented-Binary") {
         log.reset(new SegmentedLog(parentDir,
                                    SegmentedLog::Encoding::BINARY,
-                                   config));
+                                   config,
+                                   storageLayout.archiveDir));
     } else if (module == "Segmented-Text") {
         log.reset(new SegmentedLog(parentDir,
                                    SegmentedLog::Encoding::TEXT,
-                                   config));
+                                   config,
+                                   storageLayout.archiveDir));
+    } else if (module == "Segmented-Raw") {
+        log.reset(new SegmentedLog(parentDir,
+                                   SegmentedLog::Encoding::RAW,
+                                   config,
+                                   storageLayout.archiveDir));
+    } else if (module == "MMap") {
+        log.reset(new MMapLog(parentDir, config));
     } else {
         EXIT("Unknown storage module from config file: %s", module.c_str());
     }
@@ -23,6 +23,7 @@
 #include "liblogcabin/Core/StringUtil.h"
 #include "liblogcabin/Storage/Layout.h"
 #include "liblogcabin/Storage/LogFactory.h"
+#include "liblogcabin/Storage/MMapLog.h"
 #include "liblogcabin/Storage/MemoryLog.h"
 #include "liblogcabin/Storage/SegmentedLog.h"
 #include "liblogcabin/Storage/SimpleFileLog.h"
@@ -100,6 +101,30 @@ TEST_F(StorageLogFactoryTest, makeLog_Segmented_Text)
     EXPECT_EQ("Segmented-Text", log->getName());
 }
 
+TEST_F(StorageLogFactoryTest, makeLog_Segmented_Raw)
+{
+    // expect warning
+    Core::Debug::setLogPolicy({
+        {"Storage/SegmentedLog.cc", "ERROR"}
+    });
+
+    config.set("storageModule", "Segmented-Raw");
+    std::unique_ptr<Log> log = LogFactory::makeLog(config, layout);
+    EXPECT_EQ("Segmented-Raw", log->getName());
+}
+
+TEST_F(StorageLogFactoryTest, makeLog_MMap)
+{
+    // expect warning
+    Core::Debug::setLogPolicy({
+        {"Storage/MMapLog.cc", "ERROR"}
+    });
+
+    config.set("storageModule", "MMap");
+    std::unique_ptr<Log> log = LogFactory::makeLog(config, layout);
+    EXPECT_EQ("MMap", log->getName());
+}
+
 TEST_F(StorageLogFactoryTest, makeLog_notfound)
 {
     config.set("storageModule", "punchcard");
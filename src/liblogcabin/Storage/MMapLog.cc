@@ -0,0 +1,673 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _BSD_SOURCE
+#include <endian.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "liblogcabin/Core/CRC32C.h"
+#include "liblogcabin/Core/Config.h"
+#include "liblogcabin/Core/Debug.h"
+#include "liblogcabin/Core/StringUtil.h"
+#include "liblogcabin/Core/Util.h"
+#include "liblogcabin/Protocol/ServerStats.pb.h"
+#include "liblogcabin/Storage/MMapLog.h"
+
+namespace LibLogCabin {
+namespace Storage {
+
+namespace FS = FilesystemUtil;
+using Core::StringUtil::format;
+
+namespace {
+
+/**
+ * Format string for segment filenames.
+ * First param: incrementing counter.
+ */
+#define SEGMENT_FORMAT "segment-%020lu"
+
+/**
+ * Return the start of the page containing the given offset.
+ */
+uint64_t
+pageDown(uint64_t offset)
+{
+    static const uint64_t pageSize = uint64_t(sysconf(_SC_PAGESIZE));
+    return offset - offset % pageSize;
+}
+
+} // anonymous namespace
+
+////////// MMapLog::Mapping //////////
+
+MMapLog::Mapping::Mapping(FS::File file, uint64_t length)
+    : file(std::move(file))
+    , length(length)
+    , base(NULL)
+{
+    void* map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     this->file.fd, 0);
+    if (map == MAP_FAILED) {
+        PANIC("Could not map %s: %s",
+              this->file.path.c_str(), strerror(errno));
+    }
+    base = static_cast<char*>(map);
+}
+
+MMapLog::Mapping::~Mapping()
+{
+    if (munmap(base, length) != 0) {
+        WARNING("Failed to munmap file %s: %s",
+                file.path.c_str(), strerror(errno));
+    }
+}
+
+void
+MMapLog::Mapping::sync(uint64_t offset, uint64_t length) const
+{
+    if (length == 0)
+        return;
+    // msync needs a page-aligned address.
+    uint64_t start = pageDown(offset);
+    if (msync(base + start, offset + length - start, MS_SYNC) != 0) {
+        PANIC("Could not msync bytes [%lu, %lu) of %s: %s",
+              offset, offset + length, file.path.c_str(), strerror(errno));
+    }
+}
+
+void
+MMapLog::Mapping::prefetch(uint64_t offset, uint64_t length) const
+{
+    if (length == 0)
+        return;
+    // madvise needs a page-aligned address.
+    uint64_t start = pageDown(offset);
+    if (madvise(base + start, offset + length - start, MADV_WILLNEED) != 0) {
+        WARNING("Could not madvise bytes [%lu, %lu) of %s: %s",
+                offset, offset + length, file.path.c_str(), strerror(errno));
+    }
+}
+
+////////// MMapLog::Sync //////////
+
+MMapLog::Sync::Range::Range(const std::shared_ptr<Mapping>& mapping,
+                            uint64_t offset,
+                            uint64_t length)
+    : mapping(mapping)
+    , offset(offset)
+    , length(length)
+{
+}
+
+MMapLog::Sync::Sync(uint64_t lastIndex)
+    : Log::Sync(lastIndex)
+    , ranges()
+    , files()
+{
+}
+
+MMapLog::Sync::~Sync()
+{
+}
+
+void
+MMapLog::Sync::addRange(const std::shared_ptr<Mapping>& mapping,
+                        uint64_t offset,
+                        uint64_t length)
+{
+    if (!ranges.empty()) {
+        Range& last = ranges.back();
+        if (last.mapping == mapping &&
+            last.offset + last.length == offset) {
+            last.length += length;
+            return;
+        }
+    }
+    ranges.emplace_back(mapping, offset, length);
+}
+
+void
+MMapLog::Sync::wait()
+{
+    for (auto it = files.begin(); it != files.end(); ++it)
+        FS::fsync(*it);
+    files.clear();
+    for (auto it = ranges.begin(); it != ranges.end(); ++it)
+        it->mapping->sync(it->offset, it->length);
+    ranges.clear();
+}
+
+////////// MMapLog::Segment //////////
+
+MMapLog::Segment::Segment(uint64_t id, std::shared_ptr<Mapping> mapping)
+    : id(id)
+    , filename(format(SEGMENT_FORMAT, id))
+    , mapping(std::move(mapping))
+    , startIndex(0)
+    , bytes(0)
+    , offsets()
+{
+}
+
+uint64_t
+MMapLog::Segment::getNextIndex() const
+{
+    return startIndex + offsets.size();
+}
+
+////////// MMapLog public functions //////////
+
+MMapLog::MMapLog(const FS::File& parentDir,
+                 const Core::Config& config)
+    : MAX_SEGMENT_SIZE(config.read<uint64_t>("storageSegmentBytes",
+                                             8 * 1024 * 1024))
+    , metadata()
+    , dir(FS::openDir(parentDir, "MMap"))
+    , logStartIndex(1)
+    , segments()
+    , nextSegmentId(1)
+    , termIndex()
+    , entryBuffer()
+    , currentSync(new Sync(0))
+{
+    MMapLogMetadata::Metadata metadata1;
+    MMapLogMetadata::Metadata metadata2;
+    bool ok1 = readMetadata("metadata1", metadata1);
+    bool ok2 = readMetadata("metadata2", metadata2);
+    if (ok1 && ok2) {
+        if (metadata1.version() > metadata2.version())
+            metadata = metadata1;
+        else
+            metadata = metadata2;
+    } else if (ok1) {
+        metadata = metadata1;
+    } else if (ok2) {
+        metadata = metadata2;
+    } else {
+        // Brand new servers won't have metadata, and that's ok.
+        metadata.set_version(0);
+        metadata.set_entries_start(logStartIndex);
+    }
+    logStartIndex = metadata.entries_start();
+    Log::metadata = metadata.raft_metadata();
+    // Write both metadata files
+    updateMetadata();
+    updateMetadata();
+    FS::fsync(dir); // in case metadata files didn't exist
+
+    loadSegments();
+}
+
+MMapLog::~MMapLog()
+{
+    // Flush whatever was appended since the last takeSync(), since nothing
+    // else will.
+    currentSync->wait();
+    currentSync->completed = true;
+}
+
+std::pair<uint64_t, uint64_t>
+MMapLog::append(const std::vector<const Entry*>& entries)
+{
+    uint64_t firstIndex = getLastLogIndex() + 1;
+    uint64_t index = firstIndex;
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        const Entry& entry = **it;
+        uint32_t length = Core::Util::downCast<uint32_t>(entry.ByteSize());
+        uint64_t recordBytes = sizeof(RecordHeader) + length;
+        if (segments.empty() ||
+            segments.back().bytes + recordBytes >
+                segments.back().mapping->length) {
+            openNewSegment(recordBytes);
+        }
+        Segment& segment = segments.back();
+        if (segment.offsets.empty())
+            segment.startIndex = index;
+        assert(segment.getNextIndex() == index);
+
+        // Serialize the entry in place, then fill in its header.
+        uint64_t offset = segment.bytes;
+        char* record = segment.mapping->base + offset;
+        char* payload = record + sizeof(RecordHeader);
+        entry.SerializeWithCachedSizesToArray(
+            reinterpret_cast<uint8_t*>(payload));
+        RecordHeader header;
+        header.length = htole32(length);
+        header.index = htole64(index);
+        header.term = htole64(entry.term());
+        header.checksum = htole32(calculateChecksum(header, payload));
+        memcpy(record, &header, sizeof(header));
+
+        segment.offsets.push_back(offset);
+        segment.bytes += recordBytes;
+        termIndex.append(entry.term());
+        currentSync->addRange(segment.mapping, offset, recordBytes);
+        ++index;
+    }
+    currentSync->lastIndex = index - 1;
+    return {firstIndex, index - 1};
+}
+
+const Log::Entry&
+MMapLog::getEntry(uint64_t index) const
+{
+    if (index < getLogStartIndex() ||
+        index > getLastLogIndex()) {
+        PANIC("Attempted to access entry %lu outside of log "
+              "(start index is %lu, last index is %lu)",
+              index, getLogStartIndex(), getLastLogIndex());
+    }
+    // Find the last segment starting at or before index.
+    auto it = std::upper_bound(segments.begin(), segments.end(), index,
+                               [](uint64_t i, const Segment& segment) {
+                                   return i < segment.startIndex;
+                               });
+    --it;
+    const Segment& segment = *it;
+    assert(segment.startIndex <= index);
+    assert(index < segment.getNextIndex());
+    uint64_t offset = segment.offsets.at(index - segment.startIndex);
+    RecordHeader header = readHeader(*segment.mapping, offset);
+    const char* payload = segment.mapping->base + offset + sizeof(header);
+    if (!entryBuffer.ParseFromArray(payload, int(header.length))) {
+        PANIC("Could not parse entry %lu from %s at offset %lu",
+              index, segment.mapping->file.path.c_str(), offset);
+    }
+    return entryBuffer;
+}
+
+uint64_t
+MMapLog::getTerm(uint64_t index) const
+{
+    return termIndex.getTerm(index);
+}
+
+void
+MMapLog::prefetch(uint64_t startIndex, uint64_t bytes) const
+{
+    if (startIndex < getLogStartIndex() ||
+        startIndex > getLastLogIndex()) {
+        return;
+    }
+    auto it = std::upper_bound(segments.begin(), segments.end(), startIndex,
+                               [](uint64_t i, const Segment& segment) {
+                                   return i < segment.startIndex;
+                               });
+    --it;
+    uint64_t offset = it->offsets.at(startIndex - it->startIndex);
+    for (; it != segments.end() && bytes > 0; ++it) {
+        uint64_t length = std::min(bytes, it->bytes - offset);
+        it->mapping->prefetch(offset, length);
+        bytes -= length;
+        offset = 0;
+    }
+}
+
+uint64_t
+MMapLog::getLogStartIndex() const
+{
+    return logStartIndex;
+}
+
+uint64_t
+MMapLog::getLastLogIndex() const
+{
+    return termIndex.getLastLogIndex();
+}
+
+std::string
+MMapLog::getName() const
+{
+    return "MMap";
+}
+
+uint64_t
+MMapLog::getSizeBytes() const
+{
+    uint64_t size = 0;
+    for (auto it = segments.begin(); it != segments.end(); ++it)
+        size += it->bytes;
+    return size;
+}
+
+std::unique_ptr<Log::Sync>
+MMapLog::takeSync()
+{
+    std::unique_ptr<Sync> other(new Sync(getLastLogIndex()));
+    std::swap(other, currentSync);
+    return std::move(other);
+}
+
+void
+MMapLog::truncatePrefix(uint64_t firstIndex)
+{
+    if (firstIndex <= logStartIndex)
+        return;
+    NOTICE("Truncating log to start at index %lu (was %lu)",
+           firstIndex, logStartIndex);
+    logStartIndex = firstIndex;
+    termIndex.truncatePrefix(firstIndex);
+    // The new start index must be durable before any segments go away:
+    // loading ignores segments that end before it.
+    updateMetadata();
+
+    while (!segments.empty() &&
+           (segments.front().offsets.empty() ||
+            segments.front().getNextIndex() <= firstIndex)) {
+        FS::removeFile(dir, segments.front().filename);
+        segments.pop_front();
+    }
+}
+
+void
+MMapLog::truncateSuffix(uint64_t lastIndex)
+{
+    if (lastIndex >= getLastLogIndex())
+        return;
+    lastIndex = std::max(lastIndex, logStartIndex - 1);
+    NOTICE("Truncating log to end at index %lu (was %lu)",
+           lastIndex, getLastLogIndex());
+    termIndex.truncateSuffix(lastIndex);
+
+    // Remove whole segments first, durably. If the server crashes before the
+    // remaining segment is zeroed below, the log is still a prefix of what
+    // it was.
+    bool removed = false;
+    while (!segments.empty() &&
+           (segments.back().offsets.empty() ||
+            segments.back().startIndex > lastIndex)) {
+        FS::removeFile(dir, segments.back().filename);
+        segments.pop_back();
+        removed = true;
+    }
+    if (removed)
+        FS::fsync(dir);
+
+    if (!segments.empty()) {
+        Segment& segment = segments.back();
+        uint64_t numEntries = lastIndex + 1 - segment.startIndex;
+        if (numEntries < segment.offsets.size()) {
+            uint64_t offset = segment.offsets.at(numEntries);
+            memset(segment.mapping->base + offset, 0,
+                   segment.bytes - offset);
+            segment.mapping->sync(offset, segment.bytes - offset);
+            segment.offsets.resize(numEntries);
+            segment.bytes = offset;
+        }
+    }
+}
+
+void
+MMapLog::updateMetadata()
+{
+    if (Log::metadata.ByteSize() == 0)
+        metadata.clear_raft_metadata();
+    else
+        *metadata.mutable_raft_metadata() = Log::metadata;
+    metadata.set_entries_start(logStartIndex);
+    metadata.set_version(metadata.version() + 1);
+
+    std::string payload;
+    if (!metadata.SerializeToString(&payload))
+        PANIC("Could not serialize metadata");
+    uint32_t checksum = htole32(Core::CRC32C::value(payload.data(),
+                                                    payload.length()));
+    std::string filename = (metadata.version() % 2 == 1) ? "metadata1"
+                                                         : "metadata2";
+    NOTICE("Writing new storage metadata (version %lu) to %s",
+           metadata.version(), filename.c_str());
+    FS::File file = FS::openFile(dir, filename,
+                                 O_CREAT|O_WRONLY|O_TRUNC);
+    ssize_t written = FS::write(file.fd, {
+        {&checksum, sizeof(checksum)},
+        {payload.data(), payload.length()},
+    });
+    if (written == -1) {
+        PANIC("Failed to write to %s: %s",
+              file.path.c_str(), strerror(errno));
+    }
+    FS::fsync(file);
+}
+
+void
+MMapLog::updateServerStats(Protocol::ServerStats& serverStats) const
+{
+    Protocol::ServerStats::Storage& stats = *serverStats.mutable_storage();
+    stats.set_num_segments(segments.size());
+    stats.set_metadata_version(metadata.version());
+}
+
+////////// MMapLog private functions //////////
+
+bool
+MMapLog::readMetadata(const std::string& filename,
+                      MMapLogMetadata::Metadata& metadata) const
+{
+    std::string error;
+    FS::File file = FS::tryOpenFile(dir, filename, O_RDONLY);
+    if (file.fd == -1) {
+        error = format("Could not open %s/%s: %s",
+                       dir.path.c_str(), filename.c_str(), strerror(errno));
+    } else {
+        FS::FileContents reader(file);
+        uint32_t checksum = 0;
+        uint64_t length = reader.getFileLength();
+        if (length < sizeof(checksum)) {
+            error = "File too short";
+        } else {
+            reader.copy(0, &checksum, sizeof(checksum));
+            length -= sizeof(checksum);
+            const char* payload = reader.get<char>(sizeof(checksum), length);
+            if (le32toh(checksum) != Core::CRC32C::value(payload, length))
+                error = "Checksum doesn't match";
+            else if (!metadata.ParseFromArray(payload, int(length)))
+                error = "Could not parse ProtoBuf";
+        }
+    }
+    if (error.empty()) {
+        NOTICE("Read metadata version %lu from %s",
+               metadata.version(), filename.c_str());
+        return true;
+    } else {
+        WARNING("Error reading metadata from %s: %s",
+                filename.c_str(), error.c_str());
+        return false;
+    }
+}
+
+void
+MMapLog::loadSegments()
+{
+    std::vector<uint64_t> ids;
+    std::vector<std::string> filenames = FS::ls(dir);
+    for (auto it = filenames.begin(); it != filenames.end(); ++it) {
+        const std::string& filename = *it;
+        if (filename == "metadata1" || filename == "metadata2")
+            continue;
+        uint64_t id;
+        unsigned bytesConsumed;
+        int matched = sscanf(filename.c_str(),
+                             SEGMENT_FORMAT "%n",
+                             &id, &bytesConsumed);
+        if (matched == 1 && bytesConsumed == filename.length()) {
+            ids.push_back(id);
+            nextSegmentId = std::max(nextSegmentId, id + 1);
+            continue;
+        }
+        WARNING("%s doesn't look like a valid segment filename (from %s)",
+                filename.c_str(),
+                (dir.path + "/" + filename).c_str());
+    }
+    std::sort(ids.begin(), ids.end());
+
+    // Segments that end before the log start index are left over from
+    // truncatePrefix() and are removed. After that, each segment must
+    // continue where the previous one left off. The first record that
+    // doesn't ends the log.
+    bool ended = false;
+    bool removed = false;
+    for (auto it = ids.begin(); it != ids.end(); ++it) {
+        uint64_t id = *it;
+        std::string filename = format(SEGMENT_FORMAT, id);
+        if (ended) {
+            NOTICE("Removing segment %s past the end of the log",
+                   filename.c_str());
+            FS::removeFile(dir, filename);
+            removed = true;
+            continue;
+        }
+        FS::File file = FS::openFile(dir, filename, O_RDWR);
+        uint64_t length = FS::getSize(file);
+        if (length < sizeof(RecordHeader)) {
+            WARNING("Removing segment %s, which is too short (%lu bytes)",
+                    filename.c_str(), length);
+            FS::removeFile(dir, filename);
+            removed = true;
+            continue;
+        }
+        Segment segment(id, std::make_shared<Mapping>(std::move(file),
+                                                      length));
+        uint64_t nextIndex = segments.empty()
+                                ? 0
+                                : segments.back().getNextIndex();
+        ended = !scanSegment(segment, nextIndex);
+        if (segment.offsets.empty() ||
+            segment.getNextIndex() <= logStartIndex) {
+            NOTICE("Removing segment %s, which has no entries in the log",
+                   filename.c_str());
+            FS::removeFile(dir, filename);
+            removed = true;
+            continue;
+        }
+        NOTICE("Loaded entries %lu through %lu from %s",
+               segment.startIndex, segment.getNextIndex() - 1,
+               filename.c_str());
+        segments.push_back(std::move(segment));
+    }
+    if (removed)
+        FS::fsync(dir);
+
+    if (!segments.empty() && segments.front().startIndex > logStartIndex) {
+        PANIC("Log starts at index %lu, but the first segment (%s) starts "
+              "at index %lu",
+              logStartIndex,
+              segments.front().filename.c_str(),
+              segments.front().startIndex);
+    }
+
+    // Build the term index. Its start index is adjusted before and after
+    // adding the terms, since the first segment may start earlier.
+    if (!segments.empty())
+        termIndex.truncatePrefix(segments.front().startIndex);
+    for (auto it = segments.begin(); it != segments.end(); ++it) {
+        for (auto it2 = it->offsets.begin(); it2 != it->offsets.end(); ++it2)
+            termIndex.append(readHeader(*it->mapping, *it2).term);
+    }
+    termIndex.truncatePrefix(logStartIndex);
+}
+
+bool
+MMapLog::scanSegment(Segment& segment, uint64_t nextIndex)
+{
+    const Mapping& mapping = *segment.mapping;
+    uint64_t offset = 0;
+    std::string error;
+    while (offset + sizeof(RecordHeader) <= mapping.length) {
+        RecordHeader header = readHeader(mapping, offset);
+        if (header.index == 0 && header.length == 0)
+            return true;
+        const char* payload = mapping.base + offset + sizeof(header);
+        if (header.length >
+            mapping.length - offset - sizeof(header)) {
+            error = format("record length %u runs past the end of the file",
+                           header.length);
+        } else {
+            RecordHeader stored;
+            memcpy(&stored, mapping.base + offset, sizeof(stored));
+            if (header.checksum != calculateChecksum(stored, payload)) {
+                error = "checksum doesn't match";
+            } else if (nextIndex != 0 && header.index != nextIndex) {
+                error = format("expected entry %lu but found entry %lu",
+                               nextIndex, header.index);
+            }
+        }
+        if (!error.empty())
+            break;
+        if (segment.offsets.empty())
+            segment.startIndex = header.index;
+        segment.offsets.push_back(offset);
+        offset += sizeof(header) + header.length;
+        segment.bytes = offset;
+        nextIndex = header.index + 1;
+    }
+    if (error.empty())
+        return true;
+
+    WARNING("Found an invalid record at offset %lu of %s (%s). Assuming "
+            "it was never synced and ending the log there.",
+            offset, mapping.file.path.c_str(), error.c_str());
+    memset(mapping.base + offset, 0, mapping.length - offset);
+    mapping.sync(offset, mapping.length - offset);
+    return false;
+}
+
+void
+MMapLog::openNewSegment(uint64_t minBytes)
+{
+    uint64_t id = nextSegmentId;
+    ++nextSegmentId;
+    std::string filename = format(SEGMENT_FORMAT, id);
+    uint64_t length = std::max(MAX_SEGMENT_SIZE, minBytes);
+    FS::File file = FS::openFile(dir, filename, O_CREAT|O_EXCL|O_RDWR);
+    FS::allocate(file, 0, length);
+    // The next Sync makes the new file and its directory entry durable
+    // along with the first records written into it.
+    currentSync->files.push_back(FS::dup(file));
+    currentSync->files.push_back(FS::dup(dir));
+    segments.emplace_back(id, std::make_shared<Mapping>(std::move(file),
+                                                        length));
+}
+
+MMapLog::RecordHeader
+MMapLog::readHeader(const Mapping& mapping, uint64_t offset)
+{
+    RecordHeader header;
+    memcpy(&header, mapping.base + offset, sizeof(header));
+    header.checksum = le32toh(header.checksum);
+    header.length = le32toh(header.length);
+    header.index = le64toh(header.index);
+    header.term = le64toh(header.term);
+    return header;
+}
+
+uint32_t
+MMapLog::calculateChecksum(const RecordHeader& header, const char* payload)
+{
+    const char* rest = reinterpret_cast<const char*>(&header) +
+                       sizeof(header.checksum);
+    uint32_t crc = Core::CRC32C::value(rest,
+                                       sizeof(header) -
+                                       sizeof(header.checksum));
+    return Core::CRC32C::extend(crc, payload, le32toh(header.length));
+}
+
+} // namespace LibLogCabin::Storage
+} // namespace LibLogCabin
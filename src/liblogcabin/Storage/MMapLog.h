@@ -0,0 +1,356 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "liblogcabin/Storage/FilesystemUtil.h"
+#include "liblogcabin/Storage/Log.h"
+#include "liblogcabin/Storage/MMapLog.pb.h"
+#include "liblogcabin/Storage/TermIndex.h"
+
+#ifndef LIBLOGCABIN_STORAGE_MMAPLOG_H
+#define LIBLOGCABIN_STORAGE_MMAPLOG_H
+
+namespace LibLogCabin {
+
+// forward declaration
+namespace Core {
+class Config;
+}
+
+namespace Storage {
+
+/**
+ * This class persists a log in memory-mapped files.
+ *
+ * The log is stored in a series of segment files, each preallocated to
+ * MAX_SEGMENT_SIZE bytes and mapped shared and writable into memory.
+ * Appending an entry serializes it straight into the mapping, so no write()
+ * system call copies it into the kernel, and Sync::wait() makes it durable
+ * with msync(MS_SYNC) on just the range that was written. getEntry() parses
+ * entries straight out of the mapping as well. This suits fast NVMe devices
+ * and DAX-capable filesystems, where the mapping is the storage itself.
+ *
+ * Segment files are named "segment-" followed by an incrementing, 20-digit
+ * counter. Each holds a sequence of records: a RecordHeader followed by the
+ * entry serialized as a binary ProtoBuf. The rest of the file is zeros, and
+ * a header of all zeros ends the segment. Consecutive entries go into
+ * consecutive records, within a segment and from one segment to the next.
+ *
+ * Two metadata files, metadata1 and metadata2, hold the log start index and
+ * Raft's metadata. They're written alternately so that one of them is intact
+ * if the server crashes while writing the other.
+ *
+ * A record that fails its checksum or doesn't follow the previous entry's
+ * index ends the log when it's loaded. Such a record was never synced, so
+ * the rest of its segment is zeroed and any later segments are removed.
+ */
+class MMapLog : public Log {
+  public:
+
+    /**
+     * A segment file mapped into memory. Segments share these with any Sync
+     * objects that still need to flush part of them, so that removing a
+     * segment doesn't pull the mapping out from under a concurrent
+     * Sync::wait().
+     */
+    struct Mapping {
+        /**
+         * Map the first 'length' bytes of the given file, which must be at
+         * least that long. PANICs on errors.
+         */
+        Mapping(FilesystemUtil::File file, uint64_t length);
+        /**
+         * Unmap the file.
+         */
+        ~Mapping();
+        /**
+         * Flush the given byte range of the mapping to disk with
+         * msync(MS_SYNC). PANICs on errors.
+         */
+        void sync(uint64_t offset, uint64_t length) const;
+        /**
+         * Ask the kernel to start reading the given byte range of the
+         * mapping into memory with madvise(MADV_WILLNEED). Since this is
+         * only a hint, errors are logged as warnings and otherwise ignored.
+         */
+        void prefetch(uint64_t offset, uint64_t length) const;
+        /**
+         * The mapped file.
+         */
+        FilesystemUtil::File file;
+        /**
+         * The number of bytes mapped, which is also the size of the file.
+         */
+        uint64_t length;
+        /**
+         * The start of the mapping.
+         */
+        char* base;
+
+        // Mapping is not copyable.
+        Mapping(const Mapping&) = delete;
+        Mapping& operator=(const Mapping&) = delete;
+    };
+
+    /**
+     * Flushes newly written records out of the mappings.
+     */
+    class Sync : public Log::Sync {
+      public:
+        explicit Sync(uint64_t lastIndex);
+        ~Sync();
+        void wait();
+        /**
+         * Note that the given byte range of a segment's mapping was written.
+         * Ranges that continue the previous one are merged into it.
+         */
+        void addRange(const std::shared_ptr<Mapping>& mapping,
+                      uint64_t offset,
+                      uint64_t length);
+
+        /**
+         * A byte range of a mapping to flush.
+         */
+        struct Range {
+            Range(const std::shared_ptr<Mapping>& mapping,
+                  uint64_t offset,
+                  uint64_t length);
+            std::shared_ptr<Mapping> mapping;
+            uint64_t offset;
+            uint64_t length;
+        };
+
+        /**
+         * Byte ranges of mappings to flush, in the order they were written.
+         */
+        std::vector<Range> ranges;
+
+        /**
+         * Newly created segment files and directories to fsync before
+         * flushing the ranges, so that the files themselves are durable.
+         */
+        std::vector<FilesystemUtil::File> files;
+    };
+
+    /**
+     * Constructor.
+     * \param parentDir
+     *      A filesystem directory in which all the files for this storage
+     *      module are kept (in a subdirectory named "MMap").
+     * \param config
+     *      Settings. Reads storageSegmentBytes.
+     */
+    MMapLog(const FilesystemUtil::File& parentDir,
+            const Core::Config& config);
+    ~MMapLog();
+
+    // Methods implemented from Log interface
+    std::pair<uint64_t, uint64_t>
+    append(const std::vector<const Entry*>& entries);
+    const Entry& getEntry(uint64_t) const;
+    uint64_t getTerm(uint64_t index) const;
+    void prefetch(uint64_t startIndex, uint64_t bytes) const;
+    uint64_t getLogStartIndex() const;
+    uint64_t getLastLogIndex() const;
+    std::string getName() const;
+    uint64_t getSizeBytes() const;
+    std::unique_ptr<Log::Sync> takeSync();
+    void truncatePrefix(uint64_t firstIndex);
+    void truncateSuffix(uint64_t lastIndex);
+    void updateMetadata();
+    void updateServerStats(Protocol::ServerStats& serverStats) const;
+
+  private:
+
+    /**
+     * Precedes each entry's ProtoBuf in a segment. All fields are stored in
+     * little-endian byte order.
+     */
+    struct RecordHeader {
+        /**
+         * CRC-32C of the rest of the header followed by the ProtoBuf.
+         */
+        uint32_t checksum;
+        /**
+         * The number of bytes in the ProtoBuf that follows.
+         */
+        uint32_t length;
+        /**
+         * The entry's index in the log. This is never 0, so a header of all
+         * zeros marks the end of a segment.
+         */
+        uint64_t index;
+        /**
+         * The entry's term, so that loading a segment doesn't need to parse
+         * the ProtoBufs.
+         */
+        uint64_t term;
+    } __attribute__((packed));
+
+    /**
+     * A segment file, which contains a contiguous range of entries.
+     */
+    struct Segment {
+        Segment(uint64_t id, std::shared_ptr<Mapping> mapping);
+        /**
+         * The index of the entry after this segment's last entry.
+         */
+        uint64_t getNextIndex() const;
+        /**
+         * The segment's counter, used in its filename.
+         */
+        uint64_t id;
+        /**
+         * The segment's filename within #dir.
+         */
+        std::string filename;
+        /**
+         * The segment's file, mapped into memory.
+         */
+        std::shared_ptr<Mapping> mapping;
+        /**
+         * The index of the first entry in the segment. This is meaningless
+         * while #offsets is empty, and it's set when the first record is
+         * written.
+         */
+        uint64_t startIndex;
+        /**
+         * The number of bytes of records in the segment. New records are
+         * written at this offset.
+         */
+        uint64_t bytes;
+        /**
+         * The byte offset of each entry's record, starting with the one at
+         * #startIndex.
+         */
+        std::vector<uint64_t> offsets;
+    };
+
+    /**
+     * Read a metadata file from disk. This is only used during
+     * initialization.
+     * \param filename
+     *      Filename within #dir to attempt to open and read.
+     * \param[out] metadata
+     *      Where the contents of the file end up.
+     * \return
+     *      True if the file was read successfully, false otherwise.
+     */
+    bool readMetadata(const std::string& filename,
+                      MMapLogMetadata::Metadata& metadata) const;
+
+    /**
+     * Map the segment files in #dir and fill in #segments and #termIndex.
+     * This is only used during initialization, once #logStartIndex is known.
+     */
+    void loadSegments();
+
+    /**
+     * Fill in the records of a segment that was just mapped during
+     * initialization. Zeros out everything past the last valid record.
+     * \param segment
+     *      The segment to scan, with no records yet.
+     * \param nextIndex
+     *      The index the first record must have, or 0 if it may have any
+     *      index.
+     * \return
+     *      True if every record was valid up to the end of the segment,
+     *      false if a record that was corrupt or out of sequence ended it
+     *      early.
+     */
+    bool scanSegment(Segment& segment, uint64_t nextIndex);
+
+    /**
+     * Create, preallocate, and map a new segment file at the end of
+     * #segments.
+     * \param minBytes
+     *      The number of bytes the segment must be able to hold. The segment
+     *      is MAX_SEGMENT_SIZE bytes or this large, whichever is larger.
+     */
+    void openNewSegment(uint64_t minBytes);
+
+    /**
+     * Read the header of the given record.
+     */
+    static RecordHeader readHeader(const Mapping& mapping, uint64_t offset);
+
+    /**
+     * Return the CRC-32C of a record, which is what its header's checksum
+     * field should be.
+     * \param header
+     *      The record's header, still in little-endian byte order.
+     * \param payload
+     *      The ProtoBuf following the header.
+     */
+    static uint32_t calculateChecksum(const RecordHeader& header,
+                                      const char* payload);
+
+    /**
+     * Segment files are preallocated to this size, unless an entry that
+     * won't fit needs a larger one.
+     */
+    const uint64_t MAX_SEGMENT_SIZE;
+
+    /**
+     * The metadata this class maintains. This should be combined with the
+     * superclass's metadata when being written out to disk.
+     */
+    MMapLogMetadata::Metadata metadata;
+
+    /**
+     * The directory containing every file this log creates.
+     */
+    FilesystemUtil::File dir;
+
+    /**
+     * The index of the first entry in the log, see getLogStartIndex().
+     */
+    uint64_t logStartIndex;
+
+    /**
+     * The segments holding the log's entries, in log order. Only the last
+     * one takes new records.
+     */
+    std::deque<Segment> segments;
+
+    /**
+     * The counter to use for the next segment file that's created.
+     */
+    uint64_t nextSegmentId;
+
+    /**
+     * The term of every entry in the log, for getTerm().
+     */
+    TermIndex termIndex;
+
+    /**
+     * Holds the entry most recently returned by getEntry().
+     */
+    mutable Entry entryBuffer;
+
+    /**
+     * Accumulates the ranges written since the last takeSync().
+     */
+    std::unique_ptr<Sync> currentSync;
+};
+
+} // namespace LibLogCabin::Storage
+} // namespace LibLogCabin
+
+#endif /* LIBLOGCABIN_STORAGE_MMAPLOG_H */
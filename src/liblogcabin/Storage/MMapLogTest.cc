@@ -0,0 +1,388 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <gtest/gtest.h>
+
+#include "liblogcabin/Core/Config.h"
+#include "liblogcabin/Core/Debug.h"
+#include "liblogcabin/Core/STLUtil.h"
+#include "liblogcabin/Protocol/ServerStats.pb.h"
+#include "liblogcabin/Storage/FilesystemUtil.h"
+#include "liblogcabin/Storage/Layout.h"
+#include "liblogcabin/Storage/MMapLog.h"
+
+namespace LibLogCabin {
+namespace Storage {
+namespace {
+
+namespace FS = FilesystemUtil;
+using Core::STLUtil::sorted;
+
+class StorageMMapLogTest : public ::testing::Test {
+    StorageMMapLogTest()
+        : config()
+        , layout()
+        , log()
+        , sampleEntry()
+    {
+        config.set<uint64_t>("storageSegmentBytes", 1024);
+        layout.initTemporary();
+
+        sampleEntry.set_term(40);
+        sampleEntry.set_data("foo");
+        sampleEntry.set_cluster_time(1);
+
+        construct();
+    }
+    ~StorageMMapLogTest()
+    {
+        log.reset();
+    }
+    void construct() {
+        log.reset(); // shut down existing /before/ constructing new
+        log.reset(new MMapLog(layout.logDir, config));
+    }
+    void sync() {
+        std::unique_ptr<Log::Sync> sync = log->takeSync();
+        sync->wait();
+        log->syncComplete(std::move(sync));
+    }
+
+    Core::Config config;
+    Storage::Layout layout;
+    std::unique_ptr<MMapLog> log;
+    Log::Entry sampleEntry;
+};
+
+TEST_F(StorageMMapLogTest, basic_blackbox)
+{
+    std::pair<uint64_t, uint64_t> range = log->append({&sampleEntry});
+    EXPECT_EQ(1U, range.first);
+    EXPECT_EQ(1U, range.second);
+    Log::Entry entry = log->getEntry(1);
+    EXPECT_EQ(40U, entry.term());
+    EXPECT_EQ("foo", entry.data());
+    sync();
+}
+
+TEST_F(StorageMMapLogTest, append_blackbox)
+{
+    std::pair<uint64_t, uint64_t> range = log->append({&sampleEntry});
+    EXPECT_EQ(1U, range.first);
+    EXPECT_EQ(1U, range.second);
+    log->truncatePrefix(10);
+    range = log->append({&sampleEntry, &sampleEntry});
+    EXPECT_EQ(10U, range.first);
+    EXPECT_EQ(11U, range.second);
+    EXPECT_EQ(10U, log->getLogStartIndex());
+    EXPECT_EQ(11U, log->getLastLogIndex());
+    sync();
+}
+
+TEST_F(StorageMMapLogTest, append_rollsOverSegments)
+{
+    sampleEntry.set_data(std::string(400, 'x'));
+    log->append({&sampleEntry, &sampleEntry, &sampleEntry}); // index 1-3
+    EXPECT_EQ(2U, log->segments.size());
+    EXPECT_EQ(1U, log->segments.at(0).startIndex);
+    EXPECT_EQ(3U, log->segments.at(1).startIndex);
+
+    // an entry larger than a segment gets a segment of its own
+    sampleEntry.set_data(std::string(2000, 'y'));
+    log->append({&sampleEntry}); // index 4
+    EXPECT_EQ(3U, log->segments.size());
+    EXPECT_LT(2000U, log->segments.back().mapping->length);
+    sync();
+
+    construct();
+    EXPECT_EQ(4U, log->getLastLogIndex());
+    EXPECT_EQ(std::string(400, 'x'), log->getEntry(3).data());
+    EXPECT_EQ(std::string(2000, 'y'), log->getEntry(4).data());
+}
+
+TEST_F(StorageMMapLogTest, getEntry_blackbox)
+{
+    log->append({&sampleEntry});
+    Log::Entry entry = log->getEntry(1);
+    EXPECT_EQ(40U, entry.term());
+    EXPECT_EQ("foo", entry.data());
+    EXPECT_DEATH(log->getEntry(0), "outside");
+    EXPECT_DEATH(log->getEntry(2), "outside");
+
+    sampleEntry.set_data("bar");
+    log->append({&sampleEntry});
+    log->truncatePrefix(2);
+    EXPECT_DEATH(log->getEntry(1), "outside");
+    log->append({&sampleEntry});
+    Log::Entry entry2 = log->getEntry(2);
+    EXPECT_EQ("bar", entry2.data());
+    sync();
+}
+
+TEST_F(StorageMMapLogTest, getTerm_blackbox)
+{
+    log->append({&sampleEntry, &sampleEntry}); // index 1-2
+    sampleEntry.set_term(41);
+    log->append({&sampleEntry, &sampleEntry}); // index 3-4
+    log->truncatePrefix(2);
+    EXPECT_EQ(40U, log->getTerm(2));
+    EXPECT_EQ(41U, log->getTerm(3));
+    EXPECT_DEATH(log->getTerm(1), "outside");
+    EXPECT_DEATH(log->getTerm(5), "outside");
+    sync();
+    log->truncateSuffix(3);
+    sync();
+    construct();
+    EXPECT_EQ(2U, log->termIndex.getNumRuns());
+    EXPECT_EQ(40U, log->getTerm(2));
+    EXPECT_EQ(41U, log->getTerm(3));
+    EXPECT_DEATH(log->getTerm(4), "outside");
+}
+
+TEST_F(StorageMMapLogTest, prefetch)
+{
+    // out of range: ignored
+    log->prefetch(1, 1024);
+    sampleEntry.set_data(std::string(400, 'x'));
+    log->append({&sampleEntry, &sampleEntry, &sampleEntry}); // index 1-3
+    EXPECT_EQ(2U, log->segments.size());
+    log->prefetch(0, 1024);
+    log->prefetch(4, 1024);
+    // spans both segments
+    log->prefetch(2, 1U << 20);
+    log->prefetch(1, 1);
+    log->prefetch(3, 0);
+    EXPECT_EQ(std::string(400, 'x'), log->getEntry(2).data());
+    sync();
+}
+
+TEST_F(StorageMMapLogTest, getSizeBytes_blackbox)
+{
+    EXPECT_EQ(0U, log->getSizeBytes());
+    sampleEntry.set_data(std::string(300, 'c'));
+    log->append({&sampleEntry});
+    EXPECT_LE(300U, log->getSizeBytes());
+    EXPECT_GT(400U, log->getSizeBytes());
+    log->append({&sampleEntry, &sampleEntry, &sampleEntry});
+    EXPECT_LE(1200U, log->getSizeBytes());
+    EXPECT_GT(1600U, log->getSizeBytes());
+    sync();
+}
+
+TEST_F(StorageMMapLogTest, truncatePrefix_blackbox)
+{
+    EXPECT_EQ(1U, log->getLogStartIndex());
+    log->truncatePrefix(0);
+    EXPECT_EQ(1U, log->getLogStartIndex());
+
+    // entries is empty
+    log->truncatePrefix(500);
+    EXPECT_EQ(500U, log->getLogStartIndex());
+    EXPECT_EQ(499U, log->getLastLogIndex());
+
+    // entries has fewer elements than truncated
+    log->append({&sampleEntry});
+    log->truncatePrefix(502);
+    EXPECT_EQ(502U, log->getLogStartIndex());
+    EXPECT_EQ(501U, log->getLastLogIndex());
+    EXPECT_EQ(0U, log->segments.size());
+
+    // entries has more elements than truncated
+    log->append({&sampleEntry});
+    log->append({&sampleEntry});
+    sampleEntry.set_data("bar");
+    log->append({&sampleEntry});
+    log->truncatePrefix(504);
+    EXPECT_EQ(504U, log->getLogStartIndex());
+    EXPECT_EQ(504U, log->getLastLogIndex());
+    EXPECT_EQ("bar", log->getEntry(504).data());
+
+    // make sure truncating to an earlier id has no effect
+    log->truncatePrefix(400);
+    EXPECT_EQ(504U, log->getLogStartIndex());
+    sync();
+
+    construct();
+    EXPECT_EQ(504U, log->getLogStartIndex());
+    EXPECT_EQ(504U, log->getLastLogIndex());
+    EXPECT_EQ("bar", log->getEntry(504).data());
+}
+
+TEST_F(StorageMMapLogTest, truncatePrefix_removesSegments)
+{
+    sampleEntry.set_data(std::string(400, 'x'));
+    log->append({&sampleEntry, &sampleEntry}); // index 1-2
+    log->append({&sampleEntry, &sampleEntry}); // index 3-4
+    log->append({&sampleEntry}); // index 5
+    sync();
+    EXPECT_EQ(3U, log->segments.size());
+    log->truncatePrefix(4);
+    EXPECT_EQ(2U, log->segments.size());
+    EXPECT_EQ((std::vector<std::string> {
+                   "metadata1",
+                   "metadata2",
+                   "segment-00000000000000000002",
+                   "segment-00000000000000000003",
+               }), sorted(FS::ls(log->dir)));
+    EXPECT_EQ(std::string(400, 'x'), log->getEntry(4).data());
+}
+
+TEST_F(StorageMMapLogTest, truncateSuffix_blackbox)
+{
+    log->truncateSuffix(0);
+    log->truncateSuffix(10);
+    EXPECT_EQ(0U, log->getLastLogIndex());
+    log->append({&sampleEntry});
+    log->append({&sampleEntry});
+    sync();
+    log->truncateSuffix(10);
+    EXPECT_EQ(2U, log->getLastLogIndex());
+    log->truncateSuffix(2);
+    EXPECT_EQ(2U, log->getLastLogIndex());
+    log->truncateSuffix(1);
+    EXPECT_EQ(1U, log->getLastLogIndex());
+    log->truncateSuffix(0);
+    EXPECT_EQ(0U, log->getLastLogIndex());
+
+    log->truncatePrefix(10);
+    log->append({&sampleEntry});
+    EXPECT_EQ(10U, log->getLastLogIndex());
+    sync();
+    log->truncateSuffix(10);
+    EXPECT_EQ(10U, log->getLastLogIndex());
+    log->truncateSuffix(8);
+    EXPECT_EQ(9U, log->getLastLogIndex());
+    log->append({&sampleEntry});
+    EXPECT_EQ(10U, log->getLastLogIndex());
+    sync();
+}
+
+TEST_F(StorageMMapLogTest, truncateSuffix_durable)
+{
+    sampleEntry.set_data(std::string(400, 'x'));
+    log->append({&sampleEntry, &sampleEntry}); // index 1-2
+    log->append({&sampleEntry, &sampleEntry}); // index 3-4
+    sync();
+    log->truncateSuffix(1);
+    EXPECT_EQ(1U, log->segments.size());
+    sampleEntry.set_data("bar");
+    log->append({&sampleEntry}); // index 2
+    sync();
+
+    construct();
+    EXPECT_EQ(2U, log->getLastLogIndex());
+    EXPECT_EQ(std::string(400, 'x'), log->getEntry(1).data());
+    EXPECT_EQ("bar", log->getEntry(2).data());
+}
+
+TEST_F(StorageMMapLogTest, constructor_metadata)
+{
+    log->Log::metadata.set_current_term(5);
+    log->Log::metadata.set_voted_for(2);
+    log->truncatePrefix(3); // v3
+    EXPECT_EQ(3U, log->metadata.version());
+    construct(); // reads v3, writes v4 and v5
+    EXPECT_EQ(5U, log->Log::metadata.current_term());
+    EXPECT_EQ(3U, log->getLogStartIndex());
+    EXPECT_EQ(5U, log->metadata.version());
+
+    // The server crashes while writing v6 to metadata2: fall back to v5.
+    log->truncatePrefix(4);
+    {
+        FS::File file = FS::openFile(log->dir, "metadata2", O_WRONLY);
+        EXPECT_EQ(1, FS::pwrite(file.fd, "x", 1, 4));
+    }
+    construct();
+    EXPECT_EQ(3U, log->getLogStartIndex());
+    EXPECT_EQ(7U, log->metadata.version());
+}
+
+TEST_F(StorageMMapLogTest, constructor_tornRecord)
+{
+    log->append({&sampleEntry, &sampleEntry, &sampleEntry}); // index 1-3
+    sync();
+    const MMapLog::Segment& segment = log->segments.front();
+    // Corrupt entry 2, which should also end the log there.
+    segment.mapping->base[segment.offsets.at(1) + 20] ^= 1;
+    segment.mapping->sync(0, segment.bytes);
+    uint64_t offset = segment.offsets.at(1);
+    construct();
+    EXPECT_EQ(1U, log->getLastLogIndex());
+    EXPECT_EQ(offset, log->segments.front().bytes);
+    // The rest of the segment was zeroed, so new entries can go there.
+    sampleEntry.set_data("bar");
+    log->append({&sampleEntry});
+    sync();
+    construct();
+    EXPECT_EQ(2U, log->getLastLogIndex());
+    EXPECT_EQ("bar", log->getEntry(2).data());
+}
+
+TEST_F(StorageMMapLogTest, constructor_removesSegmentsPastEnd)
+{
+    sampleEntry.set_data(std::string(400, 'x'));
+    log->append({&sampleEntry, &sampleEntry}); // index 1-2
+    log->append({&sampleEntry, &sampleEntry}); // index 3-4
+    sync();
+    EXPECT_EQ(2U, log->segments.size());
+    const MMapLog::Segment& segment = log->segments.front();
+    segment.mapping->base[segment.offsets.at(1) + 20] ^= 1;
+    segment.mapping->sync(0, segment.bytes);
+    construct();
+    EXPECT_EQ(1U, log->getLastLogIndex());
+    EXPECT_EQ((std::vector<std::string> {
+                   "metadata1",
+                   "metadata2",
+                   "segment-00000000000000000001",
+               }), sorted(FS::ls(log->dir)));
+    log->append({&sampleEntry, &sampleEntry}); // index 2-3
+    EXPECT_EQ(2U, log->segments.size());
+    EXPECT_EQ("segment-00000000000000000003",
+              log->segments.back().filename);
+    sync();
+}
+
+TEST_F(StorageMMapLogTest, sync_mergesRanges)
+{
+    log->append({&sampleEntry});
+    log->append({&sampleEntry, &sampleEntry});
+    EXPECT_EQ(1U, log->currentSync->ranges.size());
+    EXPECT_EQ(log->segments.front().bytes,
+              log->currentSync->ranges.front().length);
+    EXPECT_EQ(2U, log->currentSync->files.size());
+    std::unique_ptr<Log::Sync> sync = log->takeSync();
+    EXPECT_EQ(3U, sync->lastIndex);
+    sync->wait();
+    log->syncComplete(std::move(sync));
+    log->append({&sampleEntry});
+    EXPECT_EQ(1U, log->currentSync->ranges.size());
+    EXPECT_EQ(0U, log->currentSync->files.size());
+    this->sync();
+}
+
+TEST_F(StorageMMapLogTest, updateServerStats)
+{
+    log->append({&sampleEntry});
+    Protocol::ServerStats stats;
+    log->updateServerStats(stats);
+    EXPECT_EQ(1U, stats.storage().num_segments());
+    EXPECT_EQ(2U, stats.storage().metadata_version());
+    sync();
+}
+
+} // namespace LibLogCabin::Storage::<anonymous>
+} // namespace LibLogCabin::Storage
+} // namespace LibLogCabin
@@ -33,6 +33,7 @@ namespace Storage {
 MemoryLog::MemoryLog()
     : startIndex(1)
     , entries()
+    , termIndex()
     , currentSync(new Sync(0))
 {
 }
@@ -47,8 +48,23 @@ MemoryLog::append(const std::vector<const Entry*>& newEntries)
 {
     uint64_t firstIndex = startIndex + entries.size();
     uint64_t lastIndex = firstIndex + newEntries.size() - 1;
-    for (auto it = newEntries.begin(); it != newEntries.end(); ++it)
+    for (auto it = newEntries.begin(); it != newEntries.end(); ++it) {
         entries.push_back(**it);
+        termIndex.append((*it)->term());
+    }
+    currentSync->lastIndex = lastIndex;
+    return {firstIndex, lastIndex};
+}
+
+std::pair<uint64_t, uint64_t>
+MemoryLog::appendMoved(std::vector<Entry>&& newEntries)
+{
+    uint64_t firstIndex = startIndex + entries.size();
+    uint64_t lastIndex = firstIndex + newEntries.size() - 1;
+    for (auto it = newEntries.begin(); it != newEntries.end(); ++it) {
+        termIndex.append(it->term());
+        entries.push_back(std::move(*it));
+    }
     currentSync->lastIndex = lastIndex;
     return {firstIndex, lastIndex};
 }
@@ -60,6 +76,12 @@ MemoryLog::getEntry(uint64_t index) const
     return entries.at(offset);
 }
 
+uint64_t
+MemoryLog::getTerm(uint64_t index) const
+{
+    return termIndex.getTerm(index);
+}
+
 uint64_t
 MemoryLog::getLogStartIndex() const
 {
@@ -109,6 +131,7 @@ MemoryLog::truncatePrefix(uint64_t firstIndex)
                       int64_t(std::min(firstIndex - startIndex,
                                        entries.size())));
         startIndex = firstIndex;
+        termIndex.truncatePrefix(firstIndex);
     }
 }
 
@@ -119,6 +142,7 @@ MemoryLog::truncateSuffix(uint64_t lastIndex)
         entries.clear();
     else if (lastIndex < startIndex - 1 + entries.size())
         entries.resize(lastIndex - startIndex + 1);
+    termIndex.truncateSuffix(lastIndex);
 }
 
 void
@@ -19,6 +19,7 @@
 #include <string>
 
 #include "liblogcabin/Storage/Log.h"
+#include "liblogcabin/Storage/TermIndex.h"
 
 #ifndef LIBLOGCABIN_STORAGE_MEMORYLOG_H
 #define LIBLOGCABIN_STORAGE_MEMORYLOG_H
@@ -36,7 +37,10 @@ class MemoryLog : public Log {
 
     std::pair<uint64_t, uint64_t>
     append(const std::vector<const Entry*>& entries);
+    std::pair<uint64_t, uint64_t>
+    appendMoved(std::vector<Entry>&& entries);
     const Entry& getEntry(uint64_t logIndex) const;
+    uint64_t getTerm(uint64_t logIndex) const;
     uint64_t getLogStartIndex() const;
     uint64_t getLastLogIndex() const;
     std::string getName() const;
@@ -62,6 +66,11 @@ class MemoryLog : public Log {
      */
     std::deque<Entry> entries;
 
+    /**
+     * The terms of 'entries', for getTerm().
+     */
+    TermIndex termIndex;
+
     /**
      * This is returned by the next call to getSync.
      * It's totally unnecessary to have this member for MemoryLog, as its syncs
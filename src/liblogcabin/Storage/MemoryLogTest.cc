@@ -60,6 +60,17 @@ TEST_F(StorageMemoryLogTest, append)
     EXPECT_EQ(11U, log.getLastLogIndex());
 }
 
+TEST_F(StorageMemoryLogTest, appendMoved)
+{
+    log.truncatePrefix(10);
+    std::vector<Log::Entry> entries(2, sampleEntry);
+    std::pair<uint64_t, uint64_t> range = log.appendMoved(std::move(entries));
+    EXPECT_EQ(10U, range.first);
+    EXPECT_EQ(11U, range.second);
+    EXPECT_EQ("foo", log.getEntry(11).data());
+    EXPECT_EQ(40U, log.getTerm(11));
+}
+
 TEST_F(StorageMemoryLogTest, getEntry)
 {
     log.append({&sampleEntry});
@@ -78,6 +89,20 @@ TEST_F(StorageMemoryLogTest, getEntry)
     EXPECT_EQ("bar", entry2.data());
 }
 
+TEST_F(StorageMemoryLogTest, getTerm)
+{
+    log.append({&sampleEntry});
+    sampleEntry.set_term(41);
+    log.append({&sampleEntry, &sampleEntry});
+    EXPECT_EQ(40U, log.getTerm(1));
+    EXPECT_EQ(41U, log.getTerm(3));
+    log.truncatePrefix(2);
+    log.truncateSuffix(2);
+    EXPECT_EQ(41U, log.getTerm(2));
+    EXPECT_DEATH(log.getTerm(1), "outside");
+    EXPECT_DEATH(log.getTerm(3), "outside");
+}
+
 TEST_F(StorageMemoryLogTest, getLogStartIndex)
 {
     EXPECT_EQ(1U, log.getLogStartIndex());
@@ -18,11 +18,19 @@
 #include <endian.h>
 
 #include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <set>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <zlib.h>
 
+#include "liblogcabin/Core/CRC32C.h"
 #include "liblogcabin/Core/Checksum.h"
+#include "liblogcabin/Core/CompatAtomic.h"
 #include "liblogcabin/Core/Config.h"
 #include "liblogcabin/Core/Debug.h"
 #include "liblogcabin/Core/ProtoBuf.h"
@@ -56,6 +64,16 @@ namespace {
  */
 #define CLOSED_SEGMENT_FORMAT "%020lu-%020lu"
 
+/**
+ * Suffix appended to a closed segment's filename to name its index file.
+ */
+#define SEGMENT_INDEX_SUFFIX ".index"
+
+/**
+ * Suffix appended to a closed segment's filename to name its compressed copy.
+ */
+#define COMPRESSED_SEGMENT_SUFFIX ".z"
+
 /**
  * Return true if all the bytes in range [start, start + length) are zero.
  */
@@ -70,21 +88,62 @@ isAllZeros(const void* _start, size_t length)
     return true;
 }
 
+/**
+ * Return the number of bytes in checksums produced by the given algorithm,
+ * including the null terminator.
+ */
+uint32_t
+getChecksumLength(const std::string& algorithm)
+{
+    char checksum[Core::Checksum::MAX_LENGTH];
+    return Core::Checksum::calculate(algorithm.c_str(), "", 0, checksum);
+}
+
+/**
+ * Return the name of the directory (and of the storage module) for the given
+ * encoding.
+ */
+const char*
+getEncodingName(SegmentedLog::Encoding encoding)
+{
+    switch (encoding) {
+        case SegmentedLog::Encoding::TEXT:
+            return "Segmented-Text";
+        case SegmentedLog::Encoding::BINARY:
+            return "Segmented-Binary";
+        case SegmentedLog::Encoding::RAW:
+            return "Segmented-Raw";
+    }
+    PANIC("Unknown encoding %d", int(encoding));
+}
+
 } // anonymous namespace
 
 
 ////////// SegmentedLog::PreparedSegments //////////
 
 
-SegmentedLog::PreparedSegments::PreparedSegments(uint64_t queueSize)
+SegmentedLog::PreparedSegments::PreparedSegments(uint64_t minQueueSize,
+                                                 uint64_t maxQueueSize,
+                                                 uint64_t maxRecycled)
     : quietForUnitTests(false)
     , mutex()
     , consumed()
     , produced()
     , exiting(false)
-    , demanded(queueSize)
+    , demanded(minQueueSize)
     , filenameCounter(0)
     , openSegments()
+    , minQueueSize(minQueueSize)
+    , maxQueueSize(std::max(minQueueSize, maxQueueSize))
+    , targetSize(minQueueSize)
+    , lastConsumed()
+    , consumeIntervalNanos()
+    , prepareNanos()
+    , waitNanos()
+    , maxRecycled(maxRecycled)
+    , numRecycled(0)
+    , recycled()
 {
 }
 
@@ -118,6 +177,46 @@ SegmentedLog::PreparedSegments::releaseAll()
     return ret;
 }
 
+std::deque<std::string>
+SegmentedLog::PreparedSegments::releaseRecycled()
+{
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    std::deque<std::string> ret;
+    std::swap(recycled, ret);
+    numRecycled -= ret.size();
+    return ret;
+}
+
+bool
+SegmentedLog::PreparedSegments::reserveRecycled()
+{
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    if (numRecycled >= maxRecycled)
+        return false;
+    ++numRecycled;
+    return true;
+}
+
+void
+SegmentedLog::PreparedSegments::recycle(const std::string& filename)
+{
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    assert(recycled.size() < numRecycled);
+    recycled.push_back(filename);
+}
+
+std::string
+SegmentedLog::PreparedSegments::takeRecycled()
+{
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    if (recycled.empty())
+        return "";
+    std::string filename = recycled.front();
+    recycled.pop_front();
+    --numRecycled;
+    return filename;
+}
+
 void
 SegmentedLog::PreparedSegments::submitOpenSegment(OpenSegment segment)
 {
@@ -126,6 +225,14 @@ SegmentedLog::PreparedSegments::submitOpenSegment(OpenSegment segment)
     produced.notify_one();
 }
 
+void
+SegmentedLog::PreparedSegments::recordPrepareTime(
+        std::chrono::nanoseconds elapsed)
+{
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    prepareNanos.push(uint64_t(elapsed.count()));
+}
+
 uint64_t
 SegmentedLog::PreparedSegments::waitForDemand()
 {
@@ -145,6 +252,12 @@ SegmentedLog::PreparedSegments::OpenSegment
 SegmentedLog::PreparedSegments::waitForOpenSegment()
 {
     std::unique_lock<Core::Mutex> lockGuard(mutex);
+    TimePoint start = Clock::now();
+    if (lastConsumed != TimePoint()) {
+        consumeIntervalNanos.push(uint64_t(
+            std::chrono::nanoseconds(start - lastConsumed).count()));
+    }
+    lastConsumed = start;
     uint64_t numWaits = 0;
     while (true) {
         if (exiting) {
@@ -157,29 +270,122 @@ SegmentedLog::PreparedSegments::waitForOpenSegment()
         if (numWaits == 0 && !quietForUnitTests) {
             WARNING("Prepared segment not ready, having to wait on it. "
                     "This is perfectly safe but bad for performance. "
-                    "Consider increasing storageOpenSegments in the config.");
+                    "Consider increasing storageOpenSegments or "
+                    "storageMaxOpenSegments in the config.");
         }
         ++numWaits;
         produced.wait(lockGuard);
     }
-    if (numWaits > 0 && !quietForUnitTests) {
-        WARNING("Done waiting: prepared segment now ready");
+    std::chrono::nanoseconds waited = Clock::now() - start;
+    waitNanos.push(uint64_t(waited.count()));
+    if (numWaits > 0) {
+        waitNanos.noteExceptional(start, uint64_t(waited.count()));
+        if (!quietForUnitTests)
+            WARNING("Done waiting: prepared segment now ready");
     }
     OpenSegment r = std::move(openSegments.front());
     openSegments.pop_front();
+    demanded += adjustTargetSize(numWaits > 0);
     consumed.notify_one();
-    ++demanded;
     return r;
 }
 
+void
+SegmentedLog::PreparedSegments::updateServerStats(
+        Protocol::ServerStats& serverStats) const
+{
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    Protocol::ServerStats::Storage& stats = *serverStats.mutable_storage();
+    waitNanos.updateProtoBuf(*stats.mutable_open_segment_wait_nanos());
+    prepareNanos.updateProtoBuf(*stats.mutable_segment_prepare_nanos());
+    stats.set_prepared_segments_target(targetSize);
+}
+
+uint64_t
+SegmentedLog::PreparedSegments::adjustTargetSize(bool waited)
+{
+    uint64_t wanted = minQueueSize;
+    // Keep enough segments to cover those consumed while preparing one more,
+    // plus a spare. This needs a few samples of each to be meaningful.
+    double interval = consumeIntervalNanos.getEWMA4();
+    double prepare = prepareNanos.getEWMA4();
+    if (consumeIntervalNanos.getCount() >= 2 &&
+        prepareNanos.getCount() >= 1 &&
+        interval > 0) {
+        wanted = std::max(wanted, uint64_t(std::ceil(prepare / interval)) + 1);
+    }
+    // Running dry is the clearest sign the queue is too small.
+    if (waited)
+        wanted = std::max(wanted, targetSize + 1);
+    wanted = std::min(wanted, maxQueueSize);
+    if (wanted > targetSize) {
+        ++targetSize;
+        return 2;
+    }
+    if (wanted < targetSize) {
+        --targetSize;
+        return 0;
+    }
+    return 1;
+}
+
+
+////////// SegmentedLog::MetadataFiles //////////
+
+
+SegmentedLog::MetadataFiles::MetadataFiles()
+    : mutex()
+    , files()
+    , versions()
+{
+}
+
+void
+SegmentedLog::MetadataFiles::open(const FS::File& dir,
+                                  uint64_t version1,
+                                  uint64_t version2)
+{
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    files[0] = FS::openFile(dir, "metadata1", O_CREAT|O_WRONLY);
+    files[1] = FS::openFile(dir, "metadata2", O_CREAT|O_WRONLY);
+    versions[0] = version1;
+    versions[1] = version2;
+}
+
+bool
+SegmentedLog::MetadataFiles::write(const Core::Buffer& record,
+                                   uint64_t version)
+{
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    if (version <= std::max(versions[0], versions[1]))
+        return false;
+    uint64_t i = (versions[0] <= versions[1] ? 0 : 1);
+    FS::File& file = files[i];
+    // Any bytes left past the end of the record from an older, longer
+    // record are ignored by readMetadata().
+    if (FS::pwrite(file.fd, record.getData(), record.getLength(), 0) < 0) {
+        PANIC("Failed to write to %s: %s",
+              file.path.c_str(), strerror(errno));
+    }
+    FS::fdatasync(file);
+    versions[i] = version;
+    return true;
+}
+
 
 ////////// SegmentedLog::Sync //////////
 
 
 SegmentedLog::Sync::Sync(uint64_t lastIndex,
-                         std::chrono::nanoseconds diskWriteDurationThreshold)
+                         std::chrono::nanoseconds diskWriteDurationThreshold,
+                         IoUring* ioUring,
+                         MetadataFiles* metadataFiles)
     : Log::Sync(lastIndex)
     , diskWriteDurationThreshold(diskWriteDurationThreshold)
+    , ioUring(ioUring)
+    , metadataFiles(metadataFiles)
+    , recycledFilenames()
+    , removedFilenames()
     , ops()
     , waitStart(TimePoint::max())
     , waitEnd(TimePoint::max())
@@ -193,22 +399,45 @@ SegmentedLog::Sync::~Sync()
 void
 SegmentedLog::Sync::optimize()
 {
-    if (ops.size() < 3)
-        return;
-    auto prev = ops.begin();
-    auto it = prev + 1;
-    auto next = it + 1;
-    while (next != ops.end()) {
-        if (prev->opCode == Op::FDATASYNC &&
-            it->opCode == Op::WRITE &&
-            next->opCode == Op::FDATASYNC &&
-            prev->fd == it->fd &&
-            it->fd == next->fd) {
-            prev->opCode = Op::NOOP;
-        }
-        prev = it;
-        it = next;
-        ++next;
+    if (ops.size() >= 3) {
+        auto prev = ops.begin();
+        auto it = prev + 1;
+        auto next = it + 1;
+        while (next != ops.end()) {
+            if (prev->opCode == Op::FDATASYNC &&
+                it->opCode == Op::WRITE &&
+                next->opCode == Op::FDATASYNC &&
+                prev->fd == it->fd &&
+                it->fd == next->fd) {
+                prev->opCode = Op::NOOP;
+            }
+            prev = it;
+            it = next;
+            ++next;
+        }
+    }
+
+    // Merge writes that are now adjacent (ignoring NOOPs) into the first
+    // write of each run.
+    auto run = ops.end();
+    for (auto it = ops.begin(); it != ops.end(); ++it) {
+        if (it->opCode == Op::NOOP)
+            continue;
+        if (it->opCode == Op::WRITE &&
+            run != ops.end() &&
+            run->fd == it->fd &&
+            run->offset < 0 && it->offset < 0 &&
+            run->writeData.size() + it->writeData.size() <= IOV_MAX) {
+            for (auto bit = it->writeData.begin();
+                 bit != it->writeData.end();
+                 ++bit) {
+                run->writeData.push_back(std::move(*bit));
+            }
+            it->writeData.clear();
+            it->opCode = Op::NOOP;
+            continue;
+        }
+        run = (it->opCode == Op::WRITE ? it : ops.end());
     }
 }
 
@@ -226,61 +455,59 @@ SegmentedLog::Sync::wait()
     uint64_t fsyncs = 0;
     uint64_t closes = 0;
     uint64_t unlinks = 0;
-
-    while (!ops.empty()) {
-        Op& op = ops.front();
-        FS::File f(op.fd, "-unknown-");
-        switch (op.opCode) {
-            case Op::WRITE: {
-                ssize_t written = FS::write(op.fd,
-                        op.writeData.getData(),
-                        op.writeData.getLength());
-                if (written < 0) {
-                    PANIC("Failed to write to fd %d: %s",
-                          op.fd,
-                          strerror(errno));
-                }
+    uint64_t metadataWrites = 0;
+    for (auto it = ops.begin(); it != ops.end(); ++it) {
+        switch (it->opCode) {
+            case Op::WRITE:
                 ++writes;
-                totalBytesWritten += op.writeData.getLength();
+                for (auto bit = it->writeData.begin();
+                     bit != it->writeData.end();
+                     ++bit) {
+                    totalBytesWritten += bit->getLength();
+                }
                 break;
-            }
-            case Op::TRUNCATE: {
-                FS::truncate(f, op.size);
+            case Op::TRUNCATE:
                 ++truncates;
                 break;
-            }
-            case Op::RENAME: {
-                FS::rename(f, op.filename1,
-                           f, op.filename2);
+            case Op::RENAME:
                 ++renames;
                 break;
-            }
-            case Op::FDATASYNC: {
-                FS::fdatasync(f);
+            case Op::FDATASYNC:
                 ++fdatasyncs;
                 break;
-            }
-            case Op::FSYNC: {
-                FS::fsync(f);
+            case Op::FSYNC:
                 ++fsyncs;
                 break;
-            }
-            case Op::CLOSE: {
-                f.close();
+            case Op::CLOSE:
                 ++closes;
                 break;
-            }
-            case Op::UNLINKAT: {
-                FS::removeFile(f, op.filename1);
+            case Op::UNLINKAT:
                 ++unlinks;
                 break;
-            }
-            case Op::NOOP: {
+            case Op::WRITE_FILE:
+                ++writes;
+                ++fdatasyncs;
+                for (auto bit = it->writeData.begin();
+                     bit != it->writeData.end();
+                     ++bit) {
+                    totalBytesWritten += bit->getLength();
+                }
                 break;
-            }
+            case Op::METADATA:
+                ++metadataWrites;
+                break;
+            case Op::NOOP:
+                break;
+        }
+    }
+
+    if (ioUring != NULL) {
+        waitIoUring();
+    } else {
+        while (!ops.empty()) {
+            executeOp(ops.front());
+            ops.pop_front();
         }
-        f.release();
-        ops.pop_front();
     }
 
     waitEnd = Clock::now();
@@ -288,8 +515,8 @@ SegmentedLog::Sync::wait()
     if (elapsed > diskWriteDurationThreshold) {
         WARNING("Executing filesystem operations took longer than expected "
                 "(%s for %lu writes totaling %lu bytes, %lu truncates, "
-                "%lu renames, %lu fdatasyncs, %lu fsyncs, %lu closes, and "
-                "%lu unlinks)",
+                "%lu renames, %lu fdatasyncs, %lu fsyncs, %lu closes, "
+                "%lu unlinks, and %lu metadata writes)",
                 Core::StringUtil::toString(elapsed).c_str(),
                 writes,
                 totalBytesWritten,
@@ -298,8 +525,259 @@ SegmentedLog::Sync::wait()
                 fdatasyncs,
                 fsyncs,
                 closes,
-                unlinks);
+                unlinks,
+                metadataWrites);
+    }
+}
+
+void
+SegmentedLog::Sync::executeOp(Op& op)
+{
+    FS::File f(op.fd, "-unknown-");
+    switch (op.opCode) {
+        case Op::WRITE: {
+            if (op.offset >= 0) {
+                uint64_t offset = uint64_t(op.offset);
+                for (auto it = op.writeData.begin();
+                     it != op.writeData.end();
+                     ++it) {
+                    if (FS::pwrite(op.fd, it->getData(), it->getLength(),
+                                   offset) < 0) {
+                        PANIC("Failed to write to fd %d at offset %lu: %s",
+                              op.fd,
+                              offset,
+                              strerror(errno));
+                    }
+                    offset += it->getLength();
+                }
+                break;
+            }
+            std::vector<std::pair<const void*, uint64_t>> data;
+            for (auto it = op.writeData.begin();
+                 it != op.writeData.end();
+                 ++it) {
+                data.push_back({it->getData(), it->getLength()});
+            }
+            ssize_t written = FS::write(op.fd, data);
+            if (written < 0) {
+                PANIC("Failed to write to fd %d: %s",
+                      op.fd,
+                      strerror(errno));
+            }
+            break;
+        }
+        case Op::TRUNCATE: {
+            FS::truncate(f, op.size);
+            break;
+        }
+        case Op::RENAME: {
+            FS::rename(f, op.filename1,
+                       f, op.filename2);
+            break;
+        }
+        case Op::FDATASYNC: {
+            FS::fdatasync(f);
+            break;
+        }
+        case Op::FSYNC: {
+            FS::fsync(f);
+            break;
+        }
+        case Op::CLOSE: {
+            f.close();
+            break;
+        }
+        case Op::UNLINKAT: {
+            FS::removeFile(f, op.filename1);
+            break;
+        }
+        case Op::WRITE_FILE: {
+            FS::File file = FS::openFile(f, op.filename1,
+                                         O_CREAT|O_WRONLY|O_TRUNC);
+            std::vector<std::pair<const void*, uint64_t>> data;
+            for (auto it = op.writeData.begin();
+                 it != op.writeData.end();
+                 ++it) {
+                data.push_back({it->getData(), it->getLength()});
+            }
+            if (FS::write(file.fd, data) < 0) {
+                PANIC("Failed to write to %s: %s",
+                      file.path.c_str(),
+                      strerror(errno));
+            }
+            FS::fdatasync(file);
+            break;
+        }
+        case Op::METADATA: {
+            metadataFiles->write(op.writeData.at(0), op.size);
+            break;
+        }
+        case Op::NOOP: {
+            break;
+        }
+    }
+    f.release();
+}
+
+void
+SegmentedLog::Sync::waitIoUring()
+{
+    std::lock_guard<Core::Mutex> lockGuard(ioUring->mutex);
+    // Maps from each submitted request's user_data to its op.
+    std::vector<const Op*> submitted;
+    // The I/O vectors for submitted writes, which must remain valid until
+    // the writes complete.
+    std::deque<std::vector<struct iovec>> iovecs;
+    // Requests are chained per file descriptor: each maps to the last
+    // request submitted for it, which the next one on that fd links to.
+    std::unordered_map<int, std::pair<struct io_uring_sqe*, const Op*>>
+        chainTails;
+
+    auto writeLength = [](const Op& op) {
+        uint64_t length = 0;
+        for (auto it = op.writeData.begin(); it != op.writeData.end(); ++it)
+            length += it->getLength();
+        return length;
+    };
+
+    // Submit everything queued so far, wait for it, and check the results.
+    auto flush = [&]() {
+        std::vector<IoUring::Completion> completions;
+        ioUring->submitAndWait(completions);
+        chainTails.clear();
+        const IoUring::Completion* failed = NULL;
+        for (auto it = completions.begin(); it != completions.end(); ++it) {
+            const Op& op = *submitted.at(it->userData);
+            bool ok;
+            if (op.opCode == Op::WRITE)
+                ok = (it->result >= 0 &&
+                      uint64_t(it->result) == writeLength(op));
+            else if (op.opCode == Op::UNLINKAT)
+                ok = (it->result >= 0 || it->result == -ENOENT);
+            else
+                ok = (it->result >= 0);
+            // Requests canceled because an earlier link failed aren't
+            // interesting; report the failure that caused them.
+            if (!ok && (failed == NULL || failed->result == -ECANCELED))
+                failed = &*it;
+        }
+        if (failed != NULL) {
+            const Op& op = *submitted.at(failed->userData);
+            if (op.opCode == Op::WRITE && failed->result >= 0) {
+                PANIC("Short write to fd %d: wrote %d of %lu bytes",
+                      op.fd,
+                      failed->result,
+                      writeLength(op));
+            }
+            PANIC("Failed to execute operation %d on fd %d (%s %s): %s",
+                  int(op.opCode),
+                  op.fd,
+                  op.filename1.c_str(),
+                  op.filename2.c_str(),
+                  strerror(-failed->result));
+        }
+        submitted.clear();
+        iovecs.clear();
+    };
+
+    for (auto it = ops.begin(); it != ops.end(); ++it) {
+        Op& op = *it;
+        if (op.opCode == Op::NOOP)
+            continue;
+        if ((op.opCode == Op::FDATASYNC || op.opCode == Op::FSYNC) &&
+            FS::skipFsync) {
+            continue;
+        }
+        if (op.opCode == Op::TRUNCATE ||
+            op.opCode == Op::WRITE_FILE ||
+            op.opCode == Op::METADATA) {
+            flush();
+            executeOp(op);
+            continue;
+        }
+        // A rename or unlink can't be undone, and it may depend on ops for
+        // other files (a rename of a segment needs that segment's data synced
+        // first), so it waits for everything before it to succeed.
+        if ((op.opCode == Op::RENAME || op.opCode == Op::UNLINKAT) &&
+            (chainTails.size() > 1 ||
+             (chainTails.size() == 1 && chainTails.count(op.fd) == 0))) {
+            flush();
+        }
+        struct io_uring_sqe* sqe = ioUring->getSqe();
+        if (sqe == NULL) {
+            flush();
+            sqe = ioUring->getSqe();
+        }
+        switch (op.opCode) {
+            case Op::WRITE: {
+                iovecs.emplace_back();
+                std::vector<struct iovec>& iov = iovecs.back();
+                for (auto bit = op.writeData.begin();
+                     bit != op.writeData.end();
+                     ++bit) {
+                    iov.push_back({const_cast<void*>(bit->getData()),
+                                   bit->getLength()});
+                }
+                sqe->opcode = IORING_OP_WRITEV;
+                sqe->fd = op.fd;
+                sqe->addr = uint64_t(iov.data());
+                sqe->len = uint32_t(iov.size());
+                if (op.offset < 0)
+                    sqe->off = ~0UL; // use and advance the file position
+                else
+                    sqe->off = uint64_t(op.offset);
+                break;
+            }
+            case Op::RENAME:
+                sqe->opcode = IORING_OP_RENAMEAT;
+                sqe->fd = op.fd;
+                sqe->addr = uint64_t(op.filename1.c_str());
+                sqe->len = uint32_t(op.fd);
+                sqe->addr2 = uint64_t(op.filename2.c_str());
+                break;
+            case Op::FDATASYNC:
+                sqe->opcode = IORING_OP_FSYNC;
+                sqe->fd = op.fd;
+                sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+                break;
+            case Op::FSYNC:
+                sqe->opcode = IORING_OP_FSYNC;
+                sqe->fd = op.fd;
+                break;
+            case Op::CLOSE:
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->fd = op.fd;
+                break;
+            case Op::UNLINKAT:
+                sqe->opcode = IORING_OP_UNLINKAT;
+                sqe->fd = op.fd;
+                sqe->addr = uint64_t(op.filename1.c_str());
+                break;
+            case Op::TRUNCATE:
+            case Op::WRITE_FILE:
+            case Op::METADATA:
+            case Op::NOOP:
+                assert(false);
+                break;
+        }
+        sqe->user_data = submitted.size();
+        submitted.push_back(&op);
+        // A request waits only for the one before it on the same fd, so
+        // writes to one file overlap with writes to and syncs of another.
+        // An unlink of a missing file fails with ENOENT, which is fine, so
+        // the request after it is hard-linked to keep the chain going
+        // regardless.
+        auto tail = chainTails.find(op.fd);
+        if (tail != chainTails.end()) {
+            if (tail->second.second->opCode == Op::UNLINKAT)
+                tail->second.first->flags |= IOSQE_IO_HARDLINK;
+            else
+                tail->second.first->flags |= IOSQE_IO_LINK;
+        }
+        chainTails[op.fd] = {sqe, &op};
     }
+    flush();
+    ops.clear();
 }
 
 void
@@ -317,7 +795,11 @@ SegmentedLog::Sync::updateStats(Core::RollingStat& nanos) const
 
 SegmentedLog::Segment::Record::Record(uint64_t offset)
     : offset(offset)
+    , term(0)
+    , length(0)
+    , type(0)
     , entry()
+    , released(false)
 {
 }
 
@@ -326,11 +808,18 @@ SegmentedLog::Segment::Record::Record(uint64_t offset)
 
 SegmentedLog::Segment::Segment()
     : isOpen(false)
+    , compressed(false)
+    , compressing(false)
     , startIndex(~0UL)
     , endIndex(~0UL - 1)
+    , version(0)
     , bytes(0)
     , filename("--invalid--")
     , entries()
+    , file()
+    , contents()
+    , blockBytes(0)
+    , blockOffsets()
 {
 }
 
@@ -341,93 +830,341 @@ SegmentedLog::Segment::makeClosedFilename() const
                   startIndex, endIndex);
 }
 
-////////// SegmentedLog public functions //////////
-
+std::string
+SegmentedLog::Segment::makeIndexFilename() const
+{
+    return makeClosedFilename() + SEGMENT_INDEX_SUFFIX;
+}
 
-SegmentedLog::SegmentedLog(const FS::File& parentDir,
-                           Encoding encoding,
-                           const Core::Config& config)
-    : encoding(encoding)
-    , checksumAlgorithm(config.read<std::string>("storageChecksum", "CRC32"))
-    , MAX_SEGMENT_SIZE(config.read<uint64_t>("storageSegmentBytes",
-                                             8 * 1024 * 1024))
-    , shouldCheckInvariants(config.read<bool>("storageDebug", false))
-    , diskWriteDurationThreshold(config.read<uint64_t>(
-        "electionTimeoutMilliseconds", 500) / 4)
-    , metadata()
-    , dir(FS::openDir(parentDir,
-                      (encoding == Encoding::BINARY
-                        ? "Segmented-Binary"
-                        : "Segmented-Text")))
-    , openSegmentFile()
-    , logStartIndex(1)
-    , segmentsByStartIndex()
-    , totalClosedSegmentBytes(0)
-    , preparedSegments(
-        std::max(config.read<uint64_t>("storageOpenSegments", 3),
-                 1UL))
-    , currentSync(new SegmentedLog::Sync(0, diskWriteDurationThreshold))
-    , metadataWriteNanos()
-    , filesystemOpsNanos()
-    , segmentPreparer()
+uint64_t
+SegmentedLog::Segment::bytesToKeep(uint64_t numEntries) const
 {
-    std::vector<Segment> segments = readSegmentFilenames();
+    assert(numEntries > 0);
+    const Record& last = entries.at(numEntries - 1);
+    const Record& next = entries.at(numEntries);
+    if (next.offset != last.offset)
+        return next.offset;
+    // The next entry is in the same batch as the last one to keep, and the
+    // batch's length is stored in its first entry's record.
+    uint64_t first = numEntries - 1;
+    while (first > 0 && entries.at(first - 1).offset == last.offset)
+        --first;
+    return last.offset + entries.at(first).length;
+}
 
-    bool quiet = config.read<bool>("unittest-quiet", false);
-    preparedSegments.quietForUnitTests = quiet;
-    SegmentedLogMetadata::Metadata metadata1;
-    SegmentedLogMetadata::Metadata metadata2;
-    bool ok1 = readMetadata("metadata1", metadata1, quiet);
-    bool ok2 = readMetadata("metadata2", metadata2, quiet);
-    if (ok1 && ok2) {
-        if (metadata1.version() > metadata2.version())
-            metadata = metadata1;
-        else
-            metadata = metadata2;
-    } else if (ok1) {
-        metadata = metadata1;
-    } else if (ok2) {
-        metadata = metadata2;
-    } else {
-        // Brand new servers won't have metadata, and that's ok.
-        if (!segments.empty()) {
-            PANIC("No readable metadata file but found segments in %s",
-                  dir.path.c_str());
-        }
-        metadata.set_entries_start(logStartIndex);
-    }
+////////// SegmentedLog::Compressor //////////
 
-    logStartIndex = metadata.entries_start();
-    Log::metadata = metadata.raft_metadata();
-    // Write both metadata files
-    updateMetadata();
-    updateMetadata();
-    FS::fsync(dir); // in case metadata files didn't exist
 
+SegmentedLog::Compressor::Compressor()
+    : mutex()
+    , queued()
+    , done()
+    , exiting(false)
+    , busy(false)
+    , pending()
+    , finished()
+{
+}
 
-    // Read data from segments, closing any open segments.
-    for (auto it = segments.begin(); it != segments.end(); ++it) {
-        Segment& segment = *it;
-        bool keep = segment.isOpen ? loadOpenSegment(segment, logStartIndex)
-                                   : loadClosedSegment(segment, logStartIndex);
-        if (keep) {
-            assert(!segment.isOpen);
-            uint64_t startIndex = segment.startIndex;
-            std::string filename = segment.filename;
-            auto result = segmentsByStartIndex.insert({startIndex,
-                                                       std::move(segment)});
-            if (!result.second) {
-                Segment& other = result.first->second;
-                PANIC("Two segments contain entry %lu: %s and %s",
-                      startIndex,
-                      other.filename.c_str(),
-                      filename.c_str());
-            }
-        }
-    }
+SegmentedLog::Compressor::~Compressor()
+{
+}
 
-    // Check to make sure no entry is present in more than one segment,
-    // and that there's no gap in the numbering for entries we have.
+void
+SegmentedLog::Compressor::exit()
+{
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    exiting = true;
+    pending.clear();
+    queued.notify_all();
+    done.notify_all();
+}
+
+void
+SegmentedLog::Compressor::compress(const std::string& filename)
+{
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    pending.push_back(filename);
+    queued.notify_all();
+}
+
+void
+SegmentedLog::Compressor::finish(const std::string& filename)
+{
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    finished.push_back(filename);
+}
+
+std::vector<std::string>
+SegmentedLog::Compressor::takeFinished()
+{
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    std::vector<std::string> ret;
+    std::swap(ret, finished);
+    return ret;
+}
+
+bool
+SegmentedLog::Compressor::waitForWork(std::string& filename)
+{
+    std::unique_lock<Core::Mutex> lockGuard(mutex);
+    busy = false;
+    done.notify_all();
+    while (!exiting) {
+        if (!pending.empty()) {
+            filename = pending.front();
+            pending.pop_front();
+            busy = true;
+            return true;
+        }
+        queued.wait(lockGuard);
+    }
+    return false;
+}
+
+void
+SegmentedLog::Compressor::waitUntilIdle()
+{
+    std::unique_lock<Core::Mutex> lockGuard(mutex);
+    while (busy || !pending.empty())
+        done.wait(lockGuard);
+}
+
+
+////////// SegmentedLog::Reclaimer //////////
+
+
+SegmentedLog::Reclaimer::Reclaimer()
+    : mutex()
+    , queued()
+    , done()
+    , exiting(false)
+    , busy(false)
+    , segments()
+    , filenames()
+{
+}
+
+SegmentedLog::Reclaimer::~Reclaimer()
+{
+}
+
+void
+SegmentedLog::Reclaimer::exit()
+{
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    exiting = true;
+    queued.notify_all();
+}
+
+void
+SegmentedLog::Reclaimer::reclaim(Segment segment)
+{
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    segments.push_back(std::move(segment));
+    queued.notify_all();
+}
+
+void
+SegmentedLog::Reclaimer::remove(const std::vector<std::string>& newFilenames)
+{
+    if (newFilenames.empty())
+        return;
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    filenames.insert(filenames.end(),
+                     newFilenames.begin(),
+                     newFilenames.end());
+    queued.notify_all();
+}
+
+bool
+SegmentedLog::Reclaimer::waitForWork(std::deque<Segment>& outSegments,
+                                     std::vector<std::string>& outFilenames)
+{
+    std::unique_lock<Core::Mutex> lockGuard(mutex);
+    busy = false;
+    done.notify_all();
+    while (segments.empty() && filenames.empty()) {
+        if (exiting)
+            return false;
+        queued.wait(lockGuard);
+    }
+    std::swap(outSegments, segments);
+    std::swap(outFilenames, filenames);
+    busy = true;
+    return true;
+}
+
+void
+SegmentedLog::Reclaimer::waitUntilIdle()
+{
+    std::unique_lock<Core::Mutex> lockGuard(mutex);
+    while (busy || !segments.empty() || !filenames.empty())
+        done.wait(lockGuard);
+}
+
+
+////////// SegmentedLog public functions //////////
+
+
+SegmentedLog::SegmentedLog(const FS::File& parentDir,
+                           Encoding encoding,
+                           const Core::Config& config,
+                           const FS::File& archiveParentDir)
+    : encoding(encoding)
+    , checksumAlgorithm(config.read<std::string>(
+        "storageChecksum",
+        Core::CRC32C::isHardwareAccelerated() ? "CRC32C" : "CRC32"))
+    , checksumLength(getChecksumLength(checksumAlgorithm))
+    , segmentVersion(config.read<uint64_t>("storageSegmentVersion", 2))
+    , MAX_SEGMENT_SIZE(config.read<uint64_t>("storageSegmentBytes",
+                                             8 * 1024 * 1024))
+    , shouldCheckInvariants(config.read<bool>("storageDebug", false))
+    , diskWriteDurationThreshold(config.read<uint64_t>(
+        "electionTimeoutMilliseconds", 500) / 4)
+    , metadata()
+    , dir(FS::openDir(parentDir, getEncodingName(encoding)))
+    , archiveDir(archiveParentDir.fd >= 0
+                    ? FS::openDir(archiveParentDir, getEncodingName(encoding))
+                    : FS::dup(dir))
+    , openSegmentFile()
+    , logStartIndex(1)
+    , segmentsByStartIndex()
+    , termIndex()
+    , totalClosedSegmentBytes(0)
+    , maxCachedEntries(config.read<uint64_t>("storageEntryCacheEntries", 0))
+    , entryCache()
+    , entryCacheIndex()
+    , entryCacheHits(0)
+    , entryCacheMisses(0)
+    , maxMappedSegments(std::max(
+        config.read<uint64_t>("storageMaxMappedSegments", 16),
+        1UL))
+    , mappedSegments()
+    , mappedSegmentsIndex()
+    , compressSegments(config.read<bool>("storageCompressSegments", false))
+    , hotSegments(config.read<uint64_t>("storageHotSegments", 4))
+    , compressedBlockBytes(std::max(
+        std::min(config.read<uint64_t>("storageCompressedBlockBytes",
+                                       64 * 1024),
+                 uint64_t(UINT32_MAX)),
+        1UL))
+    , maxCachedBlocks(config.read<uint64_t>(
+        "storageCompressedBlockCacheBlocks", 16))
+    , blockCache()
+    , blockCacheIndex()
+    , blockCacheHits(0)
+    , blockCacheMisses(0)
+    , directIO(config.read<bool>("storageDirectIO", false))
+    , directIOAlignment(config.read<uint64_t>("storageDirectIOAlignment",
+                                              4096))
+    , directIOBuffer()
+    , directIOBufferOffset(0)
+    , directIOBufferDirty(false)
+    , preparedSegments(
+        std::max(config.read<uint64_t>("storageOpenSegments", 3),
+                 1UL),
+        config.read<uint64_t>("storageMaxOpenSegments", 8),
+        config.read<uint64_t>("storageRecycleSegments", 3))
+    , backgroundReclaim(config.read<bool>("storageBackgroundReclaim", true))
+    , reclaimer()
+    , compressor()
+    , ioUring(config.read<bool>("storageIoUring", false)
+                ? new IoUring(256)
+                : NULL)
+    , metadataFiles()
+    , currentSync(new SegmentedLog::Sync(0, diskWriteDurationThreshold,
+                                         ioUring.get(), &metadataFiles))
+    , metadataWriteNanos()
+    , filesystemOpsNanos()
+    , segmentPreparer()
+    , segmentReclaimer()
+    , segmentCompressor()
+{
+    if (ioUring && !ioUring->isAvailable()) {
+        NOTICE("Falling back to blocking system calls for log writes");
+        ioUring.reset();
+        currentSync->ioUring = NULL;
+    }
+    if (directIO &&
+        (directIOAlignment == 0 ||
+         (directIOAlignment & (directIOAlignment - 1)) != 0)) {
+        PANIC("storageDirectIOAlignment must be a power of two, but it is "
+              "%lu", directIOAlignment);
+    }
+    if (segmentVersion != 1 && segmentVersion != 2) {
+        PANIC("storageSegmentVersion must be 1 or 2, but it is %lu",
+              segmentVersion);
+    }
+
+    std::vector<Segment> segments = readSegmentFilenames();
+
+    bool quiet = config.read<bool>("unittest-quiet", false);
+    preparedSegments.quietForUnitTests = quiet;
+    SegmentedLogMetadata::Metadata metadata1;
+    SegmentedLogMetadata::Metadata metadata2;
+    bool ok1 = readMetadata("metadata1", metadata1, quiet);
+    bool ok2 = readMetadata("metadata2", metadata2, quiet);
+    if (ok1 && ok2) {
+        if (metadata1.version() > metadata2.version())
+            metadata = metadata1;
+        else
+            metadata = metadata2;
+    } else if (ok1) {
+        metadata = metadata1;
+    } else if (ok2) {
+        metadata = metadata2;
+    } else {
+        // Brand new servers won't have metadata, and that's ok.
+        if (!segments.empty()) {
+            PANIC("No readable metadata file but found segments in %s",
+                  dir.path.c_str());
+        }
+        metadata.set_entries_start(logStartIndex);
+    }
+
+    logStartIndex = metadata.entries_start();
+    Log::metadata = metadata.raft_metadata();
+    metadataFiles.open(dir,
+                       ok1 ? metadata1.version() : 0,
+                       ok2 ? metadata2.version() : 0);
+    // Write both metadata files
+    updateMetadata();
+    updateMetadata();
+    FS::fsync(dir); // in case metadata files didn't exist
+
+
+    // Read data from segments, closing any open segments. The closed
+    // segments are read first, in parallel.
+    uint64_t numLoadThreads = config.read<uint64_t>(
+        "storageLoadThreads",
+        std::max(std::thread::hardware_concurrency(), 1U));
+    std::deque<bool> closedKeep = loadClosedSegments(segments,
+                                                     logStartIndex,
+                                                     numLoadThreads);
+    for (uint64_t i = 0; i < segments.size(); ++i) {
+        Segment& segment = segments.at(i);
+        bool keep = segment.isOpen ? loadOpenSegment(segment, logStartIndex)
+                                   : closedKeep.at(i);
+        if (keep) {
+            assert(!segment.isOpen);
+            totalClosedSegmentBytes += segment.bytes;
+            uint64_t startIndex = segment.startIndex;
+            std::string filename = segment.filename;
+            auto result = segmentsByStartIndex.insert({startIndex,
+                                                       std::move(segment)});
+            if (!result.second) {
+                Segment& other = result.first->second;
+                PANIC("Two segments contain entry %lu: %s and %s",
+                      startIndex,
+                      other.filename.c_str(),
+                      filename.c_str());
+            }
+        }
+    }
+
+    // Check to make sure no entry is present in more than one segment,
+    // and that there's no gap in the numbering for entries we have.
     if (!segmentsByStartIndex.empty()) {
         uint64_t nextIndex = segmentsByStartIndex.begin()->first;
         for (auto it = segmentsByStartIndex.begin();
@@ -449,6 +1186,23 @@ SegmentedLog::SegmentedLog(const FS::File& parentDir,
             nextIndex = segment.endIndex + 1;
         }
     }
+    removeOrphanIndexes();
+
+    // Build the term index. Its start index is adjusted before and after
+    // adding the terms, since the first segment may start earlier.
+    if (!segmentsByStartIndex.empty())
+        termIndex.truncatePrefix(segmentsByStartIndex.begin()->first);
+    for (auto it = segmentsByStartIndex.begin();
+         it != segmentsByStartIndex.end();
+         ++it) {
+        const Segment& segment = it->second;
+        for (auto it2 = segment.entries.begin();
+             it2 != segment.entries.end();
+             ++it2) {
+            termIndex.append(it2->term);
+        }
+    }
+    termIndex.truncatePrefix(logStartIndex);
 
     // Open a segment to write new entries into.
     uint64_t fileId = preparedSegments.waitForDemand();
@@ -459,12 +1213,29 @@ SegmentedLog::SegmentedLog(const FS::File& parentDir,
     // Launch the segment preparer thread so that we'll have a source for
     // additional new segments.
     segmentPreparer = std::thread(&SegmentedLog::segmentPreparerMain, this);
+    if (backgroundReclaim) {
+        segmentReclaimer = std::thread(&SegmentedLog::segmentReclaimerMain,
+                                       this);
+    }
+    if (compressSegments) {
+        segmentCompressor = std::thread(&SegmentedLog::segmentCompressorMain,
+                                        this);
+        compressColdSegments();
+    }
 
     checkInvariants();
 }
 
 SegmentedLog::~SegmentedLog()
 {
+    // Finish any queued operations, such as metadata updates from
+    // truncatePrefix(), before closing the files they refer to.
+    if (!currentSync->ops.empty() || directIOBufferDirty) {
+        std::unique_ptr<Log::Sync> sync = takeSync();
+        sync->wait();
+        syncComplete(std::move(sync));
+    }
+
     NOTICE("Closing open segment");
     closeSegment();
 
@@ -480,6 +1251,26 @@ SegmentedLog::~SegmentedLog()
         FS::removeFile(dir, filename);
         prepared.pop_front();
     }
+    auto recycled = preparedSegments.releaseRecycled();
+    for (auto it = recycled.begin(); it != recycled.end(); ++it) {
+        NOTICE("Removing unneeded segment that was never recycled: %s",
+               it->c_str());
+        FS::removeFile(dir, *it);
+    }
+
+    // Stop compressing segments, but switch over to the copies that are
+    // already done.
+    compressor.exit();
+    if (segmentCompressor.joinable())
+        segmentCompressor.join();
+    std::vector<std::string> compressed = compressor.takeFinished();
+    for (auto it = compressed.begin(); it != compressed.end(); ++it)
+        finishCompression(*it);
+
+    // Let the reclaimer finish removing the files queued by the last sync.
+    reclaimer.exit();
+    if (segmentReclaimer.joinable())
+        segmentReclaimer.join();
     FS::fsync(dir);
 
     // Keep assertion in Log.h happy. No need to "take" and "complete" this
@@ -490,36 +1281,75 @@ SegmentedLog::~SegmentedLog()
 
 std::pair<uint64_t, uint64_t>
 SegmentedLog::append(const std::vector<const Entry*>& entries)
+{
+    std::vector<Entry> copies;
+    copies.reserve(entries.size());
+    for (auto it = entries.begin(); it != entries.end(); ++it)
+        copies.push_back(**it);
+    return appendMoved(std::move(copies));
+}
+
+std::pair<uint64_t, uint64_t>
+SegmentedLog::appendMoved(std::vector<Entry>&& entries)
 {
     Segment* openSegment = &getOpenSegment();
     uint64_t startIndex = openSegment->endIndex + 1;
     uint64_t index = startIndex;
+    // With version 2 segments, entries are collected here and written as a
+    // single batch record when the batch is complete.
+    std::vector<Core::Buffer> batch;
+    uint64_t batchBytes = 0;
     for (auto it = entries.begin(); it != entries.end(); ++it) {
+        // All entries in a batch share the offset of the batch.
         Segment::Record record(openSegment->bytes);
         // Note that record.offset may change later, if this entry doesn't fit.
-        record.entry = **it;
+        record.entry.Swap(&*it);
         if (record.entry.has_index()) {
             assert(index == record.entry.index());
         } else {
             record.entry.set_index(index);
         }
-        Core::Buffer buf = serializeProto(record.entry);
+        Core::Buffer buf = (openSegment->version == 1
+                                ? serializeProto(record.entry)
+                                : encodeProto(record.entry));
+        record.term = record.entry.term();
+        record.type = uint32_t(record.entry.type());
+        // The number of bytes this entry adds to the segment.
+        uint64_t entryBytes = buf.getLength();
+        if (openSegment->version != 1) {
+            entryBytes += sizeof(uint32_t);
+            if (batch.empty())
+                entryBytes += checksumLength + sizeof(uint32_t);
+        }
 
         // See if we need to roll over to a new head segment. If someone is
         // writing an entry that is bigger than MAX_SEGMENT_SIZE, just put it
         // in its own segment. This duplicates some code from closeSegment(),
         // but queues up the operations into 'currentSync'.
-        if (openSegment->bytes > sizeof(SegmentHeader) &&
-            openSegment->bytes + buf.getLength() > MAX_SEGMENT_SIZE) {
+        if (openSegment->bytes + batchBytes > sizeof(SegmentHeader) &&
+            (openSegment->bytes + batchBytes + entryBytes >
+             MAX_SEGMENT_SIZE)) {
             NOTICE("Rolling over to new head segment: trying to append new "
                    "entry that is %lu bytes long, but open segment is already "
                    "%lu of %lu bytes large",
-                   buf.getLength(),
-                   openSegment->bytes,
+                   entryBytes,
+                   openSegment->bytes + batchBytes,
                    MAX_SEGMENT_SIZE);
 
+            // Finish the batch in this segment.
+            if (!batch.empty()) {
+                openSegment->entries.at(openSegment->entries.size() -
+                                        batch.size()).length =
+                    uint32_t(batchBytes);
+                writeRecord(serializeBatch(batch));
+                batch.clear();
+                batchBytes = 0;
+                entryBytes += checksumLength + sizeof(uint32_t);
+            }
+
             // Truncate away any extra 0 bytes at the end from when
             // MAX_SEGMENT_SIZE was allocated.
+            flushDirectIOBuffer();
             currentSync->ops.emplace_back(openSegmentFile.fd,
                                           Sync::Op::TRUNCATE);
             currentSync->ops.back().size = openSegment->bytes;
@@ -536,9 +1366,20 @@ SegmentedLog::append(const std::vector<const Entry*>& entries)
             currentSync->ops.emplace_back(dir.fd, Sync::Op::RENAME);
             currentSync->ops.back().filename1 = openSegment->filename;
             currentSync->ops.back().filename2 = newFilename;
-            currentSync->ops.emplace_back(dir.fd, Sync::Op::FSYNC);
             openSegment->filename = newFilename;
 
+            // Write the segment's index, if it'll ever be read (see
+            // writeIndex()). The Sync creates the file, so that doesn't
+            // happen here under the log's lock.
+            if (maxCachedEntries > 0) {
+                currentSync->ops.emplace_back(dir.fd, Sync::Op::WRITE_FILE);
+                currentSync->ops.back().filename1 =
+                    openSegment->makeIndexFilename();
+                currentSync->ops.back().writeData.push_back(
+                    serializeIndex(*openSegment));
+            }
+            currentSync->ops.emplace_back(dir.fd, Sync::Op::FSYNC);
+
             // Bookkeeping.
             openSegment->isOpen = false;
             totalClosedSegmentBytes += openSegment->bytes;
@@ -549,24 +1390,39 @@ SegmentedLog::append(const std::vector<const Entry*>& entries)
             record.offset = openSegment->bytes;
         }
 
-        if (buf.getLength() > MAX_SEGMENT_SIZE) {
+        if (entryBytes > MAX_SEGMENT_SIZE) {
             WARNING("Trying to append an entry of %lu bytes when the maximum "
                     "segment size is %lu bytes. Placing this entry in its own "
                     "segment. Consider adjusting 'storageSegmentBytes' in the "
                     "config.",
-                    buf.getLength(),
+                    entryBytes,
                     MAX_SEGMENT_SIZE);
         }
 
+        termIndex.append(record.term);
         openSegment->entries.emplace_back(std::move(record));
-        openSegment->bytes += buf.getLength();
-        currentSync->ops.emplace_back(openSegmentFile.fd, Sync::Op::WRITE);
-        currentSync->ops.back().writeData = std::move(buf);
+        if (openSegment->version == 1) {
+            openSegment->entries.back().length = uint32_t(buf.getLength());
+            writeRecord(std::move(buf));
+        } else {
+            batch.push_back(std::move(buf));
+            batchBytes += entryBytes;
+        }
         ++openSegment->endIndex;
         ++index;
     }
+    if (!batch.empty()) {
+        openSegment->entries.at(openSegment->entries.size() -
+                                batch.size()).length = uint32_t(batchBytes);
+        writeRecord(serializeBatch(batch));
+    }
 
-    currentSync->ops.emplace_back(openSegmentFile.fd, Sync::Op::FDATASYNC);
+    // With direct I/O, the records are written when the Sync is taken, and
+    // O_DSYNC makes that write durable on its own.
+    if (!directIO) {
+        currentSync->ops.emplace_back(openSegmentFile.fd,
+                                      Sync::Op::FDATASYNC);
+    }
     currentSync->lastIndex = getLastLogIndex();
     checkInvariants();
     return {startIndex, getLastLogIndex()};
@@ -586,7 +1442,82 @@ SegmentedLog::getEntry(uint64_t index) const
     const Segment& segment = it->second;
     assert(segment.startIndex <= index);
     assert(index <= segment.endIndex);
-    return segment.entries.at(index - segment.startIndex).entry;
+    const Segment::Record& record = segment.entries.at(index -
+                                                       segment.startIndex);
+    if (!record.released)
+        return record.entry;
+    return readReleasedEntry(segment, index);
+}
+
+uint64_t
+SegmentedLog::getTerm(uint64_t index) const
+{
+    if (index < getLogStartIndex() ||
+        index > getLastLogIndex()) {
+        PANIC("Attempted to access entry %lu outside of log "
+              "(start index is %lu, last index is %lu)",
+              index, getLogStartIndex(), getLastLogIndex());
+    }
+    return termIndex.getTerm(index);
+}
+
+void
+SegmentedLog::prefetch(uint64_t startIndex, uint64_t bytes) const
+{
+    if (startIndex < getLogStartIndex() ||
+        startIndex > getLastLogIndex()) {
+        return;
+    }
+    auto it = segmentsByStartIndex.upper_bound(startIndex);
+    --it;
+    uint64_t index = startIndex;
+    while (bytes > 0 && it != segmentsByStartIndex.end()) {
+        const Segment& segment = it->second;
+        // Entries in the open segment and in closed segments that haven't
+        // been released are already in memory. Segments are released oldest
+        // first, so the rest of the log is in memory too.
+        if (segment.isOpen)
+            break;
+        const Segment::Record& record = segment.entries.at(index -
+                                                           segment.startIndex);
+        if (!record.released)
+            break;
+        uint64_t offset = record.offset;
+        uint64_t length = std::min(bytes, segment.bytes - offset);
+        if (!segment.contents) {
+            // Mapping the file (and reading a compressed segment's header)
+            // could block, and this runs with the caller's locks held. Just
+            // open the file long enough to pass the kernel the hint; the
+            // page cache keeps it after the file is closed. A compressed
+            // segment's block offsets aren't known yet, so read ahead from
+            // the start of the file, which is where the next batch usually
+            // begins when it crosses into a new segment.
+            FS::File file = FS::tryOpenFile(
+                segment.compressed ? archiveDir : dir,
+                segment.filename,
+                O_RDONLY);
+            if (file.fd >= 0)
+                FS::prefetch(file, segment.compressed ? 0 : offset, length);
+        } else if (segment.compressed) {
+            // Read ahead the compressed blocks spanning the range.
+            uint64_t numBlocks = segment.blockOffsets.size() - 1;
+            uint64_t firstBlock = std::min(offset / segment.blockBytes,
+                                           numBlocks - 1);
+            uint64_t lastBlock = std::min((offset + length - 1) /
+                                              segment.blockBytes,
+                                          numBlocks - 1);
+            uint64_t begin = segment.blockOffsets.at(firstBlock);
+            FS::prefetch(segment.file,
+                         begin,
+                         segment.blockOffsets.at(lastBlock + 1) - begin);
+        } else {
+            FS::prefetch(segment.file, offset, length);
+        }
+        bytes -= std::min(bytes, length);
+        ++it;
+        if (it != segmentsByStartIndex.end())
+            index = it->second.startIndex;
+    }
 }
 
 uint64_t
@@ -610,10 +1541,7 @@ SegmentedLog::getLastLogIndex() const
 std::string
 SegmentedLog::getName() const
 {
-    if (encoding == Encoding::BINARY)
-        return "Segmented-Binary";
-    else
-        return "Segmented-Text";
+    return getEncodingName(encoding);
 }
 
 uint64_t
@@ -625,9 +1553,12 @@ SegmentedLog::getSizeBytes() const
 std::unique_ptr<Log::Sync>
 SegmentedLog::takeSync()
 {
+    flushDirectIOBuffer();
     std::unique_ptr<SegmentedLog::Sync> other(
             new SegmentedLog::Sync(getLastLogIndex(),
-                                   diskWriteDurationThreshold));
+                                   diskWriteDurationThreshold,
+                                   ioUring.get(),
+                                   &metadataFiles));
     std::swap(other, currentSync);
     return std::move(other);
 }
@@ -635,8 +1566,17 @@ SegmentedLog::takeSync()
 void
 SegmentedLog::syncCompleteVirtual(std::unique_ptr<Log::Sync> sync)
 {
-    static_cast<SegmentedLog::Sync*>(sync.get())->
-        updateStats(filesystemOpsNanos);
+    SegmentedLog::Sync* segmentedSync =
+        static_cast<SegmentedLog::Sync*>(sync.get());
+    segmentedSync->updateStats(filesystemOpsNanos);
+    for (auto it = segmentedSync->recycledFilenames.begin();
+         it != segmentedSync->recycledFilenames.end();
+         ++it) {
+        preparedSegments.recycle(*it);
+    }
+    reclaimer.remove(segmentedSync->removedFilenames);
+    releaseEntries(sync->lastIndex);
+    compressColdSegments();
 }
 
 void
@@ -648,24 +1588,45 @@ SegmentedLog::truncatePrefix(uint64_t newStartIndex)
     NOTICE("Truncating log to start at index %lu (was %lu)",
            newStartIndex, logStartIndex);
     logStartIndex = newStartIndex;
-    // update metadata before removing files in case of interruption
-    updateMetadata();
+    termIndex.truncatePrefix(newStartIndex);
+    // The metadata is written before the files are removed, in case of
+    // interruption. The new start index doesn't need to reach the disk any
+    // sooner than that.
+    queueMetadataUpdate();
 
     while (!segmentsByStartIndex.empty()) {
         Segment& segment = segmentsByStartIndex.begin()->second;
         if (logStartIndex <= segment.endIndex)
             break;
-        NOTICE("Deleting unneeded segment %s (its end index is %lu)",
-               segment.filename.c_str(),
-               segment.endIndex);
-        currentSync->ops.emplace_back(dir.fd, Sync::Op::UNLINKAT);
-        currentSync->ops.back().filename1 = segment.filename;
         if (segment.isOpen) {
+            NOTICE("Deleting unneeded segment %s (its end index is %lu)",
+                   segment.filename.c_str(),
+                   segment.endIndex);
+            queueRemoval(segment.filename);
             currentSync->ops.emplace_back(openSegmentFile.release(),
                                           Sync::Op::CLOSE);
         } else {
+            // A compressed file can't be reused as an open segment, and one
+            // the compressor may be reading mustn't be overwritten.
+            if (!segment.compressed && !segment.compressing &&
+                preparedSegments.reserveRecycled()) {
+                NOTICE("Recycling unneeded segment %s (its end index is %lu)",
+                       segment.filename.c_str(),
+                       segment.endIndex);
+                currentSync->recycledFilenames.push_back(segment.filename);
+            } else {
+                NOTICE("Deleting unneeded segment %s (its end index is %lu)",
+                       segment.filename.c_str(),
+                       segment.endIndex);
+                queueRemoval(segment.filename);
+            }
+            queueRemoval(segment.makeIndexFilename());
             totalClosedSegmentBytes -= segment.bytes;
         }
+        // Freeing a segment's records can take a while, so let the
+        // reclaimer do it.
+        if (backgroundReclaim)
+            reclaimer.reclaim(std::move(segment));
         segmentsByStartIndex.erase(segmentsByStartIndex.begin());
     }
 
@@ -673,6 +1634,7 @@ SegmentedLog::truncatePrefix(uint64_t newStartIndex)
         openNewSegment();
     if (currentSync->lastIndex < logStartIndex - 1)
         currentSync->lastIndex = logStartIndex - 1;
+    trimEntryCache();
     checkInvariants();
 }
 
@@ -684,13 +1646,14 @@ SegmentedLog::truncateSuffix(uint64_t newEndIndex)
 
     NOTICE("Truncating log to end at index %lu (was %lu)",
            newEndIndex, getLastLogIndex());
+    termIndex.truncateSuffix(newEndIndex);
     { // Check if the open segment has some entries we need. If so,
       // just truncate that segment, open a new one, and return.
         Segment& openSegment = getOpenSegment();
         if (newEndIndex >= openSegment.startIndex) {
             // Update in-memory segment
             uint64_t i = newEndIndex + 1 - openSegment.startIndex;
-            openSegment.bytes = openSegment.entries.at(i).offset;
+            openSegment.bytes = openSegment.bytesToKeep(i);
             openSegment.entries.erase(
                 openSegment.entries.begin() + int64_t(i),
                 openSegment.entries.end());
@@ -703,6 +1666,15 @@ SegmentedLog::truncateSuffix(uint64_t newEndIndex)
         }
     }
 
+    // Make sure the compressor isn't reading any closed segment that's about
+    // to change.
+    if (compressSegments) {
+        compressor.waitUntilIdle();
+        std::vector<std::string> compressed = compressor.takeFinished();
+        for (auto it = compressed.begin(); it != compressed.end(); ++it)
+            finishCompression(*it);
+    }
+
     { // Remove the open segment.
         Segment& openSegment = getOpenSegment();
         openSegment.endIndex = openSegment.startIndex - 1;
@@ -718,14 +1690,28 @@ SegmentedLog::truncateSuffix(uint64_t newEndIndex)
             break;
         if (segment.startIndex > newEndIndex) { // remove segment
             NOTICE("Removing closed segment %s", segment.filename.c_str());
-            FS::removeFile(dir, segment.filename);
+            if (segment.compressed) {
+                FS::removeFile(archiveDir, segment.filename);
+                FS::fsync(archiveDir);
+                // Later segments may reuse this start index.
+                blockCache.clear();
+                blockCacheIndex.clear();
+            } else {
+                FS::removeFile(dir, segment.filename);
+            }
+            FS::removeFile(dir, segment.makeIndexFilename());
             FS::fsync(dir);
             totalClosedSegmentBytes -= segment.bytes;
             segmentsByStartIndex.erase(segment.startIndex);
         } else if (segment.endIndex > newEndIndex) { // truncate segment
+            if (segment.compressed)
+                decompressSegment(segment);
+            // The index no longer matches the segment.
+            FS::removeFile(dir, segment.makeIndexFilename());
+
             // Update in-memory segment
             uint64_t i = newEndIndex + 1 - segment.startIndex;
-            uint64_t newBytes = segment.entries.at(i).offset;
+            uint64_t newBytes = segment.bytesToKeep(i);
             totalClosedSegmentBytes -= (segment.bytes - newBytes);
             segment.bytes = newBytes;
             segment.entries.erase(
@@ -747,46 +1733,31 @@ SegmentedLog::truncateSuffix(uint64_t newEndIndex)
             FS::File f = FS::openFile(dir, segment.filename, O_WRONLY);
             FS::truncate(f, segment.bytes);
             FS::fsync(f);
+            segment.contents.reset();
+            segment.file.close();
+
+            writeIndex(segment);
+            FS::fsync(dir);
         }
     }
 
     // Reopen a segment (so that we can write again)
     openNewSegment();
+    trimEntryCache();
     checkInvariants();
 }
 
 void
 SegmentedLog::updateMetadata()
 {
-    if (Log::metadata.ByteSize() == 0)
-        metadata.clear_raft_metadata();
-    else
-        *metadata.mutable_raft_metadata() = Log::metadata;
-    metadata.set_format_version(1);
-    metadata.set_entries_start(logStartIndex);
-    metadata.set_version(metadata.version() + 1);
-    std::string filename;
-    if (metadata.version() % 2 == 1) {
-        filename = "metadata1";
-    } else {
-        filename = "metadata2";
-    }
-
     TimePoint start = Clock::now();
 
-    NOTICE("Writing new storage metadata (version %lu) to %s",
-           metadata.version(),
-           filename.c_str());
-    FS::File file = FS::openFile(dir, filename, O_CREAT|O_WRONLY|O_TRUNC);
-    Core::Buffer record = serializeProto(metadata);
-    ssize_t written = FS::write(file.fd,
-                                record.getData(),
-                                record.getLength());
-    if (written == -1) {
-        PANIC("Failed to write to %s: %s",
-              file.path.c_str(), strerror(errno));
-    }
-    FS::fsync(file);
+    Core::Buffer record = prepareMetadata();
+    NOTICE("Writing new storage metadata (version %lu)",
+           metadata.version());
+    bool written = metadataFiles.write(record, metadata.version());
+    assert(written);
+    (void) written;
 
     TimePoint end = Clock::now();
     std::chrono::nanoseconds elapsed = end - start;
@@ -809,6 +1780,20 @@ SegmentedLog::updateServerStats(Protocol::ServerStats& serverStats) const
     stats.set_metadata_version(metadata.version());
     metadataWriteNanos.updateProtoBuf(*stats.mutable_metadata_write_nanos());
     filesystemOpsNanos.updateProtoBuf(*stats.mutable_filesystem_ops_nanos());
+    stats.set_entry_cache_hits(entryCacheHits);
+    stats.set_entry_cache_misses(entryCacheMisses);
+    stats.set_entry_cache_entries(entryCache.size());
+    uint64_t numCompressed = 0;
+    for (auto it = segmentsByStartIndex.begin();
+         it != segmentsByStartIndex.end();
+         ++it) {
+        if (it->second.compressed)
+            ++numCompressed;
+    }
+    stats.set_num_compressed_segments(numCompressed);
+    stats.set_block_cache_hits(blockCacheHits);
+    stats.set_block_cache_misses(blockCacheMisses);
+    preparedSegments.updateServerStats(serverStats);
 }
 
 
@@ -822,16 +1807,35 @@ SegmentedLog::readSegmentFilenames()
     std::vector<std::string> filenames = FS::ls(dir);
     // sorting isn't strictly necessary, but it helps with unit tests
     std::sort(filenames.begin(), filenames.end());
+    // Compressed segments kept on another device are listed after the
+    // others, so that a segment's original file always comes before its
+    // compressed copy.
+    if (archiveDir.path != dir.path) {
+        std::vector<std::string> archived = FS::ls(archiveDir);
+        std::sort(archived.begin(), archived.end());
+        for (auto it = archived.begin(); it != archived.end(); ++it) {
+            if (Core::StringUtil::endsWith(*it, COMPRESSED_SEGMENT_SUFFIX)) {
+                filenames.push_back(*it);
+            } else {
+                WARNING("%s doesn't look like a compressed segment filename "
+                        "(from %s)",
+                        it->c_str(),
+                        (archiveDir.path + "/" + *it).c_str());
+            }
+        }
+    }
+    std::set<std::string> closedFilenames;
     for (auto it = filenames.begin(); it != filenames.end(); ++it) {
         const std::string& filename = *it;
         if (filename == "metadata1" ||
-            filename == "metadata2") {
+            filename == "metadata2" ||
+            Core::StringUtil::endsWith(filename, SEGMENT_INDEX_SUFFIX)) {
             continue;
         }
         Segment segment;
         segment.filename = filename;
         segment.bytes = 0;
-        { // Closed segment: xxx-yyy
+        { // Closed segment: xxx-yyy or xxx-yyy.z
             uint64_t startIndex = 1;
             uint64_t endIndex = 0;
             unsigned bytesConsumed;
@@ -843,7 +1847,27 @@ SegmentedLog::readSegmentFilenames()
                 segment.isOpen = false;
                 segment.startIndex = startIndex;
                 segment.endIndex = endIndex;
-                segments.push_back(segment);
+                segments.push_back(std::move(segment));
+                closedFilenames.insert(filename);
+                continue;
+            }
+            if (matched == 2 &&
+                filename.substr(bytesConsumed) == COMPRESSED_SEGMENT_SUFFIX) {
+                std::string original = filename.substr(0, bytesConsumed);
+                if (closedFilenames.count(original) > 0) {
+                    // The server must have stopped before switching over to
+                    // the compressed copy, so it may be incomplete.
+                    NOTICE("Removing compressed copy %s of segment %s",
+                           filename.c_str(), original.c_str());
+                    FS::removeFile(archiveDir, filename);
+                    FS::fsync(archiveDir);
+                    continue;
+                }
+                segment.isOpen = false;
+                segment.compressed = true;
+                segment.startIndex = startIndex;
+                segment.endIndex = endIndex;
+                segments.push_back(std::move(segment));
                 continue;
             }
         }
@@ -859,7 +1883,7 @@ SegmentedLog::readSegmentFilenames()
                 segment.isOpen = true;
                 segment.startIndex = ~0UL;
                 segment.endIndex = ~0UL - 1;
-                segments.push_back(segment);
+                segments.push_back(std::move(segment));
                 preparedSegments.foundFile(counter);
                 continue;
             }
@@ -911,22 +1935,39 @@ bool
 SegmentedLog::loadClosedSegment(Segment& segment, uint64_t logStartIndex)
 {
     assert(!segment.isOpen);
-    FS::File file = FS::openFile(dir, segment.filename, O_RDWR);
-    FS::FileContents reader(file);
+    FS::File file;
+    // For compressed segments, this holds as much of the original contents
+    // as has been needed so far, starting with just the first block.
+    std::string decompressed;
+    std::unique_ptr<FS::FileContents> reader;
+    uint64_t segmentBytes;
+    if (segment.compressed) {
+        segmentBytes = openCompressedSegment(segment);
+        file = FS::dup(segment.file);
+        if (segmentBytes > 0)
+            decompressed = decompressBlock(segment, 0);
+        reader.reset(new FS::FileContents(decompressed.data(),
+                                          decompressed.size(),
+                                          file.path));
+    } else {
+        file = FS::openFile(dir, segment.filename, O_RDWR);
+        reader.reset(new FS::FileContents(file));
+        segmentBytes = reader->getFileLength();
+    }
     uint64_t offset = 0;
 
-    if (reader.getFileLength() < 1) {
+    if (reader->getFileLength() < 1) {
         PANIC("Found completely empty segment file %s (it doesn't even have "
               "a version field)",
               segment.filename.c_str());
     } else {
-        uint8_t version = *reader.get<uint8_t>(0, 1);
+        segment.version = *reader->get<uint8_t>(0, 1);
         offset += 1;
-        if (version != 1) {
+        if (segment.version != 1 && segment.version != 2) {
             PANIC("Segment version read from %s was %u, but this code can "
-                  "only read version 1",
+                  "only read versions 1 and 2",
                   segment.filename.c_str(),
-                  version);
+                  segment.version);
         }
     }
 
@@ -936,21 +1977,59 @@ SegmentedLog::loadClosedSegment(Segment& segment, uint64_t logStartIndex)
                segment.endIndex,
                logStartIndex,
                segment.filename.c_str());
-        FS::removeFile(dir, segment.filename);
+        if (segment.compressed) {
+            FS::removeFile(archiveDir, segment.filename);
+            FS::fsync(archiveDir);
+        } else {
+            FS::removeFile(dir, segment.filename);
+        }
+        FS::removeFile(dir, segment.makeIndexFilename());
         FS::fsync(dir);
         return false;
     }
 
-    for (uint64_t index = segment.startIndex;
-         index <= segment.endIndex;
-         ++index) {
+    // When entries are going to be released anyway, the segment's index has
+    // everything needed, and the entries' checksums are verified as they're
+    // read back later.
+    if (maxCachedEntries > 0) {
+        if (readIndex(segment, segmentBytes)) {
+            segment.bytes = segmentBytes;
+            // Like other closed segments, this is reopened on demand.
+            segment.contents.reset();
+            segment.file.close();
+            return true;
+        }
+    }
+
+    // Otherwise, every entry is parsed out of the segment now.
+    if (segment.compressed) {
+        for (uint64_t block = 1;
+             block + 1 < segment.blockOffsets.size();
+             ++block) {
+            decompressed += decompressBlock(segment, block);
+        }
+        if (decompressed.size() != segmentBytes) {
+            PANIC("Compressed segment %s holds %lu bytes, but its header "
+                  "says %lu",
+                  segment.filename.c_str(),
+                  decompressed.size(),
+                  segmentBytes);
+        }
+        reader.reset(new FS::FileContents(decompressed.data(),
+                                          decompressed.size(),
+                                          file.path));
+    }
+
+    uint64_t index = segment.startIndex;
+    while (index <= segment.endIndex) {
         std::string error;
-        if (offset >= reader.getFileLength()) {
+        std::vector<Entry> entries;
+        uint64_t recordOffset = offset;
+        if (offset >= reader->getFileLength()) {
             error = "File too short";
         } else {
-            segment.entries.emplace_back(offset);
-            error = readProtoFromFile(file, reader, &offset,
-                                      &segment.entries.back().entry);
+            error = readEntries(segment.version, file, *reader, &offset,
+                                &entries);
         }
         if (!error.empty()) {
             PANIC("Could not read entry %lu in log segment %s "
@@ -961,22 +2040,84 @@ SegmentedLog::loadClosedSegment(Segment& segment, uint64_t logStartIndex)
                   offset,
                   error.c_str());
         }
+        // Entries in the last batch past the end index were truncated away,
+        // so they're skipped here.
+        for (uint64_t i = 0;
+             i < entries.size() && index <= segment.endIndex;
+             ++i, ++index) {
+            segment.entries.emplace_back(recordOffset);
+            Segment::Record& record = segment.entries.back();
+            record.term = entries.at(i).term();
+            record.length = (i == 0 ? uint32_t(offset - recordOffset) : 0);
+            record.type = uint32_t(entries.at(i).type());
+            if (maxCachedEntries == 0)
+                record.entry.Swap(&entries.at(i));
+            else
+                record.released = true;
+        }
     }
-    if (offset < reader.getFileLength()) {
+    if (offset < reader->getFileLength() && segment.compressed) {
+        // Segments are only compressed after they've been loaded, so this
+        // shouldn't happen. The extra bytes are never read.
+        WARNING("Found an extra %lu bytes at the end of compressed segment "
+                "%s. Ignoring them.",
+                reader->getFileLength() - offset,
+                segment.filename.c_str());
+    } else if (offset < reader->getFileLength()) {
         WARNING("Found an extra %lu bytes at the end of closed segment "
                 "%s. This can happen if the server crashed while "
                 "truncating the segment. Truncating these now.",
-                reader.getFileLength() - offset,
+                reader->getFileLength() - offset,
                 segment.filename.c_str());
         // TODO(ongaro): do we want to save these bytes somewhere?
         FS::truncate(file, offset);
         FS::fsync(file);
     }
     segment.bytes = offset;
-    totalClosedSegmentBytes += segment.bytes;
+    segment.contents.reset();
+    segment.file.close();
+    // Replace a missing or invalid index so the next startup can use it.
+    if (maxCachedEntries > 0) {
+        writeIndex(segment);
+        FS::fsync(dir);
+    }
     return true;
 }
 
+std::deque<bool>
+SegmentedLog::loadClosedSegments(std::vector<Segment>& segments,
+                                 uint64_t logStartIndex,
+                                 uint64_t numThreads)
+{
+    std::deque<bool> keep(segments.size(), false);
+    std::atomic<uint64_t> next(0);
+    auto loaderMain = [&]() {
+        while (true) {
+            uint64_t i = next.fetch_add(1);
+            if (i >= segments.size())
+                break;
+            if (!segments.at(i).isOpen)
+                keep.at(i) = loadClosedSegment(segments.at(i), logStartIndex);
+        }
+    };
+
+    uint64_t numClosed = uint64_t(std::count_if(
+        segments.begin(), segments.end(),
+        [](const Segment& segment) { return !segment.isOpen; }));
+    numThreads = std::max(std::min(numThreads, numClosed), 1UL);
+    std::vector<std::thread> loaders;
+    for (uint64_t i = 1; i < numThreads; ++i) {
+        loaders.emplace_back([&]() {
+            Core::ThreadId::setName("SegmentLoader");
+            loaderMain();
+        });
+    }
+    loaderMain();
+    for (auto it = loaders.begin(); it != loaders.end(); ++it)
+        it->join();
+    return keep;
+}
+
 bool
 SegmentedLog::loadOpenSegment(Segment& segment, uint64_t logStartIndex)
 {
@@ -990,26 +2131,27 @@ SegmentedLog::loadOpenSegment(Segment& segment, uint64_t logStartIndex)
                 "a version field)",
                 segment.filename.c_str());
     } else {
-        uint8_t version = *reader.get<uint8_t>(0, 1);
+        segment.version = *reader.get<uint8_t>(0, 1);
         offset += 1;
-        if (version != 1) {
+        if (segment.version != 1 && segment.version != 2) {
             PANIC("Segment version read from %s was %u, but this code can "
-                  "only read version 1",
+                  "only read versions 1 and 2",
                   segment.filename.c_str(),
-                  version);
+                  segment.version);
         }
     }
 
+    uint64_t firstIndex = 0;
     uint64_t lastIndex = 0;
     while (offset < reader.getFileLength()) {
-        segment.entries.emplace_back(offset);
-        std::string error = readProtoFromFile(
-                file,
-                reader,
-                &offset,
-                &segment.entries.back().entry);
+        std::vector<Entry> entries;
+        uint64_t recordOffset = offset;
+        std::string error = readEntries(segment.version,
+                                        file,
+                                        reader,
+                                        &offset,
+                                        &entries);
         if (!error.empty()) {
-            segment.entries.pop_back();
             uint64_t remainingBytes = reader.getFileLength() - offset;
             if (isAllZeros(reader.get(offset, remainingBytes),
                            remainingBytes)) {
@@ -1038,17 +2180,49 @@ SegmentedLog::loadOpenSegment(Segment& segment, uint64_t logStartIndex)
             FS::fsync(file);
             break;
         }
-        lastIndex = segment.entries.back().entry.index();
+        if (!segment.entries.empty() &&
+            entries.front().index() != lastIndex + 1) {
+            uint64_t remainingBytes = reader.getFileLength() - recordOffset;
+            NOTICE("Found stale entry %lu following entry %lu in log "
+                   "segment %s (%lu bytes into the segment), left over from "
+                   "before the file was recycled. Discarding the remainder "
+                   "of the file (%lu bytes).",
+                   entries.front().index(),
+                   lastIndex,
+                   segment.filename.c_str(),
+                   recordOffset,
+                   remainingBytes);
+            offset = recordOffset;
+            FS::truncate(file, offset);
+            FS::fsync(file);
+            break;
+        }
+        for (uint64_t i = 0; i < entries.size(); ++i) {
+            segment.entries.emplace_back(recordOffset);
+            Segment::Record& record = segment.entries.back();
+            record.term = entries.at(i).term();
+            record.length = (i == 0 ? uint32_t(offset - recordOffset) : 0);
+            record.type = uint32_t(entries.at(i).type());
+            if (segment.entries.size() == 1)
+                firstIndex = entries.at(i).index();
+            lastIndex = entries.at(i).index();
+            // This segment is about to be closed, so it may be released as
+            // well.
+            if (maxCachedEntries == 0)
+                record.entry.Swap(&entries.at(i));
+            else
+                record.released = true;
+        }
     }
 
     bool remove = false;
     if (segment.entries.empty()) {
         NOTICE("Removing empty segment: %s", segment.filename.c_str());
         remove = true;
-    } else if (segment.entries.back().entry.index() < logStartIndex) {
+    } else if (lastIndex < logStartIndex) {
         NOTICE("Removing open segment whose entries are no longer "
                "needed (last index is %lu but log start index is %lu): %s",
-               segment.entries.back().entry.index(),
+               lastIndex,
                logStartIndex,
                segment.filename.c_str());
         remove = true;
@@ -1059,14 +2233,14 @@ SegmentedLog::loadOpenSegment(Segment& segment, uint64_t logStartIndex)
         return false;
     } else {
         segment.bytes = offset;
-        totalClosedSegmentBytes += segment.bytes;
         segment.isOpen = false;
-        segment.startIndex = segment.entries.front().entry.index();
-        segment.endIndex = segment.entries.back().entry.index();
+        segment.startIndex = firstIndex;
+        segment.endIndex = lastIndex;
         std::string newFilename = segment.makeClosedFilename();
         NOTICE("Closing open segment %s, renaming to %s",
                 segment.filename.c_str(),
                 newFilename.c_str());
+        writeIndex(segment);
         FS::rename(dir, segment.filename,
                    dir, newFilename);
         FS::fsync(dir);
@@ -1076,6 +2250,103 @@ SegmentedLog::loadOpenSegment(Segment& segment, uint64_t logStartIndex)
 }
 
 
+bool
+SegmentedLog::readIndex(Segment& segment, uint64_t segmentBytes) const
+{
+    assert(!segment.isOpen);
+    assert(segment.entries.empty());
+    std::string filename = segment.makeIndexFilename();
+    FS::File file = FS::tryOpenFile(dir, filename, O_RDONLY);
+    if (file.fd == -1) {
+        NOTICE("No index found for segment %s (%s), scanning it instead",
+               segment.filename.c_str(), strerror(errno));
+        return false;
+    }
+    FS::FileContents reader(file);
+    SegmentedLogMetadata::SegmentIndex index;
+    uint64_t offset = 0;
+    std::string error = readProtoFromFile(file, reader, &offset, &index);
+    if (error.empty()) {
+        uint64_t numEntries = segment.endIndex + 1 - segment.startIndex;
+        uint64_t expectedOffset = sizeof(SegmentHeader);
+        if (uint64_t(index.offset_size()) != numEntries ||
+            uint64_t(index.length_size()) != numEntries ||
+            uint64_t(index.term_size()) != numEntries ||
+            uint64_t(index.type_size()) != numEntries) {
+            error = "Wrong number of entries";
+        } else {
+            for (int i = 0; i < index.offset_size(); ++i) {
+                // Later entries in a batch share its offset.
+                if (i > 0 && index.offset(i) == index.offset(i - 1)) {
+                    if (index.length(i) != 0) {
+                        error = format("Entry %d is in a batch but has "
+                                       "length %u", i, index.length(i));
+                        break;
+                    }
+                    continue;
+                }
+                if (index.offset(i) != expectedOffset) {
+                    error = format("Entry %d is at offset %lu, expected %lu",
+                                   i, index.offset(i), expectedOffset);
+                    break;
+                }
+                expectedOffset += index.length(i);
+            }
+            if (error.empty() && expectedOffset != segmentBytes) {
+                error = format("Index covers %lu bytes but segment has %lu",
+                               expectedOffset, segmentBytes);
+            }
+        }
+    }
+    if (!error.empty()) {
+        WARNING("Ignoring invalid index %s for segment %s: %s",
+                filename.c_str(),
+                segment.filename.c_str(),
+                error.c_str());
+        return false;
+    }
+
+    for (int i = 0; i < index.offset_size(); ++i) {
+        segment.entries.emplace_back(index.offset(i));
+        Segment::Record& record = segment.entries.back();
+        record.length = index.length(i);
+        record.term = index.term(i);
+        record.type = index.type(i);
+        record.released = true;
+    }
+    return true;
+}
+
+void
+SegmentedLog::removeOrphanIndexes()
+{
+    std::vector<std::string> filenames = FS::ls(dir);
+    bool removed = false;
+    for (auto it = filenames.begin(); it != filenames.end(); ++it) {
+        const std::string& filename = *it;
+        if (!Core::StringUtil::endsWith(filename, SEGMENT_INDEX_SUFFIX))
+            continue;
+        bool found = false;
+        uint64_t startIndex = 1;
+        uint64_t endIndex = 0;
+        if (sscanf(filename.c_str(), CLOSED_SEGMENT_FORMAT,
+                   &startIndex, &endIndex) == 2) {
+            auto segmentIt = segmentsByStartIndex.find(startIndex);
+            found = (segmentIt != segmentsByStartIndex.end() &&
+                     segmentIt->second.makeIndexFilename() == filename);
+        }
+        if (!found) {
+            NOTICE("Removing index file with no matching segment: %s",
+                   filename.c_str());
+            FS::removeFile(dir, filename);
+            removed = true;
+        }
+    }
+    if (removed)
+        FS::fsync(dir);
+}
+
+
 ////////// SegmentedLog normal operation helper functions //////////
 
 
@@ -1103,10 +2374,21 @@ SegmentedLog::checkInvariants()
                segment.endIndex + 1 - segment.startIndex);
         uint64_t lastOffset = 0;
         for (uint64_t i = 0; i < segment.entries.size(); ++i) {
-            assert(segment.entries.at(i).entry.index() ==
-                   segment.startIndex + i);
+            const Segment::Record& record = segment.entries.at(i);
+            if (segment.startIndex + i >= logStartIndex)
+                assert(termIndex.getTerm(segment.startIndex + i) ==
+                       record.term);
+            if (!record.released) {
+                assert(record.entry.index() == segment.startIndex + i);
+                assert(record.entry.term() == record.term);
+            } else {
+                assert(!segment.isOpen);
+                assert(maxCachedEntries > 0);
+            }
             if (i == 0)
                 assert(segment.entries.at(0).offset == sizeof(SegmentHeader));
+            else if (segment.entries.at(i).offset == lastOffset)
+                assert(segment.version != 1 && record.length == 0);
             else
                 assert(segment.entries.at(i).offset > lastOffset);
             lastOffset = segment.entries.at(i).offset;
@@ -1115,6 +2397,7 @@ SegmentedLog::checkInvariants()
             assert(segment.isOpen);
             assert(segment.endIndex >= segment.startIndex - 1);
             assert(Core::StringUtil::startsWith(segment.filename, "open-"));
+            assert(!segment.compressed);
             assert(segment.bytes >= sizeof(SegmentHeader));
         } else {
             assert(!segment.isOpen);
@@ -1122,10 +2405,17 @@ SegmentedLog::checkInvariants()
             assert(next->second.startIndex == segment.endIndex + 1);
             assert(segment.bytes > sizeof(SegmentHeader));
             closedBytes += segment.bytes;
-            assert(segment.filename == segment.makeClosedFilename());
+            if (segment.compressed) {
+                assert(segment.filename == segment.makeClosedFilename() +
+                                           COMPRESSED_SEGMENT_SUFFIX);
+            } else {
+                assert(segment.filename == segment.makeClosedFilename());
+            }
         }
     }
     assert(closedBytes == totalClosedSegmentBytes);
+    assert(termIndex.getLogStartIndex() == logStartIndex);
+    assert(termIndex.getLastLogIndex() == getLastLogIndex());
 #endif /* DEBUG */
 }
 
@@ -1159,6 +2449,7 @@ SegmentedLog::closeSegment()
     NOTICE("Closing segment (was %s, renaming to %s)",
            openSegment.filename.c_str(),
            newFilename.c_str());
+    writeIndex(openSegment);
     FS::rename(dir, openSegment.filename,
                dir, newFilename);
     FS::fsync(dir);
@@ -1182,6 +2473,30 @@ SegmentedLog::getOpenSegment() const
     return segmentsByStartIndex.rbegin()->second;
 }
 
+Core::Buffer
+SegmentedLog::prepareMetadata()
+{
+    if (Log::metadata.ByteSize() == 0)
+        metadata.clear_raft_metadata();
+    else
+        *metadata.mutable_raft_metadata() = Log::metadata;
+    metadata.set_format_version(1);
+    metadata.set_entries_start(logStartIndex);
+    metadata.set_version(metadata.version() + 1);
+    return serializeProto(metadata);
+}
+
+void
+SegmentedLog::queueMetadataUpdate()
+{
+    NOTICE("Queuing new storage metadata (version %lu)",
+           metadata.version() + 1);
+    currentSync->ops.emplace_back(-1, Sync::Op::METADATA);
+    Sync::Op& op = currentSync->ops.back();
+    op.writeData.push_back(prepareMetadata());
+    op.size = metadata.version();
+}
+
 void
 SegmentedLog::openNewSegment()
 {
@@ -1193,13 +2508,211 @@ SegmentedLog::openNewSegment()
     newSegment.isOpen = true;
     newSegment.startIndex = getLastLogIndex() + 1;
     newSegment.endIndex = newSegment.startIndex - 1;
+    newSegment.version = uint8_t(segmentVersion);
     newSegment.bytes = sizeof(SegmentHeader);
     // This can throw ThreadInterruptedException, but it shouldn't ever, since
     // this class shouldn't have been destroyed yet.
     auto s = preparedSegments.waitForOpenSegment();
     newSegment.filename = s.first;
     openSegmentFile = std::move(s.second);
-    segmentsByStartIndex.insert({newSegment.startIndex, newSegment});
+    if (directIO) {
+        // The header was written through the page cache when the file was
+        // prepared; reopen the file to write the rest directly.
+        int flags = O_RDWR|O_DIRECT|(FS::skipFsync ? 0 : O_DSYNC);
+        int fd = openat(dir.fd, newSegment.filename.c_str(), flags);
+        if (fd >= 0) {
+            openSegmentFile = FS::File(fd, openSegmentFile.path);
+        } else if (errno == EINVAL) {
+            WARNING("The filesystem containing %s does not support "
+                    "O_DIRECT. Writing log segments through the page cache "
+                    "instead.",
+                    dir.path.c_str());
+            directIO = false;
+        } else {
+            PANIC("Could not reopen %s with O_DIRECT: %s",
+                  openSegmentFile.path.c_str(), strerror(errno));
+        }
+    }
+    if (directIO) {
+        SegmentHeader header;
+        header.version = uint8_t(segmentVersion);
+        directIOBuffer.assign(reinterpret_cast<const char*>(&header),
+                              sizeof(header));
+        directIOBufferOffset = 0;
+        directIOBufferDirty = false;
+    }
+    segmentsByStartIndex.insert({newSegment.startIndex,
+                                 std::move(newSegment)});
+}
+
+void
+SegmentedLog::flushDirectIOBuffer()
+{
+    if (!directIOBufferDirty)
+        return;
+    uint64_t length = ((directIOBuffer.size() + directIOAlignment - 1) &
+                       ~(directIOAlignment - 1));
+    void* data = NULL;
+    int errnum = posix_memalign(&data, directIOAlignment, length);
+    if (errnum != 0) {
+        PANIC("Could not allocate %lu bytes for direct I/O: %s",
+              length, strerror(errnum));
+    }
+    memcpy(data, directIOBuffer.data(), directIOBuffer.size());
+    memset(static_cast<char*>(data) + directIOBuffer.size(), 0,
+           length - directIOBuffer.size());
+    currentSync->ops.emplace_back(openSegmentFile.fd, Sync::Op::WRITE);
+    currentSync->ops.back().writeData.emplace_back(data, length, free);
+    currentSync->ops.back().offset = int64_t(directIOBufferOffset);
+
+    // Keep the last partial block; the next write starts with it.
+    uint64_t fullBytes = directIOBuffer.size() & ~(directIOAlignment - 1);
+    directIOBuffer.erase(0, fullBytes);
+    directIOBufferOffset += fullBytes;
+    directIOBufferDirty = false;
+}
+
+const SegmentedLog::Entry&
+SegmentedLog::readReleasedEntry(const Segment& segment, uint64_t index) const
+{
+    auto it = entryCacheIndex.find(index);
+    if (it != entryCacheIndex.end()) {
+        ++entryCacheHits;
+        entryCache.splice(entryCache.begin(), entryCache, it->second);
+        return it->second->second;
+    }
+
+    ++entryCacheMisses;
+    assert(!segment.isOpen);
+    // Find the entry's position within its record.
+    uint64_t i = index - segment.startIndex;
+    uint64_t offset = segment.entries.at(i).offset;
+    uint64_t first = i;
+    while (first > 0 && segment.entries.at(first - 1).offset == offset)
+        --first;
+    std::vector<Entry> entries;
+    std::string error;
+    if (segment.compressed) {
+        // Decompress just the record, and parse it from memory.
+        std::string record = readCompressed(segment, offset,
+                                            segment.entries.at(first).length);
+        FS::FileContents reader(record.data(), record.size(),
+                                segment.file.path);
+        uint64_t recordOffset = 0;
+        error = readEntries(segment.version,
+                            segment.file,
+                            reader,
+                            &recordOffset,
+                            &entries);
+    } else {
+        openReleasedSegment(segment);
+        error = readEntries(segment.version,
+                            segment.file,
+                            *segment.contents,
+                            &offset,
+                            &entries);
+    }
+    if (error.empty() && entries.size() <= i - first)
+        error = format("Record has only %lu entries", entries.size());
+    if (!error.empty()) {
+        PANIC("Could not re-read entry %lu in log segment %s "
+              "(offset %lu bytes). The file must have been modified after "
+              "it was loaded. Error was: %s",
+              index,
+              segment.filename.c_str(),
+              offset,
+              error.c_str());
+    }
+    entryCache.emplace_front(index, Entry());
+    entryCache.front().second.Swap(&entries.at(i - first));
+    entryCacheIndex[index] = entryCache.begin();
+    while (entryCache.size() > maxCachedEntries) {
+        entryCacheIndex.erase(entryCache.back().first);
+        entryCache.pop_back();
+    }
+    return entryCache.front().second;
+}
+
+void
+SegmentedLog::openReleasedSegment(const Segment& segment) const
+{
+    assert(!segment.isOpen);
+    auto it = mappedSegmentsIndex.find(segment.startIndex);
+    if (it != mappedSegmentsIndex.end())
+        mappedSegments.erase(it->second);
+    mappedSegments.push_front(segment.startIndex);
+    mappedSegmentsIndex[segment.startIndex] = mappedSegments.begin();
+    if (segment.contents)
+        return;
+    if (segment.compressed) {
+        openCompressedSegment(segment);
+    } else {
+        segment.file = FS::openFile(dir, segment.filename, O_RDONLY);
+        segment.contents.reset(new FS::FileContents(segment.file));
+    }
+    while (mappedSegments.size() > maxMappedSegments) {
+        uint64_t startIndex = mappedSegments.back();
+        mappedSegmentsIndex.erase(startIndex);
+        mappedSegments.pop_back();
+        auto victim = segmentsByStartIndex.find(startIndex);
+        if (victim != segmentsByStartIndex.end() &&
+            !victim->second.isOpen) {
+            victim->second.contents.reset();
+            victim->second.file.close();
+        }
+    }
+}
+
+void
+SegmentedLog::releaseEntries(uint64_t syncedIndex)
+{
+    if (maxCachedEntries == 0)
+        return;
+    // Segments are released in order, so walk backwards from the newest
+    // closed segment until reaching one that was released earlier.
+    for (auto it = segmentsByStartIndex.rbegin();
+         it != segmentsByStartIndex.rend();
+         ++it) {
+        Segment& segment = it->second;
+        if (segment.isOpen || segment.endIndex >= syncedIndex)
+            continue;
+        if (segment.entries.front().released)
+            break;
+        for (auto rit = segment.entries.begin();
+             rit != segment.entries.end();
+             ++rit) {
+            // Swapping with an empty entry frees the entry's strings, which
+            // Clear() would keep allocated.
+            Entry().Swap(&rit->entry);
+            rit->released = true;
+        }
+    }
+}
+
+void
+SegmentedLog::trimEntryCache()
+{
+    uint64_t lastLogIndex = getLastLogIndex();
+    auto it = entryCache.begin();
+    while (it != entryCache.end()) {
+        if (it->first < logStartIndex || it->first > lastLogIndex) {
+            entryCacheIndex.erase(it->first);
+            it = entryCache.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    auto mit = mappedSegments.begin();
+    while (mit != mappedSegments.end()) {
+        auto segmentIt = segmentsByStartIndex.find(*mit);
+        if (segmentIt == segmentsByStartIndex.end() ||
+            segmentIt->second.isOpen) {
+            mappedSegmentsIndex.erase(*mit);
+            mit = mappedSegments.erase(mit);
+        } else {
+            ++mit;
+        }
+    }
 }
 
 std::string
@@ -1240,10 +2753,95 @@ SegmentedLog::readProtoFromFile(const FS::File& file,
     const void* data = reader.get(loffset, dataLen);
     loffset += dataLen;
 
+    error = parseProto(file, data, dataLen, out);
+    if (!error.empty())
+        return error;
+    *offset = loffset;
+    return "";
+}
+
+std::string
+SegmentedLog::readEntries(uint8_t version,
+                          const FS::File& file,
+                          FS::FileContents& reader,
+                          uint64_t* offset,
+                          std::vector<Entry>* out) const
+{
+    if (version == 1) {
+        out->emplace_back();
+        std::string error = readProtoFromFile(file, reader, offset,
+                                              &out->back());
+        if (!error.empty())
+            out->clear();
+        return error;
+    }
+
+    uint64_t loffset = *offset;
+    char checksum[Core::Checksum::MAX_LENGTH];
+    uint64_t bytesRead = reader.copyPartial(loffset, checksum,
+                                            sizeof(checksum));
+    uint32_t checksumBytes = Core::Checksum::length(checksum,
+                                                    uint32_t(bytesRead));
+    if (checksumBytes == 0)
+        return format("Missing checksum in file %s", file.path.c_str());
+    loffset += checksumBytes;
+
+    uint32_t count;
+    if (reader.copyPartial(loffset, &count, sizeof(count)) < sizeof(count))
+        return format("Batch count truncated in file %s", file.path.c_str());
+    count = be32toh(count);
+    if (count == 0)
+        return format("Empty batch in file %s", file.path.c_str());
+    uint64_t headerLen = sizeof(count) + sizeof(uint32_t) * uint64_t(count);
+    if (reader.getFileLength() < loffset + headerLen) {
+        return format("Batch lengths truncated in file %s",
+                      file.path.c_str());
+    }
+    std::vector<uint32_t> lengths(count);
+    reader.copy(loffset + sizeof(count), lengths.data(),
+                headerLen - sizeof(count));
+    uint64_t dataLen = 0;
+    for (auto it = lengths.begin(); it != lengths.end(); ++it) {
+        *it = be32toh(*it);
+        dataLen += *it;
+    }
+    if (reader.getFileLength() < loffset + headerLen + dataLen)
+        return format("Batch truncated in file %s", file.path.c_str());
+
+    const void* checksumCoverage = reader.get(loffset, headerLen + dataLen);
+    std::string error = Core::Checksum::verify(checksum, checksumCoverage,
+                                               headerLen + dataLen);
+    if (!error.empty()) {
+        return format("Checksum verification failure on %s: %s",
+                      file.path.c_str(), error.c_str());
+    }
+    loffset += headerLen;
+
+    out->resize(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t length = lengths.at(i);
+        error = parseProto(file, reader.get(loffset, length), length,
+                           &out->at(i));
+        if (!error.empty()) {
+            out->clear();
+            return error;
+        }
+        loffset += length;
+    }
+    *offset = loffset;
+    return "";
+}
+
+std::string
+SegmentedLog::parseProto(const FS::File& file,
+                         const void* data,
+                         uint64_t length,
+                         google::protobuf::Message* out) const
+{
     switch (encoding) {
         case SegmentedLog::Encoding::BINARY: {
             Core::Buffer contents(const_cast<void*>(data),
-                                  dataLen,
+                                  length,
                                   NULL);
             if (!Core::ProtoBuf::parse(contents, *out)) {
                 return format("Failed to parse protobuf in %s",
@@ -1252,37 +2850,180 @@ SegmentedLog::readProtoFromFile(const FS::File& file,
             break;
         }
         case SegmentedLog::Encoding::TEXT: {
-            std::string contents(static_cast<const char*>(data), dataLen);
+            std::string contents(static_cast<const char*>(data), length);
             Core::ProtoBuf::Internal::fromString(contents, *out);
             break;
         }
+        case SegmentedLog::Encoding::RAW: {
+            if (out->GetDescriptor() == Entry::descriptor()) {
+                if (!parseRawEntry(data, length,
+                                   static_cast<Entry*>(out))) {
+                    return format("Failed to parse raw entry in %s",
+                                  file.path.c_str());
+                }
+            } else {
+                Core::Buffer contents(const_cast<void*>(data),
+                                      length,
+                                      NULL);
+                if (!Core::ProtoBuf::parse(contents, *out)) {
+                    return format("Failed to parse protobuf in %s",
+                                  file.path.c_str());
+                }
+            }
+            break;
+        }
     }
-    *offset = loffset;
     return "";
 }
 
 Core::Buffer
-SegmentedLog::serializeProto(const google::protobuf::Message& in) const
+SegmentedLog::encodeRawEntry(const Entry& entry)
 {
-    // TODO(ongaro): can the intermediate buffer be avoided?
-    const void* data = NULL;
-    uint64_t len = 0;
-    Core::Buffer binaryContents;
-    std::string asciiContents;
+    RawEntryHeader header;
+    header.index = htole64(entry.index());
+    header.term = htole64(entry.term());
+    header.clusterTime = htole64(entry.cluster_time());
+    header.type = htole16(uint16_t(entry.type()));
+    uint16_t flags = 0;
+    if (entry.has_type())
+        flags |= RawEntryHeader::HAS_TYPE;
+    if (entry.has_cluster_time())
+        flags |= RawEntryHeader::HAS_CLUSTER_TIME;
+    std::string configuration;
+    const std::string* payload = &configuration;
+    if (entry.has_data()) {
+        flags |= RawEntryHeader::DATA;
+        payload = &entry.data();
+    } else if (entry.has_configuration()) {
+        flags |= RawEntryHeader::CONFIGURATION;
+        entry.configuration().SerializeToString(&configuration);
+    }
+    header.flags = htole16(flags);
+    header.length = htole32(uint32_t(payload->length()));
+
+    uint64_t totalLen = sizeof(header) + payload->length();
+    char* buf = new char[totalLen];
+    Core::Util::memcpy(buf, {
+        {&header, sizeof(header)},
+        {payload->data(), payload->length()},
+    });
+    return Core::Buffer(buf, totalLen, Core::Buffer::deleteArrayFn<char>);
+}
+
+bool
+SegmentedLog::parseRawEntry(const void* data,
+                            uint64_t length,
+                            Entry* out)
+{
+    RawEntryHeader header;
+    if (length < sizeof(header))
+        return false;
+    memcpy(&header, data, sizeof(header));
+    uint64_t payloadLen = le32toh(header.length);
+    if (length != sizeof(header) + payloadLen)
+        return false;
+    const char* payload = static_cast<const char*>(data) + sizeof(header);
+    uint16_t flags = le16toh(header.flags);
+
+    out->set_index(le64toh(header.index));
+    out->set_term(le64toh(header.term));
+    if (flags & RawEntryHeader::HAS_CLUSTER_TIME)
+        out->set_cluster_time(le64toh(header.clusterTime));
+    if (flags & RawEntryHeader::HAS_TYPE) {
+        uint16_t type = le16toh(header.type);
+        if (!Raft::Protocol::EntryType_IsValid(type))
+            return false;
+        out->set_type(Raft::Protocol::EntryType(type));
+    }
+    switch (flags & ~(RawEntryHeader::HAS_TYPE |
+                      RawEntryHeader::HAS_CLUSTER_TIME)) {
+        case 0:
+            return payloadLen == 0;
+        case RawEntryHeader::DATA:
+            out->set_data(payload, payloadLen);
+            return true;
+        case RawEntryHeader::CONFIGURATION: {
+            Core::Buffer contents(const_cast<char*>(payload),
+                                  payloadLen,
+                                  NULL);
+            return Core::ProtoBuf::parse(contents,
+                                         *out->mutable_configuration());
+        }
+        default:
+            return false;
+    }
+}
+
+Core::Buffer
+SegmentedLog::serializeIndex(const Segment& segment) const
+{
+    SegmentedLogMetadata::SegmentIndex index;
+    for (auto it = segment.entries.begin();
+         it != segment.entries.end();
+         ++it) {
+        index.add_offset(it->offset);
+        index.add_length(it->length);
+        index.add_term(it->term);
+        index.add_type(it->type);
+    }
+    return serializeProto(index);
+}
+
+void
+SegmentedLog::writeIndex(const Segment& segment) const
+{
+    // Index files are only read when entries are released (see readIndex()),
+    // so don't spend a write and an fdatasync on them otherwise.
+    if (maxCachedEntries == 0)
+        return;
+    FS::File file = FS::openFile(dir, segment.makeIndexFilename(),
+                                 O_CREAT|O_WRONLY|O_TRUNC);
+    Core::Buffer record = serializeIndex(segment);
+    ssize_t written = FS::write(file.fd,
+                                record.getData(),
+                                record.getLength());
+    if (written == -1) {
+        PANIC("Failed to write to %s: %s",
+              file.path.c_str(), strerror(errno));
+    }
+    FS::fdatasync(file);
+}
+
+Core::Buffer
+SegmentedLog::encodeProto(const google::protobuf::Message& in) const
+{
+    Core::Buffer contents;
     switch (encoding) {
         case SegmentedLog::Encoding::BINARY: {
-            Core::ProtoBuf::serialize(in, binaryContents);
-            data = binaryContents.getData();
-            len = binaryContents.getLength();
+            Core::ProtoBuf::serialize(in, contents);
             break;
         }
         case SegmentedLog::Encoding::TEXT: {
-            asciiContents = Core::ProtoBuf::dumpString(in);
-            data = asciiContents.data();
-            len = asciiContents.length();
+            std::string ascii = Core::ProtoBuf::dumpString(in);
+            char* buf = new char[ascii.length()];
+            memcpy(buf, ascii.data(), ascii.length());
+            contents.setData(buf, ascii.length(),
+                             Core::Buffer::deleteArrayFn<char>);
+            break;
+        }
+        case SegmentedLog::Encoding::RAW: {
+            if (in.GetDescriptor() == Entry::descriptor())
+                contents = encodeRawEntry(static_cast<const Entry&>(in));
+            else
+                Core::ProtoBuf::serialize(in, contents);
             break;
         }
     }
+    return contents;
+}
+
+Core::Buffer
+SegmentedLog::serializeProto(const google::protobuf::Message& in) const
+{
+    // TODO(ongaro): can the intermediate buffer be avoided?
+    Core::Buffer contents = encodeProto(in);
+    const void* data = contents.getData();
+    uint64_t len = contents.getLength();
     uint64_t netLen = htobe64(len);
     char checksum[Core::Checksum::MAX_LENGTH];
     uint32_t checksumLen = Core::Checksum::calculate(
@@ -1306,6 +3047,374 @@ SegmentedLog::serializeProto(const google::protobuf::Message& in) const
     return record;
 }
 
+Core::Buffer
+SegmentedLog::serializeBatch(const std::vector<Core::Buffer>& entries) const
+{
+    uint64_t coveredLen = sizeof(uint32_t) * (entries.size() + 1);
+    for (auto it = entries.begin(); it != entries.end(); ++it)
+        coveredLen += it->getLength();
+    uint64_t totalLen = checksumLength + coveredLen;
+    char* buf = new char[totalLen];
+    Core::Buffer record(
+        buf,
+        totalLen,
+        Core::Buffer::deleteArrayFn<char>);
+
+    // Lay out everything after the checksum first, since the checksum
+    // covers it.
+    char* covered = buf + checksumLength;
+    char* p = covered;
+    uint32_t netCount = htobe32(uint32_t(entries.size()));
+    memcpy(p, &netCount, sizeof(netCount));
+    p += sizeof(netCount);
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        uint32_t netLen = htobe32(uint32_t(it->getLength()));
+        memcpy(p, &netLen, sizeof(netLen));
+        p += sizeof(netLen);
+    }
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        memcpy(p, it->getData(), it->getLength());
+        p += it->getLength();
+    }
+    char checksum[Core::Checksum::MAX_LENGTH];
+    uint32_t checksumLen = Core::Checksum::calculate(
+        checksumAlgorithm.c_str(), covered, coveredLen, checksum);
+    assert(checksumLen == checksumLength);
+    memcpy(buf, checksum, checksumLen);
+    return record;
+}
+
+void
+SegmentedLog::writeRecord(Core::Buffer record)
+{
+    getOpenSegment().bytes += record.getLength();
+    if (directIO) {
+        directIOBuffer.append(static_cast<const char*>(record.getData()),
+                              record.getLength());
+        directIOBufferDirty = true;
+    } else {
+        currentSync->ops.emplace_back(openSegmentFile.fd, Sync::Op::WRITE);
+        currentSync->ops.back().writeData.push_back(std::move(record));
+    }
+}
+
+
+////////// SegmentedLog compressed segment functions //////////
+
+void
+SegmentedLog::compressColdSegments()
+{
+    if (!compressSegments)
+        return;
+    std::vector<std::string> compressed = compressor.takeFinished();
+    for (auto it = compressed.begin(); it != compressed.end(); ++it)
+        finishCompression(*it);
+
+    // Walk backwards past the hot segments. Older segments are queued as
+    // they go cold, so this stops at the first compressed one.
+    uint64_t numClosed = 0;
+    for (auto it = segmentsByStartIndex.rbegin();
+         it != segmentsByStartIndex.rend();
+         ++it) {
+        Segment& segment = it->second;
+        if (segment.isOpen)
+            continue;
+        ++numClosed;
+        if (numClosed <= hotSegments || segment.compressing)
+            continue;
+        if (segment.compressed)
+            break;
+        segment.compressing = true;
+        compressor.compress(segment.filename);
+    }
+}
+
+void
+SegmentedLog::finishCompression(const std::string& filename)
+{
+    std::string compressedFilename = filename + COMPRESSED_SEGMENT_SUFFIX;
+    uint64_t startIndex = 1;
+    uint64_t endIndex = 0;
+    sscanf(filename.c_str(), CLOSED_SEGMENT_FORMAT,
+           &startIndex, &endIndex);
+    auto it = segmentsByStartIndex.find(startIndex);
+    if (it == segmentsByStartIndex.end() ||
+        it->second.filename != filename) {
+        NOTICE("Removing compressed copy %s of a segment that's no longer "
+               "in the log",
+               compressedFilename.c_str());
+        FS::removeFile(archiveDir, compressedFilename);
+        FS::fsync(archiveDir);
+        if (it != segmentsByStartIndex.end())
+            it->second.compressing = false;
+        return;
+    }
+
+    Segment& segment = it->second;
+    assert(!segment.isOpen);
+    assert(!segment.compressed);
+    NOTICE("Switching segment %s over to its compressed copy",
+           filename.c_str());
+    segment.compressed = true;
+    segment.compressing = false;
+    segment.filename = compressedFilename;
+    segment.contents.reset();
+    segment.file.close();
+    // The compressed copy is already on disk, so the original can go any
+    // time. If it's still around after a crash, it'll be used instead.
+    if (backgroundReclaim)
+        reclaimer.remove({filename});
+    else
+        FS::removeFile(dir, filename);
+}
+
+void
+SegmentedLog::decompressSegment(Segment& segment)
+{
+    assert(segment.compressed);
+    TimePoint start = Clock::now();
+    uint64_t segmentBytes = openCompressedSegment(segment);
+    std::string filename = segment.makeClosedFilename();
+    NOTICE("Decompressing segment %s back into %s",
+           segment.filename.c_str(),
+           filename.c_str());
+    // The reclaimer might still be about to remove the original file.
+    if (backgroundReclaim)
+        reclaimer.waitUntilIdle();
+
+    FS::File file = FS::openFile(dir, filename, O_CREAT|O_WRONLY|O_TRUNC);
+    uint64_t written = 0;
+    for (uint64_t block = 0;
+         block + 1 < segment.blockOffsets.size();
+         ++block) {
+        std::string data = decompressBlock(segment, block);
+        if (FS::write(file.fd, data.data(), data.size()) == -1) {
+            PANIC("Failed to write to %s: %s",
+                  file.path.c_str(), strerror(errno));
+        }
+        written += data.size();
+    }
+    if (written != segmentBytes) {
+        PANIC("Compressed segment %s holds %lu bytes, but its header says "
+              "%lu",
+              segment.filename.c_str(),
+              written,
+              segmentBytes);
+    }
+    FS::fsync(file);
+    FS::fsync(dir);
+    FS::removeFile(archiveDir, segment.filename);
+    FS::fsync(archiveDir);
+
+    segment.compressed = false;
+    segment.filename = filename;
+    segment.contents.reset();
+    segment.file.close();
+    segment.blockOffsets.clear();
+    blockCache.clear();
+    blockCacheIndex.clear();
+
+    TimePoint end = Clock::now();
+    std::chrono::nanoseconds elapsed = end - start;
+    if (elapsed > diskWriteDurationThreshold) {
+        WARNING("Decompressing segment took longer than expected (%s)",
+                Core::StringUtil::toString(elapsed).c_str());
+    }
+}
+
+uint64_t
+SegmentedLog::openCompressedSegment(const Segment& segment) const
+{
+    assert(segment.compressed);
+    segment.contents.reset();
+    segment.file = FS::openFile(archiveDir, segment.filename, O_RDONLY);
+    segment.contents.reset(new FS::FileContents(segment.file));
+    SegmentedLogMetadata::CompressedSegment header;
+    uint64_t offset = 0;
+    std::string error = readProtoFromFile(segment.file, *segment.contents,
+                                          &offset, &header);
+    if (error.empty() && header.block_bytes() == 0)
+        error = "Block size is 0";
+    if (error.empty()) {
+        uint64_t numBlocks = ((header.segment_bytes() +
+                               header.block_bytes() - 1) /
+                              header.block_bytes());
+        if (uint64_t(header.block_length_size()) != numBlocks) {
+            error = format("Found %d blocks, expected %lu",
+                           header.block_length_size(), numBlocks);
+        }
+    }
+    if (error.empty()) {
+        segment.blockBytes = header.block_bytes();
+        segment.blockOffsets.clear();
+        segment.blockOffsets.push_back(offset);
+        for (int i = 0; i < header.block_length_size(); ++i) {
+            offset += header.block_length(i);
+            segment.blockOffsets.push_back(offset);
+        }
+        if (offset != segment.contents->getFileLength()) {
+            error = format("Blocks cover %lu bytes but file has %lu",
+                           offset, segment.contents->getFileLength());
+        }
+    }
+    if (!error.empty()) {
+        PANIC("Could not read the header of compressed segment %s. This "
+              "indicates the file was somehow corrupted. Error was: %s",
+              segment.file.path.c_str(),
+              error.c_str());
+    }
+    return header.segment_bytes();
+}
+
+std::string
+SegmentedLog::decompressBlock(const Segment& segment, uint64_t block) const
+{
+    assert(block + 1 < segment.blockOffsets.size());
+    uint64_t offset = segment.blockOffsets.at(block);
+    uint64_t length = segment.blockOffsets.at(block + 1) - offset;
+    std::string out(segment.blockBytes, '\0');
+    uLongf outLength = uLongf(out.size());
+    int r = uncompress(reinterpret_cast<Bytef*>(&out[0]),
+                       &outLength,
+                       segment.contents->get<Bytef>(offset, length),
+                       uLong(length));
+    // Only the last block may be short.
+    if (r == Z_OK &&
+        outLength != segment.blockBytes &&
+        block + 2 < segment.blockOffsets.size()) {
+        r = Z_DATA_ERROR;
+    }
+    if (r != Z_OK) {
+        PANIC("Could not decompress block %lu of segment %s (offset %lu "
+              "bytes). This indicates the file was somehow corrupted. Error "
+              "was: %s",
+              block,
+              segment.file.path.c_str(),
+              offset,
+              zError(r));
+    }
+    out.resize(outLength);
+    return out;
+}
+
+std::string
+SegmentedLog::readCompressed(const Segment& segment,
+                             uint64_t offset,
+                             uint64_t length) const
+{
+    openReleasedSegment(segment);
+    std::string out;
+    out.reserve(length);
+    uint64_t block = offset / segment.blockBytes;
+    while (out.size() < length) {
+        if (block + 1 >= segment.blockOffsets.size()) {
+            PANIC("Attempted to read bytes %lu through %lu of compressed "
+                  "segment %s, past its end",
+                  offset, offset + length - 1,
+                  segment.filename.c_str());
+        }
+        std::pair<uint64_t, uint64_t> key(segment.startIndex, block);
+        auto it = blockCacheIndex.find(key);
+        if (it != blockCacheIndex.end()) {
+            ++blockCacheHits;
+            blockCache.splice(blockCache.begin(), blockCache, it->second);
+        } else {
+            ++blockCacheMisses;
+            blockCache.emplace_front(key, decompressBlock(segment, block));
+            blockCacheIndex[key] = blockCache.begin();
+        }
+        const std::string& data = blockCache.front().second;
+        uint64_t blockStart = block * segment.blockBytes;
+        uint64_t from = offset + out.size() - blockStart;
+        if (from >= data.size()) {
+            PANIC("Attempted to read byte %lu of compressed segment %s, past "
+                  "its end",
+                  offset + out.size(),
+                  segment.filename.c_str());
+        }
+        out.append(data, from,
+                   std::min(data.size() - from, length - out.size()));
+        ++block;
+    }
+    while (blockCache.size() > maxCachedBlocks) {
+        blockCacheIndex.erase(blockCache.back().first);
+        blockCache.pop_back();
+    }
+    return out;
+}
+
+bool
+SegmentedLog::compressSegment(const std::string& filename) const
+{
+    TimePoint start = Clock::now();
+    FS::File file = FS::tryOpenFile(dir, filename, O_RDONLY);
+    if (file.fd < 0) {
+        NOTICE("Not compressing segment %s: it was removed from the log",
+               filename.c_str());
+        return false;
+    }
+    FS::FileContents reader(file);
+    uint64_t segmentBytes = reader.getFileLength();
+    SegmentedLogMetadata::CompressedSegment header;
+    header.set_segment_bytes(segmentBytes);
+    header.set_block_bytes(uint32_t(compressedBlockBytes));
+    std::string blocks;
+    for (uint64_t offset = 0;
+         offset < segmentBytes;
+         offset += compressedBlockBytes) {
+        uint64_t length = std::min(compressedBlockBytes,
+                                   segmentBytes - offset);
+        uLongf compressedLength = compressBound(uLong(length));
+        uint64_t blockOffset = blocks.size();
+        blocks.resize(blockOffset + compressedLength);
+        int r = compress2(reinterpret_cast<Bytef*>(&blocks[blockOffset]),
+                          &compressedLength,
+                          reader.get<Bytef>(offset, length),
+                          uLong(length),
+                          Z_DEFAULT_COMPRESSION);
+        if (r != Z_OK) {
+            PANIC("Failed to compress %s: %s",
+                  file.path.c_str(), zError(r));
+        }
+        blocks.resize(blockOffset + compressedLength);
+        header.add_block_length(uint32_t(compressedLength));
+    }
+
+    Core::Buffer record = serializeProto(header);
+    FS::File out = FS::openFile(archiveDir,
+                                filename + COMPRESSED_SEGMENT_SUFFIX,
+                                O_CREAT|O_WRONLY|O_TRUNC);
+    ssize_t written = FS::write(out.fd, {
+        {record.getData(), record.getLength()},
+        {blocks.data(), blocks.size()},
+    });
+    if (written == -1) {
+        PANIC("Failed to write to %s: %s",
+              out.path.c_str(), strerror(errno));
+    }
+    FS::fsync(out);
+    FS::fsync(archiveDir);
+
+    TimePoint end = Clock::now();
+    NOTICE("Compressed segment %s from %lu to %lu bytes (took %s)",
+           filename.c_str(),
+           segmentBytes,
+           record.getLength() + blocks.size(),
+           Core::StringUtil::toString(end - start).c_str());
+    return true;
+}
+
+void
+SegmentedLog::segmentCompressorMain()
+{
+    Core::ThreadId::setName("SegmentCompressor");
+    std::string filename;
+    while (compressor.waitForWork(filename)) {
+        if (compressSegment(filename))
+            compressor.finish(filename);
+    }
+    VERBOSE("Exiting");
+}
 
 ////////// SegmentedLog segment preparer thread functions //////////
 
@@ -1315,11 +3424,22 @@ SegmentedLog::prepareNewSegment(uint64_t id)
     TimePoint start = Clock::now();
 
     std::string filename = format(OPEN_SEGMENT_FORMAT, id);
-    FS::File file = FS::openFile(dir, filename,
-                                 O_CREAT|O_EXCL|O_RDWR);
+    FS::File file;
+    std::string recycled = preparedSegments.takeRecycled();
+    if (!recycled.empty()) {
+        // Reusing an old segment file avoids allocating new blocks. Its old
+        // entries are left in place; see the class comment.
+        NOTICE("Recycling %s as %s", recycled.c_str(), filename.c_str());
+        FS::rename(dir, recycled, dir, filename);
+        file = FS::openFile(dir, filename, O_RDWR);
+    } else {
+        file = FS::openFile(dir, filename, O_CREAT|O_EXCL|O_RDWR);
+    }
+    // Closed segments were truncated to their length, so recycled files
+    // usually need some more space too.
     FS::allocate(file, 0, MAX_SEGMENT_SIZE);
     SegmentHeader header;
-    header.version = 1;
+    header.version = uint8_t(segmentVersion);
     ssize_t written = FS::write(file.fd,
                                 &header,
                                 sizeof(header));
@@ -1332,7 +3452,7 @@ SegmentedLog::prepareNewSegment(uint64_t id)
 
     TimePoint end = Clock::now();
     std::chrono::nanoseconds elapsed = end - start;
-    // TODO(ongaro): record elapsed times into RollingStat in a thread-safe way
+    preparedSegments.recordPrepareTime(elapsed);
     if (elapsed > diskWriteDurationThreshold) {
         WARNING("Preparing open segment file took longer than expected (%s)",
                 Core::StringUtil::toString(elapsed).c_str());
@@ -1358,5 +3478,43 @@ SegmentedLog::segmentPreparerMain()
     }
 }
 
+////////// SegmentedLog segment reclaimer thread functions //////////
+
+void
+SegmentedLog::queueRemoval(const std::string& filename)
+{
+    if (backgroundReclaim) {
+        currentSync->removedFilenames.push_back(filename);
+    } else {
+        const FS::File& from =
+            (Core::StringUtil::endsWith(filename, COMPRESSED_SEGMENT_SUFFIX)
+                ? archiveDir
+                : dir);
+        currentSync->ops.emplace_back(from.fd, Sync::Op::UNLINKAT);
+        currentSync->ops.back().filename1 = filename;
+    }
+}
+
+void
+SegmentedLog::segmentReclaimerMain()
+{
+    Core::ThreadId::setName("SegmentReclaimer");
+    std::deque<Segment> segments;
+    std::vector<std::string> filenames;
+    while (reclaimer.waitForWork(segments, filenames)) {
+        segments.clear();
+        for (auto it = filenames.begin(); it != filenames.end(); ++it) {
+            VERBOSE("Removing %s", it->c_str());
+            // Compressed segments are the only files kept in archiveDir.
+            if (Core::StringUtil::endsWith(*it, COMPRESSED_SEGMENT_SUFFIX))
+                FS::removeFile(archiveDir, *it);
+            else
+                FS::removeFile(dir, *it);
+        }
+        filenames.clear();
+    }
+    VERBOSE("Exiting");
+}
+
 } // namespace LibLogCabin::Storage
 } // namespace LibLogCabin
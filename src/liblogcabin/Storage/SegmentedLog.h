@@ -15,7 +15,11 @@
  */
 
 #include <deque>
+#include <list>
+#include <map>
+#include <memory>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "liblogcabin/Core/Buffer.h"
@@ -23,8 +27,10 @@
 #include "liblogcabin/Core/Mutex.h"
 #include "liblogcabin/Core/RollingStat.h"
 #include "liblogcabin/Storage/FilesystemUtil.h"
+#include "liblogcabin/Storage/IoUring.h"
 #include "liblogcabin/Storage/Log.h"
 #include "liblogcabin/Storage/SegmentedLog.pb.h"
+#include "liblogcabin/Storage/TermIndex.h"
 
 #ifndef LIBLOGCABIN_STORAGE_SEGMENTEDLOG_H
 #define LIBLOGCABIN_STORAGE_SEGMENTEDLOG_H
@@ -57,6 +63,10 @@ namespace Storage {
  * Metadata files are named "metadata1" and "metadata2". The code alternates
  * between these so that there is always at least one readable metadata file.
  * On boot, the readable metadata file with the higher version number is used.
+ * Both files are kept open, and updateMetadata() rewrites one with a single
+ * write and fdatasync. Metadata updates that don't need to be durable right
+ * away, such as the new log start index from truncatePrefix(), are instead
+ * queued into the current Sync along with the log writes.
  *
  * Closed segments are named by the format string "%020lu-%020lu" with their
  * start and end indexes, both inclusive. Closed segments always contain at
@@ -76,15 +86,75 @@ namespace Storage {
  * between a corrupt file and a partially written entry. The code assumes it's
  * a partially written entry, issues a WARNING, and ignores it.
  *
+ * A background thread creates and preallocates open segments ahead of time,
+ * so that appends rarely wait for one. It keeps between 'storageOpenSegments'
+ * and 'storageMaxOpenSegments' of them ready, depending on how quickly the
+ * log uses them up (see PreparedSegments).
+ *
  * Truncating a suffix of the log will remove all entries that are no longer
  * part of the log. Truncating a prefix of the log will only remove complete
  * segments that are before the new log start index. For example, if a
  * segment has entries 10 through 20 and the prefix of the log is truncated to
  * start at entry 15, that entire segment will be retained.
  *
+ * Rather than removing all of those segment files, a few of them (see
+ * 'storageRecycleSegments') are renamed to become new open segments, which
+ * reuses their allocated disk blocks. Recycled open segments may contain
+ * stale entries past the newly written ones. Since every stale entry came
+ * before the log start index, its index doesn't follow the entry before it,
+ * and loading an open segment stops at the first such entry.
+ *
+ * truncatePrefix() only moves the log start index and queues the new
+ * metadata. The segments it drops are handed to a background thread (see
+ * Reclaimer and 'storageBackgroundReclaim'), which frees their entries and
+ * removes their files once the metadata has reached the disk. Neither
+ * happens under the caller's lock or holds up the next Sync.
+ *
  * Each segment file starts with a segment header, which currently contains
- * just a one-byte version number for the format of that segment. The current
- * format (version 1) is just a concatenation of serialized entry records.
+ * just a one-byte version number for the format of that segment. Version 1 is
+ * just a concatenation of serialized entry records, each with its own
+ * checksum. Version 2 (the default, see 'storageSegmentVersion') instead
+ * writes each call to append() as a single batch record with one checksum:
+ *     |checksum\0|count|length_1|...|length_count|entry_1|...|entry_count|
+ * where count and the lengths are 32-bit big-endian integers and the checksum
+ * covers everything after it. Batches are split at segment boundaries. Since
+ * a batch can't be partially truncated, truncating a suffix of the log in the
+ * middle of a batch keeps the whole batch in the file, and the entries past
+ * the closed segment's end index are ignored when it's loaded. Both versions
+ * can be read, and each segment is written in a single version.
+ *
+ * The entries themselves are ProtoBufs in binary or text format, depending on
+ * the Encoding, except with Encoding::RAW. That one writes each entry as a
+ * fixed-size little-endian RawEntryHeader followed by a payload: the command
+ * for DATA entries or the binary ProtoBuf for configuration entries. This
+ * can be decoded with a few loads and a single copy out of the mapped file,
+ * rather than a full ProtoBuf parse. Metadata and index files are always
+ * binary ProtoBufs with Encoding::RAW.
+ *
+ * If the 'storageCompressSegments' config option is set, closed segments
+ * that have at least 'storageHotSegments' newer closed segments are cold:
+ * they're rarely read except to catch up a follower that's far behind. A
+ * background thread (see Compressor) compresses each cold segment into a
+ * new file, named like the segment followed by ".z", in the archive
+ * directory: a directory on a secondary device (see Layout::archiveDir) if
+ * one is configured, otherwise the log's own directory. The file holds a
+ * CompressedSegment header followed by the segment's contents split into
+ * blocks (see 'storageCompressedBlockBytes') and compressed with zlib one
+ * block at a time. Once that file has reached the disk, the log switches
+ * over to it and removes the original. Released entries of compressed
+ * segments are read back by decompressing only the blocks they span, which
+ * go through a small cache (see 'storageCompressedBlockCacheBlocks'). Index
+ * files are never compressed. If the server crashes while both files
+ * exist, the original wins and the compressed one is removed. Truncating a
+ * compressed segment's suffix decompresses it back into the log directory
+ * first.
+ *
+ * If the 'storageDirectIO' config option is set, the open segment is written
+ * with O_DIRECT (and O_DSYNC), bypassing the page cache. Appended records are
+ * staged in memory and written out once per Sync as whole aligned blocks,
+ * zero-padded past the end of the last record; the last partial block is
+ * rewritten by the next Sync. The zero padding looks the same as the
+ * preallocated space that follows it, so the on-disk format is unchanged.
  */
 class SegmentedLog : public Log {
     /**
@@ -106,6 +176,8 @@ class SegmentedLog : public Log {
       TEXT,
       /// ProtoBuf binary format.
       BINARY,
+      /// Fixed RawEntryHeader and payload for entries; see the class comment.
+      RAW,
     };
 
     /**
@@ -117,16 +189,26 @@ class SegmentedLog : public Log {
      *      Specifies how individual records are stored.
      * \param config
      *      Settings.
+     * \param archiveParentDir
+     *      A filesystem directory on a secondary device in which to keep
+     *      compressed segments (in a subdirectory named after the encoding),
+     *      or an empty placeholder to keep them with the rest of the log.
      */
     SegmentedLog(const FilesystemUtil::File& parentDir,
                  Encoding encoding,
-                 const Core::Config& config);
+                 const Core::Config& config,
+                 const FilesystemUtil::File& archiveParentDir =
+                    FilesystemUtil::File());
     ~SegmentedLog();
 
     // Methods implemented from Log interface
     std::pair<uint64_t, uint64_t>
     append(const std::vector<const Entry*>& entries);
+    std::pair<uint64_t, uint64_t>
+    appendMoved(std::vector<Entry>&& entries);
     const Entry& getEntry(uint64_t) const;
+    uint64_t getTerm(uint64_t) const;
+    void prefetch(uint64_t startIndex, uint64_t bytes) const;
     uint64_t getLogStartIndex() const;
     uint64_t getLastLogIndex() const;
     std::string getName() const;
@@ -145,6 +227,13 @@ class SegmentedLog : public Log {
      * segments. These are created asynchronously, hopefully ahead of the log
      * appends.
      *
+     * The number of segments to keep prepared adapts to the workload, between
+     * a minimum and a maximum: it's about the number of segments the log
+     * consumes in the time it takes to prepare one, plus one spare. It also
+     * grows whenever the log has to wait for a segment. Each time the log
+     * takes a segment, the target moves by at most one, and the queue follows
+     * it by replacing that segment with zero, one, or two new ones.
+     *
      * This class is written in a monitor style; each public method acquires
      * #mutex.
      */
@@ -159,11 +248,20 @@ class SegmentedLog : public Log {
 
         /**
          * Constructor.
-         * \param queueSize
+         * \param minQueueSize
+         *      The minimum number of prepared segments to aim to hold in the
+         *      queue at a time. The queue starts out at this size.
+         * \param maxQueueSize
          *      The maximum number of prepared segments to hold in the queue
-         *      at a time.
+         *      at a time. If this is no larger than minQueueSize, the queue
+         *      stays at minQueueSize.
+         * \param maxRecycled
+         *      The maximum number of unneeded segment files to hold for
+         *      reuse at a time.
          */
-        explicit PreparedSegments(uint64_t queueSize);
+        PreparedSegments(uint64_t minQueueSize,
+                         uint64_t maxQueueSize,
+                         uint64_t maxRecycled);
 
         /**
          * Destructor.
@@ -189,6 +287,38 @@ class SegmentedLog : public Log {
          */
         std::deque<OpenSegment> releaseAll();
 
+        /**
+         * Immediately return the filenames of all segment files waiting to
+         * be recycled.
+         */
+        std::deque<std::string> releaseRecycled();
+
+        /**
+         * Reserve a place for an unneeded segment file that will be passed
+         * to recycle() later.
+         * \return
+         *      True if the file may be recycled, false if it should be
+         *      removed instead because enough files are already waiting.
+         */
+        bool reserveRecycled();
+
+        /**
+         * Make a segment file that's no longer needed available for reuse.
+         * reserveRecycled() must have returned true first.
+         * \param filename
+         *      Name of the file relative to #dir.
+         */
+        void recycle(const std::string& filename);
+
+        /**
+         * Producers call this to get a segment file to reuse for a new open
+         * segment, if one is available.
+         * \return
+         *      Name of the file relative to #dir, or the empty string if
+         *      there are none.
+         */
+        std::string takeRecycled();
+
         /**
          * Producers call this when they're done creating a new file. This must
          * be called once after each call waitForDemand(); otherwise, the
@@ -198,6 +328,12 @@ class SegmentedLog : public Log {
          */
         void submitOpenSegment(OpenSegment segment);
 
+        /**
+         * Producers call this to report how long it took to prepare a
+         * segment, which is used to size the queue.
+         */
+        void recordPrepareTime(std::chrono::nanoseconds elapsed);
+
         /**
          * Producers call this first to block until work becomes needed.
          * \return
@@ -214,16 +350,33 @@ class SegmentedLog : public Log {
          */
         OpenSegment waitForOpenSegment();
 
+        /**
+         * Add the queue's statistics to the given structure.
+         */
+        void updateServerStats(Protocol::ServerStats& serverStats) const;
+
         /**
          * Reduce log message verbosity for unit tests.
          */
         bool quietForUnitTests;
 
       private:
+        /**
+         * Called by waitForOpenSegment() after taking a segment to move
+         * #targetSize towards the size the workload calls for, by at most
+         * one.
+         * \param waited
+         *      Whether the consumer had to wait for the segment.
+         * \return
+         *      The number of producers to start to replace the segment: 0 if
+         *      the target shrank, 1 if it stayed, or 2 if it grew.
+         */
+        uint64_t adjustTargetSize(bool waited);
+
         /**
          * Mutual exclusion for all of the members of this class.
          */
-        Core::Mutex mutex;
+        mutable Core::Mutex mutex;
         /**
          * Notified when #openSegments shrinks in size or when #exiting becomes
          * true.
@@ -254,6 +407,112 @@ class SegmentedLog : public Log {
          * available for the log to use as future open segments.
          */
         std::deque<OpenSegment> openSegments;
+        /**
+         * See constructor.
+         */
+        const uint64_t minQueueSize;
+        /**
+         * See constructor.
+         */
+        const uint64_t maxQueueSize;
+        /**
+         * The number of prepared segments the queue currently aims to hold,
+         * counting those being prepared. Between #minQueueSize and
+         * #maxQueueSize; see adjustTargetSize().
+         */
+        uint64_t targetSize;
+        /**
+         * When waitForOpenSegment() was last called, or the epoch if it
+         * hasn't been called yet.
+         */
+        TimePoint lastConsumed;
+        /**
+         * The time between consecutive calls to waitForOpenSegment(), which
+         * gives the rate at which the log uses up segments.
+         */
+        Core::RollingStat consumeIntervalNanos;
+        /**
+         * How long producers take to prepare each segment.
+         */
+        Core::RollingStat prepareNanos;
+        /**
+         * How long each call to waitForOpenSegment() waited for a segment to
+         * be prepared (mostly zeros, hopefully).
+         */
+        Core::RollingStat waitNanos;
+        /**
+         * See constructor.
+         */
+        const uint64_t maxRecycled;
+        /**
+         * The number of successful calls to reserveRecycled() whose files
+         * have not yet been taken with takeRecycled().
+         */
+        uint64_t numRecycled;
+        /**
+         * Segment files that are no longer needed, waiting to be reused as
+         * open segments.
+         */
+        std::deque<std::string> recycled;
+    };
+
+    /**
+     * The metadata files, "metadata1" and "metadata2", kept open for writing.
+     * Metadata is written both directly by updateMetadata() and from Syncs
+     * that carry queued metadata updates, possibly concurrently, so each
+     * public method acquires #mutex.
+     *
+     * Each write goes to whichever file doesn't hold the newest version, so
+     * that a torn write can never lose the last metadata that reached the
+     * disk. Writes of versions older than one already written are skipped,
+     * since the newer version supersedes them.
+     */
+    class MetadataFiles {
+      public:
+        /**
+         * Constructor. No files are open until open() is called.
+         */
+        MetadataFiles();
+
+        /**
+         * Open (or create) both metadata files.
+         * \param dir
+         *      Directory containing the metadata files.
+         * \param version1
+         *      Version of the metadata in "metadata1", or 0 if it's unreadable.
+         * \param version2
+         *      Version of the metadata in "metadata2", or 0 if it's unreadable.
+         */
+        void open(const FilesystemUtil::File& dir,
+                  uint64_t version1,
+                  uint64_t version2);
+
+        /**
+         * Write a serialized metadata record to the start of a file with a
+         * single write and flush it with fdatasync.
+         * \param record
+         *      Record from serializeProto().
+         * \param version
+         *      The version of the metadata in 'record'.
+         * \return
+         *      True if the record was written, false if it was skipped
+         *      because a newer version has already been written.
+         */
+        bool write(const Core::Buffer& record, uint64_t version);
+
+      private:
+        /**
+         * Mutual exclusion for all of the members of this class.
+         */
+        Core::Mutex mutex;
+        /**
+         * The open metadata files, "metadata1" and "metadata2".
+         */
+        FilesystemUtil::File files[2];
+        /**
+         * The version of the metadata last written to each of #files.
+         */
+        uint64_t versions[2];
     };
 
     /**
@@ -271,6 +530,12 @@ class SegmentedLog : public Log {
                 FSYNC,
                 CLOSE,
                 UNLINKAT,
+                /// Create filename1 in the directory fd, write writeData to
+                /// it, fdatasync it, and close it.
+                WRITE_FILE,
+                /// Write writeData[0], a metadata record of version 'size',
+                /// through the Sync's metadataFiles.
+                METADATA,
                 NOOP,
             };
             Op(int fd, OpCode opCode)
@@ -280,18 +545,25 @@ class SegmentedLog : public Log {
                 , filename1()
                 , filename2()
                 , size(0)
+                , offset(-1)
             {
             }
             int fd;
             OpCode opCode;
-            Core::Buffer writeData;
+            /// Data for WRITE, written with a single vectored write.
+            std::vector<Core::Buffer> writeData;
             std::string filename1;
             std::string filename2;
             uint64_t size;
+            /// For WRITE, the file offset at which to write, or -1 to write
+            /// at (and advance) the file's current position.
+            int64_t offset;
         };
 
-        explicit Sync(uint64_t lastIndex,
-                      std::chrono::nanoseconds diskWriteDurationThreshold);
+        Sync(uint64_t lastIndex,
+             std::chrono::nanoseconds diskWriteDurationThreshold,
+             IoUring* ioUring,
+             MetadataFiles* metadataFiles);
         ~Sync();
         /**
          * Add how long the filesystem ops took to 'nanos'. This is invoked
@@ -301,18 +573,51 @@ class SegmentedLog : public Log {
          */
         void updateStats(Core::RollingStat& nanos) const;
         /**
-         * Called at the start of wait to avoid some redundant disk flushes.
+         * Called at the start of wait to avoid some redundant disk flushes
+         * and to merge consecutive writes to the same file into a single
+         * vectored write of up to IOV_MAX buffers.
          */
         void optimize();
         void wait();
+        /**
+         * Execute a single operation with blocking system calls.
+         */
+        void executeOp(Op& op);
+        /**
+         * Execute all of #ops through #ioUring. Ops on the same fd are
+         * submitted as a chain of linked requests, so each starts only after
+         * the previous one on that fd completes, while ops on different fds
+         * proceed concurrently. Renames and unlinks first wait for all
+         * earlier ops to succeed. Unlinks are hard-linked to the requests
+         * after them, so that removing a file that's already gone doesn't
+         * cancel the rest of the chain. Truncates aren't supported by
+         * io_uring on all kernels, so they are executed synchronously
+         * between batches, as are WRITE_FILE and METADATA ops.
+         */
+        void waitIoUring();
         /// If a wait() exceeds this time, log a warning.
         const std::chrono::nanoseconds diskWriteDurationThreshold;
+        /// If not NULL, wait() submits #ops through this ring.
+        IoUring* ioUring;
+        /// Where METADATA ops write their records.
+        MetadataFiles* metadataFiles;
+        /// Closed segment files that truncatePrefix() dropped from the log.
+        /// These may be reused once the Sync completes, since only then has
+        /// the new log start index reached the disk.
+        std::vector<std::string> recycledFilenames;
+        /// Files that truncatePrefix() dropped from the log, handed to the
+        /// Reclaimer for removal once the Sync completes, for the same
+        /// reason.
+        std::vector<std::string> removedFilenames;
         /// List of operations to perform during wait().
         std::deque<Op> ops;
         /// Time at start of wait() call.
         TimePoint waitStart;
         /// Time at end of wait() call.
         TimePoint waitEnd;
+        // Sync is non-copyable.
+        Sync(const Sync&) = delete;
+        Sync& operator=(const Sync&) = delete;
     };
 
     /**
@@ -329,15 +634,43 @@ class SegmentedLog : public Log {
             explicit Record(uint64_t offset);
 
             /**
-             * Byte offset in the file where the entry begins.
-             * This is used when truncating a segment.
+             * Byte offset in the file where the record containing the entry
+             * begins. In version 2 segments, entries in the same batch share
+             * the same offset. This is used when truncating a segment.
              */
             uint64_t offset;
 
             /**
-             * The entry itself.
+             * The entry's term, kept even when #entry has been released.
+             */
+            uint64_t term;
+
+            /**
+             * The number of bytes the entry's record occupies in the file.
+             * For batches, this is the size of the whole batch for its first
+             * entry and 0 for the rest.
+             */
+            uint32_t length;
+
+            /**
+             * The entry's type (a Protocol::Raft::EntryType), kept so that
+             * the segment's index can be rewritten after #entry has been
+             * released.
+             */
+            uint32_t type;
+
+            /**
+             * The entry itself, unless #released. It's held by value so that
+             * appending an entry doesn't take an extra heap allocation.
              */
             Log::Entry entry;
+
+            /**
+             * Set once #entry has been emptied to bound memory usage (see
+             * #maxCachedEntries). Released entries are parsed back out of
+             * the segment file on demand.
+             */
+            bool released;
         };
 
         /**
@@ -351,10 +684,37 @@ class SegmentedLog : public Log {
          */
         std::string makeClosedFilename() const;
 
+        /**
+         * Return the name of the index file for this segment once it's
+         * closed. See #writeIndex().
+         */
+        std::string makeIndexFilename() const;
+
+        /**
+         * Return the number of bytes at the start of the file needed to keep
+         * the first 'numEntries' entries, including the header. In version 2
+         * segments, this may also keep some later entries that share a batch
+         * with the last kept one.
+         * \param numEntries
+         *      At least 1 and less than the number of entries in the segment.
+         */
+        uint64_t bytesToKeep(uint64_t numEntries) const;
+
         /**
          * True for the open segment, false for closed segments.
          */
         bool isOpen;
+        /**
+         * True if the segment's file is compressed and lives in
+         * #archiveDir (see the class comment). Only closed segments are
+         * compressed.
+         */
+        bool compressed;
+        /**
+         * True from when the segment is queued on the #compressor until the
+         * log switches over to the compressed file or discards it.
+         */
+        bool compressing;
         /**
          * The index of the first entry in the segment. If the segment is open
          * and empty, this may not exist yet and will be #logStartIndex.
@@ -365,6 +725,10 @@ class SegmentedLog : public Log {
          * the segment is open and empty.
          */
         uint64_t endIndex;
+        /**
+         * The format version of the segment file (see SegmentHeader).
+         */
+        uint8_t version;
         /**
          * Size in bytes of the valid entries stored in the file plus
          * the version number at the start of the file.
@@ -378,7 +742,215 @@ class SegmentedLog : public Log {
          * The entries in this segment, from startIndex to endIndex, inclusive.
          */
         std::deque<Record> entries;
+        /**
+         * The segment file, opened lazily by #getEntry() when it needs to
+         * read released entries. Only used for closed segments.
+         */
+        mutable FilesystemUtil::File file;
+        /**
+         * A read-only mapping of #file, or NULL if it has not been needed
+         * since the segment was loaded or last truncated.
+         */
+        mutable std::unique_ptr<FilesystemUtil::FileContents> contents;
+        /**
+         * For compressed segments, the number of bytes of the original
+         * segment in each block. Read along with #contents.
+         */
+        mutable uint64_t blockBytes;
+        /**
+         * For compressed segments, the offset in #file at which each
+         * compressed block starts, followed by the offset at which the last
+         * one ends. Read along with #contents.
+         */
+        mutable std::vector<uint64_t> blockOffsets;
+
+    };
+
+    /**
+     * A queue of cold closed segments to compress (see the class comment),
+     * shared with the #segmentCompressor thread. The log queues segments by
+     * filename, and the thread reports back which ones it has written
+     * compressed copies of. The log decides what to do with those, since the
+     * segments may have changed in the meantime. Each public method acquires
+     * #mutex.
+     */
+    class Compressor {
+      public:
+        /**
+         * Constructor.
+         */
+        Compressor();
+
+        /**
+         * Destructor.
+         */
+        ~Compressor();
+
+        /**
+         * Make waitForWork() return false, dropping any segments that
+         * haven't been started.
+         */
+        void exit();
+
+        /**
+         * Queue a closed segment to be compressed.
+         * \param filename
+         *      Name of the segment file within #dir.
+         */
+        void compress(const std::string& filename);
+
+        /**
+         * The compressor thread calls this once it has written and flushed
+         * the compressed copy of a segment.
+         * \param filename
+         *      The name passed to compress().
+         */
+        void finish(const std::string& filename);
+
+        /**
+         * Return the names of the segments passed to finish() since the last
+         * call.
+         */
+        std::vector<std::string> takeFinished();
+
+        /**
+         * The compressor thread calls this to block until there is a segment
+         * to compress. Calling this also indicates that the previous one is
+         * done.
+         * \param[out] filename
+         *      Set to the name of the segment file to compress.
+         * \return
+         *      True if the caller should compress the segment, false if
+         *      exit() has been called.
+         */
+        bool waitForWork(std::string& filename);
+
+        /**
+         * Block until every segment queued so far has been compressed. Used
+         * before modifying closed segments, so that the compressor thread
+         * never reads a file as it's being truncated.
+         */
+        void waitUntilIdle();
+
+      private:
+        /**
+         * Mutual exclusion for all of the members of this class.
+         */
+        Core::Mutex mutex;
+        /**
+         * Notified when a segment is queued or when #exiting becomes true.
+         */
+        Core::ConditionVariable queued;
+        /**
+         * Notified when the compressor thread finishes a segment.
+         */
+        Core::ConditionVariable done;
+        /**
+         * Set to true when the compressor thread should exit.
+         */
+        bool exiting;
+        /**
+         * True while the compressor thread is working on a segment it took
+         * from waitForWork().
+         */
+        bool busy;
+        /**
+         * Names of segment files waiting to be compressed.
+         */
+        std::deque<std::string> pending;
+        /**
+         * Names of segment files whose compressed copies are ready.
+         */
+        std::vector<std::string> finished;
+    };
+
+    /**
+     * Holds segments and files that truncatePrefix() dropped from the log
+     * until the #segmentReclaimer thread gets to them. Destroying a segment
+     * with millions of records and unlinking large files both take a while,
+     * so they're kept off the caller's lock and out of Sync::wait(). Each
+     * public method acquires #mutex.
+     */
+    class Reclaimer {
+      public:
+        /**
+         * Constructor.
+         */
+        Reclaimer();
+
+        /**
+         * Destructor.
+         */
+        ~Reclaimer();
+
+        /**
+         * Make waitForWork() return false once the queued work is done.
+         */
+        void exit();
+
+        /**
+         * Queue a segment that's no longer part of the log to be destroyed,
+         * which frees its records and closes its files.
+         */
+        void reclaim(Segment segment);
+
+        /**
+         * Queue files to be removed. Call this only once the log start index
+         * that made them unneeded has reached the disk.
+         * \param filenames
+         *      Names of the files relative to #dir.
+         */
+        void remove(const std::vector<std::string>& filenames);
 
+        /**
+         * The reclaimer thread calls this to block until there is work to do.
+         * Calling this also indicates that the previous work is done.
+         * \param[out] segments
+         *      Filled in with segments to destroy.
+         * \param[out] filenames
+         *      Filled in with files to remove.
+         * \return
+         *      True if the caller should do the work, false if exit() has
+         *      been called and there is no more work.
+         */
+        bool waitForWork(std::deque<Segment>& segments,
+                         std::vector<std::string>& filenames);
+
+        /**
+         * Block until all work queued so far is done. Used in unit tests.
+         */
+        void waitUntilIdle();
+
+      private:
+        /**
+         * Mutual exclusion for all of the members of this class.
+         */
+        Core::Mutex mutex;
+        /**
+         * Notified when work is queued or when #exiting becomes true.
+         */
+        Core::ConditionVariable queued;
+        /**
+         * Notified when the reclaimer thread finishes a batch of work.
+         */
+        Core::ConditionVariable done;
+        /**
+         * Set to true when the reclaimer thread should exit.
+         */
+        bool exiting;
+        /**
+         * True while the reclaimer thread is working on a batch it took
+         * from waitForWork().
+         */
+        bool busy;
+        /**
+         * Segments waiting to be destroyed.
+         */
+        std::deque<Segment> segments;
+        /**
+         * Files waiting to be removed, relative to #dir.
+         */
+        std::vector<std::string> filenames;
     };
 
     /**
@@ -386,11 +958,41 @@ class SegmentedLog : public Log {
      */
     struct SegmentHeader {
         /**
-         * Always set to 1 for now.
+         * Either 1 or 2; see the class comment.
          */
         uint8_t version;
     } __attribute__((packed));
 
+    /**
+     * Precedes each entry's payload in Encoding::RAW. All fields are stored
+     * in little-endian byte order.
+     */
+    struct RawEntryHeader {
+        /**
+         * Bits for #flags.
+         */
+        enum {
+            /// The entry's type field is set.
+            HAS_TYPE = 1,
+            /// The payload is the entry's data field.
+            DATA = 2,
+            /// The payload is the entry's configuration field, encoded as a
+            /// binary ProtoBuf.
+            CONFIGURATION = 4,
+            /// The entry's cluster_time field is set.
+            HAS_CLUSTER_TIME = 16,
+        };
+        uint64_t index;
+        uint64_t term;
+        uint64_t clusterTime;
+        uint16_t type;
+        uint16_t flags;
+        /**
+         * The number of bytes in the payload that follows.
+         */
+        uint32_t length;
+    } __attribute__((packed));
+
     ////////// initialization helper functions //////////
 
     /**
@@ -440,6 +1042,52 @@ class SegmentedLog : public Log {
      */
     bool loadClosedSegment(Segment& segment, uint64_t logStartIndex);
 
+    /**
+     * Call #loadClosedSegment() on every closed segment in 'segments', using
+     * up to 'numThreads' threads. Segments are independent of each other until
+     * they're inserted into #segmentsByStartIndex, so reading them and
+     * verifying their checksums in parallel shortens startup time for large
+     * logs. This is only used during initialization.
+     * \param[in,out] segments
+     *      Segments returned from #readSegmentFilenames(). Open segments are
+     *      skipped; they're loaded afterwards by #loadOpenSegment().
+     * \param logStartIndex
+     *      The index of the first entry in the log, according to the log
+     *      metadata.
+     * \param numThreads
+     *      The maximum number of threads to use, including the calling thread.
+     * \return
+     *      The return value of #loadClosedSegment() for each closed segment in
+     *      'segments', in order, or false for each open segment.
+     */
+    std::deque<bool> loadClosedSegments(std::vector<Segment>& segments,
+                                        uint64_t logStartIndex,
+                                        uint64_t numThreads);
+
+    /**
+     * Fill in the entry records for a closed segment from its index file,
+     * instead of scanning the segment itself. The entries are left released,
+     * so this is only useful when #maxCachedEntries is nonzero. This is only
+     * used during initialization.
+     * \param[in,out] segment
+     *      Closed segment whose startIndex, endIndex, and filename are set
+     *      and whose entries are empty.
+     * \param segmentBytes
+     *      The size of the segment file. The index is only trusted if it
+     *      describes exactly this many bytes.
+     * \return
+     *      True if the index was read and matched the segment; false if it
+     *      was missing or invalid, in which case the segment must be scanned.
+     */
+    bool readIndex(Segment& segment, uint64_t segmentBytes) const;
+
+    /**
+     * Remove index files whose segments no longer exist. These may be left
+     * behind if the server crashed while removing a segment. This is only
+     * used during initialization.
+     */
+    void removeOrphanIndexes();
+
     /**
      * Read the given open segment from disk, issuing PANICs and WARNINGs
      * appropriately, and closing the segment. This is only used during
@@ -489,6 +1137,19 @@ class SegmentedLog : public Log {
     Segment& getOpenSegment();
     const Segment& getOpenSegment() const;
 
+    /**
+     * Fill in #metadata from the current state, assign it the next version
+     * number, and serialize it for writing to #metadataFiles.
+     */
+    Core::Buffer prepareMetadata();
+
+    /**
+     * Like updateMetadata(), but queue the write into #currentSync instead
+     * of waiting for it. The new metadata is written before the operations
+     * queued after it and is durable once that Sync completes.
+     */
+    void queueMetadataUpdate();
+
     /**
      * Set up a new open segment for the log head.
      * This is called when #append() needs more space but also when the end of
@@ -498,6 +1159,119 @@ class SegmentedLog : public Log {
      */
     void openNewSegment();
 
+    /**
+     * Parse a released entry out of its segment file, going through
+     * #entryCache. Called by #getEntry() when the entry's Record no longer
+     * holds a parsed copy.
+     * \param segment
+     *      Closed segment containing the entry.
+     * \param index
+     *      Index of the entry to read.
+     * \return
+     *      The entry, which stays valid until the next call to this function
+     *      or the next modification to the log.
+     */
+    const Entry& readReleasedEntry(const Segment& segment,
+                                   uint64_t index) const;
+
+    /**
+     * Open and map a closed segment's file, if it's not open already. For
+     * compressed segments, this also reads the CompressedSegment header (see
+     * openCompressedSegment()). If this leaves more than #maxMappedSegments
+     * segments open, the least recently used one is closed.
+     */
+    void openReleasedSegment(const Segment& segment) const;
+
+    /**
+     * Release the parsed entries of closed segments that are fully on disk,
+     * leaving only their offsets, terms, and lengths in memory. Does nothing
+     * unless #maxCachedEntries is nonzero.
+     * \param syncedIndex
+     *      The last index of a Sync that has just completed. Segments that
+     *      were rolled over before this entry was written have been renamed
+     *      and flushed, so their files can be read back safely.
+     */
+    void releaseEntries(uint64_t syncedIndex);
+
+    /**
+     * Remove entries from #entryCache that are no longer part of the log,
+     * and forget segments in #mappedSegments that have been removed.
+     * Called after truncating the log.
+     */
+    void trimEntryCache();
+
+    ////////// compressed segment functions //////////
+
+    /**
+     * Switch over to the compressed copies the #segmentCompressor has
+     * finished, and queue any closed segments that have become cold. Does
+     * nothing unless #compressSegments is set.
+     */
+    void compressColdSegments();
+
+    /**
+     * Start using the compressed copy of a segment in place of the original,
+     * or remove the copy if the segment has since been truncated away.
+     * \param filename
+     *      The name of the original segment file, as passed to
+     *      Compressor::compress().
+     */
+    void finishCompression(const std::string& filename);
+
+    /**
+     * Write an uncompressed copy of a compressed segment back into #dir and
+     * switch over to it. Used before truncating the segment.
+     */
+    void decompressSegment(Segment& segment);
+
+    /**
+     * Open a compressed segment's file and read its CompressedSegment header
+     * into #Segment::blockBytes and #Segment::blockOffsets, if that hasn't
+     * been done already. PANICs if the file is corrupt.
+     * \return
+     *      The size of the segment before it was compressed.
+     */
+    uint64_t openCompressedSegment(const Segment& segment) const;
+
+    /**
+     * Decompress one block of a compressed segment that has been opened with
+     * openCompressedSegment(). PANICs if the block is corrupt.
+     */
+    std::string decompressBlock(const Segment& segment,
+                                uint64_t block) const;
+
+    /**
+     * Read part of a compressed segment's original contents, decompressing
+     * only the blocks it spans and going through #blockCache.
+     * \param segment
+     *      A compressed segment.
+     * \param offset
+     *      Offset of the first byte to read in the original segment.
+     * \param length
+     *      Number of bytes to read.
+     */
+    std::string readCompressed(const Segment& segment,
+                               uint64_t offset,
+                               uint64_t length) const;
+
+    /**
+     * Write a compressed copy of a closed segment into #archiveDir and flush
+     * it to disk. Called on the #segmentCompressor thread, so this only
+     * reads the file and the log's immutable settings.
+     * \param filename
+     *      The name of the segment file within #dir.
+     * \return
+     *      True if the compressed copy was written, false if the segment's
+     *      file was already gone (truncatePrefix() may remove segments that
+     *      are still queued).
+     */
+    bool compressSegment(const std::string& filename) const;
+
+    /**
+     * The main function for the #segmentCompressor thread.
+     */
+    void segmentCompressorMain();
+
     /**
      * Read the next ProtoBuf record out of 'file'.
      * \param file
@@ -530,6 +1304,77 @@ class SegmentedLog : public Log {
                                   uint64_t* offset,
                                   google::protobuf::Message* out) const;
 
+    /**
+     * Read the next record out of a segment file: a single entry for version
+     * 1 segments or a batch of entries for version 2 segments (see the class
+     * comment).
+     * \param version
+     *      The format version of the segment.
+     * \param file
+     *      The open file, useful for error messages.
+     * \param reader
+     *      A reader for 'file'.
+     * \param[in,out] offset
+     *      The byte offset in the file at which to start reading as input.
+     *      The byte just after the last byte of the record as output if
+     *      successful, otherwise unmodified.
+     * \param[out] out
+     *      An empty vector to fill in with the record's entries.
+     * \return
+     *      Empty string if successful, otherwise error message.
+     */
+    std::string readEntries(uint8_t version,
+                            const FilesystemUtil::File& file,
+                            FilesystemUtil::FileContents& reader,
+                            uint64_t* offset,
+                            std::vector<Entry>* out) const;
+
+    /**
+     * Parse a ProtoBuf encoded as binary or text, depending on encoding.
+     * With Encoding::RAW, entries are decoded from their RawEntryHeader and
+     * payload, and other ProtoBufs are parsed as binary.
+     * \param file
+     *      The file the data came from, useful for error messages.
+     * \param data
+     *      The encoded ProtoBuf.
+     * \param length
+     *      The number of bytes in 'data'.
+     * \param[out] out
+     *      An empty ProtoBuf to fill in.
+     * \return
+     *      Empty string if successful, otherwise error message.
+     */
+    std::string parseProto(const FilesystemUtil::File& file,
+                           const void* data,
+                           uint64_t length,
+                           google::protobuf::Message* out) const;
+
+    /**
+     * Encode a ProtoBuf as binary or text, depending on encoding, without
+     * any framing. See #parseProto() for Encoding::RAW.
+     */
+    Core::Buffer encodeProto(const google::protobuf::Message& in) const;
+
+    /**
+     * Encode an entry for Encoding::RAW (see RawEntryHeader).
+     */
+    static Core::Buffer encodeRawEntry(const Entry& entry);
+
+    /**
+     * Decode an entry encoded with #encodeRawEntry().
+     * \param data
+     *      The encoded entry.
+     * \param length
+     *      The number of bytes in 'data'.
+     * \param[out] out
+     *      An empty entry to fill in.
+     * \return
+     *      True if successful, false if 'data' is malformed.
+     */
+    static bool parseRawEntry(const void* data,
+                              uint64_t length,
+                              Entry* out);
+
     /**
      * Prepare a ProtoBuf record to be written to disk.
      * \param in
@@ -539,6 +1384,50 @@ class SegmentedLog : public Log {
      */
     Core::Buffer serializeProto(const google::protobuf::Message& in) const;
 
+    /**
+     * Prepare a version 2 batch record to be written to disk.
+     * \param entries
+     *      Entries encoded with #encodeProto().
+     * \return
+     *      Buffer containing serialized record.
+     */
+    Core::Buffer serializeBatch(const std::vector<Core::Buffer>& entries) const;
+
+    /**
+     * Queue a serialized record to be written to the end of the open segment
+     * and account for its bytes.
+     */
+    void writeRecord(Core::Buffer record);
+
+    /**
+     * Prepare the index record for a closed segment, listing the offset,
+     * length, term, and type of each of its entries.
+     * \param segment
+     *      Closed segment, or the open segment as it's being closed.
+     * \return
+     *      Buffer containing serialized record.
+     */
+    Core::Buffer serializeIndex(const Segment& segment) const;
+
+    /**
+     * Write the index file for a closed segment and flush it. The caller is
+     * responsible for flushing #dir afterwards. Index files allow
+     * #loadClosedSegment() to skip reading the segment itself. Does nothing
+     * unless #maxCachedEntries is nonzero, since only then are they read.
+     * \param segment
+     *      Closed segment, or the open segment as it's being closed.
+     */
+    void writeIndex(const Segment& segment) const;
+
+    /**
+     * Queue a write to #currentSync for the records staged in
+     * #directIOBuffer, rounded up to whole blocks of #directIOAlignment
+     * bytes. Afterwards, #directIOBuffer retains only the last partial
+     * block, since that must be rewritten along with the next records.
+     * Does nothing if no records have been staged since the last call.
+     */
+    void flushDirectIOBuffer();
+
     ////////// segment preparer thread functions //////////
 
     /**
@@ -557,6 +1446,20 @@ class SegmentedLog : public Log {
      */
     void segmentPreparerMain();
 
+    ////////// segment reclaimer thread functions //////////
+
+    /**
+     * Queue a file that truncatePrefix() dropped from the log to be removed
+     * once #currentSync completes: by the #segmentReclaimer if
+     * #backgroundReclaim is set, or by the Sync itself otherwise.
+     */
+    void queueRemoval(const std::string& filename);
+
+    /**
+     * The main function for the #segmentReclaimer thread.
+     */
+    void segmentReclaimerMain();
+
     ////////// member variables //////////
 
     /**
@@ -566,10 +1469,25 @@ class SegmentedLog : public Log {
 
     /**
      * The algorithm to use when writing new records. When reading records, any
-     * available checksum is used.
+     * available checksum is used. Controlled by the 'storageChecksum' config
+     * option, which defaults to CRC32C if the CPU can compute it in hardware
+     * and CRC32 otherwise.
      */
     const std::string checksumAlgorithm;
 
+    /**
+     * The number of bytes in checksums produced by #checksumAlgorithm,
+     * including the null terminator.
+     */
+    const uint32_t checksumLength;
+
+    /**
+     * The format version for newly written segments (see SegmentHeader).
+     * Controlled by the 'storageSegmentVersion' config option, which defaults
+     * to 2.
+     */
+    const uint64_t segmentVersion;
+
     /**
      * The maximum size in bytes for newly written segments. Controlled by the
      * 'storageSegmentBytes' config option.
@@ -594,10 +1512,17 @@ class SegmentedLog : public Log {
     SegmentedLogMetadata::Metadata metadata;
 
     /**
-     * The directory containing every file this log creates.
+     * The directory containing every file this log creates, other than
+     * compressed segments.
      */
     FilesystemUtil::File dir;
 
+    /**
+     * The directory containing compressed segments (see the class comment).
+     * This is either on a secondary device or another handle to #dir.
+     */
+    FilesystemUtil::File archiveDir;
+
     /**
      * A writable OS-level file that contains the entries for the current open
      * segment. It is a class invariant that this is always a valid file.
@@ -616,17 +1541,193 @@ class SegmentedLog : public Log {
      */
     std::map<uint64_t, Segment> segmentsByStartIndex;
 
+    /**
+     * The terms of the entries in [logStartIndex, getLastLogIndex()], for
+     * getTerm(). The terms are also in the segments' records, but this is
+     * much more compact.
+     */
+    TermIndex termIndex;
+
     /**
      * The total number of bytes occupied by the closed segments on disk.
      * Used to calculate getSizeBytes() efficiently.
      */
     uint64_t totalClosedSegmentBytes;
 
+    /**
+     * If nonzero, closed segments release the contents of their entries,
+     * keeping only each entry's offset, term, and length (and an empty
+     * Entry) in memory, and up to this many entries read back from disk are
+     * cached in #entryCache. If zero, every entry is kept in memory.
+     * Controlled by the 'storageEntryCacheEntries' config option.
+     */
+    const uint64_t maxCachedEntries;
+
+    /**
+     * Entries parsed back out of closed segments, most recently used first.
+     * Bounded by #maxCachedEntries.
+     */
+    mutable std::list<std::pair<uint64_t, Entry>> entryCache;
+
+    /**
+     * Maps from entry index to its position in #entryCache.
+     */
+    mutable std::unordered_map<
+        uint64_t,
+        std::list<std::pair<uint64_t, Entry>>::iterator> entryCacheIndex;
+
+    /**
+     * The number of #getEntry() calls for released entries that were found
+     * in #entryCache.
+     */
+    mutable uint64_t entryCacheHits;
+
+    /**
+     * The number of #getEntry() calls for released entries that had to be
+     * read from disk.
+     */
+    mutable uint64_t entryCacheMisses;
+
+    /**
+     * The maximum number of closed segments whose files are kept open and
+     * mapped by openReleasedSegment() at once. At least 1.
+     * Controlled by the 'storageMaxMappedSegments' config option.
+     */
+    const uint64_t maxMappedSegments;
+
+    /**
+     * The start indexes of closed segments opened by openReleasedSegment(),
+     * most recently used first. Bounded by #maxMappedSegments: the least
+     * recently used segment's Segment::file and Segment::contents are closed
+     * to make room for another.
+     */
+    mutable std::list<uint64_t> mappedSegments;
+
+    /**
+     * Maps from segment start index to its position in #mappedSegments.
+     */
+    mutable std::unordered_map<
+        uint64_t,
+        std::list<uint64_t>::iterator> mappedSegmentsIndex;
+
+    /**
+     * If true, cold closed segments are compressed (see the class comment).
+     * Controlled by the 'storageCompressSegments' config option.
+     */
+    const bool compressSegments;
+
+    /**
+     * The number of newest closed segments that are never compressed.
+     * Controlled by the 'storageHotSegments' config option.
+     */
+    const uint64_t hotSegments;
+
+    /**
+     * The number of bytes of a segment to compress into each block.
+     * Controlled by the 'storageCompressedBlockBytes' config option.
+     */
+    const uint64_t compressedBlockBytes;
+
+    /**
+     * The maximum number of decompressed blocks kept in #blockCache.
+     * Controlled by the 'storageCompressedBlockCacheBlocks' config option.
+     */
+    const uint64_t maxCachedBlocks;
+
+    /**
+     * Blocks decompressed by readCompressed(), most recently used first,
+     * keyed by the start index of their segment and their block number.
+     * Bounded by #maxCachedBlocks.
+     */
+    mutable std::list<std::pair<std::pair<uint64_t, uint64_t>, std::string>>
+        blockCache;
+
+    /**
+     * Maps from segment start index and block number to the block's position
+     * in #blockCache.
+     */
+    mutable std::map<
+        std::pair<uint64_t, uint64_t>,
+        std::list<std::pair<std::pair<uint64_t, uint64_t>,
+                            std::string>>::iterator> blockCacheIndex;
+
+    /**
+     * The number of blocks readCompressed() found in #blockCache.
+     */
+    mutable uint64_t blockCacheHits;
+
+    /**
+     * The number of blocks readCompressed() had to decompress.
+     */
+    mutable uint64_t blockCacheMisses;
+
+    /**
+     * If true, the open segment is opened with O_DIRECT and written from
+     * #directIOBuffer. Controlled by the 'storageDirectIO' config option, and
+     * cleared if the filesystem doesn't support O_DIRECT.
+     */
+    bool directIO;
+
+    /**
+     * The block size to which O_DIRECT writes are aligned, in bytes.
+     * Controlled by the 'storageDirectIOAlignment' config option.
+     */
+    const uint64_t directIOAlignment;
+
+    /**
+     * When #directIO is set, the contents of the open segment from
+     * #directIOBufferOffset through the end of its last record.
+     */
+    std::string directIOBuffer;
+
+    /**
+     * The offset in the open segment of the first byte in #directIOBuffer.
+     * This is always a multiple of #directIOAlignment.
+     */
+    uint64_t directIOBufferOffset;
+
+    /**
+     * True if #directIOBuffer has records that haven't yet been queued for
+     * writing by #flushDirectIOBuffer().
+     */
+    bool directIOBufferDirty;
+
     /**
      * See PreparedSegments.
      */
     PreparedSegments preparedSegments;
 
+    /**
+     * If true, segments that truncatePrefix() drops are destroyed and their
+     * files removed by the #segmentReclaimer thread. Otherwise, they're
+     * destroyed right away and removed by the next Sync. Controlled by the
+     * 'storageBackgroundReclaim' config option.
+     */
+    const bool backgroundReclaim;
+
+    /**
+     * See Reclaimer.
+     */
+    Reclaimer reclaimer;
+
+    /**
+     * See Compressor.
+     */
+    Compressor compressor;
+
+    /**
+     * If not NULL, Syncs submit their operations through this ring rather
+     * than with blocking system calls. Controlled by the 'storageIoUring'
+     * config option, and left NULL if the kernel doesn't support io_uring.
+     */
+    std::unique_ptr<IoUring> ioUring;
+
+    /**
+     * See MetadataFiles. This is declared before #currentSync so that it's
+     * destroyed after any METADATA operations that refer to it.
+     */
+    MetadataFiles metadataFiles;
+
     /**
      * Accumulates deferred filesystem operations for append() and
      * truncatePrefix().
@@ -648,6 +1749,18 @@ class SegmentedLog : public Log {
      * #preparedSegments for the log to use.
      */
     std::thread segmentPreparer;
+
+    /**
+     * Destroys segments and removes files queued on #reclaimer. Only
+     * started if #backgroundReclaim is set.
+     */
+    std::thread segmentReclaimer;
+
+    /**
+     * Writes compressed copies of the segments queued on #compressor. Only
+     * started if #compressSegments is set.
+     */
+    std::thread segmentCompressor;
 };
 
 } // namespace LibLogCabin::Storage
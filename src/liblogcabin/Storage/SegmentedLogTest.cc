@@ -14,6 +14,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <climits>
 #include <fcntl.h>
 #include <gtest/gtest.h>
 #include <sys/mman.h>
@@ -22,7 +23,9 @@
 #include "liblogcabin/Core/Debug.h"
 #include "liblogcabin/Core/ProtoBuf.h"
 #include "liblogcabin/Core/STLUtil.h"
+#include "liblogcabin/Core/StringUtil.h"
 #include "liblogcabin/Core/Util.h"
+#include "liblogcabin/Protocol/ServerStats.pb.h"
 #include "liblogcabin/Storage/FilesystemUtil.h"
 #include "liblogcabin/Storage/Layout.h"
 #include "liblogcabin/Storage/SegmentedLog.h"
@@ -46,7 +49,7 @@ extractOpCodes(const SegmentedLog::Sync& sync)
 TEST(StorageSegmentedLogSyncTest, optimize)
 {
     typedef SegmentedLog::Sync::Op Op;
-    SegmentedLog::Sync sync(0, std::chrono::nanoseconds(1));
+    SegmentedLog::Sync sync(0, std::chrono::nanoseconds(1), NULL, NULL);
 
     sync.optimize(); // hopefully no out of bounds issues
     EXPECT_EQ(0U, sync.ops.size());
@@ -60,7 +63,7 @@ TEST(StorageSegmentedLogSyncTest, optimize)
     EXPECT_EQ((std::vector<Op::OpCode> {
                    Op::WRITE,
                    Op::NOOP,
-                   Op::WRITE,
+                   Op::NOOP, // merged into first write
                    Op::FDATASYNC,
                }), extractOpCodes(sync));
 
@@ -78,11 +81,11 @@ TEST(StorageSegmentedLogSyncTest, optimize)
     EXPECT_EQ((std::vector<Op::OpCode> {
                    Op::WRITE,
                    Op::NOOP,
-                   Op::WRITE,
                    Op::NOOP,
-                   Op::WRITE,
                    Op::NOOP,
-                   Op::WRITE,
+                   Op::NOOP,
+                   Op::NOOP,
+                   Op::NOOP,
                    Op::FDATASYNC,
                }), extractOpCodes(sync));
 
@@ -125,6 +128,45 @@ TEST(StorageSegmentedLogSyncTest, optimize)
     sync.completed = true;
 }
 
+TEST(StorageSegmentedLogSyncTest, optimize_mergeWrites)
+{
+    typedef SegmentedLog::Sync::Op Op;
+    SegmentedLog::Sync sync(0, std::chrono::nanoseconds(1), NULL, NULL);
+    for (uint64_t i = 0; i < 3; ++i) {
+        sync.ops.emplace_back(30, Op::WRITE);
+        sync.ops.back().writeData.emplace_back();
+    }
+    sync.ops.emplace_back(31, Op::WRITE);
+    sync.ops.back().writeData.emplace_back();
+    sync.ops.emplace_back(31, Op::FSYNC);
+    sync.ops.emplace_back(31, Op::WRITE);
+    sync.ops.back().writeData.emplace_back();
+    sync.optimize();
+    EXPECT_EQ((std::vector<Op::OpCode> {
+                   Op::WRITE,
+                   Op::NOOP,
+                   Op::NOOP,
+                   Op::WRITE, // different fd
+                   Op::FSYNC,
+                   Op::WRITE, // not adjacent
+               }), extractOpCodes(sync));
+    EXPECT_EQ(3U, sync.ops.at(0).writeData.size());
+    EXPECT_EQ(1U, sync.ops.at(3).writeData.size());
+
+    // no more than IOV_MAX buffers per write
+    sync.ops.clear();
+    for (uint64_t i = 0; i < IOV_MAX + 1; ++i) {
+        sync.ops.emplace_back(30, Op::WRITE);
+        sync.ops.back().writeData.emplace_back();
+    }
+    sync.optimize();
+    EXPECT_EQ(uint64_t(IOV_MAX), sync.ops.at(0).writeData.size());
+    EXPECT_EQ(Op::WRITE, sync.ops.at(IOV_MAX).opCode);
+    EXPECT_EQ(1U, sync.ops.at(IOV_MAX).writeData.size());
+
+    sync.completed = true;
+}
+
 // One thing to keep in mind for these tests is truncatePrefix. Calling that
 // basically affects every other method, so every test should include
 // a call to truncatePrefix.
@@ -138,8 +180,16 @@ class StorageSegmentedLogTest : public ::testing::Test {
         , closedSegment()
         , openSegment()
     {
+        // The log's background threads may hold locks (such as ThreadId's)
+        // when a death test forks, which can hang the child. Re-executing
+        // the test binary for death tests avoids that. gtest restores this
+        // flag after each test.
+        ::testing::FLAGS_gtest_death_test_style = "threadsafe";
         config.set<uint64_t>("storageSegmentBytes", 1024);
         config.set<uint64_t>("storageOpenSegments", 1);
+        // The default depends on the CPU, and the checksum's length affects
+        // record sizes, which some tests depend on.
+        config.set("storageChecksum", "CRC32C");
         config.set<bool>("unittest-quiet", true);
         config.set<bool>("storageDebug", true);
         layout.initTemporary();
@@ -187,15 +237,25 @@ class StorageSegmentedLogTest : public ::testing::Test {
         log->append({&sampleEntry, &sampleEntry}); // index 7-8
         sync();
         FS::File logDir = FS::dup(log->dir);
+        // index files are only written when entries are released
+        bool indexes = (log->maxCachedEntries > 0);
         log.reset();
-        EXPECT_EQ((std::vector<std::string> {
-                        "00000000000000000003-00000000000000000004",
-                        "00000000000000000005-00000000000000000006",
-                        "00000000000000000007-00000000000000000008",
-                        "metadata1",
-                        "metadata2",
-                   }),
-                  sorted(FS::ls(logDir)));
+        std::vector<std::string> expected = {
+            "00000000000000000003-00000000000000000004",
+            "00000000000000000005-00000000000000000006",
+            "00000000000000000007-00000000000000000008",
+            "metadata1",
+            "metadata2",
+        };
+        if (indexes) {
+            expected.push_back(
+                "00000000000000000003-00000000000000000004.index");
+            expected.push_back(
+                "00000000000000000005-00000000000000000006.index");
+            expected.push_back(
+                "00000000000000000007-00000000000000000008.index");
+        }
+        EXPECT_EQ(sorted(expected), sorted(FS::ls(logDir)));
     }
 
     void readProtoFromFileHelper() {
@@ -299,6 +359,21 @@ TEST_F(StorageSegmentedLogTest, append_blackbox)
     sync();
 }
 
+TEST_F(StorageSegmentedLogTest, appendMoved_blackbox)
+{
+    log->truncatePrefix(10);
+    std::vector<Log::Entry> entries(2, sampleEntry);
+    std::pair<uint64_t, uint64_t> range =
+        log->appendMoved(std::move(entries));
+    EXPECT_EQ(10U, range.first);
+    EXPECT_EQ(11U, range.second);
+    EXPECT_EQ("foo", log->getEntry(11).data());
+    EXPECT_EQ(11U, log->getEntry(11).index());
+    sync();
+    construct();
+    EXPECT_EQ("foo", log->getEntry(11).data());
+}
+
 TEST_F(StorageSegmentedLogTest, getEntry_blackbox)
 {
     log->append({&sampleEntry});
@@ -318,6 +393,26 @@ TEST_F(StorageSegmentedLogTest, getEntry_blackbox)
     sync();
 }
 
+TEST_F(StorageSegmentedLogTest, getTerm_blackbox)
+{
+    log->append({&sampleEntry, &sampleEntry}); // index 1-2
+    sampleEntry.set_term(41);
+    log->append({&sampleEntry, &sampleEntry}); // index 3-4
+    log->truncatePrefix(2);
+    EXPECT_EQ(40U, log->getTerm(2));
+    EXPECT_EQ(41U, log->getTerm(3));
+    EXPECT_DEATH(log->getTerm(1), "outside");
+    EXPECT_DEATH(log->getTerm(5), "outside");
+    sync();
+    log->truncateSuffix(3);
+    sync();
+    construct();
+    EXPECT_EQ(2U, log->termIndex.getNumRuns());
+    EXPECT_EQ(40U, log->getTerm(2));
+    EXPECT_EQ(41U, log->getTerm(3));
+    EXPECT_DEATH(log->getTerm(4), "outside");
+}
+
 TEST_F(StorageSegmentedLogTest, getLogStartIndex_blackbox)
 {
     EXPECT_EQ(1U, log->getLogStartIndex());
@@ -561,6 +656,9 @@ TEST_F(StorageSegmentedLogTest, constructor_nodup_sameStartIndex)
 
 TEST_F(StorageSegmentedLogTest, constructor_nodup_differentStartIndex)
 {
+    // Entries need their own records to be copied separately.
+    config.set<uint64_t>("storageSegmentVersion", 1);
+    construct();
     FS::File logDir = FS::dup(log->dir);
     setUpThreeSegments();
     {
@@ -598,31 +696,245 @@ TEST_F(StorageSegmentedLogTest, append_rollover)
 {
     log->truncatePrefix(3);
     std::vector<const Log::Entry*> entries;
-    for (uint64_t i = 3; i <= 19; ++i)
+    for (uint64_t i = 3; i <= 25; ++i)
         entries.push_back(&sampleEntry);
-    EXPECT_EQ((std::pair<uint64_t, uint64_t>{3, 19}),
+    EXPECT_EQ((std::pair<uint64_t, uint64_t>{3, 25}),
               log->append(entries));
-    EXPECT_EQ((std::vector<uint64_t> { 3, 17 }),
+    EXPECT_EQ((std::vector<uint64_t> { 3, 22 }),
               Core::STLUtil::getKeys(log->segmentsByStartIndex))
         << "This test may fail when record sizes change.";
+    // The batch is split between the two segments.
+    const SegmentedLog::Segment& first = log->segmentsByStartIndex.at(3);
     EXPECT_EQ(sizeof(SegmentedLog::SegmentHeader),
-              log->segmentsByStartIndex.at(17).entries.at(0).offset);
-    EXPECT_EQ(19U, log->currentSync->lastIndex);
+              first.entries.at(18).offset);
+    EXPECT_EQ(first.bytes - sizeof(SegmentedLog::SegmentHeader),
+              first.entries.at(0).length);
+    EXPECT_EQ(0U, first.entries.at(18).length);
+    EXPECT_EQ(sizeof(SegmentedLog::SegmentHeader),
+              log->segmentsByStartIndex.at(22).entries.at(0).offset);
+    EXPECT_EQ(25U, log->currentSync->lastIndex);
     sync();
     FS::File logDir = FS::dup(log->dir);
     log.reset();
     EXPECT_EQ((std::vector<std::string> {
-                    "00000000000000000003-00000000000000000016",
-                    "00000000000000000017-00000000000000000019",
+                    "00000000000000000003-00000000000000000021",
+                    "00000000000000000022-00000000000000000025",
                     "metadata1",
                     "metadata2",
                }),
               sorted(FS::ls(logDir)));
     EXPECT_GE(1024U, getSize(FS::openFile(
                                 logDir,
-                                "00000000000000000003-00000000000000000016",
+                                "00000000000000000003-00000000000000000021",
                                 O_RDONLY)));
     construct(); // extra sanity checks
+    EXPECT_EQ("foo", log->getEntry(21).data());
+    EXPECT_EQ("foo", log->getEntry(22).data());
+}
+
+TEST_F(StorageSegmentedLogTest, append_rolloverWritesIndexInSync)
+{
+    config.set<uint64_t>("storageEntryCacheEntries", 10);
+    construct();
+    log->truncatePrefix(3);
+    std::vector<const Log::Entry*> entries;
+    for (uint64_t i = 3; i <= 25; ++i)
+        entries.push_back(&sampleEntry);
+    log->append(entries);
+    const char* indexFilename =
+        "00000000000000000003-00000000000000000021.index";
+    // append() leaves creating the index file to the Sync
+    EXPECT_EQ(-1, FS::tryOpenFile(log->dir, indexFilename, O_RDONLY).fd);
+    sync();
+    FS::File logDir = FS::dup(log->dir);
+    EXPECT_LT(0U, getSize(FS::openFile(logDir, indexFilename, O_RDONLY)));
+    construct(); // reads the index back
+    EXPECT_EQ("foo", log->getEntry(21).data());
+}
+
+TEST_F(StorageSegmentedLogTest, append_rollover_version1)
+{
+    config.set<uint64_t>("storageSegmentVersion", 1);
+    construct();
+    log->truncatePrefix(3);
+    std::vector<const Log::Entry*> entries;
+    for (uint64_t i = 3; i <= 19; ++i)
+        entries.push_back(&sampleEntry);
+    EXPECT_EQ((std::pair<uint64_t, uint64_t>{3, 19}),
+              log->append(entries));
+    EXPECT_EQ((std::vector<uint64_t> { 3, 17 }),
+              Core::STLUtil::getKeys(log->segmentsByStartIndex))
+        << "This test may fail when record sizes change.";
+    EXPECT_EQ(sizeof(SegmentedLog::SegmentHeader),
+              log->segmentsByStartIndex.at(17).entries.at(0).offset);
+    sync();
+
+    // Version 1 segments can still be read after switching versions.
+    config.set<uint64_t>("storageSegmentVersion", 2);
+    construct();
+    EXPECT_EQ(19U, log->getLastLogIndex());
+    EXPECT_EQ(1U, log->segmentsByStartIndex.at(3).version);
+    EXPECT_EQ(1U, log->segmentsByStartIndex.at(17).version);
+    EXPECT_EQ("foo", log->getEntry(18).data());
+    log->append({&sampleEntry});
+    sync();
+    construct();
+    EXPECT_EQ(2U, log->segmentsByStartIndex.at(20).version);
+    EXPECT_EQ("foo", log->getEntry(20).data());
+}
+
+// Uses io_uring if the kernel allows it; otherwise this exercises the
+// fallback path.
+TEST_F(StorageSegmentedLogTest, append_ioUring)
+{
+    config.set<bool>("storageIoUring", true);
+    construct();
+    log->truncatePrefix(3);
+    std::vector<const Log::Entry*> entries;
+    for (uint64_t i = 3; i <= 19; ++i)
+        entries.push_back(&sampleEntry);
+    log->append(entries);
+    sync();
+    log->truncatePrefix(17);
+    sync();
+    FS::File logDir = FS::dup(log->dir);
+    construct();
+    EXPECT_EQ(17U, log->getLogStartIndex());
+    EXPECT_EQ(19U, log->getLastLogIndex());
+    EXPECT_EQ("foo", log->getEntry(19).data());
+    EXPECT_EQ(-1, FS::tryOpenFile(
+                    logDir, "00000000000000000003-00000000000000000016",
+                    O_RDONLY).fd);
+    EXPECT_EQ(-1, FS::tryOpenFile(
+                    logDir, "00000000000000000003-00000000000000000016.index",
+                    O_RDONLY).fd);
+}
+
+// Uses io_uring if the kernel allows it; otherwise this exercises the
+// fallback path.
+TEST_F(StorageSegmentedLogTest, waitIoUring_unlinkOrdering)
+{
+    typedef SegmentedLog::Sync::Op Op;
+    config.set<bool>("storageIoUring", true);
+    construct();
+    FS::openFile(log->dir, "a", O_CREAT|O_WRONLY);
+    FS::openFile(log->dir, "c", O_CREAT|O_WRONLY);
+    std::unique_ptr<Log::Sync> s = log->takeSync();
+    SegmentedLog::Sync& sync = *static_cast<SegmentedLog::Sync*>(s.get());
+    // the unlink of b must wait for the rename that creates it
+    sync.ops.emplace_back(log->dir.fd, Op::RENAME);
+    sync.ops.back().filename1 = "a";
+    sync.ops.back().filename2 = "b";
+    sync.ops.emplace_back(log->dir.fd, Op::UNLINKAT);
+    sync.ops.back().filename1 = "b";
+    // a missing file doesn't stop the ops after it
+    sync.ops.emplace_back(log->dir.fd, Op::UNLINKAT);
+    sync.ops.back().filename1 = "missing";
+    sync.ops.emplace_back(log->dir.fd, Op::RENAME);
+    sync.ops.back().filename1 = "c";
+    sync.ops.back().filename2 = "d";
+    s->wait();
+    log->syncComplete(std::move(s));
+    EXPECT_EQ(-1, FS::tryOpenFile(log->dir, "a", O_RDONLY).fd);
+    EXPECT_EQ(-1, FS::tryOpenFile(log->dir, "b", O_RDONLY).fd);
+    EXPECT_EQ(-1, FS::tryOpenFile(log->dir, "c", O_RDONLY).fd);
+    EXPECT_NE(-1, FS::tryOpenFile(log->dir, "d", O_RDONLY).fd);
+    FS::removeFile(log->dir, "d");
+}
+
+// Uses io_uring if the kernel allows it; otherwise this exercises the
+// fallback path.
+TEST_F(StorageSegmentedLogTest, waitIoUring_chainsPerFile)
+{
+    typedef SegmentedLog::Sync::Op Op;
+    config.set<bool>("storageIoUring", true);
+    construct();
+    FS::File a = FS::openFile(log->dir, "a", O_CREAT|O_WRONLY);
+    FS::File b = FS::openFile(log->dir, "b", O_CREAT|O_WRONLY);
+    std::unique_ptr<Log::Sync> s = log->takeSync();
+    SegmentedLog::Sync& sync = *static_cast<SegmentedLog::Sync*>(s.get());
+    // writes to each file stay in order, interleaved with the other file's
+    for (int i = 0; i < 2; ++i) {
+        sync.ops.emplace_back(a.fd, Op::WRITE);
+        sync.ops.back().writeData.emplace_back(
+            const_cast<char*>("aa"), 2, Core::Buffer::Deleter());
+        sync.ops.emplace_back(b.fd, Op::WRITE);
+        sync.ops.back().writeData.emplace_back(
+            const_cast<char*>("bbb"), 3, Core::Buffer::Deleter());
+    }
+    sync.ops.emplace_back(a.fd, Op::FDATASYNC);
+    sync.ops.emplace_back(b.fd, Op::FDATASYNC);
+    // the rename waits for both files' ops
+    sync.ops.emplace_back(log->dir.fd, Op::RENAME);
+    sync.ops.back().filename1 = "a";
+    sync.ops.back().filename2 = "c";
+    sync.ops.emplace_back(log->dir.fd, Op::FSYNC);
+    s->wait();
+    log->syncComplete(std::move(s));
+    EXPECT_EQ(4U, FS::getSize(a));
+    EXPECT_EQ(6U, FS::getSize(b));
+    EXPECT_EQ(-1, FS::tryOpenFile(log->dir, "a", O_RDONLY).fd);
+    EXPECT_NE(-1, FS::tryOpenFile(log->dir, "c", O_RDONLY).fd);
+    FS::removeFile(log->dir, "b");
+    FS::removeFile(log->dir, "c");
+}
+
+TEST_F(StorageSegmentedLogTest, append_directIO)
+{
+    typedef SegmentedLog::Sync::Op Op;
+    config.set<bool>("storageDirectIO", true);
+    config.set<uint64_t>("storageDirectIOAlignment", 512);
+    construct();
+    ASSERT_TRUE(log->directIO);
+    log->truncatePrefix(3);
+    sync();
+
+    // Each Sync writes the staged records as whole blocks, starting from the
+    // block containing the end of the previous Sync's records.
+    uint64_t index = 3;
+    for (uint64_t i = 0; i < 3; ++i) {
+        uint64_t startBytes = log->getOpenSegment().bytes;
+        std::vector<const Log::Entry*> entries;
+        for (uint64_t j = 0; j < 3; ++j)
+            entries.push_back(&sampleEntry);
+        log->append(entries);
+        index += entries.size();
+        uint64_t endBytes = log->getOpenSegment().bytes;
+        std::unique_ptr<Log::Sync> s = log->takeSync();
+        SegmentedLog::Sync& sync = *static_cast<SegmentedLog::Sync*>(s.get());
+        ASSERT_EQ(1U, sync.ops.size());
+        const Op& op = sync.ops.front();
+        EXPECT_EQ(Op::WRITE, op.opCode);
+        EXPECT_EQ(int64_t(startBytes / 512 * 512), op.offset);
+        ASSERT_EQ(1U, op.writeData.size());
+        EXPECT_EQ((endBytes + 511) / 512 * 512 - uint64_t(op.offset),
+                  op.writeData.at(0).getLength());
+        EXPECT_EQ(0U, uint64_t(op.writeData.at(0).getData()) % 512);
+        s->wait();
+        log->syncComplete(std::move(s));
+    }
+
+    // Fill past the end of the segment so that it rolls over.
+    std::vector<const Log::Entry*> entries;
+    for (uint64_t j = 0; j < 20; ++j)
+        entries.push_back(&sampleEntry);
+    log->append(entries);
+    index += entries.size();
+    EXPECT_LT(1U, log->segmentsByStartIndex.size());
+    sync();
+
+    // The io_uring path writes at the same offsets.
+    config.set<bool>("storageIoUring", true);
+    construct();
+    log->append(entries);
+    index += entries.size();
+    sync();
+
+    construct();
+    EXPECT_EQ(3U, log->getLogStartIndex());
+    EXPECT_EQ(index - 1, log->getLastLogIndex());
+    for (uint64_t i = 3; i < index; ++i)
+        EXPECT_EQ("foo", log->getEntry(i).data()) << i;
 }
 
 TEST_F(StorageSegmentedLogTest, append_largerThanMaxSegmentSize)
@@ -732,6 +1044,121 @@ TEST_F(StorageSegmentedLogTest, truncatePrefix_allSegments)
               sorted(FS::ls(logDir)));
 }
 
+TEST_F(StorageSegmentedLogTest, truncatePrefix_backgroundReclaim)
+{
+    config.set<uint64_t>("storageRecycleSegments", 0);
+    construct();
+    log->append({&sampleEntry, &sampleEntry}); // index 1-2
+    sync();
+    log->closeSegment();
+    log->openNewSegment();
+    log->append({&sampleEntry}); // index 3
+    std::string name1 = "00000000000000000001-00000000000000000002";
+    log->truncatePrefix(3);
+    EXPECT_EQ((std::vector<std::string> {
+                   name1,
+                   name1 + ".index",
+               }),
+              log->currentSync->removedFilenames);
+    for (auto it = log->currentSync->ops.begin();
+         it != log->currentSync->ops.end();
+         ++it) {
+        EXPECT_NE(SegmentedLog::Sync::Op::UNLINKAT, it->opCode);
+    }
+    log->reclaimer.waitUntilIdle();
+    // The files stay until the new start index is durable.
+    EXPECT_NE(-1, FS::tryOpenFile(log->dir, name1, O_RDONLY).fd);
+    sync();
+    log->reclaimer.waitUntilIdle();
+    EXPECT_EQ(-1, FS::tryOpenFile(log->dir, name1, O_RDONLY).fd);
+    EXPECT_EQ(-1, FS::tryOpenFile(log->dir, name1 + ".index",
+                                  O_RDONLY).fd);
+    EXPECT_EQ(3U, log->getLogStartIndex());
+    EXPECT_EQ(3U, log->getLastLogIndex());
+}
+
+TEST_F(StorageSegmentedLogTest, truncatePrefix_noBackgroundReclaim)
+{
+    config.set<uint64_t>("storageRecycleSegments", 0);
+    config.set<bool>("storageBackgroundReclaim", false);
+    construct();
+    EXPECT_FALSE(log->segmentReclaimer.joinable());
+    log->append({&sampleEntry, &sampleEntry}); // index 1-2
+    sync();
+    log->closeSegment();
+    log->openNewSegment();
+    log->append({&sampleEntry}); // index 3
+    std::string name1 = "00000000000000000001-00000000000000000002";
+    log->truncatePrefix(3);
+    EXPECT_EQ(0U, log->currentSync->removedFilenames.size());
+    std::vector<std::string> unlinked;
+    for (auto it = log->currentSync->ops.begin();
+         it != log->currentSync->ops.end();
+         ++it) {
+        if (it->opCode == SegmentedLog::Sync::Op::UNLINKAT)
+            unlinked.push_back(it->filename1);
+    }
+    EXPECT_EQ((std::vector<std::string> {
+                   name1,
+                   name1 + ".index",
+               }),
+              unlinked);
+    sync();
+    EXPECT_EQ(-1, FS::tryOpenFile(log->dir, name1, O_RDONLY).fd);
+}
+
+TEST_F(StorageSegmentedLogTest, truncatePrefix_recyclesSegments)
+{
+    config.set<uint64_t>("storageRecycleSegments", 1);
+    construct();
+    log->append({&sampleEntry, &sampleEntry}); // index 1-2
+    sync();
+    log->closeSegment();
+    log->openNewSegment();
+    log->append({&sampleEntry, &sampleEntry}); // index 3-4
+    sync();
+    log->closeSegment();
+    log->openNewSegment();
+    // wait for the preparer thread to refill its queue
+    auto waitForPreparer = [this] () {
+        SegmentedLog::PreparedSegments& prepared = log->preparedSegments;
+        while (true) {
+            {
+                std::lock_guard<Core::Mutex> lockGuard(prepared.mutex);
+                if (prepared.demanded == 0 &&
+                    !prepared.openSegments.empty()) {
+                    break;
+                }
+            }
+            usleep(1000);
+        }
+    };
+    waitForPreparer();
+    std::string name1 = "00000000000000000001-00000000000000000002";
+    std::string name3 = "00000000000000000003-00000000000000000004";
+    uint64_t bytes1 = FS::getSize(FS::openFile(log->dir, name1, O_RDONLY));
+    log->truncatePrefix(5);
+    EXPECT_EQ((std::vector<std::string> { name1 }),
+              log->currentSync->recycledFilenames);
+    // Otherwise the preparer might take the recycled segment.
+    waitForPreparer();
+    sync();
+    log->reclaimer.waitUntilIdle();
+    EXPECT_EQ(-1, FS::tryOpenFile(log->dir, name3, O_RDONLY).fd);
+    EXPECT_EQ(-1, FS::tryOpenFile(log->dir, name1 + ".index", O_RDONLY).fd);
+    EXPECT_EQ(1U, log->preparedSegments.recycled.size());
+
+    auto ret = log->prepareNewSegment(50);
+    EXPECT_EQ("open-50", ret.first);
+    EXPECT_EQ(-1, FS::tryOpenFile(log->dir, name1, O_RDONLY).fd);
+    EXPECT_EQ(log->MAX_SEGMENT_SIZE, FS::getSize(ret.second));
+    FS::FileContents contents(ret.second);
+    EXPECT_EQ(2U, *contents.get<uint8_t>(0, 1)); // header
+    // The old entries are left in place.
+    EXPECT_NE(0U, *contents.get<uint8_t>(1, 1));
+    EXPECT_EQ(0U, *contents.get<uint8_t>(bytes1, 1));
+}
+
 TEST_F(StorageSegmentedLogTest, truncateSuffix_noop)
 {
     log->truncatePrefix(3);
@@ -778,6 +1205,37 @@ TEST_F(StorageSegmentedLogTest, truncateSuffix_openSegment_partial)
     EXPECT_EQ(3U, log->getLastLogIndex());
 }
 
+TEST_F(StorageSegmentedLogTest, truncateSuffix_midBatch)
+{
+    log->truncatePrefix(3);
+    log->append({&sampleEntry, &sampleEntry, &sampleEntry}); // index 3-5
+    sync();
+    uint64_t batchBytes = log->segmentsByStartIndex.at(3).bytes;
+    log->truncateSuffix(4);
+    // The whole batch stays, but entry 5 is no longer part of the log.
+    const SegmentedLog::Segment& segment = log->segmentsByStartIndex.at(3);
+    EXPECT_EQ(2U, segment.entries.size());
+    EXPECT_EQ(batchBytes, segment.bytes);
+    Log::Entry entry = sampleEntry;
+    entry.set_data("bar");
+    log->append({&entry}); // index 5
+    sync();
+    EXPECT_EQ("bar", log->getEntry(5).data());
+    log.reset();
+    construct();
+    EXPECT_EQ(5U, log->getLastLogIndex());
+    EXPECT_EQ("foo", log->getEntry(4).data());
+    EXPECT_EQ("bar", log->getEntry(5).data());
+    // Again, with released entries: the first load writes the index and the
+    // second one uses it.
+    config.set<uint64_t>("storageEntryCacheEntries", 10);
+    construct();
+    construct();
+    EXPECT_EQ(2U, log->segmentsByStartIndex.at(3).entries.size());
+    EXPECT_EQ("foo", log->getEntry(4).data());
+    EXPECT_EQ("bar", log->getEntry(5).data());
+}
+
 TEST_F(StorageSegmentedLogTest, truncateSuffix_openSegment_full)
 {
     log->truncatePrefix(3);
@@ -843,6 +1301,69 @@ TEST_F(StorageSegmentedLogTest, truncateSuffix_closedSegments)
 
 // updateMetadata tested pretty well in constructor tests already
 
+TEST_F(StorageSegmentedLogTest, metadataFiles_write)
+{
+    SegmentedLog::MetadataFiles files;
+    files.open(log->dir, 5, 4);
+    SegmentedLogMetadata::Metadata metadata;
+    metadata.set_format_version(1);
+    metadata.set_entries_start(1);
+    auto record = [&](uint64_t version) {
+        metadata.set_version(version);
+        return log->serializeProto(metadata);
+    };
+    // Goes to metadata2, which has the older version.
+    EXPECT_TRUE(files.write(record(6), 6));
+    // Superseded by version 6.
+    EXPECT_FALSE(files.write(record(5), 5));
+    EXPECT_FALSE(files.write(record(6), 6));
+    // Goes to metadata1.
+    EXPECT_TRUE(files.write(record(7), 7));
+    SegmentedLogMetadata::Metadata m1;
+    SegmentedLogMetadata::Metadata m2;
+    EXPECT_TRUE(log->readMetadata("metadata1", m1, false));
+    EXPECT_TRUE(log->readMetadata("metadata2", m2, false));
+    EXPECT_EQ(7U, m1.version());
+    EXPECT_EQ(6U, m2.version());
+}
+
+TEST_F(StorageSegmentedLogTest, truncatePrefix_queuesMetadata)
+{
+    log->truncatePrefix(3);
+    // Queued before the open segment is removed.
+    EXPECT_EQ(SegmentedLog::Sync::Op::METADATA,
+              log->currentSync->ops.front().opCode);
+    EXPECT_EQ(SegmentedLog::Sync::Op::CLOSE,
+              log->currentSync->ops.at(1).opCode);
+    EXPECT_EQ((std::vector<std::string> {
+                   "open-1",
+               }),
+              log->currentSync->removedFilenames);
+    SegmentedLogMetadata::Metadata m1;
+    SegmentedLogMetadata::Metadata m2;
+    EXPECT_TRUE(log->readMetadata("metadata1", m1, false));
+    EXPECT_TRUE(log->readMetadata("metadata2", m2, false));
+    EXPECT_EQ(1U, m1.entries_start());
+    EXPECT_EQ(1U, m2.entries_start());
+    sync();
+    EXPECT_TRUE(log->readMetadata("metadata1", m1, false));
+    EXPECT_EQ(3U, m1.entries_start());
+    EXPECT_EQ(3U, m1.version());
+
+    // A synchronous update that overtakes a queued one supersedes it.
+    log->truncatePrefix(5);
+    log->updateMetadata();
+    sync();
+    EXPECT_TRUE(log->readMetadata("metadata1", m1, false));
+    EXPECT_TRUE(log->readMetadata("metadata2", m2, false));
+    EXPECT_EQ(3U, m1.version());
+    EXPECT_EQ("version: 5 "
+              "format_version: 1 "
+              "entries_start: 5", m2);
+    construct();
+    EXPECT_EQ(5U, log->getLogStartIndex());
+}
+
 TEST_F(StorageSegmentedLogTest, readSegmentFilenames)
 {
     log->closeSegment();
@@ -939,9 +1460,10 @@ TEST_F(StorageSegmentedLogTest, loadClosedSegment_unknownVersion)
     FS::File file = FS::openFile(log->dir,
                                  closedSegment.filename,
                                  O_CREAT|O_WRONLY);
-    writeSegmentHeader(file, /*version=*/2);
+    writeSegmentHeader(file, /*version=*/3);
     EXPECT_DEATH(log->loadClosedSegment(closedSegment, 5000),
-                 "version.*was 2, but this code can only read version 1");
+                 "version.*was 3, but this code can only read versions 1 "
+                 "and 2");
 }
 
 TEST_F(StorageSegmentedLogTest, loadClosedSegment_removeUnneeded)
@@ -978,6 +1500,8 @@ TEST_F(StorageSegmentedLogTest, loadClosedSegment_corrupt)
 
 TEST_F(StorageSegmentedLogTest, loadClosedSegment_extraBytes)
 {
+    config.set<uint64_t>("storageSegmentVersion", 1);
+    construct();
     log->truncatePrefix(3);
     log->append({&sampleEntry, &sampleEntry}); // index 3-4
     sync();
@@ -1004,6 +1528,31 @@ TEST_F(StorageSegmentedLogTest, loadClosedSegment_extraBytes)
     construct(); // additional sanity checks
 }
 
+TEST_F(StorageSegmentedLogTest, loadClosedSegment_batchPastEndIndex)
+{
+    log->truncatePrefix(3);
+    log->append({&sampleEntry, &sampleEntry}); // index 3-4, one batch
+    sync();
+    log->closeSegment();
+    log->openNewSegment();
+    std::string oldName = "00000000000000000003-00000000000000000004";
+    FS::File file = FS::openFile(log->dir, oldName, O_RDWR);
+    uint64_t oldSize = FS::getSize(file);
+    closedSegment.filename = "00000000000000000003-00000000000000000003";
+    closedSegment.startIndex = 3;
+    closedSegment.endIndex = 3;
+    FS::rename(log->dir, oldName,
+               log->dir, closedSegment.filename);
+    EXPECT_TRUE(log->loadClosedSegment(closedSegment, 1));
+    EXPECT_EQ(2U, closedSegment.version);
+    ASSERT_EQ(1U, closedSegment.entries.size());
+    EXPECT_EQ(3U, closedSegment.entries.at(0).entry.index());
+    EXPECT_EQ(oldSize - sizeof(SegmentedLog::SegmentHeader),
+              closedSegment.entries.at(0).length);
+    EXPECT_EQ(oldSize, closedSegment.bytes);
+    EXPECT_EQ(oldSize, FS::getSize(file));
+}
+
 TEST_F(StorageSegmentedLogTest, loadClosedSegment_ok)
 {
     log->truncatePrefix(3);
@@ -1019,6 +1568,131 @@ TEST_F(StorageSegmentedLogTest, loadClosedSegment_ok)
     EXPECT_EQ(2U, closedSegment.entries.size());
 }
 
+TEST_F(StorageSegmentedLogTest, loadClosedSegments)
+{
+    setUpThreeSegments();
+    config.set<uint64_t>("storageLoadThreads", 8);
+    construct();
+    EXPECT_EQ((std::vector<uint64_t> { 3, 5, 7, 9 }),
+              Core::STLUtil::getKeys(log->segmentsByStartIndex));
+
+    std::vector<SegmentedLog::Segment> segments(3);
+    segments.at(0).startIndex = 3;
+    segments.at(0).endIndex = 4;
+    segments.at(0).filename = segments.at(0).makeClosedFilename();
+    segments.at(1).startIndex = 5;
+    segments.at(1).endIndex = 6;
+    segments.at(1).filename = segments.at(1).makeClosedFilename();
+    segments.at(2).isOpen = true;
+    segments.at(2).filename = "open-90";
+    EXPECT_EQ((std::deque<bool> { true, true, false }),
+              log->loadClosedSegments(segments, 1, 8));
+    EXPECT_EQ(2U, segments.at(0).entries.size());
+    EXPECT_EQ(2U, segments.at(1).entries.size());
+    EXPECT_EQ(0U, segments.at(2).entries.size());
+}
+
+
+TEST_F(StorageSegmentedLogTest, loadClosedSegment_index)
+{
+    config.set<uint64_t>("storageEntryCacheEntries", 10);
+    construct(); // so that closing segments writes their indexes
+    FS::File logDir = FS::dup(log->dir);
+    setUpThreeSegments();
+    { // corrupt the batch with entries 5 and 6, which the index lets us
+      // skip reading
+        FS::File file = FS::openFile(
+            logDir, "00000000000000000005-00000000000000000006", O_RDWR);
+        uint64_t size = FS::getSize(file);
+        uint8_t* map = static_cast<uint8_t*>(
+            mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, file.fd, 0));
+        map[size - 2] = uint8_t(~map[size - 2]);
+        munmap(map, size);
+    }
+    construct();
+    const SegmentedLog::Segment& segment = log->segmentsByStartIndex.at(5);
+    EXPECT_EQ(2U, segment.entries.size());
+    EXPECT_TRUE(segment.entries.at(1).released);
+    EXPECT_EQ(40U, segment.entries.at(1).term);
+    EXPECT_EQ(segment.entries.at(0).offset, segment.entries.at(1).offset);
+    EXPECT_EQ(0U, segment.entries.at(1).length);
+    EXPECT_EQ(segment.bytes,
+              segment.entries.at(0).offset + segment.entries.at(0).length);
+    EXPECT_EQ("foo", log->getEntry(3).data());
+    EXPECT_DEATH(log->getEntry(6), "Could not re-read entry 6");
+}
+
+TEST_F(StorageSegmentedLogTest, readIndex)
+{
+    config.set<uint64_t>("storageEntryCacheEntries", 10);
+    construct(); // so that closing segments writes their indexes
+    FS::File logDir = FS::dup(log->dir);
+    setUpThreeSegments();
+    { // garbage index for 3-4, no index for 5-6
+        FS::File file = FS::openFile(
+            logDir, "00000000000000000003-00000000000000000004.index",
+            O_WRONLY|O_TRUNC);
+        EXPECT_EQ(3, FS::write(file.fd, "foo", 3));
+        FS::removeFile(logDir,
+                       "00000000000000000005-00000000000000000006.index");
+    }
+    LibLogCabin::Core::Debug::setLogPolicy({ // expect warnings
+        {"Storage/SegmentedLog", "ERROR"}
+    });
+    construct(); // scans both segments and rewrites their indexes
+    LibLogCabin::Core::Debug::setLogPolicy({
+        {"", "WARNING"}
+    });
+    EXPECT_EQ(6U, log->getEntry(6).index());
+
+    SegmentedLog::Segment segment;
+    segment.startIndex = 3;
+    segment.endIndex = 4;
+    segment.filename = segment.makeClosedFilename();
+    const SegmentedLog::Segment& loaded = log->segmentsByStartIndex.at(3);
+    LibLogCabin::Core::Debug::setLogPolicy({ // expect warnings
+        {"Storage/SegmentedLog", "ERROR"}
+    });
+    EXPECT_FALSE(log->readIndex(segment, loaded.bytes + 1));
+    LibLogCabin::Core::Debug::setLogPolicy({
+        {"", "WARNING"}
+    });
+    EXPECT_TRUE(log->readIndex(segment, loaded.bytes));
+    ASSERT_EQ(2U, segment.entries.size());
+    EXPECT_EQ(loaded.entries.at(1).offset, segment.entries.at(1).offset);
+    EXPECT_EQ(loaded.entries.at(1).length, segment.entries.at(1).length);
+    EXPECT_EQ(40U, segment.entries.at(1).term);
+
+    // truncating a segment rewrites its index
+    log->truncateSuffix(5);
+    SegmentedLog::Segment truncated;
+    truncated.startIndex = 5;
+    truncated.endIndex = 5;
+    truncated.filename = truncated.makeClosedFilename();
+    EXPECT_TRUE(log->readIndex(truncated,
+                               log->segmentsByStartIndex.at(5).bytes));
+    EXPECT_EQ(-1, FS::tryOpenFile(
+                    logDir, "00000000000000000005-00000000000000000006.index",
+                    O_RDONLY).fd);
+}
+
+TEST_F(StorageSegmentedLogTest, removeOrphanIndexes)
+{
+    config.set<uint64_t>("storageEntryCacheEntries", 10);
+    construct(); // so that closing segments writes their indexes
+    FS::File logDir = FS::dup(log->dir);
+    setUpThreeSegments();
+    FS::openFile(logDir, "00000000000000000009-00000000000000000010.index",
+                 O_CREAT|O_WRONLY);
+    FS::openFile(logDir, "foo.index", O_CREAT|O_WRONLY);
+    construct();
+    EXPECT_EQ(-1, FS::tryOpenFile(
+                    logDir, "00000000000000000009-00000000000000000010.index",
+                    O_RDONLY).fd);
+    EXPECT_EQ(-1, FS::tryOpenFile(logDir, "foo.index", O_RDONLY).fd);
+    FS::openFile(logDir, "00000000000000000007-00000000000000000008.index",
+                 O_RDONLY);
+}
 
 TEST_F(StorageSegmentedLogTest, loadOpenSegment_empty)
 {
@@ -1050,9 +1724,10 @@ TEST_F(StorageSegmentedLogTest, loadOpenSegment_unknownVersion)
     FS::File file = FS::openFile(log->dir,
                                  openSegment.filename,
                                  O_CREAT|O_WRONLY);
-    writeSegmentHeader(file, /*version=*/2);
+    writeSegmentHeader(file, /*version=*/3);
     EXPECT_DEATH(log->loadOpenSegment(openSegment, 1),
-                 "version.*was 2, but this code can only read version 1");
+                 "version.*was 3, but this code can only read versions 1 "
+                 "and 2");
 }
 
 TEST_F(StorageSegmentedLogTest, loadOpenSegment_removeUnneeded)
@@ -1127,6 +1802,51 @@ TEST_F(StorageSegmentedLogTest, loadOpenSegment_truncateZeroAndOk)
     EXPECT_EQ(4U, openSegment.endIndex);
 }
 
+TEST_F(StorageSegmentedLogTest, loadOpenSegment_staleEntries)
+{
+    log->append({&sampleEntry, &sampleEntry}); // index 1-2
+    sync();
+    log->closeSegment();
+    std::string stale;
+    {
+        FS::File file = FS::openFile(
+            log->dir,
+            "00000000000000000001-00000000000000000002",
+            O_RDONLY);
+        FS::FileContents contents(file);
+        stale = std::string(contents.get<char>(1, 1),
+                            contents.getFileLength() - 1);
+    }
+    log->openNewSegment();
+    log->truncatePrefix(3);
+    log->append({&sampleEntry, &sampleEntry}); // index 3-4
+    sync();
+    uint64_t bytes = log->getOpenSegment().bytes;
+    {
+        FS::File oldFile =
+            FS::openFile(log->dir,
+                         log->getOpenSegment().filename,
+                         O_RDONLY);
+        FS::FileContents contents(oldFile);
+        FS::File newFile =
+            FS::openFile(log->dir,
+                         openSegment.filename,
+                         O_CREAT|O_RDWR);
+        EXPECT_LT(0, FS::write(newFile.fd,
+                               contents.get(0, bytes),
+                               bytes));
+        EXPECT_LT(0, FS::write(newFile.fd, stale.data(), stale.length()));
+    }
+    EXPECT_TRUE(log->loadOpenSegment(openSegment, 3));
+    EXPECT_EQ(2U, openSegment.entries.size());
+    EXPECT_EQ(3U, openSegment.startIndex);
+    EXPECT_EQ(4U, openSegment.endIndex);
+    EXPECT_EQ(bytes, openSegment.bytes);
+    EXPECT_EQ(bytes, FS::getSize(FS::openFile(log->dir,
+                                              openSegment.filename,
+                                              O_RDONLY)));
+}
+
 TEST_F(StorageSegmentedLogTest, closeSegment_empty)
 {
     std::string filename = log->getOpenSegment().filename;
@@ -1157,6 +1877,371 @@ TEST_F(StorageSegmentedLogTest, closeSegment_nonEmpty)
 
 // openNewSegment tested sufficiently elsewhere
 
+// This depends on the exact size of sampleEntry's record, like
+// append_rollover.
+TEST_F(StorageSegmentedLogTest, getEntry_released)
+{
+    config.set<uint64_t>("storageEntryCacheEntries", 2);
+    construct();
+    log->truncatePrefix(3);
+    std::vector<const Log::Entry*> entries;
+    for (uint64_t i = 3; i <= 25; ++i)
+        entries.push_back(&sampleEntry);
+    log->append(entries);
+    const SegmentedLog::Segment& closed = log->segmentsByStartIndex.at(3);
+    EXPECT_FALSE(closed.isOpen);
+    // not released until the rename has reached the disk
+    EXPECT_FALSE(closed.entries.at(0).released);
+    sync();
+    EXPECT_TRUE(closed.entries.at(0).released);
+    EXPECT_FALSE(closed.entries.at(0).entry.has_data());
+    EXPECT_EQ(40U, closed.entries.at(0).term);
+    EXPECT_LT(0U, closed.entries.at(0).length);
+    EXPECT_FALSE(log->segmentsByStartIndex.at(22).entries.at(0).released);
+
+    EXPECT_EQ(3U, log->getEntry(3).index());
+    EXPECT_EQ("foo", log->getEntry(3).data());
+    EXPECT_EQ(21U, log->getEntry(21).index()); // last in its batch
+    EXPECT_EQ(22U, log->getEntry(22).index()); // not released
+    EXPECT_EQ(2U, log->entryCacheMisses);
+    EXPECT_EQ(1U, log->entryCacheHits);
+    log->getEntry(4); // evicts 3
+    EXPECT_EQ(3U, log->getEntry(3).index());
+    EXPECT_EQ(2U, log->entryCache.size());
+    EXPECT_EQ(4U, log->entryCacheMisses);
+
+    Protocol::ServerStats stats;
+    log->updateServerStats(stats);
+    EXPECT_EQ(1U, stats.storage().entry_cache_hits());
+    EXPECT_EQ(4U, stats.storage().entry_cache_misses());
+    EXPECT_EQ(2U, stats.storage().entry_cache_entries());
+}
+
+TEST_F(StorageSegmentedLogTest, getEntry_releasedOnLoad)
+{
+    setUpThreeSegments();
+    config.set<uint64_t>("storageEntryCacheEntries", 10);
+    construct();
+    for (auto it = log->segmentsByStartIndex.begin();
+         it != log->segmentsByStartIndex.end();
+         ++it) {
+        const SegmentedLog::Segment& segment = it->second;
+        for (auto rit = segment.entries.begin();
+             rit != segment.entries.end();
+             ++rit) {
+            EXPECT_TRUE(rit->released);
+            EXPECT_EQ(40U, rit->term);
+        }
+    }
+    for (uint64_t index = 3; index <= 8; ++index) {
+        EXPECT_EQ(index, log->getEntry(index).index());
+        EXPECT_EQ("foo", log->getEntry(index).data());
+    }
+    EXPECT_EQ(6U, log->entryCacheMisses);
+}
+
+TEST_F(StorageSegmentedLogTest, openReleasedSegment_maxMappedSegments)
+{
+    setUpThreeSegments();
+    config.set<uint64_t>("storageEntryCacheEntries", 10);
+    config.set<uint64_t>("storageMaxMappedSegments", 2);
+    construct();
+    const SegmentedLog::Segment& s1 = log->segmentsByStartIndex.at(3);
+    const SegmentedLog::Segment& s2 = log->segmentsByStartIndex.at(5);
+    const SegmentedLog::Segment& s3 = log->segmentsByStartIndex.at(7);
+
+    EXPECT_EQ(3U, log->getEntry(3).index());
+    EXPECT_EQ(5U, log->getEntry(5).index());
+    EXPECT_TRUE(bool(s1.contents));
+    EXPECT_TRUE(bool(s2.contents));
+
+    // reading from s1 again makes s2 the least recently used
+    EXPECT_EQ(4U, log->getEntry(4).index());
+    EXPECT_EQ(7U, log->getEntry(7).index());
+    EXPECT_TRUE(bool(s1.contents));
+    EXPECT_FALSE(bool(s2.contents));
+    EXPECT_EQ(-1, s2.file.fd);
+    EXPECT_TRUE(bool(s3.contents));
+    EXPECT_EQ((std::list<uint64_t> {7, 3}), log->mappedSegments);
+
+    // closed segments are reopened on demand
+    EXPECT_EQ("foo", log->getEntry(6).data());
+    EXPECT_FALSE(bool(s1.contents));
+    EXPECT_TRUE(bool(s2.contents));
+    EXPECT_EQ(2U, log->mappedSegmentsIndex.size());
+}
+
+TEST_F(StorageSegmentedLogTest, prefetch)
+{
+    setUpThreeSegments();
+    config.set<uint64_t>("storageEntryCacheEntries", 10);
+    construct();
+    const SegmentedLog::Segment& s1 = log->segmentsByStartIndex.at(3);
+    const SegmentedLog::Segment& s2 = log->segmentsByStartIndex.at(5);
+    const SegmentedLog::Segment& s3 = log->segmentsByStartIndex.at(7);
+
+    // out of range: ignored
+    log->prefetch(2, 1U << 20);
+    log->prefetch(9, 1U << 20);
+    EXPECT_FALSE(bool(s1.contents));
+
+    // hints segments that aren't open without mapping them or keeping their
+    // files open, since that could block
+    log->prefetch(4, 1U << 20);
+    EXPECT_FALSE(bool(s1.contents));
+    EXPECT_FALSE(bool(s2.contents));
+    EXPECT_FALSE(bool(s3.contents));
+    EXPECT_EQ(-1, s2.file.fd);
+    EXPECT_TRUE(log->mappedSegments.empty());
+
+    // reads ahead in segments that are already open, without changing which
+    // ones were used most recently
+    EXPECT_EQ(7U, log->getEntry(7).index());
+    EXPECT_EQ(3U, log->getEntry(3).index());
+    log->prefetch(4, 1U << 20);
+    EXPECT_FALSE(bool(s2.contents));
+    EXPECT_EQ((std::list<uint64_t> {3, 7}), log->mappedSegments);
+
+    for (uint64_t index = 3; index <= 8; ++index)
+        EXPECT_EQ(index, log->getEntry(index).index());
+    EXPECT_EQ(6U, log->entryCacheMisses);
+}
+
+TEST_F(StorageSegmentedLogTest, trimEntryCache)
+{
+    setUpThreeSegments();
+    config.set<uint64_t>("storageEntryCacheEntries", 10);
+    construct();
+    for (uint64_t index = 3; index <= 8; ++index)
+        log->getEntry(index);
+    log->truncateSuffix(5);
+    EXPECT_EQ((std::vector<uint64_t> {3, 4, 5}),
+              sorted(Core::STLUtil::getKeys(log->entryCacheIndex)));
+    EXPECT_EQ(3U, log->entryCache.size());
+    EXPECT_EQ((std::vector<uint64_t> {3, 5}),
+              sorted(Core::STLUtil::getKeys(log->mappedSegmentsIndex)));
+    log->truncatePrefix(4);
+    EXPECT_EQ((std::vector<uint64_t> {4, 5}),
+              sorted(Core::STLUtil::getKeys(log->entryCacheIndex)));
+    EXPECT_EQ(5U, log->getEntry(5).index());
+    EXPECT_EQ(6U, log->entryCacheMisses);
+    EXPECT_EQ(1U, log->entryCacheHits);
+}
+
+class StorageSegmentedLogCompressionTest : public StorageSegmentedLogTest {
+    StorageSegmentedLogCompressionTest()
+        : StorageSegmentedLogTest()
+    {
+        setUpThreeSegments();
+        config.set<bool>("storageCompressSegments", true);
+        config.set<uint64_t>("storageHotSegments", 1);
+        config.set<uint64_t>("storageCompressedBlockBytes", 16);
+        config.set<uint64_t>("storageEntryCacheEntries", 1);
+    }
+    // Wait for the log to switch over to every compressed segment it's
+    // queued, and for the originals to be removed.
+    void waitForCompressor() {
+        log->compressor.waitUntilIdle();
+        log->compressColdSegments();
+        log->reclaimer.waitUntilIdle();
+    }
+    // List the log's files, except for open segments, which depend on the
+    // timing of the segment preparer.
+    std::vector<std::string> lsWithoutOpenSegments() {
+        std::vector<std::string> filenames;
+        std::vector<std::string> all = sorted(FS::ls(log->dir));
+        for (auto it = all.begin(); it != all.end(); ++it) {
+            if (!Core::StringUtil::startsWith(*it, "open-"))
+                filenames.push_back(*it);
+        }
+        return filenames;
+    }
+};
+
+TEST_F(StorageSegmentedLogCompressionTest, compressColdSegments)
+{
+    construct();
+    waitForCompressor();
+    EXPECT_TRUE(log->segmentsByStartIndex.at(3).compressed);
+    EXPECT_TRUE(log->segmentsByStartIndex.at(5).compressed);
+    EXPECT_FALSE(log->segmentsByStartIndex.at(7).compressed);
+    EXPECT_FALSE(log->segmentsByStartIndex.at(3).compressing);
+    EXPECT_EQ("00000000000000000003-00000000000000000004.z",
+              log->segmentsByStartIndex.at(3).filename);
+    EXPECT_EQ((std::vector<std::string> {
+                    "00000000000000000003-00000000000000000004.index",
+                    "00000000000000000003-00000000000000000004.z",
+                    "00000000000000000005-00000000000000000006.index",
+                    "00000000000000000005-00000000000000000006.z",
+                    "00000000000000000007-00000000000000000008",
+                    "00000000000000000007-00000000000000000008.index",
+                    "metadata1",
+                    "metadata2",
+               }),
+              lsWithoutOpenSegments());
+    for (uint64_t index = 3; index <= 8; ++index) {
+        EXPECT_EQ(index, log->getEntry(index).index());
+        EXPECT_EQ("foo", log->getEntry(index).data());
+    }
+    // Each 2-entry record spans several 16-byte blocks, and the blocks are
+    // shared with the next record.
+    EXPECT_LT(0U, log->blockCacheMisses);
+    EXPECT_LT(0U, log->blockCacheHits);
+    EXPECT_GE(16U, log->blockCache.size());
+    Protocol::ServerStats stats;
+    log->updateServerStats(stats);
+    EXPECT_EQ(2U, stats.storage().num_compressed_segments());
+
+    // Compressed segments load with or without their entries released.
+    construct();
+    EXPECT_TRUE(log->segmentsByStartIndex.at(3).compressed);
+    EXPECT_EQ("foo", log->getEntry(4).data());
+    config.set<uint64_t>("storageEntryCacheEntries", 0);
+    construct();
+    EXPECT_TRUE(log->segmentsByStartIndex.at(5).compressed);
+    EXPECT_EQ(6U, log->getEntry(6).index());
+    EXPECT_EQ("foo", log->getEntry(6).data());
+    EXPECT_EQ(0U, log->blockCacheMisses);
+}
+
+TEST_F(StorageSegmentedLogCompressionTest, prefetch)
+{
+    construct();
+    waitForCompressor();
+    const SegmentedLog::Segment& segment = log->segmentsByStartIndex.at(3);
+    ASSERT_TRUE(segment.compressed);
+    EXPECT_FALSE(bool(segment.contents));
+    log->prefetch(3, 1U << 20);
+    EXPECT_FALSE(bool(segment.contents));
+    EXPECT_EQ(-1, segment.file.fd);
+
+    // Once the segment is open, this reads ahead its compressed blocks
+    // without decompressing them.
+    EXPECT_EQ("foo", log->getEntry(4).data());
+    ASSERT_TRUE(bool(segment.contents));
+    EXPECT_LT(1U, segment.blockOffsets.size());
+    uint64_t misses = log->blockCacheMisses;
+    log->prefetch(3, 1U << 20);
+    EXPECT_EQ(misses, log->blockCacheMisses);
+}
+
+TEST_F(StorageSegmentedLogCompressionTest, truncatePrefix_compressed)
+{
+    construct();
+    waitForCompressor();
+    log->truncatePrefix(7);
+    sync();
+    log->reclaimer.waitUntilIdle();
+    EXPECT_EQ((std::vector<std::string> {
+                    "00000000000000000007-00000000000000000008",
+                    "00000000000000000007-00000000000000000008.index",
+                    "metadata1",
+                    "metadata2",
+               }),
+              lsWithoutOpenSegments());
+}
+
+TEST_F(StorageSegmentedLogCompressionTest, truncatePrefix_compressionQueued)
+{
+    config.set<uint64_t>("storageRecycleSegments", 1);
+    construct();
+    // Segments 3 and 5 were queued for compression as the log was
+    // constructed. Drop them before (or while) the compressor gets to them.
+    // They must not be recycled, since the compressor may be reading them.
+    log->truncatePrefix(7);
+    EXPECT_EQ(0U, log->preparedSegments.numRecycled);
+    sync();
+    waitForCompressor();
+    std::vector<std::string> expected = {
+        "00000000000000000007-00000000000000000008",
+        "00000000000000000007-00000000000000000008.index",
+        "metadata1",
+        "metadata2",
+    };
+    EXPECT_EQ(expected, lsWithoutOpenSegments());
+
+    // The compressor skips segments whose files are already gone.
+    log->compressor.compress("00000000000000000003-00000000000000000004");
+    waitForCompressor();
+    EXPECT_EQ(expected, lsWithoutOpenSegments());
+    EXPECT_EQ((std::vector<std::string> {}), log->compressor.takeFinished());
+}
+
+TEST_F(StorageSegmentedLogCompressionTest, truncateSuffix_compressed)
+{
+    construct();
+    waitForCompressor();
+    log->getEntry(5);
+    log->truncateSuffix(3);
+    EXPECT_FALSE(log->segmentsByStartIndex.at(3).compressed);
+    EXPECT_EQ(0U, log->blockCache.size());
+    EXPECT_EQ("foo", log->getEntry(3).data());
+    log->closeSegment();
+    FS::File logDir = FS::dup(log->dir);
+    log.reset();
+    EXPECT_EQ((std::vector<std::string> {
+                    "00000000000000000003-00000000000000000003",
+                    "00000000000000000003-00000000000000000003.index",
+                    "metadata1",
+                    "metadata2",
+               }),
+              sorted(FS::ls(logDir)));
+    construct();
+    EXPECT_EQ(3U, log->getLastLogIndex());
+    EXPECT_EQ("foo", log->getEntry(3).data());
+}
+
+TEST_F(StorageSegmentedLogCompressionTest, readSegmentFilenames_originalWins)
+{
+    // A leftover compressed copy, whose contents don't matter.
+    FS::File logDir = FS::openDir(layout.logDir, "Segmented-Text");
+    FS::openFile(logDir, "00000000000000000003-00000000000000000004.z",
+                 O_CREAT|O_WRONLY);
+    config.set<bool>("storageCompressSegments", false);
+    construct();
+    EXPECT_FALSE(log->segmentsByStartIndex.at(3).compressed);
+    EXPECT_EQ(-1, FS::tryOpenFile(
+        logDir, "00000000000000000003-00000000000000000004.z",
+        O_RDONLY).fd);
+}
+
+TEST_F(StorageSegmentedLogCompressionTest, archiveDir)
+{
+    std::string archivePath = FS::mkdtemp();
+    {
+        FS::File archiveParentDir = FS::openDir(archivePath);
+        log.reset(new SegmentedLog(layout.logDir,
+                                   SegmentedLog::Encoding::TEXT,
+                                   config,
+                                   archiveParentDir));
+        waitForCompressor();
+        EXPECT_EQ((std::vector<std::string> {
+                        "00000000000000000003-00000000000000000004.z",
+                        "00000000000000000005-00000000000000000006.z",
+                   }),
+                  sorted(FS::ls(log->archiveDir)));
+        EXPECT_EQ(-1, FS::tryOpenFile(
+            log->dir, "00000000000000000003-00000000000000000004.z",
+            O_RDONLY).fd);
+
+        log.reset(new SegmentedLog(layout.logDir,
+                                   SegmentedLog::Encoding::TEXT,
+                                   config,
+                                   archiveParentDir));
+        EXPECT_TRUE(log->segmentsByStartIndex.at(3).compressed);
+        EXPECT_EQ("foo", log->getEntry(3).data());
+        log->truncatePrefix(6);
+        sync();
+        log->reclaimer.waitUntilIdle();
+        EXPECT_EQ((std::vector<std::string> {
+                        "00000000000000000005-00000000000000000006.z",
+                   }),
+                  sorted(FS::ls(log->archiveDir)));
+        log.reset();
+    }
+    FS::remove(archivePath);
+}
+
 TEST_F(StorageSegmentedLogTest, readProtoFromFile_binary)
 {
     FS::removeFile(log->dir, "metadata1");
@@ -1179,8 +2264,97 @@ TEST_F(StorageSegmentedLogTest, readProtoFromFile_text)
     readProtoFromFileHelper();
 }
 
+TEST_F(StorageSegmentedLogTest, readProtoFromFile_raw)
+{
+    FS::removeFile(log->dir, "metadata1");
+    FS::removeFile(log->dir, "metadata2");
+    log.reset();
+    log.reset(new SegmentedLog(layout.logDir,
+                               SegmentedLog::Encoding::RAW,
+                               config));
+    readProtoFromFileHelper();
+}
+
 // serialize proto tested sufficiently by readProtoFromFile
 
+TEST_F(StorageSegmentedLogTest, rawEntry)
+{
+    std::vector<Log::Entry> entries(4);
+    entries.at(0).set_index(7);
+    entries.at(0).set_term(8);
+    entries.at(0).set_cluster_time(9);
+    entries.at(0).set_type(Raft::Protocol::EntryType::DATA);
+    entries.at(0).set_data(std::string("a\0b", 3));
+    entries.at(1).set_index(10);
+    entries.at(1).set_term(11);
+    entries.at(1).set_cluster_time(12);
+    entries.at(1).set_type(Raft::Protocol::EntryType::CONFIGURATION);
+    Raft::Protocol::SimpleConfiguration* conf =
+        entries.at(1).mutable_configuration()->mutable_prev_configuration();
+    conf->add_servers()->set_server_id(1);
+    conf->mutable_servers(0)->set_addresses("127.0.0.1:5254");
+    entries.at(2).set_index(13);
+    entries.at(2).set_term(14);
+    entries.at(2).set_cluster_time(15);
+    entries.at(2).set_type(Raft::Protocol::EntryType::DATA);
+    entries.at(2).set_data(""); // empty payload
+    entries.at(3).set_index(16); // no type, cluster time, or payload
+    entries.at(3).set_term(17);
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        Core::Buffer buf = SegmentedLog::encodeRawEntry(*it);
+        Log::Entry out;
+        EXPECT_TRUE(SegmentedLog::parseRawEntry(buf.getData(),
+                                                buf.getLength(),
+                                                &out));
+        EXPECT_EQ(*it, out);
+        // truncated
+        Log::Entry out2;
+        EXPECT_FALSE(SegmentedLog::parseRawEntry(buf.getData(),
+                                                 buf.getLength() - 1,
+                                                 &out2));
+    }
+
+    Core::Buffer buf = SegmentedLog::encodeRawEntry(entries.at(0));
+    SegmentedLog::RawEntryHeader header;
+    memcpy(&header, buf.getData(), sizeof(header));
+    EXPECT_EQ(32U, sizeof(header));
+    EXPECT_EQ(7U, le64toh(header.index));
+    EXPECT_EQ(3U, le32toh(header.length));
+    EXPECT_EQ("a", std::string(static_cast<const char*>(buf.getData()) +
+                               sizeof(header)));
+    header.flags = htole16(SegmentedLog::RawEntryHeader::DATA |
+                           SegmentedLog::RawEntryHeader::CONFIGURATION);
+    memcpy(buf.getData(), &header, sizeof(header));
+    Log::Entry out;
+    EXPECT_FALSE(SegmentedLog::parseRawEntry(buf.getData(),
+                                             buf.getLength(),
+                                             &out));
+}
+
+TEST_F(StorageSegmentedLogTest, raw_blackbox)
+{
+    FS::removeFile(log->dir, "metadata1");
+    FS::removeFile(log->dir, "metadata2");
+    log.reset();
+    log.reset(new SegmentedLog(layout.logDir,
+                               SegmentedLog::Encoding::RAW,
+                               config));
+    EXPECT_EQ("Segmented-Raw", log->getName());
+    log->truncatePrefix(3);
+    sampleEntry.set_type(Raft::Protocol::EntryType::DATA);
+    log->append({&sampleEntry, &sampleEntry}); // index 3-4
+    sync();
+    log.reset();
+    log.reset(new SegmentedLog(layout.logDir,
+                               SegmentedLog::Encoding::RAW,
+                               config));
+    EXPECT_EQ(3U, log->getLogStartIndex());
+    EXPECT_EQ(4U, log->getLastLogIndex());
+    sampleEntry.set_index(4);
+    EXPECT_EQ(sampleEntry, log->getEntry(4));
+}
+
+
 TEST_F(StorageSegmentedLogTest, prepareNewSegment)
 {
     auto ret = log->prepareNewSegment(50);
@@ -1188,7 +2362,7 @@ TEST_F(StorageSegmentedLogTest, prepareNewSegment)
     EXPECT_EQ(log->MAX_SEGMENT_SIZE,
               FS::getSize(ret.second));
     FS::FileContents contents(ret.second);
-    EXPECT_EQ(1U, *contents.get<uint8_t>(0, 1)); // header
+    EXPECT_EQ(2U, *contents.get<uint8_t>(0, 1)); // header
     for (uint64_t i = 1; i < contents.getFileLength(); ++i)
         EXPECT_EQ(0U, *contents.get<uint8_t>(i, 1));
 }
@@ -1201,7 +2375,7 @@ class StorageSegmentedLogPreparedSegmentsTest : public ::testing::Test {
     StorageSegmentedLogPreparedSegmentsTest()
         : preparedSegments()
     {
-        preparedSegments.reset(new PreparedSegments(3));
+        preparedSegments.reset(new PreparedSegments(3, 3, 2));
     }
     ~StorageSegmentedLogPreparedSegmentsTest()
     {
@@ -1233,6 +2407,24 @@ TEST_F(StorageSegmentedLogPreparedSegmentsTest, releaseAll)
     EXPECT_EQ("bar", segments.at(1).first);
 }
 
+TEST_F(StorageSegmentedLogPreparedSegmentsTest, recycle)
+{
+    EXPECT_EQ("", preparedSegments->takeRecycled());
+    EXPECT_TRUE(preparedSegments->reserveRecycled());
+    EXPECT_TRUE(preparedSegments->reserveRecycled());
+    EXPECT_FALSE(preparedSegments->reserveRecycled());
+    preparedSegments->recycle("foo");
+    EXPECT_EQ("foo", preparedSegments->takeRecycled());
+    EXPECT_EQ("", preparedSegments->takeRecycled());
+    EXPECT_TRUE(preparedSegments->reserveRecycled());
+    preparedSegments->recycle("bar");
+    preparedSegments->recycle("baz");
+    std::deque<std::string> recycled = preparedSegments->releaseRecycled();
+    EXPECT_EQ((std::deque<std::string>{"bar", "baz"}), recycled);
+    EXPECT_EQ(0U, preparedSegments->numRecycled);
+    EXPECT_EQ("", preparedSegments->takeRecycled());
+}
+
 TEST_F(StorageSegmentedLogPreparedSegmentsTest, submitOpenSegment)
 {
     preparedSegments->submitOpenSegment({"foo", FilesystemUtil::File()});
@@ -1269,7 +2461,7 @@ produceOne(SegmentedLog::PreparedSegments& preparedSegments)
 
 TEST_F(StorageSegmentedLogPreparedSegmentsTest, waitForOpenSegment)
 {
-    preparedSegments.reset(new PreparedSegments(1));
+    preparedSegments.reset(new PreparedSegments(1, 1, 2));
     preparedSegments->quietForUnitTests = true;
     preparedSegments->produced.callback =
         std::bind(produceOne, std::ref(*preparedSegments));
@@ -1278,6 +2470,64 @@ TEST_F(StorageSegmentedLogPreparedSegmentsTest, waitForOpenSegment)
     EXPECT_EQ(1U, preparedSegments->consumed.notificationCount);
 }
 
+TEST_F(StorageSegmentedLogPreparedSegmentsTest, waitForOpenSegment_adaptive)
+{
+    preparedSegments.reset(new PreparedSegments(1, 3, 2));
+    preparedSegments->quietForUnitTests = true;
+    preparedSegments->produced.callback =
+        std::bind(produceOne, std::ref(*preparedSegments));
+    EXPECT_EQ("foo", preparedSegments->waitForOpenSegment().first);
+    // having had to wait, it replaces the segment and adds another
+    EXPECT_EQ(2U, preparedSegments->targetSize);
+    EXPECT_EQ(2U, preparedSegments->demanded);
+    EXPECT_EQ(1U, preparedSegments->waitNanos.getCount());
+    EXPECT_EQ(1U, preparedSegments->waitNanos.getExceptionalCount());
+
+    Protocol::ServerStats stats;
+    preparedSegments->updateServerStats(stats);
+    EXPECT_EQ(2U, stats.storage().prepared_segments_target());
+    EXPECT_EQ(1U, stats.storage().open_segment_wait_nanos().count());
+    EXPECT_EQ(0U, stats.storage().segment_prepare_nanos().count());
+}
+
+TEST_F(StorageSegmentedLogPreparedSegmentsTest, adjustTargetSize)
+{
+    // fixed size
+    EXPECT_EQ(1U, preparedSegments->adjustTargetSize(true));
+    EXPECT_EQ(3U, preparedSegments->targetSize);
+
+    preparedSegments.reset(new PreparedSegments(2, 4, 2));
+    // not enough samples yet
+    preparedSegments->prepareNanos.push(100);
+    preparedSegments->consumeIntervalNanos.push(10);
+    EXPECT_EQ(1U, preparedSegments->adjustTargetSize(false));
+    EXPECT_EQ(2U, preparedSegments->targetSize);
+
+    // consuming 10 segments per prepare: grows one at a time up to the max
+    preparedSegments->consumeIntervalNanos.push(10);
+    EXPECT_EQ(2U, preparedSegments->adjustTargetSize(false));
+    EXPECT_EQ(3U, preparedSegments->targetSize);
+    EXPECT_EQ(2U, preparedSegments->adjustTargetSize(false));
+    EXPECT_EQ(4U, preparedSegments->targetSize);
+    EXPECT_EQ(1U, preparedSegments->adjustTargetSize(true));
+    EXPECT_EQ(4U, preparedSegments->targetSize);
+
+    // consuming 1 segment per 2 prepares: needs 2, shrinks one at a time
+    preparedSegments->consumeIntervalNanos = Core::RollingStat();
+    preparedSegments->consumeIntervalNanos.push(200);
+    preparedSegments->consumeIntervalNanos.push(200);
+    EXPECT_EQ(0U, preparedSegments->adjustTargetSize(false));
+    EXPECT_EQ(3U, preparedSegments->targetSize);
+    EXPECT_EQ(0U, preparedSegments->adjustTargetSize(false));
+    EXPECT_EQ(2U, preparedSegments->targetSize);
+    EXPECT_EQ(1U, preparedSegments->adjustTargetSize(false));
+    EXPECT_EQ(2U, preparedSegments->targetSize);
+
+    // waiting grows it even when the rates say it's big enough
+    EXPECT_EQ(2U, preparedSegments->adjustTargetSize(true));
+    EXPECT_EQ(3U, preparedSegments->targetSize);
+}
+
 } // namespace LibLogCabin::Storage::<anonymous>
 } // namespace LibLogCabin::Storage
 } // namespace LibLogCabin
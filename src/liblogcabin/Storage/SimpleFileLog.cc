@@ -225,7 +225,18 @@ SimpleFileLog::~SimpleFileLog()
 std::pair<uint64_t, uint64_t>
 SimpleFileLog::append(const std::vector<const Entry*>& entries)
 {
-    std::pair<uint64_t, uint64_t> range = memoryLog.append(entries);
+    return writeEntries(memoryLog.append(entries));
+}
+
+std::pair<uint64_t, uint64_t>
+SimpleFileLog::appendMoved(std::vector<Entry>&& entries)
+{
+    return writeEntries(memoryLog.appendMoved(std::move(entries)));
+}
+
+std::pair<uint64_t, uint64_t>
+SimpleFileLog::writeEntries(std::pair<uint64_t, uint64_t> range)
+{
     for (uint64_t index = range.first; index <= range.second; ++index) {
         FilesystemUtil::File file = protoToFile(memoryLog.getEntry(index),
                                                 dir, format("%016lx", index));
@@ -283,6 +294,12 @@ SimpleFileLog::getEntry(uint64_t i) const
     return memoryLog.getEntry(i);
 }
 
+uint64_t
+SimpleFileLog::getTerm(uint64_t i) const
+{
+    return memoryLog.getTerm(i);
+}
+
 uint64_t
 SimpleFileLog::getLogStartIndex() const
 {
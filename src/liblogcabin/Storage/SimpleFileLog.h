@@ -53,12 +53,15 @@ class SimpleFileLog : public Log {
     ~SimpleFileLog();
     std::pair<uint64_t, uint64_t>
     append(const std::vector<const Entry*>& entries);
+    std::pair<uint64_t, uint64_t>
+    appendMoved(std::vector<Entry>&& entries);
     std::string getName() const;
     std::unique_ptr<Log::Sync> takeSync();
     void truncatePrefix(uint64_t firstEntryId);
     void truncateSuffix(uint64_t lastEntryId);
 
     const Entry& getEntry(uint64_t) const;
+    uint64_t getTerm(uint64_t) const;
     uint64_t getLogStartIndex() const;
     uint64_t getLastLogIndex() const;
     uint64_t getSizeBytes() const;
@@ -67,6 +70,12 @@ class SimpleFileLog : public Log {
     void updateMetadata();
 
   protected:
+    /**
+     * Write out the entries in the given range of 'memoryLog', which were
+     * just appended, and queue them up to be synced. Returns 'range'.
+     */
+    std::pair<uint64_t, uint64_t>
+    writeEntries(std::pair<uint64_t, uint64_t> range);
     Storage::FilesystemUtil::File updateMetadataCallerSync();
     MemoryLog memoryLog;
     SimpleFileLogMetadata::Metadata metadata;
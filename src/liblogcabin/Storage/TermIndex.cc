@@ -0,0 +1,106 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+
+#include "liblogcabin/Core/Debug.h"
+#include "liblogcabin/Storage/TermIndex.h"
+
+namespace LibLogCabin {
+namespace Storage {
+
+TermIndex::TermIndex()
+    : startIndex(1)
+    , lastIndex(0)
+    , runs()
+{
+}
+
+TermIndex::~TermIndex()
+{
+}
+
+void
+TermIndex::append(uint64_t term)
+{
+    ++lastIndex;
+    if (runs.empty() || runs.back().term != term)
+        runs.emplace_back(lastIndex, term);
+}
+
+uint64_t
+TermIndex::getTerm(uint64_t index) const
+{
+    if (index < startIndex || index > lastIndex) {
+        PANIC("Attempted to look up the term of entry %lu, which is outside "
+              "of the log [%lu, %lu]",
+              index, startIndex, lastIndex);
+    }
+    // Find the last run starting at or before index.
+    auto it = std::upper_bound(runs.begin(), runs.end(), index,
+                               [](uint64_t i, const Run& run) {
+                                   return i < run.firstIndex;
+                               });
+    --it;
+    return it->term;
+}
+
+uint64_t
+TermIndex::getLogStartIndex() const
+{
+    return startIndex;
+}
+
+uint64_t
+TermIndex::getLastLogIndex() const
+{
+    return lastIndex;
+}
+
+uint64_t
+TermIndex::getNumRuns() const
+{
+    return runs.size();
+}
+
+void
+TermIndex::truncatePrefix(uint64_t firstIndex)
+{
+    if (firstIndex <= startIndex)
+        return;
+    startIndex = firstIndex;
+    if (lastIndex <= startIndex - 1) {
+        lastIndex = startIndex - 1;
+        runs.clear();
+        return;
+    }
+    while (runs.size() > 1 && runs.at(1).firstIndex <= startIndex)
+        runs.pop_front();
+    if (!runs.empty() && runs.front().firstIndex < startIndex)
+        runs.front().firstIndex = startIndex;
+}
+
+void
+TermIndex::truncateSuffix(uint64_t lastIndex)
+{
+    if (lastIndex >= this->lastIndex)
+        return;
+    this->lastIndex = std::max(lastIndex, startIndex - 1);
+    while (!runs.empty() && runs.back().firstIndex > this->lastIndex)
+        runs.pop_back();
+}
+
+} // namespace LibLogCabin::Storage
+} // namespace LibLogCabin
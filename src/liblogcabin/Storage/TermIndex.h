@@ -0,0 +1,122 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cinttypes>
+#include <deque>
+
+#ifndef LIBLOGCABIN_STORAGE_TERMINDEX_H
+#define LIBLOGCABIN_STORAGE_TERMINDEX_H
+
+namespace LibLogCabin {
+namespace Storage {
+
+/**
+ * Tracks the term of every entry in a log, for Log::getTerm().
+ *
+ * Raft logs consist of long runs of entries from the same term, so this
+ * stores just the first index of each run. Looking up a term is a binary
+ * search over a handful of runs, which usually stay in the CPU cache, and
+ * it doesn't need to touch the entries themselves.
+ *
+ * The index tracks the log's range of indexes in the same way as the Log
+ * interface, and the Log implementations mirror each of their appends and
+ * truncations here.
+ */
+class TermIndex {
+  public:
+    TermIndex();
+    ~TermIndex();
+
+    /**
+     * Add the term of a new entry at getLastLogIndex() + 1.
+     */
+    void append(uint64_t term);
+
+    /**
+     * Return the term of the entry at the given index.
+     * \param index
+     *      Must be in the range [getLogStartIndex(), getLastLogIndex()].
+     *      Otherwise, this will crash the server.
+     */
+    uint64_t getTerm(uint64_t index) const;
+
+    /**
+     * See Log::getLogStartIndex().
+     */
+    uint64_t getLogStartIndex() const;
+
+    /**
+     * See Log::getLastLogIndex().
+     */
+    uint64_t getLastLogIndex() const;
+
+    /**
+     * Return the number of runs of entries with the same term.
+     */
+    uint64_t getNumRuns() const;
+
+    /**
+     * See Log::truncatePrefix().
+     */
+    void truncatePrefix(uint64_t firstIndex);
+
+    /**
+     * See Log::truncateSuffix().
+     */
+    void truncateSuffix(uint64_t lastIndex);
+
+  private:
+
+    /**
+     * A maximal sequence of consecutive entries with the same term.
+     */
+    struct Run {
+        Run(uint64_t firstIndex, uint64_t term)
+            : firstIndex(firstIndex)
+            , term(term) {
+        }
+        /**
+         * The index of the first entry in the run that's still in the log.
+         * The run continues up to the next run's first index, or to the end
+         * of the log.
+         */
+        uint64_t firstIndex;
+        /**
+         * The term of every entry in the run.
+         */
+        uint64_t term;
+    };
+
+    /**
+     * See getLogStartIndex().
+     */
+    uint64_t startIndex;
+
+    /**
+     * See getLastLogIndex().
+     */
+    uint64_t lastIndex;
+
+    /**
+     * The runs covering [startIndex, lastIndex], sorted by first index.
+     * This is a deque to support fast prefix truncation.
+     */
+    std::deque<Run> runs;
+};
+
+} // namespace LibLogCabin::Storage
+} // namespace LibLogCabin
+
+#endif /* LIBLOGCABIN_STORAGE_TERMINDEX_H */
@@ -0,0 +1,115 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include "liblogcabin/Storage/TermIndex.h"
+
+namespace LibLogCabin {
+namespace Storage {
+namespace {
+
+class StorageTermIndexTest : public ::testing::Test {
+    StorageTermIndexTest()
+        : termIndex()
+    {
+        // index: 1 2 3 4 5 6
+        // term:  1 1 2 2 2 4
+        for (uint64_t term : {1, 1, 2, 2, 2, 4})
+            termIndex.append(term);
+    }
+    TermIndex termIndex;
+};
+
+TEST_F(StorageTermIndexTest, append)
+{
+    EXPECT_EQ(1U, termIndex.getLogStartIndex());
+    EXPECT_EQ(6U, termIndex.getLastLogIndex());
+    EXPECT_EQ(3U, termIndex.getNumRuns());
+    termIndex.append(4);
+    EXPECT_EQ(3U, termIndex.getNumRuns());
+    termIndex.append(3); // terms need not increase
+    EXPECT_EQ(4U, termIndex.getNumRuns());
+    EXPECT_EQ(8U, termIndex.getLastLogIndex());
+    EXPECT_EQ(3U, termIndex.getTerm(8));
+}
+
+TEST_F(StorageTermIndexTest, getTerm)
+{
+    EXPECT_EQ(1U, termIndex.getTerm(1));
+    EXPECT_EQ(1U, termIndex.getTerm(2));
+    EXPECT_EQ(2U, termIndex.getTerm(3));
+    EXPECT_EQ(2U, termIndex.getTerm(5));
+    EXPECT_EQ(4U, termIndex.getTerm(6));
+    EXPECT_DEATH(termIndex.getTerm(0), "outside of the log");
+    EXPECT_DEATH(termIndex.getTerm(7), "outside of the log");
+}
+
+TEST_F(StorageTermIndexTest, truncatePrefix)
+{
+    termIndex.truncatePrefix(1);
+    EXPECT_EQ(3U, termIndex.getNumRuns());
+    termIndex.truncatePrefix(4);
+    EXPECT_EQ(4U, termIndex.getLogStartIndex());
+    EXPECT_EQ(2U, termIndex.getNumRuns());
+    EXPECT_EQ(2U, termIndex.getTerm(4));
+    EXPECT_DEATH(termIndex.getTerm(3), "outside of the log");
+    termIndex.truncatePrefix(6);
+    EXPECT_EQ(1U, termIndex.getNumRuns());
+    EXPECT_EQ(4U, termIndex.getTerm(6));
+    termIndex.truncatePrefix(5); // no-op
+    EXPECT_EQ(6U, termIndex.getLogStartIndex());
+
+    termIndex.truncatePrefix(10);
+    EXPECT_EQ(10U, termIndex.getLogStartIndex());
+    EXPECT_EQ(9U, termIndex.getLastLogIndex());
+    EXPECT_EQ(0U, termIndex.getNumRuns());
+    termIndex.append(5);
+    EXPECT_EQ(5U, termIndex.getTerm(10));
+}
+
+TEST_F(StorageTermIndexTest, truncatePrefix_lastIndexPlusOne)
+{
+    termIndex.truncatePrefix(7);
+    EXPECT_EQ(7U, termIndex.getLogStartIndex());
+    EXPECT_EQ(6U, termIndex.getLastLogIndex());
+    EXPECT_EQ(0U, termIndex.getNumRuns());
+    EXPECT_DEATH(termIndex.getTerm(6), "outside of the log");
+    termIndex.append(4);
+    EXPECT_EQ(1U, termIndex.getNumRuns());
+    EXPECT_EQ(4U, termIndex.getTerm(7));
+}
+
+TEST_F(StorageTermIndexTest, truncateSuffix)
+{
+    termIndex.truncateSuffix(7); // no-op
+    EXPECT_EQ(6U, termIndex.getLastLogIndex());
+    termIndex.truncateSuffix(4);
+    EXPECT_EQ(4U, termIndex.getLastLogIndex());
+    EXPECT_EQ(2U, termIndex.getNumRuns());
+    EXPECT_EQ(2U, termIndex.getTerm(4));
+    termIndex.append(3);
+    EXPECT_EQ(3U, termIndex.getTerm(5));
+
+    termIndex.truncatePrefix(3);
+    termIndex.truncateSuffix(0);
+    EXPECT_EQ(3U, termIndex.getLogStartIndex());
+    EXPECT_EQ(2U, termIndex.getLastLogIndex());
+    EXPECT_EQ(0U, termIndex.getNumRuns());
+}
+
+} // namespace LibLogCabin::Storage::<anonymous>
+} // namespace LibLogCabin::Storage
+} // namespace LibLogCabin